@@ -591,7 +591,7 @@ static void qxl_enter_vga_mode(PCIQXLDevice *d)
     qemu_spice_create_host_memslot(&d->ssd); 
     qemu_spice_create_host_primary(&d->ssd);
     d->mode = QXL_MODE_VGA;
-    memset(&d->ssd.dirty, 0, sizeof(d->ssd.dirty));
+    qemu_spice_reset_dirty(&d->ssd);
 }
 
 
@@ -656,7 +656,7 @@ static void qxl_reset_state(PCIQXLDevice *d)
     init_qxl_ram(d);
     d->num_free_res = 0;
     d->last_release = NULL;
-    memset(&d->ssd.dirty, 0, sizeof(d->ssd.dirty));
+    qemu_spice_reset_dirty(&d->ssd);
 }
 
 static void qxl_soft_reset(PCIQXLDevice *d)
@@ -1402,6 +1402,7 @@ int qxl_init(PCIBus *bus, uint8_t *vga_ram_base, unsigned long vga_ram_offset,
     qxl->mode = QXL_MODE_UNDEFINED; 
     qxl->generation = 1;
     qxl->num_memslots = NUM_MEMSLOTS;
+    qemu_spice_display_init_common(&qxl->ssd);
     qxl->num_surfaces = NUM_SURFACES;
 
     switch (qxl->revision) {
@@ -42,6 +42,8 @@ extern char *pszgwc;
 extern int spiceplayback;
 
 extern int spiceagent_mouse;
+extern int spicecompression_threads;
+extern int spicezero_copy;
 
 extern int qxl_num;
 extern int qxl_ram;
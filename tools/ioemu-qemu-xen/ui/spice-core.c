@@ -527,6 +527,11 @@ void qemu_spice_init(void)
         (spice_server, spiceagent_mouse);
     spice_server_set_playback_compression
         (spice_server, spiceplayback);
+    if (spice_server_set_compression_threads(spice_server,
+                                             spicecompression_threads) != 0) {
+        fprintf(stderr, "invalid spice compression_threads %d\n", spicecompression_threads);
+        exit(1);
+    }
 
 #endif /* >= 0.6.0 */
 
@@ -62,12 +62,124 @@ void qemu_spice_rect_union(QXLRect *dest, const QXLRect *r)
     dest->right = MAX(dest->right, r->right);
 }
 
+void qemu_spice_display_init_common(SimpleSpiceDisplay *ssd)
+{
+    region_init(&ssd->dirty);
+    pthread_mutex_init(&ssd->pool_lock, NULL);
+    ssd->pool = NULL;
+    ssd->pool_size = 0;
+    ssd->zero_copy = spicezero_copy;
+}
+
+void qemu_spice_reset_dirty(SimpleSpiceDisplay *ssd)
+{
+    region_clear(&ssd->dirty);
+}
+
+/*
+ * Pick the next rectangle to send out of the dirty region and remove it
+ * from the region.  Falls back to the bounding box when the region is
+ * fragmented into many small pieces or when splitting it would hardly
+ * save any pixels.
+ */
+static void qemu_spice_take_dirty_rect(SimpleSpiceDisplay *ssd, QXLRect *rect)
+{
+    pixman_box32_t *boxes, *extents;
+    SpiceRect r;
+    uint64_t area, extents_area;
+    int i, n;
+
+    boxes = pixman_region32_rectangles(&ssd->dirty, &n);
+    extents = pixman_region32_extents(&ssd->dirty);
+
+    if (n > 1) {
+        area = 0;
+        for (i = 0; i < n; i++) {
+            area += (uint64_t)(boxes[i].x2 - boxes[i].x1) *
+                    (boxes[i].y2 - boxes[i].y1);
+        }
+        extents_area = (uint64_t)(extents->x2 - extents->x1) *
+                       (extents->y2 - extents->y1);
+        if (n > SSD_MAX_DIRTY_RECTS ||
+            area * 100 >= extents_area * SSD_COALESCE_PERCENT) {
+            boxes = extents;
+        }
+    }
+
+    rect->left   = boxes->x1;
+    rect->top    = boxes->y1;
+    rect->right  = boxes->x2;
+    rect->bottom = boxes->y2;
+
+    if (boxes == extents) {
+        region_clear(&ssd->dirty);
+    } else {
+        r.left   = rect->left;
+        r.top    = rect->top;
+        r.right  = rect->right;
+        r.bottom = rect->bottom;
+        region_remove(&ssd->dirty, &r);
+    }
+}
+
+/*
+ * The update can reference the DisplaySurface directly when it is the
+ * guest framebuffer itself (which stays mapped until the primary surface
+ * is destroyed, and that releases all pending updates) and when its pixels
+ * are already in the 32bpp format spice expects.
+ */
+static int qemu_spice_can_zero_copy(SimpleSpiceDisplay *ssd)
+{
+    PixelFormat pf;
+
+    if (!ssd->zero_copy || !is_buffer_shared(ssd->ds->surface)) {
+        return 0;
+    }
+    pf = qemu_default_pixelformat(32);
+    return memcmp(&ssd->ds->surface->pf, &pf, sizeof(pf)) == 0;
+}
+
+static SimpleSpiceUpdate *qemu_spice_alloc_update(SimpleSpiceDisplay *ssd,
+                                                  int bitmap_size)
+{
+    SimpleSpiceUpdate *update;
+
+    pthread_mutex_lock(&ssd->pool_lock);
+    update = ssd->pool;
+    if (update) {
+        ssd->pool = update->next;
+        ssd->pool_size--;
+    }
+    pthread_mutex_unlock(&ssd->pool_lock);
+
+    if (update == NULL) {
+        update = qemu_mallocz(sizeof(*update));
+    } else {
+        uint8_t *bitmap = update->bitmap;
+        int size = update->bitmap_size;
+
+        memset(update, 0, sizeof(*update));
+        update->bitmap = bitmap;
+        update->bitmap_size = size;
+    }
+
+    if (update->bitmap_size < bitmap_size) {
+        qemu_free(update->bitmap);
+        update->bitmap = qemu_malloc(bitmap_size);
+        update->bitmap_size = bitmap_size;
+    }
+    return update;
+}
+
 /*
  * Called from spice server thread context (via interface_get_command).
  *
  * We must aquire the global qemu mutex here to make sure the
  * DisplayState (+DisplaySurface) we are accessing doesn't change
  * underneath us.
+ *
+ * Every call hands out one disjoint piece of the dirty region, so
+ * spice keeps calling get_command until the whole region is drained.
  */
 SimpleSpiceUpdate *qemu_spice_create_update(SimpleSpiceDisplay *ssd)
 {
@@ -75,29 +187,32 @@ SimpleSpiceUpdate *qemu_spice_create_update(SimpleSpiceDisplay *ssd)
     QXLDrawable *drawable;
     QXLImage *image;
     QXLCommand *cmd;
+    QXLRect dirty;
     uint8_t *src, *dst;
-    int by, bw, bh;
+    int by, bw, bh, zero_copy;
 
     qemu_mutex_lock_iothread();
-    if (qemu_spice_rect_is_empty(&ssd->dirty)) {
+    if (region_is_empty(&ssd->dirty)) {
         qemu_mutex_unlock_iothread();
         return NULL;
     };
 
+    qemu_spice_take_dirty_rect(ssd, &dirty);
+
     dprint(2, "%s: lr %d -> %d,  tb -> %d -> %d\n", __FUNCTION__,
-           ssd->dirty.left, ssd->dirty.right,
-           ssd->dirty.top, ssd->dirty.bottom);
+           dirty.left, dirty.right,
+           dirty.top, dirty.bottom);
 
-    update   = qemu_mallocz(sizeof(*update));
+    bw       = dirty.right - dirty.left;
+    bh       = dirty.bottom - dirty.top;
+    zero_copy = qemu_spice_can_zero_copy(ssd);
+
+    update   = qemu_spice_alloc_update(ssd, zero_copy ? 0 : bw * bh * 4);
     drawable = &update->drawable;
     image    = &update->image;
     cmd      = &update->ext.cmd;
 
-    bw       = ssd->dirty.right - ssd->dirty.left;
-    bh       = ssd->dirty.bottom - ssd->dirty.top;
-    update->bitmap = qemu_malloc(bw * bh * 4);
-
-    drawable->bbox            = ssd->dirty;
+    drawable->bbox            = dirty;
     drawable->clip.type       = SPICE_CLIP_TYPE_NONE;
     drawable->effect          = QXL_EFFECT_OPAQUE;
     drawable->release_info.id = (intptr_t)update;
@@ -111,36 +226,48 @@ SimpleSpiceUpdate *qemu_spice_create_update(SimpleSpiceDisplay *ssd)
     drawable->u.copy.src_area.right  = bw;
     drawable->u.copy.src_area.bottom = bh;
 
+    src = ds_get_data(ssd->ds) +
+        dirty.top * ds_get_linesize(ssd->ds) +
+        dirty.left * ds_get_bytes_per_pixel(ssd->ds);
+
     QXL_SET_IMAGE_ID(image, QXL_IMAGE_GROUP_DEVICE, ssd->unique++);
     image->descriptor.type   = SPICE_IMAGE_TYPE_BITMAP;
     image->bitmap.flags      = QXL_BITMAP_DIRECT | QXL_BITMAP_TOP_DOWN;
-    image->bitmap.stride     = bw * 4;
     image->descriptor.width  = image->bitmap.x = bw;
     image->descriptor.height = image->bitmap.y = bh;
-    image->bitmap.data = (intptr_t)(update->bitmap);
     image->bitmap.palette = 0;
     image->bitmap.format = SPICE_BITMAP_FMT_32BIT;
 
-    if (ssd->conv == NULL) {
-        PixelFormat dst = qemu_default_pixelformat(32);
-        ssd->conv = qemu_pf_conv_get(&dst, &ssd->ds->surface->pf);
-        assert(ssd->conv);
-    }
-
-    src = ds_get_data(ssd->ds) +
-        ssd->dirty.top * ds_get_linesize(ssd->ds) +
-        ssd->dirty.left * ds_get_bytes_per_pixel(ssd->ds);
-    dst = update->bitmap;
-    for (by = 0; by < bh; by++) {
-        qemu_pf_conv_run(ssd->conv, dst, src, bw);
-        src += ds_get_linesize(ssd->ds);
-        dst += image->bitmap.stride;
+    if (zero_copy) {
+        /*
+         * Point straight into the guest framebuffer.  The guest keeps
+         * drawing while spice holds the update, so the bitmap is flagged
+         * unstable and the server won't use it for lz/glz or caching.
+         */
+        image->bitmap.flags |= QXL_BITMAP_UNSTABLE;
+        image->bitmap.stride = ds_get_linesize(ssd->ds);
+        image->bitmap.data   = (intptr_t)src;
+    } else {
+        image->bitmap.stride = bw * 4;
+        image->bitmap.data   = (intptr_t)(update->bitmap);
+
+        if (ssd->conv == NULL) {
+            PixelFormat dst = qemu_default_pixelformat(32);
+            ssd->conv = qemu_pf_conv_get(&dst, &ssd->ds->surface->pf);
+            assert(ssd->conv);
+        }
+
+        dst = update->bitmap;
+        for (by = 0; by < bh; by++) {
+            qemu_pf_conv_run(ssd->conv, dst, src, bw);
+            src += ds_get_linesize(ssd->ds);
+            dst += image->bitmap.stride;
+        }
     }
 
     cmd->type = QXL_CMD_DRAW;
     cmd->data = (intptr_t)drawable;
 
-    memset(&ssd->dirty, 0, sizeof(ssd->dirty));
     qemu_mutex_unlock_iothread();
     return update;
 }
@@ -150,11 +277,28 @@ SimpleSpiceUpdate *qemu_spice_create_update(SimpleSpiceDisplay *ssd)
  * We do *not* hold the global qemu mutex here, so extra care is needed
  * when calling qemu functions.  Qemu interfaces used:
  *    - qemu_free (underlying glibc free is re-entrant).
+ * The update pool is protected by its own lock.
  */
 void qemu_spice_destroy_update(SimpleSpiceDisplay *sdpy, SimpleSpiceUpdate *update)
 {
-    qemu_free(update->bitmap);
-    qemu_free(update);
+    pthread_mutex_lock(&sdpy->pool_lock);
+    if (sdpy->pool_size < SSD_UPDATE_POOL_SIZE) {
+        if (update->bitmap_size > SSD_POOL_MAX_BITMAP) {
+            qemu_free(update->bitmap);
+            update->bitmap = NULL;
+            update->bitmap_size = 0;
+        }
+        update->next = sdpy->pool;
+        sdpy->pool = update;
+        sdpy->pool_size++;
+        update = NULL;
+    }
+    pthread_mutex_unlock(&sdpy->pool_lock);
+
+    if (update) {
+        qemu_free(update->bitmap);
+        qemu_free(update);
+    }
 }
 
 void qemu_spice_create_host_memslot(SimpleSpiceDisplay *ssd)
@@ -219,32 +363,35 @@ void qemu_spice_vm_change_state_handler(void *opaque, int running, int reason)
 void qemu_spice_display_update(SimpleSpiceDisplay *ssd,
                                int x, int y, int w, int h)
 {
-    QXLRect update_area;
+    SpiceRect update_area;
 
     dprint(2, "%s: x %d y %d w %d h %d\n", __FUNCTION__, x, y, w, h);
+    if (w <= 0 || h <= 0) {
+        return;
+    }
     update_area.left = x,
     update_area.right = x + w;
     update_area.top = y;
     update_area.bottom = y + h;
 
-    if (qemu_spice_rect_is_empty(&ssd->dirty)) {
+    if (region_is_empty(&ssd->dirty)) {
         ssd->notify++;
     }
-    qemu_spice_rect_union(&ssd->dirty, &update_area);
+    region_add(&ssd->dirty, &update_area);
 }
 
 void qemu_spice_display_resize(SimpleSpiceDisplay *ssd)
 {
     dprint(1, "%s:\n", __FUNCTION__);
 
-    memset(&ssd->dirty, 0, sizeof(ssd->dirty));
+    qemu_spice_reset_dirty(ssd);
     qemu_pf_conv_put(ssd->conv);
     ssd->conv = NULL;
 
     qemu_spice_destroy_host_primary(ssd);
     qemu_spice_create_host_primary(ssd);
 
-    memset(&ssd->dirty, 0, sizeof(ssd->dirty));
+    qemu_spice_reset_dirty(ssd);
     ssd->notify++;
 }
 
@@ -400,6 +547,7 @@ void qemu_spice_display_init(DisplayState *ds)
     sdpy.ds = ds;
     sdpy.bufsize = (16 * 1024 * 1024);
     sdpy.buf = qemu_malloc(sdpy.bufsize);
+    qemu_spice_display_init_common(&sdpy);
     register_displaychangelistener(ds, &display_listener);
 
     sdpy.qxl.base.sif = &dpy_interface.base;
@@ -15,6 +15,8 @@
  * along with this program; if not, see <http://www.gnu.org/licenses/>.
  */
 
+#include <pthread.h>
+
 #include <spice/ipc_ring.h>
 #include <spice/enums.h>
 #include <spice/qxl_dev.h>
@@ -22,6 +24,7 @@
 #include "pflib.h"
 
 #include <spice.h>
+#include <region.h>
 
 #define NUM_MEMSLOTS 8
 #define MEMSLOT_GENERATION_BITS 8
@@ -33,6 +36,24 @@
 
 #define NUM_SURFACES 1024
 
+/*
+ * Dirty region coalescing: once the region is split into more than
+ * SSD_MAX_DIRTY_RECTS rectangles, or the rectangles cover at least
+ * SSD_COALESCE_PERCENT of their bounding box, the whole bounding box is
+ * sent as a single update instead.
+ */
+#define SSD_MAX_DIRTY_RECTS  16
+#define SSD_COALESCE_PERCENT 75
+
+/*
+ * Number of released updates kept for reuse.  Bitmaps larger than
+ * SSD_POOL_MAX_BITMAP bytes are freed rather than kept in the pool.
+ */
+#define SSD_UPDATE_POOL_SIZE 32
+#define SSD_POOL_MAX_BITMAP  (1024 * 1024)
+
+typedef struct SimpleSpiceUpdate SimpleSpiceUpdate;
+
 typedef struct SimpleSpiceDisplay {
     DisplayState *ds;
     void *buf;
@@ -42,21 +63,31 @@ typedef struct SimpleSpiceDisplay {
     uint32_t unique;
     QemuPfConv *conv;
 
-    QXLRect dirty;
+    QRegion dirty;
     int notify;
     int running;
+    int zero_copy;
+
+    /* released updates, shared between the qemu and spice server threads */
+    pthread_mutex_t pool_lock;
+    SimpleSpiceUpdate *pool;
+    int pool_size;
 } SimpleSpiceDisplay;
 
-typedef struct SimpleSpiceUpdate {
+struct SimpleSpiceUpdate {
     QXLDrawable drawable;
     QXLImage image;
     QXLCommandExt ext;
     uint8_t *bitmap;
-} SimpleSpiceUpdate;
+    int bitmap_size;
+    SimpleSpiceUpdate *next;
+};
 
 int qemu_spice_rect_is_empty(const QXLRect* r);
 void qemu_spice_rect_union(QXLRect *dest, const QXLRect *r);
 
+void qemu_spice_display_init_common(SimpleSpiceDisplay *ssd);
+void qemu_spice_reset_dirty(SimpleSpiceDisplay *ssd);
 SimpleSpiceUpdate *qemu_spice_create_update(SimpleSpiceDisplay *sdpy);
 void qemu_spice_destroy_update(SimpleSpiceDisplay *sdpy, SimpleSpiceUpdate *update);
 void qemu_spice_create_host_memslot(SimpleSpiceDisplay *ssd);
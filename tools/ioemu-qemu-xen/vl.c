@@ -283,7 +283,7 @@ uint8_t qemu_uuid[16];
 
 #ifdef CONFIG_SPICE
 bool spice_used = false; // spice option is set in xm conf file.
-char spice_opt[128];
+char spice_opt[512];
 int spice_port = 0;
 int spice_tls_port = 0;
 char spice_host[40];
@@ -304,6 +304,8 @@ char *pszgwc = NULL;
 int spiceplayback = 1;
 
 int spiceagent_mouse = 1;
+int spicecompression_threads = 0;
+int spicezero_copy = 0;
 
 char qxl_opt[64];
 int qxl_num = 0;
@@ -5593,6 +5595,18 @@ int main(int argc, char **argv, char **envp)
 		    else {
 		       spiceagent_mouse = 1;
 		    }
+		    if (get_param_value(buf, sizeof(buf), "compression_threads", spice_opt)) {
+		       spicecompression_threads = strtol(buf, NULL, 0); 
+		    }
+		    else {
+		       spicecompression_threads = 0;
+		    }
+		    if (get_param_value(buf, sizeof(buf), "zero_copy", spice_opt)) {
+		       spicezero_copy = strtol(buf, NULL, 0); 
+		    }
+		    else {
+		       spicezero_copy = 0;
+		    }
 
 		    spice_used = true;
 		    // fprintf(stderr, "spice_port=%d, spice_host=%s\n", spice_port, spice_host);
@@ -193,6 +193,8 @@ XENAPI_PLATFORM_CFG_TYPES = {
     'spicezlib_glz_wan_compression': str,
     'spiceplayback': int,
     'spiceagent_mouse': int,
+    'spicecompression_threads': int,
+    'spicezero_copy': int,
     'qxl': int,
     'qxlnum': int,
     'qxlram': int,
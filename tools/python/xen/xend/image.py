@@ -369,7 +369,8 @@ class ImageHandler:
             if not spice_config:
                 for skey in ('spicehost', 'spiceport', 'spicepasswd',
                    'spice_disable_ticketing', 'spiceic', 'spicesv', 'spicejpeg_wan_compression',
-                   'spicezlib_glz_wan_compression', 'spiceplayback', 'spiceagent_mouse'):
+                   'spicezlib_glz_wan_compression', 'spiceplayback', 'spiceagent_mouse',
+                   'spicecompression_threads', 'spicezero_copy'):
                     if skey in vmConfig['platform']:
                         spice_config[skey] = vmConfig['platform'][skey]
             spicehost = spice_config.get('spicehost', '127.0.0.1')
@@ -383,11 +384,14 @@ class ImageHandler:
             spicezlib_glz_wan_compression = spice_config.get('spicezlib_glz_wan_compression', 'auto')
             spiceplayback = int(spice_config.get('spiceplayback', 1))
             spiceagent_mouse = int(spice_config.get('spiceagent_mouse', 1))
+            spicecompression_threads = int(spice_config.get('spicecompression_threads', 0))
+            spicezero_copy = int(spice_config.get('spicezero_copy', 0))
             ret.append('-spice')
             ret.append("port=%s,host=%s,passwd=%s,disable_ticketing=%s,ic=%s,sv=%s,jpeg_wan_compression=%s,\
-zlib_glz_wan_compression=%s,playback=%s,agent_mouse=%s" % (spiceport, spicehost, spicepasswd,
-            spice_disable_ticketing, spiceic, spicesv, spicejpeg_wan_compression,
-            spicezlib_glz_wan_compression, spiceplayback, spiceagent_mouse))
+zlib_glz_wan_compression=%s,playback=%s,agent_mouse=%s,compression_threads=%s,zero_copy=%s" % (spiceport,
+            spicehost, spicepasswd, spice_disable_ticketing, spiceic, spicesv,
+            spicejpeg_wan_compression, spicezlib_glz_wan_compression, spiceplayback,
+            spiceagent_mouse, spicecompression_threads, spicezero_copy))
 
         if has_qxl:
             if not qxl_config:
@@ -629,6 +629,14 @@ gopts.var('spiceagent_mouse', val='',
           fn=set_value, default=None,
           use="""spice agent mouse mode""")
 
+gopts.var('spicecompression_threads', val='',
+          fn=set_value, default=None,
+          use="""spice image compression threads per qxl device""")
+
+gopts.var('spicezero_copy', val='',
+          fn=set_value, default=None,
+          use="""spice reads vga mode updates straight from the guest framebuffer""")
+
 gopts.var('qxl', val='',
           fn=set_value, default=None,
           use="""Should the device model use qxl?""")
@@ -1146,7 +1154,7 @@ def configure_hvm(config_image, vals):
              'vncunused', 'viridian', 'vpt_align',
              'spice', 'spicehost', 'spiceport', 'spicepasswd', 'spice_disable_ticketing',
              'spiceic', 'spicesv', 'spicejpeg_wan_compression', 'spicezlib_glz_wan_compression',
-             'spiceplayback', 'spiceagent_mouse',
+             'spiceplayback', 'spiceagent_mouse', 'spicecompression_threads', 'spicezero_copy',
              'qxl', 'qxlnum', 'qxlram',
              'xauthority', 'xen_extended_power_mgmt', 'xen_platform_pci',
              'memory_sharing' ]
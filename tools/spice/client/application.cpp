@@ -2541,6 +2541,7 @@ void Application::init_globals()
     SSL_load_error_strings();
 
     sw_canvas_init();
+    sw_canvas_set_band_threads(Platform::get_num_cpus() - 1);
 #ifdef USE_OGL
     gl_canvas_init();
 #endif
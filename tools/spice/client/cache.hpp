@@ -19,6 +19,7 @@
 #define _H_CACHE
 
 #include "utils.h"
+#include "cache_table.hpp"
 
 /*class Cache::Treat {
     T* get(T*);
@@ -30,8 +31,8 @@ template <class T, class Treat, int HASH_SIZE, class Base = EmptyBase>
 class Cache : public Base {
 public:
     Cache()
+        : _table (HASH_SIZE)
     {
-        memset(_hash, 0, sizeof(_hash));
     }
 
     ~Cache()
@@ -41,24 +42,16 @@ public:
 
     void add(uint64_t id, T* data)
     {
-        Item** item = &_hash[key(id)];
-
-        while (*item) {
-            if ((*item)->id == id) {
-                THROW("%s id %lu, double insert", Treat::name(), id);
-            }
-            item = &(*item)->next;
+        if (_table.find(id)) {
+            THROW("%s id %lu, double insert", Treat::name(), id);
         }
-        *item = new Item(id, data);
+        Item* item = _table.insert(id);
+        item->data = Treat::get(data);
     }
 
     T* get(uint64_t id)
     {
-        Item* item = _hash[key(id)];
-
-        while (item && item->id != id) {
-            item = item->next;
-        }
+        Item* item = _table.find(id);
 
         if (!item) {
             THROW("%s id %lu, not found", Treat::name(), id);
@@ -68,53 +61,34 @@ public:
 
     void remove(uint64_t id)
     {
-        Item** item = &_hash[key(id)];
-
-        while (*item) {
-            if ((*item)->id == id) {
-                Item *rm_item = *item;
-                *item = rm_item->next;
-                delete rm_item;
-                return;
-            }
-            item = &(*item)->next;
+        Item* item = _table.find(id);
+
+        if (!item) {
+            THROW("%s id %lu, not found", Treat::name(), id);
         }
-        THROW("%s id %lu, not found", Treat::name(), id);
+        Treat::release(item->data);
+        _table.erase(item);
     }
 
     void clear()
     {
-        for (int i = 0; i < HASH_SIZE; i++) {
-            while (_hash[i]) {
-                Item *item = _hash[i];
-                _hash[i] = item->next;
-                delete item;
+        for (int i = 0; i < _table.size(); i++) {
+            Item* item = _table.slot(i);
+            if (item) {
+                Treat::release(item->data);
             }
         }
+        _table.reset();
     }
 
 private:
-    inline uint32_t key(uint64_t id) {return uint32_t(id) % HASH_SIZE;}
-
-private:
-    class Item {
-    public:
-        Item(uint64_t in_id, T* data)
-            : id (in_id)
-            , next (NULL)
-            , data (Treat::get(data)) {}
-
-        ~Item()
-        {
-            Treat::release(data);
-        }
-
+    struct Item {
         uint64_t id;
         Item* next;
         T* data;
     };
 
-    Item* _hash[HASH_SIZE];
+    CacheTable<Item> _table;
 };
 
 #endif
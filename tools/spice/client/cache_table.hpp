@@ -0,0 +1,193 @@
+/*
+   Copyright (C) 2009 Red Hat, Inc.
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2.1 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef _H_CACHE_TABLE
+#define _H_CACHE_TABLE
+
+#include "utils.h"
+
+/* Open addressing (linear probing) table of cache items keyed by a 64 bit id.
+   Items are carved out of preallocated slabs and recycled through a free
+   list, so add/remove don't go through the allocator. Item must have an
+   "uint64_t id" member and an "Item* next" member, which is used for
+   linking free items. The table isn't thread safe. */
+
+template <class Item>
+class CacheTable {
+public:
+    CacheTable(int initial_size)
+        : _size (MIN_SIZE)
+        , _count (0)
+        , _slabs (NULL)
+        , _free_items (NULL)
+    {
+        while (_size < initial_size) {
+            _size <<= 1;
+        }
+        _slots = new Item*[_size];
+        memset(_slots, 0, sizeof(Item*) * _size);
+    }
+
+    ~CacheTable()
+    {
+        delete[] _slots;
+        while (_slabs) {
+            Slab* slab = _slabs;
+            _slabs = slab->next;
+            delete slab;
+        }
+    }
+
+    static inline uint32_t hash(uint64_t id)
+    {
+        return uint32_t((id * 0x9e3779b97f4a7c15ULL) >> 32);
+    }
+
+    Item* find(uint64_t id)
+    {
+        uint32_t mask = _size - 1;
+
+        for (uint32_t i = hash(id) & mask; _slots[i]; i = (i + 1) & mask) {
+            if (_slots[i]->id == id) {
+                return _slots[i];
+            }
+        }
+        return NULL;
+    }
+
+    // id must not be in the table already
+    Item* insert(uint64_t id)
+    {
+        if ((_count + 1) * 4 > _size * 3) {
+            grow();
+        }
+        Item* item = alloc_item();
+        item->id = id;
+        place(_slots, _size, item);
+        _count++;
+        return item;
+    }
+
+    void erase(Item* item)
+    {
+        uint32_t mask = _size - 1;
+        uint32_t i = hash(item->id) & mask;
+
+        while (_slots[i] != item) {
+            i = (i + 1) & mask;
+        }
+
+        // backward shift deletion: move following items of the probe
+        // sequence into the hole, so lookups never need tombstones
+        for (uint32_t j = (i + 1) & mask; _slots[j]; j = (j + 1) & mask) {
+            uint32_t home = hash(_slots[j]->id) & mask;
+            if ((j > i && (home <= i || home > j)) || (j < i && home <= i && home > j)) {
+                _slots[i] = _slots[j];
+                i = j;
+            }
+        }
+        _slots[i] = NULL;
+        _count--;
+        free_item(item);
+    }
+
+    int size() { return _size;}
+    int count() { return _count;}
+    Item* slot(int i) { return _slots[i];}
+
+    // returns all items to the free list, the caller is responsible for
+    // releasing their content first
+    void reset()
+    {
+        for (int i = 0; i < _size; i++) {
+            if (_slots[i]) {
+                free_item(_slots[i]);
+                _slots[i] = NULL;
+            }
+        }
+        _count = 0;
+    }
+
+private:
+    enum {
+        MIN_SIZE = 16,
+        SLAB_ITEMS = 256,
+    };
+
+    struct Slab {
+        Item items[SLAB_ITEMS];
+        Slab* next;
+    };
+
+    static void place(Item** slots, int size, Item* item)
+    {
+        uint32_t mask = size - 1;
+        uint32_t i = hash(item->id) & mask;
+
+        while (slots[i]) {
+            i = (i + 1) & mask;
+        }
+        slots[i] = item;
+    }
+
+    void grow()
+    {
+        int new_size = _size << 1;
+        Item** new_slots = new Item*[new_size];
+
+        memset(new_slots, 0, sizeof(Item*) * new_size);
+        for (int i = 0; i < _size; i++) {
+            if (_slots[i]) {
+                place(new_slots, new_size, _slots[i]);
+            }
+        }
+        delete[] _slots;
+        _slots = new_slots;
+        _size = new_size;
+    }
+
+    Item* alloc_item()
+    {
+        if (!_free_items) {
+            Slab* slab = new Slab;
+            slab->next = _slabs;
+            _slabs = slab;
+            for (int i = 0; i < SLAB_ITEMS; i++) {
+                free_item(&slab->items[i]);
+            }
+        }
+        Item* item = _free_items;
+        _free_items = item->next;
+        item->next = NULL;
+        return item;
+    }
+
+    void free_item(Item* item)
+    {
+        item->next = _free_items;
+        _free_items = item;
+    }
+
+private:
+    Item** _slots;
+    int _size;
+    int _count;
+    Slab* _slabs;
+    Item* _free_items;
+};
+
+#endif
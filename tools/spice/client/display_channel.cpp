@@ -148,7 +148,10 @@ private:
 #define MAX_VIDEO_FRAMES 30
 #define MAX_OVER 15
 #define MAX_UNDER -15
-
+// decoded frames, one being decoded and the rest waiting for display
+#define VIDEO_DECODE_POOL_SIZE 3
+// upper bound of the playout delay the jitter buffer adds (ms)
+#define MAX_JITTER_DELAY 100
 
 class VideoStream {
 public:
@@ -162,6 +165,7 @@ public:
     void set_clip(int type, uint32_t num_clip_rects, SpiceRect* clip_rects);
     const SpiceRect& get_dest() {return _dest;}
     void handle_update_mark(uint64_t update_mark);
+    void handle_frames_ready();
     uint32_t handle_timer_update(uint32_t now);
 
 private:
@@ -169,10 +173,14 @@ private:
     void release_all_bufs();
     void remove_dead_frames(uint32_t mm_time);
     uint32_t alloc_frame_slot();
-    void maintenance();
+    bool maintenance();
     void drop_one_frame();
     uint32_t frame_slot(uint32_t frame_index) { return frame_index % MAX_VIDEO_FRAMES;}
     static bool is_time_to_display(uint32_t now, uint32_t frame_time);
+    void update_jitter(uint32_t now, uint32_t mm_time);
+    void put_frame(int buf);
+    void decode_loop();
+    static void* decode_main(void* opaque);
 
 private:
     RedClient& _client;
@@ -181,6 +189,7 @@ private:
     MJpegDecoder *_mjpeg_decoder;
     int _stream_width;
     int _stream_height;
+    int _src_height;
     int _stride;
     bool _top_down;
     SpiceRect _dest;
@@ -193,16 +202,52 @@ private:
         uint8_t* compressed_data;
     };
 
+    // compressed frames waiting for the decode thread, protected by _frames_lock
     uint32_t _frames_head;
     uint32_t _frames_tail;
     uint32_t _kill_mark;
     VideoFrame _frames[MAX_VIDEO_FRAMES];
 
+    struct DecodedFrame {
+        uint32_t mm_time;
+        uint8_t* data;
 #ifdef WIN32
-    HBITMAP _prev_bitmap;
-    HDC _dc;
+        HBITMAP prev_bitmap;
+        HDC dc;
 #endif
-    uint8_t *_uncompressed_data;
+    };
+
+    // decoded frames are recycled, _free and _ready hold indices into _decoded and
+    // are protected by _frames_lock
+    DecodedFrame _decoded[VIDEO_DECODE_POOL_SIZE];
+    int _free[VIDEO_DECODE_POOL_SIZE];
+    int _free_count;
+    int _ready[VIDEO_DECODE_POOL_SIZE];
+    uint32_t _ready_head;
+    uint32_t _ready_tail;
+
+    Mutex _frames_lock;
+    Condition _decode_cond;
+    Thread* _decode_thread;
+    bool _stop_decoding;
+
+    // jitter buffer: frames are displayed _play_delay ms after their mm_time,
+    // the delay follows the measured arrival jitter (RFC 3550 estimator)
+    int _prev_transit;
+    uint32_t _jitter;       // 1/16 ms
+    uint32_t _play_delay;
+
+    struct {
+        uint32_t frames;
+        uint32_t dropped;   // pushed out of a full queue
+        uint32_t late;      // too late to be displayed
+        uint32_t decoded;
+        uint64_t decode_time;
+        uint64_t max_decode_time;
+    } _stat;
+
+    // the frame on the canvas waits for its update mark or its display time, both are
+    // protected by _frames_lock
     PixmapHeader _pixmap;
     uint64_t _update_mark;
     uint32_t _update_time;
@@ -260,6 +305,7 @@ VideoStream::VideoStream(RedClient& client, Canvas& canvas, DisplayChannel& chan
     , _mjpeg_decoder (NULL)
     , _stream_width (stream_width)
     , _stream_height (stream_height)
+    , _src_height (src_height)
     , _stride (stream_width * sizeof(uint32_t))
     , _top_down (top_down)
     , _dest (*dest)
@@ -267,45 +313,47 @@ VideoStream::VideoStream(RedClient& client, Canvas& canvas, DisplayChannel& chan
     , _frames_head (0)
     , _frames_tail (0)
     , _kill_mark (0)
-    , _uncompressed_data (NULL)
+    , _free_count (0)
+    , _ready_head (0)
+    , _ready_tail (0)
+    , _decode_thread (NULL)
+    , _stop_decoding (false)
+    , _prev_transit (0)
+    , _jitter (0)
+    , _play_delay (0)
     , _update_mark (0)
     , _update_time (0)
     , next (NULL)
 {
     memset(_frames, 0, sizeof(_frames));
+    memset(_decoded, 0, sizeof(_decoded));
+    memset(&_stat, 0, sizeof(_stat));
     region_init(&_clip_region);
     if (codec_type != SPICE_VIDEO_CODEC_TYPE_MJPEG) {
       THROW("invalid video codec type %u", codec_type);
     }
 
     try {
+        for (int i = 0; i < VIDEO_DECODE_POOL_SIZE; i++) {
 #ifdef WIN32
-        if (!create_bitmap(&_dc, &_prev_bitmap, &_uncompressed_data, &_stride,
-                           stream_width, stream_height)) {
-            THROW("create_bitmap failed");
-        }
+            if (!create_bitmap(&_decoded[i].dc, &_decoded[i].prev_bitmap, &_decoded[i].data,
+                               &_stride, stream_width, stream_height)) {
+                THROW("create_bitmap failed");
+            }
+            SetViewportOrgEx(_decoded[i].dc, 0, stream_height - src_height, NULL);
 #else
-        _uncompressed_data = new uint8_t[_stride * stream_height];
+            _decoded[i].data = new uint8_t[_stride * stream_height];
 #endif
+            _free[_free_count++] = i;
+        }
         _pixmap.width = src_width;
         _pixmap.height = src_height;
 
-	_mjpeg_decoder = new MJpegDecoder(stream_width, stream_height, _stride, _uncompressed_data, channel.get_peer_major() == 1);
-
-#ifdef WIN32
-        SetViewportOrgEx(_dc, 0, stream_height - src_height, NULL);
-#endif
-
-	if (_top_down) {
-	    _pixmap.data = _uncompressed_data;
-	    _pixmap.stride = _stride;
-	} else {
-	    _pixmap.data = _uncompressed_data + _stride * (src_height - 1);
-	    _pixmap.stride = -_stride;
-	}
+	_mjpeg_decoder = new MJpegDecoder(stream_width, stream_height, _stride, NULL, channel.get_peer_major() == 1);
 
         set_clip(clip_type, num_clip_rects, clip_rects);
 
+        _decode_thread = new Thread(VideoStream::decode_main, this);
     } catch (...) {
         if (_mjpeg_decoder) {
             delete _mjpeg_decoder;
@@ -318,6 +366,18 @@ VideoStream::VideoStream(RedClient& client, Canvas& canvas, DisplayChannel& chan
 
 VideoStream::~VideoStream()
 {
+    Lock lock(_frames_lock);
+    _stop_decoding = true;
+    _decode_cond.notify_one();
+    lock.unlock();
+    _decode_thread->join();
+    delete _decode_thread;
+
+    LOG_INFO("%u frames, %u dropped, %u late, decode avg %.2f ms max %.2f ms, jitter %u ms",
+             _stat.frames, _stat.dropped, _stat.late,
+             _stat.decoded ? double(_stat.decode_time) / _stat.decoded / 1000000 : 0.0,
+             double(_stat.max_decode_time) / 1000000, _jitter / 16);
+
     if (_mjpeg_decoder) {
         delete _mjpeg_decoder;
         _mjpeg_decoder = NULL;
@@ -331,15 +391,17 @@ void VideoStream::release_all_bufs()
     for (int i = 0; i < MAX_VIDEO_FRAMES; i++) {
         delete[] _frames[i].compressed_data;
     }
+    for (int i = 0; i < VIDEO_DECODE_POOL_SIZE; i++) {
 #ifdef WIN32
-    if (_dc) {
-        HBITMAP bitmap = (HBITMAP)SelectObject(_dc, _prev_bitmap);
-        DeleteObject(bitmap);
-        DeleteObject(_dc);
-    }
+        if (_decoded[i].dc) {
+            HBITMAP bitmap = (HBITMAP)SelectObject(_decoded[i].dc, _decoded[i].prev_bitmap);
+            DeleteObject(bitmap);
+            DeleteObject(_decoded[i].dc);
+        }
 #else
-    delete[] _uncompressed_data;
+        delete[] _decoded[i].data;
 #endif
+    }
 }
 
 void VideoStream::free_frame(uint32_t frame_index)
@@ -349,17 +411,21 @@ void VideoStream::free_frame(uint32_t frame_index)
     _frames[slot].compressed_data = NULL;
 }
 
+// call with _frames_lock held
 void VideoStream::remove_dead_frames(uint32_t mm_time)
 {
     while (_frames_head != _frames_tail) {
-        if (int(_frames[frame_slot(_frames_tail)].mm_time - mm_time) >= MAX_UNDER) {
+        if (int(_frames[frame_slot(_frames_tail)].mm_time + _play_delay - mm_time) >=
+                                                                                MAX_UNDER) {
             return;
         }
         free_frame(_frames_tail);
         _frames_tail++;
+        _stat.late++;
     }
 }
 
+// call with _frames_lock held
 void VideoStream::drop_one_frame()
 {
     ASSERT(MAX_VIDEO_FRAMES > 2 && (_frames_head - _frames_tail) == MAX_VIDEO_FRAMES);
@@ -371,7 +437,9 @@ void VideoStream::drop_one_frame()
         --frame_index;
         _frames[frame_slot(frame_index + 1)] = _frames[frame_slot(frame_index)];
     }
+    _frames[frame_slot(_frames_tail)].compressed_data = NULL;
     _frames_tail++;
+    _stat.dropped++;
 }
 
 bool VideoStream::is_time_to_display(uint32_t now, uint32_t frame_time)
@@ -380,40 +448,119 @@ bool VideoStream::is_time_to_display(uint32_t now, uint32_t frame_time)
     return delta <= MAX_OVER && delta >= MAX_UNDER;
 }
 
-void VideoStream::maintenance()
+void* VideoStream::decode_main(void* opaque)
 {
-    uint32_t mm_time = _client.get_mm_time();
+    ((VideoStream*)opaque)->decode_loop();
+    return NULL;
+}
 
-    remove_dead_frames(mm_time);
-    if (!_update_mark && !_update_time && _frames_head != _frames_tail) {
-        VideoFrame* tail = &_frames[frame_slot(_frames_tail)];
+/* Decodes frames ahead of their display time into the decoded frames pool. A
+   picture may span several data messages, so the buffer being decoded into is
+   kept until the decoder completes a picture. */
+void VideoStream::decode_loop()
+{
+    int buf = -1;
+
+    for (;;) {
+        VideoFrame frame;
+
+        {
+            Lock lock(_frames_lock);
+            while (!_stop_decoding && (_frames_head == _frames_tail ||
+                                       (buf == -1 && !_free_count))) {
+                _decode_cond.wait(lock);
+            }
+            if (_stop_decoding) {
+                return;
+            }
+            if (buf == -1) {
+                buf = _free[--_free_count];
+            }
+            frame = _frames[frame_slot(_frames_tail)];
+            _frames[frame_slot(_frames_tail++)].compressed_data = NULL;
+        }
+
+        uint64_t start = Platform::get_monolithic_time();
+        _mjpeg_decoder->set_frame(_decoded[buf].data);
+        bool got_picture = _mjpeg_decoder->decode_data(frame.compressed_data,
+                                                       frame.compressed_data_size);
+        uint64_t decode_time = Platform::get_monolithic_time() - start;
+        delete[] frame.compressed_data;
+
+        Lock lock(_frames_lock);
+        _stat.decode_time += decode_time;
+        _stat.max_decode_time = MAX(_stat.max_decode_time, decode_time);
+        if (!got_picture) {
+            continue;
+        }
+        _stat.decoded++;
+        _decoded[buf].mm_time = frame.mm_time;
+        _ready[_ready_head++ % VIDEO_DECODE_POOL_SIZE] = buf;
+        buf = -1;
+        lock.unlock();
+        _channel._streams_trigger.trigger();
+    }
+}
 
-        ASSERT(tail->compressed_data);
-        uint8_t* data = tail->compressed_data;
-        uint32_t length = tail->compressed_data_size;
-        int got_picture = 0;
+void VideoStream::put_frame(int buf)
+{
+    uint8_t* data = _decoded[buf].data;
 
-        got_picture =_mjpeg_decoder->decode_data(data, length);
-        if (got_picture) {
+    if (_top_down) {
+        _pixmap.data = data;
+        _pixmap.stride = _stride;
+    } else {
+        _pixmap.data = data + _stride * (_src_height - 1);
+        _pixmap.stride = -_stride;
+    }
 #ifdef WIN32
-            _canvas.put_image(_dc, _pixmap, _dest, _clip);
+    _canvas.put_image(_decoded[buf].dc, _pixmap, _dest, _clip);
 #else
-            _canvas.put_image(_pixmap, _dest, _clip);
+    _canvas.put_image(_pixmap, _dest, _clip);
 #endif
-            if (is_time_to_display(mm_time, tail->mm_time)) {
-                _update_mark = _channel.invalidate(_dest, true);
-                Platform::yield();
-            } else {
-                _update_time = tail->mm_time;
-                _channel.stream_update_request(_update_time);
-            }
+}
+
+/* Puts the next due frame on the canvas. The lock is held from taking the frame to
+   scheduling its update, so that frames go to the canvas one at a time and in order.
+   Returns true if the frame was invalidated right away. Call with _frames_lock held. */
+bool VideoStream::maintenance()
+{
+    uint32_t mm_time = _client.get_mm_time();
+
+    remove_dead_frames(mm_time);
+    if (_update_mark || _update_time) {
+        return false;
+    }
+
+    while (_ready_tail != _ready_head) {
+        int buf = _ready[_ready_tail++ % VIDEO_DECODE_POOL_SIZE];
+        uint32_t display_time = _decoded[buf].mm_time + _play_delay;
+
+        if (int(display_time - mm_time) < MAX_UNDER) {
+            _stat.late++;
+            _free[_free_count++] = buf;
+            _decode_cond.notify_one();
+            continue;
         }
-        free_frame(_frames_tail++);
+
+        put_frame(buf);
+        _free[_free_count++] = buf;
+        _decode_cond.notify_one();
+        if (is_time_to_display(mm_time, display_time)) {
+            _update_mark = _channel.invalidate(_dest, true);
+            return true;
+        }
+        _update_time = display_time;
+        _channel.stream_update_request(_update_time);
+        return false;
     }
+    return false;
 }
 
 uint32_t VideoStream::handle_timer_update(uint32_t now)
 {
+    Lock lock(_frames_lock);
+
     if (!_update_time) {
         return 0;
     }
@@ -424,17 +571,35 @@ uint32_t VideoStream::handle_timer_update(uint32_t now)
     } else if ((int)(_update_time - now) < 0) {
         DBG(0, "to late");
         _update_time = 0;
+        _stat.late++;
+        _channel._streams_trigger.trigger();
     }
     return _update_time;
 }
 
 void VideoStream::handle_update_mark(uint64_t update_mark)
 {
+    Lock lock(_frames_lock);
+
     if (!_update_mark || update_mark < _update_mark) {
         return;
     }
     _update_mark = 0;
-    maintenance();
+    if (maintenance()) {
+        lock.unlock();
+        Platform::yield();
+    }
+}
+
+/* called after the decode thread completed a frame, or a frame was too late */
+void VideoStream::handle_frames_ready()
+{
+    Lock lock(_frames_lock);
+
+    if (maintenance()) {
+        lock.unlock();
+        Platform::yield();
+    }
 }
 
 uint32_t VideoStream::alloc_frame_slot()
@@ -445,15 +610,36 @@ uint32_t VideoStream::alloc_frame_slot()
     return frame_slot(_frames_head++);
 }
 
+// call with _frames_lock held
+void VideoStream::update_jitter(uint32_t now, uint32_t mm_time)
+{
+    int transit = now - mm_time;
+
+    if (_stat.frames > 1) {
+        int d = abs(transit - _prev_transit);
+        _jitter += d - ((_jitter + 8) >> 4);
+        _play_delay = MIN(_jitter / 8, MAX_JITTER_DELAY);
+    }
+    _prev_transit = transit;
+}
+
 void VideoStream::push_data(uint32_t mm_time, uint32_t length, uint8_t* data)
 {
-    maintenance();
+    uint8_t* compressed_data = new uint8_t[length];
+    memcpy(compressed_data, data, length);
+    mm_time = mm_time ? mm_time : 1;
+
+    // decoded frames are shown from the streams trigger, on the channel thread's loop
+    uint32_t now = _client.get_mm_time();
+    Lock lock(_frames_lock);
+    _stat.frames++;
+    update_jitter(now, mm_time);
+    remove_dead_frames(now);
     uint32_t frame_slot = alloc_frame_slot();
-    _frames[frame_slot].compressed_data = new uint8_t[length];
-    memcpy(_frames[frame_slot].compressed_data, data, length);
+    _frames[frame_slot].compressed_data = compressed_data;
     _frames[frame_slot].compressed_data_size = length;
-    _frames[frame_slot].mm_time = mm_time ? mm_time : 1;
-    maintenance();
+    _frames[frame_slot].mm_time = mm_time;
+    _decode_cond.notify_one();
 }
 
 void VideoStream::set_clip(int type, uint32_t num_clip_rects, SpiceRect* clip_rects)
@@ -1718,6 +1904,7 @@ void DisplayChannel::on_streams_trigger()
     VideoStream* stream = _active_streams;
     while (stream) {
         stream->handle_update_mark(update_mark);
+        stream->handle_frames_ready();
         stream = stream->next;
     }
 }
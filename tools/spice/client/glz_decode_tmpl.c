@@ -182,6 +182,7 @@ static size_t FNAME(decode)(GlzDecoderWindow &window, uint8_t* in_buf,
     OUT_PIXEL    *out_pix_buf = (OUT_PIXEL *)out_buf;
     OUT_PIXEL    *op = out_pix_buf;
     OUT_PIXEL    *op_limit = out_pix_buf + size;
+    OUT_PIXEL    *op_published = out_pix_buf;
 
     uint32_t ctrl = *(ip++);
     int loop = true;
@@ -256,7 +257,7 @@ static size_t FNAME(decode)(GlzDecoderWindow &window, uint8_t* in_buf,
                 GLZ_ASSERT(debug_calls, ref >= out_pix_buf);
             } else {
                 ref = (OUT_PIXEL *)window.get_ref_pixel(image_win_id, image_dist,
-                                                        pixel_ofs);
+                                                        pixel_ofs, len);
             }
 
             GLZ_ASSERT(debug_calls, op + len <= op_limit);
@@ -305,6 +306,11 @@ static size_t FNAME(decode)(GlzDecoderWindow &window, uint8_t* in_buf,
             }
         } // END REF/COPY
 
+        if (LZ_UNEXPECT_CONDITIONAL(op - op_published >= GLZ_PROGRESS_PIXELS)) {
+            window.decode_progress(image_win_id, op - out_pix_buf);
+            op_published = op;
+        }
+
         if (LZ_EXPECT_CONDITIONAL(op < op_limit)) {
             ctrl = *(ip++);
         } else {
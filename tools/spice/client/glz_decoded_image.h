@@ -35,7 +35,8 @@ public:
         , _win_head_id (win_head_id)
         , _data (data)
         , _bytes_per_pixel (bytes_per_pixel)
-        , _size (size) {}
+        , _size (size)
+        , _decoded_pixels (0) {}
 
     virtual ~GlzDecodedImage() {}
     uint8_t *get_data() {return _data;}
@@ -44,12 +45,17 @@ public:
     uint64_t get_window_head_id() {return _win_head_id;}
     int      get_size() {return _size;}
 
+    // number of pixels already decoded, accessed under the window's image mutex
+    int      get_decoded_pixels() {return _decoded_pixels;}
+    void     set_decoded_pixels(int n) {_decoded_pixels = n;}
+
 protected:
     uint64_t _id;
     uint64_t _win_head_id;
     uint8_t *_data;
     int _bytes_per_pixel;  // if image is with palette pixel=byte
     int _size;             // number of pixels
+    int _decoded_pixels;
 };
 
 inline uint8_t* GlzDecodedImage::get_pixel_ref(int offset)
@@ -278,6 +278,11 @@ void GlzDecoder::decode(uint8_t *data, SpicePalette *palette, void *opaque_usr_i
 
     _image.data = decoded_image->get_data();
 
+    // an rgba image is complete only after the alpha pass
+    if (_image.type != LZ_IMAGE_TYPE_RGBA) {
+        _images_window.begin_decode(image_window_id, decoded_image);
+    }
+
     // decode_by_type
 #ifdef GLZ_DECODE_TO_RGB32
     n_in_bytes_decoded = DECODE_TO_RGB32[_image.type](_images_window, _in_now, _image.data,
@@ -295,6 +300,7 @@ void GlzDecoder::decode(uint8_t *data, SpicePalette *palette, void *opaque_usr_i
     _in_now += n_in_bytes_decoded;
 
     if (_image.type == LZ_IMAGE_TYPE_RGBA) {
+        _images_window.begin_decode(image_window_id, decoded_image);
         glz_rgb_alpha_decode(_images_window, _in_now, _image.data,
                              _image.gross_pixels, image_window_id, palette, _debug_calls);
     }
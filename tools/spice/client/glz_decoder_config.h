@@ -63,5 +63,8 @@ public:
 
 #define GLZ_DECODE_TO_RGB32
 
+/* how often a decoder publishes its progress to decoders waiting for its pixels */
+#define GLZ_PROGRESS_PIXELS (16 * 1024)
+
 #endif  //_H_GLZ_DECODER_CONFIG
 
@@ -24,16 +24,19 @@
 #define WIN_REALLOC_FACTOR 1.5
 
 GlzDecoderWindow::GlzDecoderWindow(GlzDecoderDebug &debug_calls)
-    : _aborting (false)
+    : _n_image_waiters (0)
+    , _aborting (false)
     , _debug_calls (debug_calls)
 {
     _images_capacity = INIT_IMAGES_CAPACITY;
     _images = new  GlzDecodedImage*[_images_capacity];
-    if (!_images) {
+    _decoding = new  GlzDecodedImage*[_images_capacity];
+    if (!_images || !_decoding) {
         _debug_calls.error(std::string("failed allocating images\n"));
     }
 
     memset(_images, 0, sizeof(GlzDecodedImage*) * _images_capacity);
+    memset(_decoding, 0, sizeof(GlzDecodedImage*) * _images_capacity);
 
     init();
 }
@@ -42,6 +45,7 @@ GlzDecoderWindow::~GlzDecoderWindow()
 {
     clear();
     delete[] _images;
+    delete[] _decoding;
 }
 
 DecodedImageWinId GlzDecoderWindow::pre_decode(uint64_t image_id, uint64_t relative_head_id)
@@ -60,22 +64,50 @@ void GlzDecoderWindow::post_decode(GlzDecodedImage *image)
 /* index: the physical index in the images array. Note that it can't change between waits since
    the realloc mutex should be read locked.
    No starvation for the realloc mutex can occur, since the image we wait for is located before us,
-   hence, when it arrives - no realloc is needed. */
-void GlzDecoderWindow::wait_for_image(int index)
+   hence, when it arrives - no realloc is needed.
+   No deadlock can occur between two decoders waiting for each other's pixels, since a decoder
+   only waits for images that are older than the one it decodes. */
+GlzDecodedImage *GlzDecoderWindow::wait_for_pixels(int index, int end_pixel)
 {
     Lock lock(_new_image_mutex);
-    GlzDecodedImage *image = _images[index]; // can be performed without locking the _win_mutex,
-                                             // since it is called after pre and the rw mutex is                                                 // locked, hence, physical changes to the window are
-                                             // not allowed. In addition the reading of the image ptr
-                                             // is atomic, thus, even if the value changes we are
-                                             // not affected.
+    GlzDecodedImage *image;
 
-    while (!image) {
+    for (;;) {
+        // the slots can be read without locking the _win_mutex, since it is called after pre
+        // and the rw mutex is locked, hence, physical changes to the window are not allowed.
+        if ((image = _images[index])) {
+            return image;
+        }
+        if ((image = _decoding[index]) && image->get_decoded_pixels() >= end_pixel) {
+            return image;
+        }
         if (_aborting) {
             THROW("aborting");
         }
+        _n_image_waiters++;
         _new_image_cond.wait(lock);
-        image = _images[index];
+        _n_image_waiters--;
+    }
+}
+
+void GlzDecoderWindow::begin_decode(DecodedImageWinId decoded_image_win_id,
+                                    GlzDecodedImage *image)
+{
+    Lock lock(_new_image_mutex);
+    _decoding[decoded_image_win_id] = image;
+}
+
+void GlzDecoderWindow::decode_progress(DecodedImageWinId decoded_image_win_id, int n_pixels)
+{
+    Lock lock(_new_image_mutex);
+    GlzDecodedImage *image = _decoding[decoded_image_win_id];
+
+    if (!image) {
+        return;
+    }
+    image->set_decoded_pixels(n_pixels);
+    if (_n_image_waiters) {
+        _new_image_cond.notify_all();
     }
 }
 
@@ -116,6 +148,8 @@ void GlzDecoderWindow::release_images()
             _images[idx] = NULL;
         }
     }
+    // images that are still being decoded belong to their decoder
+    memset(_decoding, 0, sizeof(GlzDecodedImage*) * _images_capacity);
 }
 
 inline bool GlzDecoderWindow::is_empty()
@@ -208,18 +242,23 @@ inline int GlzDecoderWindow::calc_realloc_size(uint64_t new_tail_image_id)
 void GlzDecoderWindow::realloc(int size)
 {
     GlzDecodedImage **new_images = new GlzDecodedImage*[size];
+    GlzDecodedImage **new_decoding = new GlzDecodedImage*[size];
 
-    if (!new_images) {
+    if (!new_images || !new_decoding) {
         _debug_calls.error(std::string("failed allocating images array"));
     }
     memset(new_images, 0, sizeof(GlzDecodedImage*) * size);
+    memset(new_decoding, 0, sizeof(GlzDecodedImage*) * size);
 
     for (int i = 0; i < _n_images; i++) {
         new_images[i] = _images[(i + _head_idx) % _images_capacity];
+        new_decoding[i] = _decoding[(i + _head_idx) % _images_capacity];
     }
     delete[] _images;
+    delete[] _decoding;
 
     _images = new_images;
+    _decoding = new_decoding;
     _head_idx = 0;
     _images_capacity = size;
 }
@@ -246,7 +285,9 @@ void GlzDecoderWindow::add_decoded_image(GlzDecodedImage *image)
 {
     Lock lock(_new_image_mutex);
     GLZ_ASSERT(_debug_calls, image->get_id() <= _tail_image_id);
-    _images[calc_image_win_idx(image->get_id())] = image;
+    int win_idx = calc_image_win_idx(image->get_id());
+    _images[win_idx] = image;
+    _decoding[win_idx] = NULL;
     _new_image_cond.notify_all();
 }
 
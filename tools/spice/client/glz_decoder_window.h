@@ -40,10 +40,17 @@ public:
 
     void post_decode(GlzDecodedImage *image);
 
+    /* Makes the image visible to other decoders while it is being decoded, so images
+       referring to it can start before post_decode, as long as the pixels they refer to
+       were already published with decode_progress. Should be called between pre and post. */
+    void begin_decode(DecodedImageWinId decoded_image_win_id, GlzDecodedImage *image);
+    void decode_progress(DecodedImageWinId decoded_image_win_id, int n_pixels);
+
     /* NOTE - get_ref_pixel should be called only after pre_decode was called and
-       before post decode was called */
+       before post decode was called. Returns once len pixels starting at pixel_offset
+       of the referenced image are decoded. */
     uint8_t *get_ref_pixel(DecodedImageWinId decoded_image_win_id, int dist_from_ref_image,
-                           int pixel_offset);
+                           int pixel_offset, int len);
 
     void abort();
 
@@ -51,9 +58,8 @@ public:
     void clear();
 
 private:
-    void wait_for_image(int index);
+    GlzDecodedImage *wait_for_pixels(int index, int end_pixel);
     void add_image(GlzDecodedImage *image);
-    uint8_t* get_pixel_after_image_entered(int image_index, int pixel_offset);
 
     bool will_overflow(uint64_t image_id, uint64_t relative_head_id);
     bool is_empty();
@@ -74,6 +80,8 @@ private:
 
 private:
     GlzDecodedImage **_images; // cyclic window
+    GlzDecodedImage **_decoding; // images between begin_decode and post_decode, same
+                                 // indices as _images
     int _head_idx;            // index in images array (not image id)
     uint64_t _tail_image_id;
     int _images_capacity;
@@ -87,6 +95,7 @@ private:
     Mutex _new_image_mutex;
 
     Condition _new_image_cond;          // when get_pixel_ref waits for an image
+    int _n_image_waiters;
     Condition _release_image_cond;      // when waiting for the window to narrow.
     Condition _win_alloc_cond;
 
@@ -95,28 +104,25 @@ private:
     GlzDecoderDebug &_debug_calls;
 };
 
-inline uint8_t* GlzDecoderWindow::get_pixel_after_image_entered(int image_index,
-                                                                int pixel_offset)
-{
-    return _images[image_index]->get_pixel_ref(pixel_offset);
-}
-
 /* should be called only between pre and post (when realloc mutex is write-locked).
    Note that it can't use calc_image_win_idx, since the window is not locked for changes
    (that are not reallocation) during decoding.*/
 inline uint8_t *GlzDecoderWindow::get_ref_pixel(DecodedImageWinId decoded_image_win_id,
-                                                int dist_from_ref_image, int pixel_offset)
+                                                int dist_from_ref_image, int pixel_offset,
+                                                int len)
 {
     int ref_image_index = (dist_from_ref_image <= decoded_image_win_id) ?
         (decoded_image_win_id - dist_from_ref_image) :
         _images_capacity + (decoded_image_win_id - dist_from_ref_image);
 
-    if (_images[ref_image_index] == NULL) { // reading image is atomic
-        wait_for_image(ref_image_index);
+    GlzDecodedImage *image = _images[ref_image_index]; // reading image is atomic
+
+    if (image == NULL) {
+        image = wait_for_pixels(ref_image_index, pixel_offset + len);
     }
 
     // after image entered - it won't leave the window till no decoder needs it
-    return get_pixel_after_image_entered(ref_image_index, pixel_offset);
+    return image->get_pixel_ref(pixel_offset);
 }
 
 #endif // _H_GLZ_DECODER_WINDOW
@@ -41,6 +41,8 @@ public:
     ~MJpegDecoder();
 
     bool decode_data(uint8_t *data, size_t length);
+    // the buffer the next picture is decoded into, may change between pictures
+    void set_frame(uint8_t *frame) { _frame = frame;}
 
 private:
 
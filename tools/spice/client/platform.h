@@ -42,6 +42,8 @@ public:
     static void path_append(std::string& path, const std::string& partial_path);
     static uint64_t get_process_id();
     static uint64_t get_thread_id();
+    static int get_num_cpus();
+    static int get_refresh_rate();
     static void term_printf(const char* format, ...);
     static void error_beep();
 
@@ -52,6 +52,12 @@ public:
     void set_icon(Icon *icon);
     virtual RedDrawable::Format get_format();
 
+    /* copies of shared memory pixmaps to the window may complete after
+       copy_pixels() returns; the source must not be drawn again before the
+       mark taken after the copy is done */
+    uint64_t get_copy_mark();
+    bool is_copy_mark_done(uint64_t mark);
+
     enum Type {
         TYPE_INVALID,
         TYPE_NORMAL,
@@ -138,6 +144,7 @@ public:
 
     virtual void pre_migrate() { }
     virtual void post_migrate() { }
+    virtual void on_copy_completion() { }
 };
 
 /*class REGION {
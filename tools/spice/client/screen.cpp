@@ -26,6 +26,17 @@
 #include "resource.h"
 #include "icon.h"
 
+#define DEFAULT_REFRESH_RATE 60
+#define MAX_PRESENT_RATE 60
+#define NSEC_PER_MSEC (1000 * 1000)
+// damage this soon after input near the pointer is presented without waiting
+// for the next update tick
+#define INPUT_PRIORITY_TIME (100ULL * NSEC_PER_MSEC)
+#define INPUT_AREA_SIZE 128
+// input that isn't followed by damage this soon isn't measured
+#define INPUT_LATENCY_TIMEOUT (1000ULL * NSEC_PER_MSEC)
+#define INPUT_LATENCY_REPORT_INTERVAL (10 * 1000ULL * NSEC_PER_MSEC)
+
 class UpdateEvent: public Event {
 public:
     UpdateEvent(int screen) : _screen (screen) {}
@@ -87,7 +98,19 @@ RedScreen::RedScreen(Application& owner, int id, const std::string& name, int wi
     , _forec_update_timer (0)
     , _update_timer (new UpdateTimer(this))
     , _composit_area (NULL)
+    , _composit_index (0)
+    , _update_deferred (false)
     , _update_mark (1)
+    , _present_interval (1000 / DEFAULT_REFRESH_RATE)
+    , _last_present_time (0)
+    , _update_event_pending (false)
+    , _last_input_time (0)
+    , _input_time (0)
+    , _input_mark (0)
+    , _input_latency_count (0)
+    , _input_latency_total (0)
+    , _input_latency_max (0)
+    , _input_latency_report_time (Platform::get_monolithic_time())
     , _monitor (NULL)
     , _default_cursor (NULL)
     , _inactive_cursor (NULL)
@@ -99,6 +122,15 @@ RedScreen::RedScreen(Application& owner, int id, const std::string& name, int wi
     , _pointer_on_screen (false)
 {
     region_init(&_dirty_region);
+    _composit_buffers[0] = _composit_buffers[1] = NULL;
+
+    // updates are presented at most once per refresh interval, every few
+    // refreshes on displays faster than MAX_PRESENT_RATE
+    int refresh_rate = Platform::get_refresh_rate();
+    if (refresh_rate > 0) {
+        _present_interval = 1000 * ((refresh_rate + MAX_PRESENT_RATE - 1) / MAX_PRESENT_RATE) /
+                            refresh_rate;
+    }
     set_name(name);
     _size.x = width;
     _size.y = height;
@@ -161,17 +193,25 @@ void RedScreen::unref()
 
 void RedScreen::destroy_composit_area()
 {
-    if (_composit_area) {
-        delete _composit_area;
-        _composit_area = NULL;
+    for (int i = 0; i < 2; i++) {
+        delete _composit_buffers[i];
+        _composit_buffers[i] = NULL;
     }
+    _composit_area = NULL;
 }
 
+/* The composit area is double buffered: copies of a shared memory pixmap to the
+   window complete asynchronously, so an update draws into the buffer the window
+   system is done with while the other one may still be read. */
 void RedScreen::create_composit_area()
 {
     destroy_composit_area();
-    _composit_area = new RedPixmapSw(_size.x, _size.y, _window.get_format(),
-                                     false, &_window);
+    for (int i = 0; i < 2; i++) {
+        _composit_buffers[i] = new RedPixmapSw(_size.x, _size.y, _window.get_format(),
+                                               false, &_window);
+        _composit_copy_marks[i] = 0;
+    }
+    _composit_area = _composit_buffers[_composit_index];
 }
 
 void RedScreen::adjust_window_rect(int x, int y)
@@ -427,15 +467,28 @@ void RedScreen::activate_timer()
     }
     _periodic_update = true;
     lock.unlock();
-    _owner.activate_interval_timer(*_update_timer, 1000 / 30);
+    _owner.activate_interval_timer(*_update_timer, _present_interval);
 }
 
 void RedScreen::update()
 {
+    RecurciveLock lock(_update_lock);
+    _update_event_pending = false;
+    lock.unlock();
+
     if (is_out_of_sync()) {
         return;
     }
 
+    // the window system still reads the buffer, on_copy_completion() retries
+    if (!_window.is_copy_mark_done(_composit_copy_marks[_composit_index])) {
+        _update_deferred = true;
+        return;
+    }
+    _update_deferred = false;
+    _composit_area = _composit_buffers[_composit_index];
+    _last_present_time = Platform::get_monolithic_time();
+
     QRegion direct_rgn;
     QRegion composit_rgn;
     QRegion frame_rgn;
@@ -444,7 +497,10 @@ void RedScreen::update()
     update_composit(composit_rgn);
     draw_direct(_window, direct_rgn, composit_rgn, frame_rgn);
     composit_to_screen(_window, composit_rgn);
+    _composit_copy_marks[_composit_index] = _window.get_copy_mark();
+    _composit_index = !_composit_index;
     update_done();
+    on_present(_last_present_time);
     region_destroy(&direct_rgn);
     region_destroy(&composit_rgn);
 
@@ -453,13 +509,54 @@ void RedScreen::update()
     }
 }
 
-bool RedScreen::_invalidate(const SpiceRect& rect, bool urgent, uint64_t& update_mark)
+bool RedScreen::is_input_adjacent(const SpiceRect& rect, uint64_t now)
 {
+    if (now - _last_input_time > INPUT_PRIORITY_TIME) {
+        return false;
+    }
+    if (_mouse_captured || !_pointer_on_screen) {
+        return true;
+    }
+    return rect.left < _pointer_pos.x + INPUT_AREA_SIZE &&
+           rect.right > _pointer_pos.x - INPUT_AREA_SIZE &&
+           rect.top < _pointer_pos.y + INPUT_AREA_SIZE &&
+           rect.bottom > _pointer_pos.y - INPUT_AREA_SIZE;
+}
+
+/* Damage is coalesced and presented on the update timer, which ticks once per
+   refresh interval. Urgent damage, and damage next to recent input, is
+   presented right away unless there was a present in this interval already,
+   in which case it goes with the next tick. */
+bool RedScreen::_invalidate(const SpiceRect& rect, bool& urgent, uint64_t& update_mark)
+{
+    uint64_t now = Platform::get_monolithic_time();
     RecurciveLock lock(_update_lock);
-    bool update_triger = !is_dirty() && (urgent || !_periodic_update);
+    bool was_dirty = is_dirty();
+
     region_add(&_dirty_region, &rect);
     update_mark = _update_mark;
-    return update_triger;
+
+    if (_input_time && !_input_mark) {
+        if (now - _input_time < INPUT_LATENCY_TIMEOUT) {
+            _input_mark = _update_mark;
+        } else {
+            _input_time = 0;
+        }
+    }
+
+    urgent = urgent || is_input_adjacent(rect, now);
+    if (!urgent) {
+        return !was_dirty && !_periodic_update;
+    }
+    if (_update_by_timer && now - _last_present_time < _present_interval * NSEC_PER_MSEC) {
+        urgent = false;
+        return true;
+    }
+    if (_update_event_pending) {
+        return false;
+    }
+    _update_event_pending = true;
+    return true;
 }
 
 uint64_t RedScreen::invalidate(const SpiceRect& rect, bool urgent)
@@ -646,6 +743,7 @@ void RedScreen::on_mouse_motion(int x, int y, unsigned int buttons_state)
 
 void RedScreen::on_pointer_motion(int x, int y, unsigned int buttons_state)
 {
+    on_input(false);
     if (_mouse_captured) {
         on_mouse_motion(x, y, buttons_state);
         return;
@@ -664,6 +762,7 @@ void RedScreen::on_pointer_motion(int x, int y, unsigned int buttons_state)
 
 void RedScreen::on_mouse_button_press(SpiceMouseButton button, unsigned int buttons_state)
 {
+    on_input(true);
     if (_mouse_captured) {
         _owner.on_mouse_down(button, buttons_state);
         return;
@@ -689,6 +788,45 @@ void RedScreen::on_mouse_button_release(SpiceMouseButton button, unsigned int bu
     _pointer_layer->on_mouse_button_release(button, buttons_state);
 }
 
+void RedScreen::on_input(bool measure_latency)
+{
+    RecurciveLock lock(_update_lock);
+    _last_input_time = Platform::get_monolithic_time();
+    if (measure_latency && !_input_time) {
+        _input_time = _last_input_time;
+        _input_mark = 0;
+    }
+}
+
+/* input to present latency is measured from an input event to the end of the
+   update that presents the first damage following it */
+void RedScreen::on_present(uint64_t now)
+{
+    RecurciveLock lock(_update_lock);
+    if (_input_mark && _update_mark - 1 >= _input_mark) {
+        uint64_t latency = now - _input_time;
+
+        _input_latency_count++;
+        _input_latency_total += latency;
+        if (latency > _input_latency_max) {
+            _input_latency_max = latency;
+        }
+        _input_time = 0;
+        _input_mark = 0;
+    }
+    if (!_input_latency_count || now - _input_latency_report_time < INPUT_LATENCY_REPORT_INTERVAL) {
+        return;
+    }
+    LOG_INFO("screen %d input to present latency: %u samples, avg %.1f ms, max %.1f ms", _id,
+             _input_latency_count,
+             (double)_input_latency_total / _input_latency_count / NSEC_PER_MSEC,
+             (double)_input_latency_max / NSEC_PER_MSEC);
+    _input_latency_count = 0;
+    _input_latency_total = 0;
+    _input_latency_max = 0;
+    _input_latency_report_time = now;
+}
+
 void RedScreen::on_pointer_leave()
 {
 //    ASSERT(!_mouse_captured);
@@ -702,6 +840,7 @@ void RedScreen::on_pointer_leave()
 
 void RedScreen::on_key_press(RedKey key)
 {
+    on_input(true);
     _owner.on_key_down(key);
 }
 
@@ -905,6 +1044,19 @@ bool RedScreen::need_recreate_context_gl()
 
 #endif
 
+void RedScreen::on_copy_completion()
+{
+    if (!_update_deferred || !_window.is_copy_mark_done(_composit_copy_marks[_composit_index])) {
+        return;
+    }
+    _update_deferred = false;
+    if (update_by_interrupt()) {
+        interrupt_update();
+    } else {
+        update();
+    }
+}
+
 void RedScreen::set_update_interrupt_trigger(EventSources::Trigger *trigger)
 {
     _update_interrupt_trigger = trigger;
@@ -121,7 +121,10 @@ private:
     void save_position();
     void __show_full_screen();
 
-    bool _invalidate(const SpiceRect& rect, bool urgent, uint64_t& update_mark);
+    bool _invalidate(const SpiceRect& rect, bool& urgent, uint64_t& update_mark);
+    bool is_input_adjacent(const SpiceRect& rect, uint64_t now);
+    void on_input(bool measure_latency);
+    void on_present(uint64_t now);
     void begin_update(QRegion& direct_rgn, QRegion& composit_rgn, QRegion& frame_rgn);
     void update_composit(QRegion& composit_rgn);
     void draw_direct(RedDrawable& win_dc, QRegion& direct_rgn, QRegion& composit_rgn,
@@ -158,6 +161,7 @@ private:
 
     virtual void pre_migrate();
     virtual void post_migrate();
+    virtual void on_copy_completion();
 
 private:
     Application& _owner;
@@ -179,7 +183,21 @@ private:
     int _forec_update_timer;
     AutoRef<UpdateTimer> _update_timer;
     RedDrawable* _composit_area;
+    RedDrawable* _composit_buffers[2];
+    uint64_t _composit_copy_marks[2];   // window copy mark after the last update of a buffer
+    int _composit_index;
+    bool _update_deferred;
     uint64_t _update_mark;
+    unsigned int _present_interval;     // ms, a whole number of refresh periods
+    uint64_t _last_present_time;
+    bool _update_event_pending;
+    uint64_t _last_input_time;
+    uint64_t _input_time;               // oldest input not presented yet
+    uint64_t _input_mark;               // update presenting the first damage after it
+    uint32_t _input_latency_count;
+    uint64_t _input_latency_total;
+    uint64_t _input_latency_max;
+    uint64_t _input_latency_report_time;
 
     SpicePoint _size;
     SpicePoint _origin;
@@ -80,7 +80,8 @@ ScreenLayer::~ScreenLayer()
 
 uint64_t ScreenLayer::invalidate_rect(const SpiceRect& r, bool urgent)
 {
-    return _screen->invalidate(r, urgent);
+    // cursor moves are presented as soon as the refresh interval allows
+    return _screen->invalidate(r, urgent || _z_order == SCREEN_LAYER_CURSOR);
 }
 
 uint64_t ScreenLayer::invalidate(const SpiceRect& r, bool urgent)
@@ -20,6 +20,7 @@
 
 #include "utils.h"
 #include "threads.h"
+#include "cache_table.hpp"
 
 /*class SharedCache::Treat {
     T* get(T*);
@@ -27,13 +28,17 @@
     const char* name();
 };*/
 
+/* Items are spread over SHARD_COUNT independently locked shards, so
+   DisplayChannel threads working on different ids don't serialize on one
+   lock. get(), get_lossless() and replace() wait until the item is added
+   (or replaced by a lossless version) by another thread. */
+
 template <class T, class Treat, int HASH_SIZE, class Base = EmptyBase>
 class SharedCache : public Base {
 public:
     SharedCache()
         : _aborting (false)
     {
-        memset(_hash, 0, sizeof(_hash));
     }
 
     ~SharedCache()
@@ -43,180 +48,145 @@ public:
 
     void add(uint64_t id, T* data, bool is_lossy = FALSE)
     {
-        Lock lock(_lock);
-        Item** item = &_hash[key(id)];
+        Shard& shard = get_shard(id);
+        Lock lock(shard.lock);
+        Item* item = shard.table.find(id);
 
-        while (*item) {
-            if ((*item)->id == id) {
-                (*item)->refs++;
-                return;
-            }
-            item = &(*item)->next;
+        if (item) {
+            item->refs++;
+            return;
         }
-        *item = new Item(id, data, is_lossy);
-        _new_item_cond.notify_all();
+        item = shard.table.insert(id);
+        item->refs = 1;
+        item->data = Treat::get(data);
+        item->lossy = is_lossy;
+        shard.new_item_cond.notify_all();
     }
 
     T* get(uint64_t id)
     {
-        Lock lock(_lock);
-        Item* item = _hash[key(id)];
-
-        for (;;) {
-            if (!item) {
-                if (_aborting) {
-                    THROW("%s aborting", Treat::name());
-                }
-                _new_item_cond.wait(lock);
-                item = _hash[key(id)];
-                continue;
-            }
-
-            if (item->id != id) {
-                item = item->next;
-                continue;
-            }
+        Shard& shard = get_shard(id);
+        Lock lock(shard.lock);
+        Item* item = wait_for_item(shard, lock, id);
 
-            return Treat::get(item->data);
-        }
+        return Treat::get(item->data);
     }
 
     T* get_lossless(uint64_t id)
     {
-        Lock lock(_lock);
-        Item* item = _hash[key(id)];
-
-        for (;;) {
-            if (!item) {
-                if (_aborting) {
-                    THROW("%s aborting", Treat::name());
-                }
-                _new_item_cond.wait(lock);
-                item = _hash[key(id)];
-                continue;
-            }
-
-            if (item->id != id) {
-                item = item->next;
-                continue;
-            }
-            break;
-        }
+        Shard& shard = get_shard(id);
+        Lock lock(shard.lock);
+        Item* item = wait_for_item(shard, lock, id);
 
         // item has been retreived. Now checking if lossless
-        for (;;) {
-            if (item->lossy) {
-                if (_aborting) {
-                    THROW("%s aborting", Treat::name());
-                }
-                _replace_data_cond.wait(lock);
-                continue;
+        while (item->lossy) {
+            if (_aborting) {
+                THROW("%s aborting", Treat::name());
             }
-
-            return Treat::get(item->data);
+            shard.replace_data_cond.wait(lock);
+            item = wait_for_item(shard, lock, id);
         }
+        return Treat::get(item->data);
     }
 
     void replace(uint64_t id, T* data, bool is_lossy = FALSE)
     {
-        Lock lock(_lock);
-        Item* item = _hash[key(id)];
-
-        for (;;) {
-            if (!item) {
-                if (_aborting) {
-                    THROW("%s aborting", Treat::name());
-                }
-                _new_item_cond.wait(lock);
-                item = _hash[key(id)];
-                continue;
-            }
-
-            if (item->id != id) {
-                item = item->next;
-                continue;
-            }
-
-            item->replace(data, is_lossy);
-            break;
-        }
-        _replace_data_cond.notify_all();
+        Shard& shard = get_shard(id);
+        Lock lock(shard.lock);
+        Item* item = wait_for_item(shard, lock, id);
+
+        Treat::release(item->data);
+        item->data = Treat::get(data);
+        item->lossy = is_lossy;
+        shard.replace_data_cond.notify_all();
     }
 
     void remove(uint64_t id)
     {
-        Lock lock(_lock);
-        Item** item = &_hash[key(id)];
-
-        while (*item) {
-            if ((*item)->id == id) {
-                if (!--(*item)->refs) {
-                    Item *rm_item = *item;
-                    *item = rm_item->next;
-                    delete rm_item;
-                }
-                return;
-            }
-            item = &(*item)->next;
+        Shard& shard = get_shard(id);
+        Lock lock(shard.lock);
+        Item* item = shard.table.find(id);
+
+        if (!item) {
+            THROW("%s id %lu, not found", Treat::name(), id);
+        }
+        if (!--item->refs) {
+            Treat::release(item->data);
+            shard.table.erase(item);
         }
-        THROW("%s id %lu, not found", Treat::name(), id);
     }
 
     void clear()
     {
-        Lock lock(_lock);
-        for (int i = 0; i < HASH_SIZE; i++) {
-            while (_hash[i]) {
-                Item *item = _hash[i];
-                _hash[i] = item->next;
-                delete item;
+        for (int i = 0; i < SHARD_COUNT; i++) {
+            Shard& shard = _shards[i];
+            Lock lock(shard.lock);
+
+            for (int j = 0; j < shard.table.size(); j++) {
+                Item* item = shard.table.slot(j);
+                if (item) {
+                    Treat::release(item->data);
+                }
             }
+            shard.table.reset();
         }
     }
 
     void abort()
     {
-        Lock lock(_lock);
         _aborting = true;
-        _new_item_cond.notify_all();
+        for (int i = 0; i < SHARD_COUNT; i++) {
+            Lock lock(_shards[i].lock);
+            _shards[i].new_item_cond.notify_all();
+            _shards[i].replace_data_cond.notify_all();
+        }
     }
 
 private:
-    inline uint32_t key(uint64_t id) {return uint32_t(id) % HASH_SIZE;}
-
-private:
-    class Item {
-    public:
-        Item(uint64_t in_id, T* data, bool is_lossy = FALSE)
-            : id (in_id)
-            , refs (1)
-            , next (NULL)
-            , data (Treat::get(data))
-            , lossy (is_lossy) {}
-
-        ~Item()
-        {
-            Treat::release(data);
-        }
-
-        void replace(T* new_data, bool is_lossy = FALSE)
-        {
-            Treat::release(data);
-            data = Treat::get(new_data);
-            lossy = is_lossy;
-        }
-
+    struct Item {
         uint64_t id;
-        int refs;
         Item* next;
+        int refs;
         T* data;
         bool lossy;
     };
 
-    Item* _hash[HASH_SIZE];
-    Mutex _lock;
-    Condition _new_item_cond;
-    Condition _replace_data_cond;
+    enum {
+        SHARD_BITS = 3,
+        SHARD_COUNT = 1 << SHARD_BITS,
+    };
+
+    class Shard {
+    public:
+        Shard() : table (HASH_SIZE / SHARD_COUNT) {}
+
+        Mutex lock;
+        Condition new_item_cond;
+        Condition replace_data_cond;
+        CacheTable<Item> table;
+    };
+
+    // the table indexes with the low bits of the hash, shards use the top ones
+    inline Shard& get_shard(uint64_t id)
+    {
+        return _shards[CacheTable<Item>::hash(id) >> (32 - SHARD_BITS)];
+    }
+
+    Item* wait_for_item(Shard& shard, Lock& lock, uint64_t id)
+    {
+        Item* item;
+
+        while (!(item = shard.table.find(id))) {
+            if (_aborting) {
+                THROW("%s aborting", Treat::name());
+            }
+            shard.new_item_cond.wait(lock);
+        }
+        return item;
+    }
+
+private:
+    Shard _shards[SHARD_COUNT];
     bool _aborting;
 };
 
@@ -0,0 +1,121 @@
+/*
+   Copyright (C) 2009 Red Hat, Inc.
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2.1 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+
+/* Measures SharedCache get/add/remove throughput with N threads hitting the
+   same cache, the way DisplayChannel threads share the pixmap cache.
+
+   usage: shared_cache_bench [threads] [ops per thread] */
+
+#include "common.h"
+#include <stdlib.h>
+#include <sys/time.h>
+#include "shared_cache.hpp"
+
+struct BenchData {
+    uint64_t id;
+};
+
+class BenchTreat {
+public:
+    static inline BenchData* get(BenchData* data) { return data;}
+    static inline void release(BenchData* data) {}
+    static const char* name() { return "bench";}
+};
+
+typedef SharedCache<BenchData, BenchTreat, 1024> BenchCache;
+
+#define RESIDENT_ITEMS 4096
+#define PRIVATE_ITEMS 256
+/* one add/remove pair for every GET_RATIO gets */
+#define GET_RATIO 8
+
+static BenchCache cache;
+static BenchData resident[RESIDENT_ITEMS];
+static int ops_per_thread = 1000000;
+
+struct BenchThread {
+    int index;
+    Thread* thread;
+    BenchData items[PRIVATE_ITEMS];
+};
+
+static uint64_t now_usec()
+{
+    struct timeval tv;
+
+    gettimeofday(&tv, NULL);
+    return uint64_t(tv.tv_sec) * 1000000 + tv.tv_usec;
+}
+
+static void* bench_thread_main(void* opaque)
+{
+    BenchThread* bench = (BenchThread*)opaque;
+    uint64_t base = uint64_t(bench->index + 1) << 32;
+    uint32_t seed = bench->index * 7919 + 1;
+    uint64_t sum = 0;
+
+    for (int i = 0; i < ops_per_thread; i++) {
+        seed = seed * 1103515245 + 12345;
+        if (i % GET_RATIO) {
+            sum += cache.get(resident[(seed >> 8) % RESIDENT_ITEMS].id)->id;
+        } else {
+            BenchData* item = &bench->items[(seed >> 8) % PRIVATE_ITEMS];
+            item->id = base + (seed >> 8) % PRIVATE_ITEMS;
+            cache.add(item->id, item);
+            sum += cache.get(item->id)->id;
+            cache.remove(item->id);
+        }
+    }
+    return (void*)(uintptr_t)sum;
+}
+
+int main(int argc, char** argv)
+{
+    int num_threads = argc > 1 ? atoi(argv[1]) : 4;
+    BenchThread* threads;
+    uint64_t start, elapsed;
+
+    if (argc > 2) {
+        ops_per_thread = atoi(argv[2]);
+    }
+    if (num_threads < 1 || ops_per_thread < 1) {
+        fprintf(stderr, "usage: %s [threads] [ops per thread]\n", argv[0]);
+        return 1;
+    }
+
+    for (int i = 0; i < RESIDENT_ITEMS; i++) {
+        resident[i].id = i;
+        cache.add(i, &resident[i]);
+    }
+
+    threads = new BenchThread[num_threads];
+    start = now_usec();
+    for (int i = 0; i < num_threads; i++) {
+        threads[i].index = i;
+        threads[i].thread = new Thread(bench_thread_main, &threads[i]);
+    }
+    for (int i = 0; i < num_threads; i++) {
+        threads[i].thread->join();
+        delete threads[i].thread;
+    }
+    elapsed = now_usec() - start;
+    delete[] threads;
+
+    printf("%d threads, %d ops each: %.3f sec, %.0f ops/sec\n", num_threads, ops_per_thread,
+           elapsed / 1000000.0, double(num_threads) * ops_per_thread * 1000000.0 / elapsed);
+    return 0;
+}
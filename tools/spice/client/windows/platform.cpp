@@ -372,6 +372,29 @@ uint64_t Platform::get_thread_id()
     return GetCurrentThreadId();
 }
 
+int Platform::get_num_cpus()
+{
+    SYSTEM_INFO info;
+
+    GetSystemInfo(&info);
+    return int(info.dwNumberOfProcessors);
+}
+
+// of the primary display in Hz, 0 when unknown
+int Platform::get_refresh_rate()
+{
+    DEVMODE mode;
+
+    mode.dmSize = sizeof(mode);
+    mode.dmDriverExtra = 0;
+    // 0 and 1 stand for the hardware default
+    if (!EnumDisplaySettings(NULL, ENUM_CURRENT_SETTINGS, &mode) ||
+        mode.dmDisplayFrequency <= 1) {
+        return 0;
+    }
+    return int(mode.dmDisplayFrequency);
+}
+
 void Platform::error_beep()
 {
     MessageBeep(MB_ICONERROR);
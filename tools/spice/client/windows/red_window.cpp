@@ -380,6 +380,16 @@ RedDrawable::Format RedWindow::get_format()
     return _format;
 }
 
+uint64_t RedWindow::get_copy_mark()
+{
+    return 0;
+}
+
+bool RedWindow::is_copy_mark_done(uint64_t mark)
+{
+    return true;
+}
+
 
 void RedWindow_p::on_pos_changing(RedWindow& red_window)
 {
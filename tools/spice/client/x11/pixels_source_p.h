@@ -56,6 +56,8 @@ struct PixelsSource_p {
             int screen;
             GC gc;
             int width, height;
+            uint64_t shm_puts;          // XShmPutImage requests sent to the drawable
+            uint64_t shm_completions;   // and the ones the server is done with
 #ifdef USE_OGL
             RenderType rendertype;
             union {
@@ -73,6 +73,7 @@
 
 static Display* x_display = NULL;
 static bool x_shm_avail = false;
+static int x_shm_completion_type = -1;
 static XVisualInfo **vinfo = NULL;
 static RedDrawable::Format *screen_format = NULL;
 #ifdef USE_OGL
@@ -334,6 +335,11 @@ bool XPlatform::is_x_shm_avail()
     return x_shm_avail;
 }
 
+int XPlatform::get_shm_completion_type()
+{
+    return x_shm_completion_type;
+}
+
 XImage *XPlatform::create_x_shm_image(RedDrawable::Format format,
                                       int width, int height, int depth,
                                       Visual *visual,
@@ -569,6 +575,35 @@ uint64_t Platform::get_thread_id()
     return uint64_t(syscall(SYS_gettid));
 }
 
+int Platform::get_num_cpus()
+{
+    long num_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    return (num_cpus > 0) ? int(num_cpus) : 1;
+}
+
+// of the default screen in Hz, 0 when unknown
+int Platform::get_refresh_rate()
+{
+    XRRScreenConfiguration* config;
+    int rate = 0;
+
+    if (!using_xrandr_1_0
+#ifdef USE_XRANDR_1_2
+        && !using_xrandr_1_2
+#endif
+        ) {
+        return 0;
+    }
+    XLockDisplay(x_display);
+    config = XRRGetScreenInfo(x_display, DefaultRootWindow(x_display));
+    if (config) {
+        rate = XRRConfigCurrentRate(config);
+        XRRFreeScreenConfigInfo(config);
+    }
+    XUnlockDisplay(x_display);
+    return rate;
+}
+
 void Platform::error_beep()
 {
     if (!x_display) {
@@ -3069,6 +3104,7 @@ void Platform::init()
     if (XShmQueryExtension (x_display) &&
         XShmQueryVersion (x_display, &major, &minor, &pixmaps)) {
         x_shm_avail = true;
+        x_shm_completion_type = XShmGetEventBase(x_display) + ShmCompletion;
     }
 
     vinfo = new XVisualInfo *[ScreenCount(x_display)];
@@ -189,7 +189,7 @@ static void free_temp_image(XImage *image, XShmSegmentInfo *shminfo, pixman_imag
 }
 
 
-static inline void copy_to_drawable_from_pixmap(const RedDrawable_p* dest,
+static inline void copy_to_drawable_from_pixmap(RedDrawable_p* dest,
                                                 const SpiceRect& area,
                                                 const SpicePoint& offset,
                                                 const PixelsSource_p* source,
@@ -212,10 +212,12 @@ static inline void copy_to_drawable_from_pixmap(const RedDrawable_p* dest,
     if (source->pixmap.x_image != NULL &&
         RedDrawable::format_copy_compatible(source->pixmap.format, screen_format)) {
         if (source->pixmap.shminfo) {
+            // counted against the completion events, see RedWindow::get_copy_mark()
             XShmPutImage(XPlatform::get_display(), dest->source.x_drawable.drawable,
                          dest->source.x_drawable.gc, source->pixmap.x_image,
                          src_x, src_y, area.left + offset.x, area.top + offset.y,
-                         area.right - area.left, area.bottom - area.top, false);
+                         area.right - area.left, area.bottom - area.top, true);
+            dest->source.x_drawable.shm_puts++;
         } else {
             XPutImage(XPlatform::get_display(), dest->source.x_drawable.drawable,
                       dest->source.x_drawable.gc, source->pixmap.x_image, src_x,
@@ -253,7 +255,7 @@ static inline void copy_to_drawable_from_pixmap(const RedDrawable_p* dest,
     XFlush(XPlatform::get_display());
 }
 
-static inline void copy_to_x_drawable(const RedDrawable_p* dest,
+static inline void copy_to_x_drawable(RedDrawable_p* dest,
                                       const SpiceRect& area,
                                       const SpicePoint& offset,
                                       const PixelsSource_p* source,
@@ -951,6 +951,12 @@ void RedWindow_p::win_proc(XEvent& event)
             memcpy(&red_window->_shadow_pointer_event, &event, sizeof(XEvent));
         }
         break;
+    default:
+        if (event.type == XPlatform::get_shm_completion_type()) {
+            ((PixelsSource_p*)red_window->get_opaque())->x_drawable.shm_completions++;
+            red_window->get_listener().on_copy_completion();
+        }
+        break;
     }
 }
 
@@ -1157,7 +1163,11 @@ void RedWindow_p::destroy(RedWindow& red_window, PixelsSource_p& pix_source)
     XLockDisplay(x_display);
     XSync(x_display, False);
     while (XCheckWindowEvent(x_display, _win, ~long(0), &event));
+    while (XCheckTypedWindowEvent(x_display, _win, XPlatform::get_shm_completion_type(),
+                                  &event));
     XUnlockDisplay(x_display);
+    // after the sync the server is done with all the puts to the window
+    pix_source.x_drawable.shm_completions = pix_source.x_drawable.shm_puts;
 
     Window window = _win;
     _win = None;
@@ -2157,6 +2167,16 @@ RedDrawable::Format RedWindow::get_format()
   return XPlatform::get_screen_format(_screen);
 }
 
+uint64_t RedWindow::get_copy_mark()
+{
+    return ((PixelsSource_p*)get_opaque())->x_drawable.shm_puts;
+}
+
+bool RedWindow::is_copy_mark_done(uint64_t mark)
+{
+    return ((PixelsSource_p*)get_opaque())->x_drawable.shm_completions >= mark;
+}
+
 void RedWindow::on_focus_in()
 {
     if (_focused) {
@@ -41,6 +41,7 @@ public:
     static void on_focus_out();
 
     static bool is_x_shm_avail();
+    static int get_shm_completion_type();
     static XImage *create_x_shm_image(RedDrawable::Format format,
 				      int width, int height, int depth,
 				      Visual *visual,
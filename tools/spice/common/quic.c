@@ -141,6 +141,7 @@ typedef struct Channel {
 
     int correlate_row_width;
     BYTE *correlate_row;
+    BYTE *residual_row;     /* row decorelated ahead of time, shares correlate_row's buffer */
 
     s_bucket **_buckets_ptrs;
 
@@ -809,6 +810,8 @@ typedef uint16_t rgb16_pixel_t;
 
 #undef ATTR_PACKED
 
+#include "quic_simd.c"
+
 #define ONE_BYTE
 #include "quic_tmpl.c"
 
@@ -1042,6 +1045,7 @@ static int init_channel(Encoder *encoder, Channel *channel)
     channel->state.encoder = encoder;
     channel->correlate_row_width = 0;
     channel->correlate_row = NULL;
+    channel->residual_row = NULL;
 
     find_model_params(encoder, 8, &ncounters, &levels, &n_buckets_ptrs, &rep_first,
                       &first_size, &rep_next, &mul_size, &n_buckets);
@@ -1132,10 +1136,11 @@ static int encoder_reste_channels(Encoder *encoder, int channels, int width, int
                 encoder->usr->free(encoder->usr, encoder->channels[i].correlate_row - 1);
             }
             if (!(encoder->channels[i].correlate_row = (BYTE *)encoder->usr->malloc(encoder->usr,
-                                                                                    width + 1))) {
+                                                                                    2 * width + 1))) {
                 return FALSE;
             }
             encoder->channels[i].correlate_row++;
+            encoder->channels[i].residual_row = encoder->channels[i].correlate_row + width;
             encoder->channels[i].correlate_row_width = width;
         }
 
@@ -1702,5 +1707,6 @@ void quic_init()
 #if defined(RLE) && defined(RLE_STAT)
     init_zeroLUT();
 #endif
+    quic_simd_init();
 }
 
@@ -18,6 +18,9 @@
 
 #ifdef QUIC_RGB32
 #undef QUIC_RGB32
+#ifdef QUIC_SIMD_ROWS
+#define QUIC_RGB32_SIMD
+#endif
 #define PIXEL rgb32_pixel_t
 #define FNAME(name) quic_rgb32_##name
 #define golomb_coding golomb_coding_8bpc
@@ -315,9 +318,22 @@ static void FNAME(compress_row0)(Encoder *encoder, const PIXEL *cur_row,
                   &codeword, &codewordlen);                                                 \
     encode(encoder, codeword, codewordlen);
 
-#define COMPRESS_ONE(channel, index)                                                            \
+#ifdef QUIC_RGB32_SIMD
+#define DECORELATE_ONE(channel, index)                                                          \
+    if (residual_row_##channel) {                                                               \
+        correlate_row_##channel[index] = residual_row_##channel[index];                         \
+    } else {                                                                                    \
+        DECORELATE(channel, &prev_row[index], &cur_row[index], bpc_mask,                        \
+                   correlate_row_##channel[index]);                                             \
+    }
+#else
+#define DECORELATE_ONE(channel, index)                                                          \
     DECORELATE(channel, &prev_row[index], &cur_row[index],bpc_mask,                             \
-               correlate_row_##channel[index]);                                                 \
+               correlate_row_##channel[index]);
+#endif
+
+#define COMPRESS_ONE(channel, index)                                                            \
+    DECORELATE_ONE(channel, index);                                                             \
     golomb_coding(correlate_row_##channel[index],                                               \
                  find_bucket(channel_##channel, correlate_row_##channel[index - 1])->bestcode,  \
                  &codeword, &codewordlen);                                                      \
@@ -338,6 +354,11 @@ static void FNAME(compress_row_seg)(Encoder *encoder, int i,
     BYTE * const correlate_row_r = channel_r->correlate_row;
     BYTE * const correlate_row_g = channel_g->correlate_row;
     BYTE * const correlate_row_b = channel_b->correlate_row;
+#ifdef QUIC_RGB32_SIMD
+    const BYTE * const residual_row_r = decorelate_row_rgb32 ? channel_r->residual_row : NULL;
+    const BYTE * const residual_row_g = decorelate_row_rgb32 ? channel_g->residual_row : NULL;
+    const BYTE * const residual_row_b = decorelate_row_rgb32 ? channel_b->residual_row : NULL;
+#endif
     int stopidx;
 #ifdef RLE
     int run_index = 0;
@@ -425,6 +446,13 @@ static void FNAME(compress_row)(Encoder *encoder,
     const unsigned int bpc_mask = BPC_MASK;
     unsigned int pos = 0;
 
+#ifdef QUIC_RGB32_SIMD
+    if (decorelate_row_rgb32) {
+        decorelate_row_rgb32(prev_row, cur_row, width, encoder->channels[0].residual_row,
+                             encoder->channels[1].residual_row, encoder->channels[2].residual_row);
+    }
+#endif
+
     while ((wmimax > (int)encoder->rgb_state.wmidx) && (encoder->rgb_state.wmileft <= width)) {
         if (encoder->rgb_state.wmileft) {
             FNAME(compress_row_seg)(encoder, pos, prev_row, cur_row,
@@ -739,6 +767,7 @@ static void FNAME(uncompress_row)(Encoder *encoder,
 #undef COMPRESS_ONE_ROW0
 #undef COMPRESS_ONE_0
 #undef COMPRESS_ONE
+#undef DECORELATE_ONE
 #undef CORELATE_0
 #undef CORELATE
 #undef UNCOMPRESS_ONE_ROW0_0
@@ -760,4 +789,5 @@ static void FNAME(uncompress_row)(Encoder *encoder,
 #undef SET_b
 #undef GET_b
 #undef UNCOMPRESS_PIX_START
+#undef QUIC_RGB32_SIMD
 
@@ -0,0 +1,190 @@
+/* -*- Mode: C; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+   Copyright (C) 2009 Red Hat, Inc.
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2.1 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+
+/* Row decorelation kernels for the rgb32 encoder, included by quic.c.
+
+   On the encoder side every input of the predictor is known in advance, so
+   the residuals of a whole row can be computed up front. Each kernel writes
+   xlatU2L[(cur - pred) & 0xff] of pixels 1..width-1 into one byte row per
+   channel. quic_rgb_tmpl.c then picks them up instead of computing them
+   per pixel. The decoder can't do the same, since each prediction depends
+   on the previously decoded pixel.
+
+   With 8 bpc xlatU2L[s] is s << 1 for s < 0x80 and ((~s) << 1) | 1
+   otherwise, which is what the vector code computes, so the output is
+   bit identical to the scalar path. */
+
+#if defined(QUIC_RGB) && defined(PRED_1)
+
+#define QUIC_SIMD_ROWS
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define QUIC_SIMD_SSE2
+#include <emmintrin.h>
+#endif
+
+#if defined(QUIC_SIMD_SSE2) && defined(__GNUC__) && !defined(__clang__) && \
+    (__GNUC__ > 4 || (__GNUC__ == 4 && __GNUC_MINOR__ >= 9))
+#define QUIC_SIMD_AVX2
+#include <immintrin.h>
+#endif
+
+typedef void (*decorelate_row_rgb32_t)(const rgb32_pixel_t *prev_row,
+                                       const rgb32_pixel_t *cur_row, int width,
+                                       BYTE *r, BYTE *g, BYTE *b);
+
+/* NULL when only the scalar path is available */
+static decorelate_row_rgb32_t decorelate_row_rgb32 = NULL;
+
+static INLINE void decorelate_row_rgb32_tail(const rgb32_pixel_t *prev_row,
+                                             const rgb32_pixel_t *cur_row, int i, int width,
+                                             BYTE *r, BYTE *g, BYTE *b)
+{
+    for (; i < width; i++) {
+        r[i] = family_8bpc.xlatU2L[(unsigned)((int)cur_row[i].r -
+                                   (int)((cur_row[i - 1].r + prev_row[i].r) >> 1)) & 0xff];
+        g[i] = family_8bpc.xlatU2L[(unsigned)((int)cur_row[i].g -
+                                   (int)((cur_row[i - 1].g + prev_row[i].g) >> 1)) & 0xff];
+        b[i] = family_8bpc.xlatU2L[(unsigned)((int)cur_row[i].b -
+                                   (int)((cur_row[i - 1].b + prev_row[i].b) >> 1)) & 0xff];
+    }
+}
+
+#ifdef QUIC_SIMD_SSE2
+
+/* xlatU2L of the per byte residual of (a + b) / 2 */
+static INLINE __m128i decorelate_sse2(__m128i cur, __m128i a, __m128i b)
+{
+    const __m128i one = _mm_set1_epi8(1);
+    __m128i pred = _mm_sub_epi8(_mm_avg_epu8(a, b), _mm_and_si128(_mm_xor_si128(a, b), one));
+    __m128i s = _mm_sub_epi8(cur, pred);
+    __m128i neg = _mm_cmplt_epi8(s, _mm_setzero_si128());
+    __m128i x = _mm_xor_si128(s, neg);
+
+    return _mm_or_si128(_mm_add_epi8(x, x), _mm_and_si128(neg, one));
+}
+
+/* extracts byte "shift / 8" of each pixel of 16 pixels into one vector */
+static INLINE __m128i extract_channel_sse2(__m128i v0, __m128i v1, __m128i v2, __m128i v3,
+                                           int shift)
+{
+    const __m128i mask = _mm_set1_epi32(0xff);
+
+    v0 = _mm_and_si128(_mm_srli_epi32(v0, shift), mask);
+    v1 = _mm_and_si128(_mm_srli_epi32(v1, shift), mask);
+    v2 = _mm_and_si128(_mm_srli_epi32(v2, shift), mask);
+    v3 = _mm_and_si128(_mm_srli_epi32(v3, shift), mask);
+    return _mm_packus_epi16(_mm_packs_epi32(v0, v1), _mm_packs_epi32(v2, v3));
+}
+
+static void decorelate_row_rgb32_sse2(const rgb32_pixel_t *prev_row,
+                                      const rgb32_pixel_t *cur_row, int width,
+                                      BYTE *r, BYTE *g, BYTE *b)
+{
+    __m128i v[4];
+    int i, j;
+
+    for (i = 1; i + 16 <= width; i += 16) {
+        for (j = 0; j < 4; j++) {
+            v[j] = decorelate_sse2(_mm_loadu_si128((const __m128i *)&cur_row[i + j * 4]),
+                                   _mm_loadu_si128((const __m128i *)&cur_row[i + j * 4 - 1]),
+                                   _mm_loadu_si128((const __m128i *)&prev_row[i + j * 4]));
+        }
+        _mm_storeu_si128((__m128i *)&b[i], extract_channel_sse2(v[0], v[1], v[2], v[3], 0));
+        _mm_storeu_si128((__m128i *)&g[i], extract_channel_sse2(v[0], v[1], v[2], v[3], 8));
+        _mm_storeu_si128((__m128i *)&r[i], extract_channel_sse2(v[0], v[1], v[2], v[3], 16));
+    }
+    decorelate_row_rgb32_tail(prev_row, cur_row, i, width, r, g, b);
+}
+
+#endif
+
+#ifdef QUIC_SIMD_AVX2
+
+#define AVX2_FUNC __attribute__ ((target ("avx2")))
+
+static INLINE AVX2_FUNC __m256i decorelate_avx2(__m256i cur, __m256i a, __m256i b)
+{
+    const __m256i one = _mm256_set1_epi8(1);
+    __m256i pred = _mm256_sub_epi8(_mm256_avg_epu8(a, b),
+                                   _mm256_and_si256(_mm256_xor_si256(a, b), one));
+    __m256i s = _mm256_sub_epi8(cur, pred);
+    __m256i neg = _mm256_cmpgt_epi8(_mm256_setzero_si256(), s);
+    __m256i x = _mm256_xor_si256(s, neg);
+
+    return _mm256_or_si256(_mm256_add_epi8(x, x), _mm256_and_si256(neg, one));
+}
+
+static INLINE AVX2_FUNC __m256i extract_channel_avx2(__m256i v0, __m256i v1, __m256i v2,
+                                                     __m256i v3, int shift)
+{
+    const __m256i mask = _mm256_set1_epi32(0xff);
+    /* the packs work per 128 bit lane, put the dwords back in pixel order */
+    const __m256i order = _mm256_setr_epi32(0, 4, 1, 5, 2, 6, 3, 7);
+
+    v0 = _mm256_and_si256(_mm256_srli_epi32(v0, shift), mask);
+    v1 = _mm256_and_si256(_mm256_srli_epi32(v1, shift), mask);
+    v2 = _mm256_and_si256(_mm256_srli_epi32(v2, shift), mask);
+    v3 = _mm256_and_si256(_mm256_srli_epi32(v3, shift), mask);
+    return _mm256_permutevar8x32_epi32(_mm256_packus_epi16(_mm256_packs_epi32(v0, v1),
+                                                           _mm256_packs_epi32(v2, v3)),
+                                       order);
+}
+
+static AVX2_FUNC void decorelate_row_rgb32_avx2(const rgb32_pixel_t *prev_row,
+                                                const rgb32_pixel_t *cur_row, int width,
+                                                BYTE *r, BYTE *g, BYTE *b)
+{
+    __m256i v[4];
+    int i, j;
+
+    for (i = 1; i + 32 <= width; i += 32) {
+        for (j = 0; j < 4; j++) {
+            v[j] = decorelate_avx2(_mm256_loadu_si256((const __m256i *)&cur_row[i + j * 8]),
+                                   _mm256_loadu_si256((const __m256i *)&cur_row[i + j * 8 - 1]),
+                                   _mm256_loadu_si256((const __m256i *)&prev_row[i + j * 8]));
+        }
+        _mm256_storeu_si256((__m256i *)&b[i], extract_channel_avx2(v[0], v[1], v[2], v[3], 0));
+        _mm256_storeu_si256((__m256i *)&g[i], extract_channel_avx2(v[0], v[1], v[2], v[3], 8));
+        _mm256_storeu_si256((__m256i *)&r[i], extract_channel_avx2(v[0], v[1], v[2], v[3], 16));
+    }
+    decorelate_row_rgb32_tail(prev_row, cur_row, i, width, r, g, b);
+}
+
+#endif
+
+static void quic_simd_init(void)
+{
+#ifdef QUIC_SIMD_SSE2
+    decorelate_row_rgb32 = decorelate_row_rgb32_sse2;
+#endif
+#ifdef QUIC_SIMD_AVX2
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        decorelate_row_rgb32 = decorelate_row_rgb32_avx2;
+    }
+#endif
+}
+
+#else
+
+static void quic_simd_init(void)
+{
+}
+
+#endif
@@ -274,6 +274,40 @@ static int test_generic (pixman_region32_t *reg1,
     return res & query;
 }
 
+/*
+ * Test a complex region against a single rectangle whose extents intersect
+ * the region's but do not contain it. The region is known to have parts
+ * outside the rectangle, so only sharing and coverage of the rectangle need
+ * to be found, which pixman answers with one banded lookup instead of a full
+ * two region walk.
+ */
+static int test_rect(pixman_region32_t *reg,
+                     pixman_box32_t *rect,
+                     int query,
+                     int reg_exclusive,
+                     int rect_exclusive)
+{
+    int res = reg_exclusive;
+
+    if ((res & query) == query) {
+        return res & query;
+    }
+
+    switch (pixman_region32_contains_rectangle(reg, rect)) {
+    case PIXMAN_REGION_IN:
+        res |= REGION_TEST_SHARED;
+        break;
+    case PIXMAN_REGION_PART:
+        res |= REGION_TEST_SHARED | rect_exclusive;
+        break;
+    default:
+        res |= rect_exclusive;
+        break;
+    }
+
+    return res & query;
+}
+
 int region_test(const QRegion *_reg1, const QRegion *_reg2, int query)
 {
     int res;
@@ -327,6 +361,14 @@ int region_test(const QRegion *_reg1, const QRegion *_reg2, int query)
     } else if (reg1 == reg2) {
         res |= REGION_TEST_SHARED;
         return res & query;
+    } else if (!reg2->data) {
+        /* reg2 is just a rect, reg1 spills out of it (it is not subsumed) */
+        return test_rect(reg1, &reg2->extents, query, REGION_TEST_LEFT_EXCLUSIVE,
+                         REGION_TEST_RIGHT_EXCLUSIVE);
+    } else if (!reg1->data) {
+        /* reg1 is just a rect, reg2 spills out of it (it is not subsumed) */
+        return test_rect(reg2, &reg1->extents, query, REGION_TEST_RIGHT_EXCLUSIVE,
+                         REGION_TEST_LEFT_EXCLUSIVE);
     } else {
         /* General purpose intersection */
         return test_generic (reg1, reg2, query);
@@ -411,7 +453,7 @@ int region_bounds_intersects(const QRegion *rgn1, const QRegion *rgn2)
     pixman_box32_t *extents1, *extents2;
 
     extents1 = pixman_region32_extents((pixman_region32_t *)rgn1);
-    extents2 = pixman_region32_extents((pixman_region32_t *)rgn1);
+    extents2 = pixman_region32_extents((pixman_region32_t *)rgn2);
 
     return EXTENTCHECK(extents1, extents2);
 }
@@ -515,6 +557,10 @@ void region_dump(const QRegion *rgn, const char *prefix)
 
 #ifdef REGION_TEST
 
+#include <time.h>
+
+static int failures;
+
 static int slow_region_test(const QRegion *rgn, const QRegion *other_rgn, int query)
 {
     pixman_region32_t intersection;
@@ -566,7 +612,7 @@ static void rect_set(SpiceRect *r, int32_t top, int32_t left, int32_t bottom, in
     ASSERT(rect_is_valid(r));
 }
 
-static void random_region(QRegion *reg)
+static void random_region(QRegion *reg, int max_rects)
 {
     int i;
     int num_rects;
@@ -576,7 +622,7 @@ static void random_region(QRegion *reg)
 
     region_clear(reg);
 
-    num_rects = rand() % 20;
+    num_rects = (max_rects > 1) ? rand() % max_rects : max_rects;
     for (i = 0; i < num_rects; i++) {
         x = rand()%100;
         y = rand()%100;
@@ -589,23 +635,130 @@ static void random_region(QRegion *reg)
     }
 }
 
+#define CHECK(res, expected) ((res) == (expected) ? "OK" : (failures++, "ERR"))
+
 static void test(const QRegion *r1, const QRegion *r2, int *expected)
 {
     printf("r1 is_empty %s [%s]\n",
            region_is_empty(r1) ? "TRUE" : "FALSE",
-           (region_is_empty(r1) == *(expected++)) ? "OK" : "ERR");
+           CHECK(region_is_empty(r1), *(expected++)));
     printf("r2 is_empty %s [%s]\n",
            region_is_empty(r2) ? "TRUE" : "FALSE",
-           (region_is_empty(r2) == *(expected++)) ? "OK" : "ERR");
+           CHECK(region_is_empty(r2), *(expected++)));
     printf("is_equal %s [%s]\n",
            region_is_equal(r1, r2) ? "TRUE" : "FALSE",
-           (region_is_equal(r1, r2) == *(expected++)) ? "OK" : "ERR");
+           CHECK(region_is_equal(r1, r2), *(expected++)));
     printf("intersects %s [%s]\n",
            region_intersects(r1, r2) ? "TRUE" : "FALSE",
-           (region_intersects(r1, r2) == *(expected++)) ? "OK" : "ERR");
+           CHECK(region_intersects(r1, r2), *(expected++)));
     printf("contains %s [%s]\n",
            region_contains(r1, r2) ? "TRUE" : "FALSE",
-           (region_contains(r1, r2) == *(expected++)) ? "OK" : "ERR");
+           CHECK(region_contains(r1, r2), *(expected++)));
+}
+
+static const int tests[] = {
+    REGION_TEST_LEFT_EXCLUSIVE,
+    REGION_TEST_RIGHT_EXCLUSIVE,
+    REGION_TEST_SHARED,
+    REGION_TEST_LEFT_EXCLUSIVE | REGION_TEST_RIGHT_EXCLUSIVE,
+    REGION_TEST_LEFT_EXCLUSIVE | REGION_TEST_SHARED,
+    REGION_TEST_RIGHT_EXCLUSIVE | REGION_TEST_SHARED,
+    REGION_TEST_LEFT_EXCLUSIVE | REGION_TEST_RIGHT_EXCLUSIVE | REGION_TEST_SHARED
+};
+
+#define NUM_TESTS ((int)(sizeof(tests) / sizeof(tests[0])))
+
+/* compare region_test and the predicates built on it against the
+   intersection based reference on random regions of up to max_rects1 and
+   max_rects2 rectangles */
+static void random_test(const char *name, int iterations, int max_rects1, int max_rects2)
+{
+    QRegion r1, r2;
+    int errors = 0;
+    int i, test;
+
+    region_init(&r1);
+    region_init(&r2);
+    for (i = 0; i < iterations; i++) {
+        int res1, res2;
+
+        random_region(&r1, max_rects1);
+        random_region(&r2, max_rects2);
+
+        for (test = 0; test < NUM_TESTS; test++) {
+            res1 = region_test(&r1, &r2, tests[test]);
+            res2 = slow_region_test(&r1, &r2, tests[test]);
+            if (res1 != res2) {
+                printf("Error in region_test %d, got %d, expected %d, query=%d\n",
+                       i, res1, res2, tests[test]);
+                printf("r1:\n");
+                region_dump(&r1, "");
+                printf("r2:\n");
+                region_dump(&r2, "");
+                errors++;
+            }
+        }
+
+        res2 = slow_region_test(&r1, &r2, REGION_TEST_SHARED);
+        if (region_intersects(&r1, &r2) != !!res2) {
+            printf("Error in region_intersects %d\n", i);
+            errors++;
+        }
+        res2 = slow_region_test(&r1, &r2, REGION_TEST_RIGHT_EXCLUSIVE);
+        if (region_contains(&r1, &r2) != !res2) {
+            printf("Error in region_contains %d\n", i);
+            errors++;
+        }
+    }
+    region_destroy(&r1);
+    region_destroy(&r2);
+
+    printf("random %s: %d iterations [%s]\n", name, iterations, errors ? "ERR" : "OK");
+    failures += errors;
+}
+
+#define PERF_REGIONS 256
+
+static double perf_loop(QRegion *r1, QRegion *r2, int iterations,
+                        int (*test_func)(const QRegion *, const QRegion *, int))
+{
+    clock_t start;
+    int i, j, sum = 0;
+
+    start = clock();
+    for (i = 0; i < iterations; i++) {
+        for (j = 0; j < PERF_REGIONS; j++) {
+            sum += test_func(&r1[j], &r2[j], REGION_TEST_ALL);
+        }
+    }
+    if (sum == -1) {
+        printf("\n");
+    }
+    return (double)(clock() - start) / CLOCKS_PER_SEC * 1e9 / ((double)iterations * PERF_REGIONS);
+}
+
+/* time region_test against the reference on the same region pairs */
+static void perf_test(const char *name, int iterations, int max_rects1, int max_rects2)
+{
+    QRegion r1[PERF_REGIONS], r2[PERF_REGIONS];
+    double fast, slow;
+    int i;
+
+    for (i = 0; i < PERF_REGIONS; i++) {
+        region_init(&r1[i]);
+        region_init(&r2[i]);
+        random_region(&r1[i], max_rects1);
+        random_region(&r2[i], max_rects2);
+    }
+
+    fast = perf_loop(r1, r2, iterations, region_test);
+    slow = perf_loop(r1, r2, iterations, slow_region_test);
+    printf("perf %s: region_test %.1f ns, reference %.1f ns\n", name, fast, slow);
+
+    for (i = 0; i < PERF_REGIONS; i++) {
+        region_destroy(&r1[i]);
+        region_destroy(&r2[i]);
+    }
 }
 
 enum {
@@ -625,7 +778,6 @@ int main(void)
     SpiceRect _r;
     SpiceRect *r = &_r;
     int expected[5];
-    int i, j;
 
     region_init(r1);
     region_init(r2);
@@ -851,42 +1003,21 @@ int main(void)
     test(r1, r3, expected);
     printf("\n");
 
-    j = 0;
-    for (i = 0; i < 1000000; i++) {
-        int res1, res2, test;
-        int tests[] = {
-            REGION_TEST_LEFT_EXCLUSIVE,
-            REGION_TEST_RIGHT_EXCLUSIVE,
-            REGION_TEST_SHARED,
-            REGION_TEST_LEFT_EXCLUSIVE | REGION_TEST_RIGHT_EXCLUSIVE,
-            REGION_TEST_LEFT_EXCLUSIVE | REGION_TEST_SHARED,
-            REGION_TEST_RIGHT_EXCLUSIVE | REGION_TEST_SHARED,
-            REGION_TEST_LEFT_EXCLUSIVE | REGION_TEST_RIGHT_EXCLUSIVE | REGION_TEST_SHARED
-        };
-
-        random_region(r1);
-        random_region(r2);
-
-        for (test = 0; test < 7; test++) {
-            res1 = region_test(r1, r2, tests[test]);
-            res2 = slow_region_test(r1, r2, tests[test]);
-            if (res1 != res2) {
-                printf ("Error in region_test %d, got %d, expected %d, query=%d\n",
-                        j, res1, res2, tests[test]);
-                printf ("r1:\n");
-                region_dump(r1, "");
-                printf ("r2:\n");
-                region_dump(r2, "");
-            }
-            j++;
-        }
-    }
+    random_test("complex/complex", 200000, 20, 20);
+    random_test("complex/rect", 200000, 20, 1);
+    random_test("rect/complex", 200000, 1, 20);
+    random_test("rect/rect", 200000, 1, 1);
+
+    perf_test("complex/complex", 2000, 20, 20);
+    perf_test("complex/rect", 2000, 20, 1);
+    perf_test("rect/rect", 2000, 1, 1);
 
     region_destroy(r3);
     region_destroy(r1);
     region_destroy(r2);
 
-    return 0;
+    printf("%d failures\n", failures);
+    return failures ? 1 : 0;
 }
 
 #endif
@@ -24,6 +24,9 @@
 #include "rect.h"
 #include "region.h"
 #include "pixman_utils.h"
+#ifndef _WIN32
+#include <pthread.h>
+#endif
 
 typedef struct SwCanvas SwCanvas;
 
@@ -34,6 +37,269 @@ struct SwCanvas {
     pixman_image_t *image;
 };
 
+/* Large fills and blits are split into horizontal bands that are rendered by
+   a pool of threads, the calling thread renders a band as well. Every band
+   writes a disjoint set of destination rows, so only operations that read
+   from the destination image itself stay serial. */
+
+#define SW_BAND_MIN_AREA (256 * 256)
+#define SW_BAND_MIN_HEIGHT 32
+#define SW_BAND_MAX_THREADS 16
+
+typedef struct SwBandOp SwBandOp;
+
+struct SwBandOp {
+    void (*rect)(SwBandOp *op, int x, int y, int width, int height);
+    pixman_image_t *dest;
+    pixman_image_t *src;
+    int offset_x;
+    int offset_y;
+    uint32_t color;
+    SpiceROP rop;
+};
+
+typedef struct SwBandTask SwBandTask;
+
+struct SwBandTask {
+    SwBandTask *next;
+    SwBandOp *op;
+    pixman_box32_t *rects;
+    int n_rects;
+    int y;
+    int band_height;
+    int num_bands;
+    int next_band;
+    int done_bands;
+};
+
+static void sw_band_task_run(SwBandTask *task, int band)
+{
+    SwBandOp *op = task->op;
+    int band_y1 = task->y + band * task->band_height;
+    int band_y2 = band_y1 + task->band_height;
+    int i;
+
+    for (i = 0; i < task->n_rects; i++) {
+        pixman_box32_t *r = &task->rects[i];
+        int y1 = MAX(r->y1, band_y1);
+        int y2 = MIN(r->y2, band_y2);
+
+        if (y1 < y2) {
+            op->rect(op, r->x1, y1, r->x2 - r->x1, y2 - y1);
+        }
+    }
+}
+
+#ifndef _WIN32
+
+static struct {
+    pthread_mutex_t lock;
+    pthread_cond_t work_cond;
+    pthread_cond_t done_cond;
+    SwBandTask *tasks;
+    int num_threads;
+} band_pool;
+
+/* must be called with band_pool.lock held. returns -1 if all the bands of
+   the task were already taken */
+static int sw_band_task_take(SwBandTask *task)
+{
+    SwBandTask **now;
+    int band;
+
+    if (task->next_band == task->num_bands) {
+        return -1;
+    }
+    band = task->next_band++;
+    if (task->next_band == task->num_bands) {
+        now = &band_pool.tasks;
+        while (*now != task) {
+            now = &(*now)->next;
+        }
+        *now = task->next;
+    }
+    return band;
+}
+
+static void sw_band_task_done(SwBandTask *task)
+{
+    if (++task->done_bands == task->num_bands) {
+        pthread_cond_broadcast(&band_pool.done_cond);
+    }
+}
+
+static void *sw_band_thread_main(void *data)
+{
+    pthread_mutex_lock(&band_pool.lock);
+    for (;;) {
+        SwBandTask *task;
+        int band;
+
+        while (!band_pool.tasks) {
+            pthread_cond_wait(&band_pool.work_cond, &band_pool.lock);
+        }
+        task = band_pool.tasks;
+        band = sw_band_task_take(task);
+        pthread_mutex_unlock(&band_pool.lock);
+        sw_band_task_run(task, band);
+        pthread_mutex_lock(&band_pool.lock);
+        sw_band_task_done(task);
+    }
+    return NULL;
+}
+
+static void sw_band_task_execute(SwBandTask *task)
+{
+    int band;
+
+    pthread_mutex_lock(&band_pool.lock);
+    task->next = band_pool.tasks;
+    band_pool.tasks = task;
+    pthread_cond_broadcast(&band_pool.work_cond);
+    while ((band = sw_band_task_take(task)) != -1) {
+        pthread_mutex_unlock(&band_pool.lock);
+        sw_band_task_run(task, band);
+        pthread_mutex_lock(&band_pool.lock);
+        sw_band_task_done(task);
+    }
+    while (task->done_bands != task->num_bands) {
+        pthread_cond_wait(&band_pool.done_cond, &band_pool.lock);
+    }
+    pthread_mutex_unlock(&band_pool.lock);
+}
+
+void sw_canvas_set_band_threads(int num_threads) //unsafe global function
+{
+    pthread_attr_t attr;
+    pthread_t thread;
+
+    if (band_pool.num_threads) {
+        return;
+    }
+    num_threads = MIN(num_threads, SW_BAND_MAX_THREADS);
+    if (num_threads <= 0) {
+        return;
+    }
+    pthread_mutex_init(&band_pool.lock, NULL);
+    pthread_cond_init(&band_pool.work_cond, NULL);
+    pthread_cond_init(&band_pool.done_cond, NULL);
+    band_pool.tasks = NULL;
+
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    for (; band_pool.num_threads < num_threads; band_pool.num_threads++) {
+        if (pthread_create(&thread, &attr, sw_band_thread_main, NULL)) {
+            break;
+        }
+    }
+    pthread_attr_destroy(&attr);
+}
+
+static inline int sw_band_threads(void)
+{
+    return band_pool.num_threads;
+}
+
+#else
+
+void sw_canvas_set_band_threads(int num_threads)
+{
+}
+
+static inline int sw_band_threads(void)
+{
+    return 0;
+}
+
+static void sw_band_task_execute(SwBandTask *task)
+{
+    int band;
+
+    for (band = 0; band < task->num_bands; band++) {
+        sw_band_task_run(task, band);
+    }
+}
+
+#endif
+
+static void sw_band_run(SwBandOp *op, pixman_box32_t *rects, int n_rects)
+{
+    SwBandTask task;
+    int64_t area;
+    int y1, y2, height, i;
+
+    if (!sw_band_threads() || op->src == op->dest || n_rects == 0) {
+        goto serial;
+    }
+
+    y1 = rects[0].y1;
+    y2 = rects[0].y2;
+    area = 0;
+    for (i = 0; i < n_rects; i++) {
+        y1 = MIN(y1, rects[i].y1);
+        y2 = MAX(y2, rects[i].y2);
+        area += (int64_t)(rects[i].x2 - rects[i].x1) * (rects[i].y2 - rects[i].y1);
+    }
+    height = y2 - y1;
+    if (area < SW_BAND_MIN_AREA || height < 2 * SW_BAND_MIN_HEIGHT) {
+        goto serial;
+    }
+
+    task.op = op;
+    task.rects = rects;
+    task.n_rects = n_rects;
+    task.y = y1;
+    task.num_bands = MIN(sw_band_threads() + 1, height / SW_BAND_MIN_HEIGHT);
+    task.band_height = (height + task.num_bands - 1) / task.num_bands;
+    task.next_band = 0;
+    task.done_bands = 0;
+    sw_band_task_execute(&task);
+    return;
+
+serial:
+    for (i = 0; i < n_rects; i++) {
+        op->rect(op, rects[i].x1, rects[i].y1,
+                 rects[i].x2 - rects[i].x1,
+                 rects[i].y2 - rects[i].y1);
+    }
+}
+
+static void sw_band_fill_rect(SwBandOp *op, int x, int y, int width, int height)
+{
+    spice_pixman_fill_rect(op->dest, x, y, width, height, op->color);
+}
+
+static void sw_band_fill_rect_rop(SwBandOp *op, int x, int y, int width, int height)
+{
+    spice_pixman_fill_rect_rop(op->dest, x, y, width, height, op->color, op->rop);
+}
+
+static void sw_band_tile_rect(SwBandOp *op, int x, int y, int width, int height)
+{
+    spice_pixman_tile_rect(op->dest, x, y, width, height,
+                           op->src, op->offset_x, op->offset_y);
+}
+
+static void sw_band_tile_rect_rop(SwBandOp *op, int x, int y, int width, int height)
+{
+    spice_pixman_tile_rect_rop(op->dest, x, y, width, height,
+                               op->src, op->offset_x, op->offset_y, op->rop);
+}
+
+static void sw_band_blit_rect(SwBandOp *op, int x, int y, int width, int height)
+{
+    spice_pixman_blit(op->dest, op->src,
+                      x - op->offset_x, y - op->offset_y,
+                      x, y, width, height);
+}
+
+static void sw_band_blit_rect_rop(SwBandOp *op, int x, int y, int width, int height)
+{
+    spice_pixman_blit_rop(op->dest, op->src,
+                          x - op->offset_x, y - op->offset_y,
+                          x, y, width, height, op->rop);
+}
+
 static pixman_image_t *canvas_get_pixman_brush(SwCanvas *canvas,
                                                SpiceBrush *brush)
 {
@@ -184,15 +450,13 @@ static void fill_solid_rects(SpiceCanvas *spice_canvas,
                              uint32_t color)
 {
     SwCanvas *canvas = (SwCanvas *)spice_canvas;
-    int i;
+    SwBandOp op;
 
-   for (i = 0; i < n_rects; i++) {
-        spice_pixman_fill_rect(canvas->image,
-                               rects[i].x1, rects[i].y1,
-                               rects[i].x2 - rects[i].x1,
-                               rects[i].y2 - rects[i].y1,
-                               color);
-    }
+    op.rect = sw_band_fill_rect;
+    op.dest = canvas->image;
+    op.src = NULL;
+    op.color = color;
+    sw_band_run(&op, rects, n_rects);
 }
 
 static void fill_solid_rects_rop(SpiceCanvas *spice_canvas,
@@ -202,15 +466,14 @@ static void fill_solid_rects_rop(SpiceCanvas *spice_canvas,
                                  SpiceROP rop)
 {
     SwCanvas *canvas = (SwCanvas *)spice_canvas;
-    int i;
-
-   for (i = 0; i < n_rects; i++) {
-        spice_pixman_fill_rect_rop(canvas->image,
-                                   rects[i].x1, rects[i].y1,
-                                   rects[i].x2 - rects[i].x1,
-                                   rects[i].y2 - rects[i].y1,
-                                   color, rop);
-    }
+    SwBandOp op;
+
+    op.rect = sw_band_fill_rect_rop;
+    op.dest = canvas->image;
+    op.src = NULL;
+    op.color = color;
+    op.rop = rop;
+    sw_band_run(&op, rects, n_rects);
 }
 
 static void __fill_tiled_rects(SpiceCanvas *spice_canvas,
@@ -220,15 +483,14 @@ static void __fill_tiled_rects(SpiceCanvas *spice_canvas,
                                int offset_x, int offset_y)
 {
     SwCanvas *canvas = (SwCanvas *)spice_canvas;
-    int i;
-
-    for (i = 0; i < n_rects; i++) {
-        spice_pixman_tile_rect(canvas->image,
-                               rects[i].x1, rects[i].y1,
-                               rects[i].x2 - rects[i].x1,
-                               rects[i].y2 - rects[i].y1,
-                               tile, offset_x, offset_y);
-    }
+    SwBandOp op;
+
+    op.rect = sw_band_tile_rect;
+    op.dest = canvas->image;
+    op.src = tile;
+    op.offset_x = offset_x;
+    op.offset_y = offset_y;
+    sw_band_run(&op, rects, n_rects);
 }
 
 static void fill_tiled_rects(SpiceCanvas *spice_canvas,
@@ -259,16 +521,15 @@ static void __fill_tiled_rects_rop(SpiceCanvas *spice_canvas,
                                    SpiceROP rop)
 {
     SwCanvas *canvas = (SwCanvas *)spice_canvas;
-    int i;
-
-    for (i = 0; i < n_rects; i++) {
-        spice_pixman_tile_rect_rop(canvas->image,
-                                   rects[i].x1, rects[i].y1,
-                                   rects[i].x2 - rects[i].x1,
-                                   rects[i].y2 - rects[i].y1,
-                                   tile, offset_x, offset_y,
-                                   rop);
-    }
+    SwBandOp op;
+
+    op.rect = sw_band_tile_rect_rop;
+    op.dest = canvas->image;
+    op.src = tile;
+    op.offset_x = offset_x;
+    op.offset_y = offset_y;
+    op.rop = rop;
+    sw_band_run(&op, rects, n_rects);
 }
 static void fill_tiled_rects_rop(SpiceCanvas *spice_canvas,
                                  pixman_box32_t *rects,
@@ -350,27 +611,17 @@ static void __blit_image(SpiceCanvas *spice_canvas,
 {
     SwCanvas *canvas = (SwCanvas *)spice_canvas;
     pixman_box32_t *rects;
-    int n_rects, i;
+    int n_rects;
+    SwBandOp op;
 
     rects = pixman_region32_rectangles(region, &n_rects);
 
-    for (i = 0; i < n_rects; i++) {
-        int src_x, src_y, dest_x, dest_y, width, height;
-
-        dest_x = rects[i].x1;
-        dest_y = rects[i].y1;
-        width = rects[i].x2 - rects[i].x1;
-        height = rects[i].y2 - rects[i].y1;
-
-        src_x = rects[i].x1 - offset_x;
-        src_y = rects[i].y1 - offset_y;
-
-        spice_pixman_blit(canvas->image,
-                          src_image,
-                          src_x, src_y,
-                          dest_x, dest_y,
-                          width, height);
-    }
+    op.rect = sw_band_blit_rect;
+    op.dest = canvas->image;
+    op.src = src_image;
+    op.offset_x = offset_x;
+    op.offset_y = offset_y;
+    sw_band_run(&op, rects, n_rects);
 }
 
 static void blit_image(SpiceCanvas *spice_canvas,
@@ -398,27 +649,18 @@ static void __blit_image_rop(SpiceCanvas *spice_canvas,
 {
     SwCanvas *canvas = (SwCanvas *)spice_canvas;
     pixman_box32_t *rects;
-    int n_rects, i;
+    int n_rects;
+    SwBandOp op;
 
     rects = pixman_region32_rectangles(region, &n_rects);
 
-    for (i = 0; i < n_rects; i++) {
-        int src_x, src_y, dest_x, dest_y, width, height;
-
-        dest_x = rects[i].x1;
-        dest_y = rects[i].y1;
-        width = rects[i].x2 - rects[i].x1;
-        height = rects[i].y2 - rects[i].y1;
-
-        src_x = rects[i].x1 - offset_x;
-        src_y = rects[i].y1 - offset_y;
-
-        spice_pixman_blit_rop(canvas->image,
-                              src_image,
-                              src_x, src_y,
-                              dest_x, dest_y,
-                              width, height, rop);
-    }
+    op.rect = sw_band_blit_rect_rop;
+    op.dest = canvas->image;
+    op.src = src_image;
+    op.offset_x = offset_x;
+    op.offset_y = offset_y;
+    op.rop = rop;
+    sw_band_run(&op, rects, n_rects);
 }
 
 static void blit_image_rop(SpiceCanvas *spice_canvas,
@@ -54,5 +54,6 @@ SpiceCanvas *canvas_create_for_data(int width, int height, uint32_t format, uint
 
 
 void sw_canvas_init();
+void sw_canvas_set_band_threads(int num_threads);
 
 #endif
@@ -130,6 +130,11 @@ GlzEncoderContext *glz_encoder_create(uint8_t id, GlzEncDictContext *dictionary,
         return NULL;
     }
 
+    // the id indexes the dictionary's per encoder window heads
+    if (id >= ((SharedDictionary *)dictionary)->max_encdoers) {
+        return NULL;
+    }
+
     if (!(encoder = (Encoder *)usr->malloc(usr, sizeof(Encoder)))) {
         return NULL;
     }
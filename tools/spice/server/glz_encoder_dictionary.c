@@ -39,6 +39,7 @@ static INLINE void __glz_dictionary_window_reset_images(SharedDictionary *dict)
         dict->window.free_images = tmp;
     }
     dict->window.used_images_tail = NULL;
+    dict->window.new_head = NULL;
 }
 
 /* allocate window fields (no reset)*/
@@ -69,6 +70,7 @@ static int glz_dictionary_window_create(SharedDictionary *dict, uint32_t size)
     dict->window.used_images_head = NULL;
     dict->window.used_images_tail = NULL;
     dict->window.free_images = NULL;
+    dict->window.new_head = NULL;
     dict->window.pixels_so_far = 0;
 
     return TRUE;
@@ -235,6 +237,24 @@ uint32_t glz_enc_dictionary_get_size(GlzEncDictContext *opaque_dict)
     return dict->window.size_limit;
 }
 
+int glz_enc_dictionary_grow(GlzEncDictContext *opaque_dict, uint32_t size,
+                            GlzEncoderUsrContext *usr)
+{
+    SharedDictionary *dict = (SharedDictionary *)opaque_dict;
+
+    if (size > LZ_MAX_WINDOW_SIZE) {
+        return FALSE;
+    }
+
+    pthread_mutex_lock(&dict->lock);
+    dict->cur_usr = usr;
+    if (size > dict->window.size_limit) {
+        dict->window.size_limit = size;
+    }
+    pthread_mutex_unlock(&dict->lock);
+    return TRUE;
+}
+
 /* doesn't call the remove image callback */
 void glz_enc_dictionary_remove_image(GlzEncDictContext *opaque_dict,
                                      GlzEncDictImageContext *opaque_image,
@@ -385,7 +405,10 @@ static INLINE void __glz_dictionary_window_free_image_segs(SharedDictionary *dic
 
 /* Returns the logical head of the window after we add an image with the give size to its tail.
    Returns NULL when the window is empty, of when we have to empty the window in order
-   to insert the new image. */
+   to insert the new image.
+   The walk starts from the head returned by the previous call: images before it are never
+   needed again, but while other encoders are encoding they are not removed, and walking
+   over them on each call made the cost of pre encode grow with the number of encoders. */
 static WindowImage *glz_dictionary_window_get_new_head(SharedDictionary *dict, int new_image_size)
 {
     uint32_t cur_win_size;
@@ -405,11 +428,12 @@ static WindowImage *glz_dictionary_window_get_new_head(SharedDictionary *dict, i
     GLZ_ASSERT(dict->cur_usr, dict->window.used_segs_head != NULL_IMAGE_SEG_ID);
     GLZ_ASSERT(dict->cur_usr, dict->window.used_segs_tail != NULL_IMAGE_SEG_ID);
 
-    // used_segs_head is the latest logical head (the physical head may preceed it)
-    cur_head = dict->window.segs[dict->window.used_segs_head].image;
+    // used_segs_head is the latest removed logical head (the physical head may preceed it)
+    cur_head = dict->window.new_head ? dict->window.new_head :
+                                       dict->window.segs[dict->window.used_segs_head].image;
     cur_win_size = dict->window.segs[dict->window.used_segs_tail].pixels_num +
         dict->window.segs[dict->window.used_segs_tail].pixels_so_far -
-        dict->window.segs[dict->window.used_segs_head].pixels_so_far;
+        dict->window.segs[cur_head->first_seg].pixels_so_far;
 
     while ((cur_win_size + new_image_size) > dict->window.size_limit) {
         GLZ_ASSERT(dict->cur_usr, cur_head);
@@ -417,6 +441,7 @@ static WindowImage *glz_dictionary_window_get_new_head(SharedDictionary *dict, i
         cur_head = cur_head->next;
     }
 
+    dict->window.new_head = cur_head;
     return cur_head;
 }
 
@@ -450,6 +475,7 @@ static void glz_dictionary_window_remove_head(SharedDictionary *dict, uint32_t e
         dict->window.used_segs_head = NULL_IMAGE_SEG_ID;
         dict->window.used_segs_tail = NULL_IMAGE_SEG_ID;
         dict->window.used_images_tail = NULL;
+        dict->window.new_head = NULL;
     } else {
         dict->window.used_segs_head = end_image->first_seg;
     }
@@ -48,6 +48,12 @@ void glz_enc_dictionary_destroy(GlzEncDictContext *opaque_dict, GlzEncoderUsrCon
 /* returns the window capacity in pixels */
 uint32_t glz_enc_dictionary_get_size(GlzEncDictContext *);
 
+/* grows the window capacity to size pixels. The window is never shrunk, since an encoder
+   may have already checked that its image fits the current size.
+   Can be called while encoders use the dictionary. Returns FALSE if size is too big. */
+int glz_enc_dictionary_grow(GlzEncDictContext *opaque_dict, uint32_t size,
+                            GlzEncoderUsrContext *usr);
+
 /* returns the current state of the dictionary.
    NOTE - you should use it only when no encoder uses the dictionary. */
 void glz_enc_dictionary_get_restore_data(GlzEncDictContext *opaque_dict,
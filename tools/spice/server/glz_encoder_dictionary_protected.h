@@ -103,6 +103,8 @@ struct SharedDictionary {
         WindowImage*        used_images_tail;
         WindowImage*        used_images_head;
         WindowImage*        free_images;
+        WindowImage*        new_head;        // the head computed by the last pre encode. The next
+                                             // one can only be later, so it is searched from here.
 
         uint64_t pixels_so_far;
         uint32_t size_limit;                 // max number of pixels in a window (per encoder)
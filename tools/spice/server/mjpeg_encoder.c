@@ -71,6 +71,12 @@ size_t mjpeg_encoder_get_frame_stride(MJpegEncoder *encoder)
     return encoder->stride;
 }
 
+/* takes effect from the next encoded frame */
+void mjpeg_encoder_set_quality(MJpegEncoder *encoder, int quality)
+{
+    encoder->quality = MIN(MAX(quality, 1), 100);
+}
+
 void init_destination(j_compress_ptr cinfo)
 {
 }
@@ -28,6 +28,7 @@ void mjpeg_encoder_destroy(MJpegEncoder *encoder);
 
 uint8_t *mjpeg_encoder_get_frame(MJpegEncoder *encoder);
 size_t mjpeg_encoder_get_frame_stride(MJpegEncoder *encoder);
+void mjpeg_encoder_set_quality(MJpegEncoder *encoder, int quality);
 int mjpeg_encoder_encode_frame(MJpegEncoder *encoder,
                                uint8_t *buffer, size_t buffer_len);
 
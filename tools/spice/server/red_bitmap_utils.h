@@ -51,7 +51,6 @@
 #endif
 
 
-#define SAMPLE_JUMP 15
 #define SAME_PIXEL(p1, p2) (GET_r(p1) == GET_r(p2) && GET_g(p1) == GET_g(p2) && \
                             GET_b(p1) == GET_b(p2))
 
@@ -93,57 +92,37 @@ static inline int FNAME(pixelcmp)(PIXEL p1, PIXEL p2)
     }
 }
 
-static inline double FNAME(pixels_square_score)(PIXEL *line1, PIXEL *line2)
+/* Samples squares of pixels (a pixel, its right and its bottom neighbours) of the
+   lines [0, num_lines - 1) into the tile columns they fall in. Every
+   TILE_SAMPLE_ROWS line and every TILE_SAMPLE_COLS pixel of a line is sampled,
+   staggered between lines. line_index is the index of the first line in the
+   bitmap. Squares of identical pixels only count as flat area. */
+static void FNAME(compute_lines_tiles_score)(uint8_t *lines, int stride, int width,
+                                             int num_lines, int line_index, int tile_width,
+                                             GradualTile *tiles)
 {
-    double ret = 0.0;
-    int all_ident = TRUE;
-    int cmp_res;
-    cmp_res = FNAME(pixelcmp)(*line1, line1[1]);
-    all_ident = all_ident && (!cmp_res);
-    ret += FNAME(PIX_PAIR_SCORE)[cmp_res];
-    cmp_res = FNAME(pixelcmp)(*line1, *line2);
-    all_ident = all_ident && (!cmp_res);
-    ret += FNAME(PIX_PAIR_SCORE)[cmp_res];
-    cmp_res = FNAME(pixelcmp)(*line1, line2[1]);
-    all_ident = all_ident && (!cmp_res);
-    ret += FNAME(PIX_PAIR_SCORE)[cmp_res];
-
-    // ignore squares where all pixels are identical
-    if (all_ident) {
-        ret -= (FNAME(PIX_PAIR_SCORE)[0]) * 3;
-    }
-
-    return ret;
-}
-
-static void FNAME(compute_lines_gradual_score)(PIXEL *lines, int width, int num_lines,
-                                               double *o_samples_sum_score, int *o_num_samples)
-{
-    int jump = (SAMPLE_JUMP % width) ? SAMPLE_JUMP : SAMPLE_JUMP - 1;
-    PIXEL *cur_pix = lines + width / 2;
-    PIXEL *bottom_pix;
-    PIXEL *last_line = lines + (num_lines - 1) * width;
-
-    if ((width <= 1) || (num_lines <= 1)) {
-        *o_num_samples = 1;
-        *o_samples_sum_score = 1.0;
-        return;
-    }
-
-    *o_samples_sum_score = 0;
-    *o_num_samples = 0;
-
-    while (cur_pix < last_line) {
-        if ((cur_pix + 1 - lines) % width == 0) { // last pixel in the row
-            cur_pix--; // jump is bigger than 1 so we will not enter endless loop
+    int y = (TILE_SAMPLE_ROWS - line_index % TILE_SAMPLE_ROWS) % TILE_SAMPLE_ROWS;
+
+    for (; y < num_lines - 1; y += TILE_SAMPLE_ROWS) {
+        PIXEL *line = (PIXEL *)(lines + y * stride);
+        PIXEL *bottom = (PIXEL *)(lines + (y + 1) * stride);
+        int x = ((line_index + y) / TILE_SAMPLE_ROWS) % TILE_SAMPLE_COLS;
+
+        for (; x < width - 1; x += TILE_SAMPLE_COLS) {
+            GradualTile *tile = &tiles[x / tile_width];
+            int right_cmp = FNAME(pixelcmp)(line[x], line[x + 1]);
+            int bottom_cmp = FNAME(pixelcmp)(line[x], bottom[x]);
+            int diag_cmp = FNAME(pixelcmp)(line[x], bottom[x + 1]);
+
+            if (!(right_cmp | bottom_cmp | diag_cmp)) {
+                tile->num_flat++;
+                continue;
+            }
+            tile->score += FNAME(PIX_PAIR_SCORE)[right_cmp] + FNAME(PIX_PAIR_SCORE)[bottom_cmp] +
+                           FNAME(PIX_PAIR_SCORE)[diag_cmp];
+            tile->num_samples++;
         }
-        bottom_pix = cur_pix + width;
-        (*o_samples_sum_score) += FNAME(pixels_square_score)(cur_pix, bottom_pix);
-        (*o_num_samples)++;
-        cur_pix += jump;
     }
-
-    (*o_num_samples) *= 3;
 }
 
 #undef PIXEL
@@ -155,7 +134,6 @@ static void FNAME(compute_lines_gradual_score)(PIXEL *lines, int width, int num_
 #undef RED_BITMAP_UTILS_RGB16
 #undef RED_BITMAP_UTILS_RGB24
 #undef RED_BITMAP_UTILS_RGB32
-#undef SAMPLE_JUMP
 #undef CONTRAST_TH
 #undef SAME_PIXEL_WEIGHT
 #undef NOT_CONTRAST_PIXELS_WEIGHT
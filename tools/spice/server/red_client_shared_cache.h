@@ -61,6 +61,21 @@ static int FUNC_NAME(hit)(CACHE *cache, uint64_t id, int *lossy, CHANNEL *channe
     return !!item;
 }
 
+/* unlike hit, doesn't update the lru and the sync of the channel */
+static int FUNC_NAME(contains)(CACHE *cache, uint64_t id)
+{
+    NewCacheItem *item;
+
+    pthread_mutex_lock(&cache->lock);
+    item = cache->hash_table[CACHE_HASH_KEY(id)];
+    while (item && item->id != id) {
+        item = item->next;
+    }
+    pthread_mutex_unlock(&cache->lock);
+
+    return !!item;
+}
+
 static int FUNC_NAME(set_lossy)(CACHE *cache, uint64_t id, int lossy)
 {
     NewCacheItem *item;
@@ -71,6 +71,8 @@ enum {
     STREAM_VIDEO_FILTER
 };
 
+#define RED_MAX_COMPRESS_THREADS 16
+
 static inline uint64_t get_time_stamp()
 {
     struct timespec time_space;
@@ -68,6 +68,8 @@ extern uint32_t streaming_video;
 extern spice_image_compression_t image_compression;
 extern spice_wan_compression_t jpeg_state;
 extern spice_wan_compression_t zlib_glz_state;
+extern uint32_t compression_threads;
+extern char *display_record_path;
 
 static RedDispatcher *dispatchers = NULL;
 
@@ -514,6 +516,8 @@ RedDispatcher *red_dispatcher_init(QXLInstance *qxl)
     init_data.jpeg_state = jpeg_state;
     init_data.zlib_glz_state = zlib_glz_state;
     init_data.streaming_video = streaming_video;
+    init_data.compression_threads = compression_threads;
+    init_data.record_path = display_record_path;
 
     dispatcher->base.major_version = SPICE_INTERFACE_QXL_MAJOR;
     dispatcher->base.minor_version = SPICE_INTERFACE_QXL_MINOR;
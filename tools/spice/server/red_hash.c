@@ -0,0 +1,154 @@
+/* -*- Mode: C; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+   Copyright (C) 2009,2010 Red Hat, Inc.
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2.1 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <string.h>
+#include "red_hash.h"
+
+#define PRIME64_1 0x9E3779B185EBCA87ULL
+#define PRIME64_2 0xC2B2AE3D27D4EB4FULL
+#define PRIME64_3 0x165667B19E3779F9ULL
+#define PRIME64_4 0x85EBCA77C2B2AE63ULL
+#define PRIME64_5 0x27D4EB2F165667C5ULL
+
+#define ROTL64(x, r) (((x) << (r)) | ((x) >> (64 - (r))))
+
+static inline uint64_t read64(const uint8_t *p)
+{
+    uint64_t v;
+
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static inline uint32_t read32(const uint8_t *p)
+{
+    uint32_t v;
+
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static inline uint64_t round64(uint64_t acc, uint64_t input)
+{
+    acc += input * PRIME64_2;
+    acc = ROTL64(acc, 31);
+    return acc * PRIME64_1;
+}
+
+static inline uint64_t merge64(uint64_t acc, uint64_t lane)
+{
+    acc ^= round64(0, lane);
+    return acc * PRIME64_1 + PRIME64_4;
+}
+
+// consumes whole stripes, returns the number of bytes consumed
+static size_t hash_stripes(uint64_t *lanes, const uint8_t *p, size_t len)
+{
+    uint64_t v0 = lanes[0], v1 = lanes[1], v2 = lanes[2], v3 = lanes[3];
+    const uint8_t *start = p;
+    const uint8_t *end = p + (len & ~(size_t)31);
+
+    for (; p < end; p += 32) {
+        v0 = round64(v0, read64(p));
+        v1 = round64(v1, read64(p + 8));
+        v2 = round64(v2, read64(p + 16));
+        v3 = round64(v3, read64(p + 24));
+    }
+    lanes[0] = v0;
+    lanes[1] = v1;
+    lanes[2] = v2;
+    lanes[3] = v3;
+    return p - start;
+}
+
+void red_hash64_init(RedHash64 *hash, uint64_t seed)
+{
+    hash->lanes[0] = seed + PRIME64_1 + PRIME64_2;
+    hash->lanes[1] = seed + PRIME64_2;
+    hash->lanes[2] = seed;
+    hash->lanes[3] = seed - PRIME64_1;
+    hash->total_len = 0;
+    hash->seed = seed;
+    hash->buf_len = 0;
+}
+
+void red_hash64_update(RedHash64 *hash, const void *data, size_t len)
+{
+    const uint8_t *p = data;
+    size_t consumed;
+
+    hash->total_len += len;
+    if (hash->buf_len) {
+        size_t n = MIN(len, sizeof(hash->buf) - hash->buf_len);
+
+        memcpy(hash->buf + hash->buf_len, p, n);
+        hash->buf_len += n;
+        p += n;
+        len -= n;
+        if (hash->buf_len < sizeof(hash->buf)) {
+            return;
+        }
+        hash_stripes(hash->lanes, hash->buf, sizeof(hash->buf));
+        hash->buf_len = 0;
+    }
+    consumed = hash_stripes(hash->lanes, p, len);
+    p += consumed;
+    len -= consumed;
+    memcpy(hash->buf, p, len);
+    hash->buf_len = len;
+}
+
+uint64_t red_hash64_final(RedHash64 *hash)
+{
+    const uint8_t *p = hash->buf;
+    const uint8_t *end = p + hash->buf_len;
+    uint64_t h;
+
+    if (hash->total_len >= 32) {
+        h = ROTL64(hash->lanes[0], 1) + ROTL64(hash->lanes[1], 7) +
+            ROTL64(hash->lanes[2], 12) + ROTL64(hash->lanes[3], 18);
+        h = merge64(h, hash->lanes[0]);
+        h = merge64(h, hash->lanes[1]);
+        h = merge64(h, hash->lanes[2]);
+        h = merge64(h, hash->lanes[3]);
+    } else {
+        h = hash->seed + PRIME64_5;
+    }
+    h += hash->total_len;
+
+    for (; p + 8 <= end; p += 8) {
+        h ^= round64(0, read64(p));
+        h = ROTL64(h, 27) * PRIME64_1 + PRIME64_4;
+    }
+    if (p + 4 <= end) {
+        h ^= (uint64_t)read32(p) * PRIME64_1;
+        h = ROTL64(h, 23) * PRIME64_2 + PRIME64_3;
+        p += 4;
+    }
+    for (; p < end; p++) {
+        h ^= *p * PRIME64_5;
+        h = ROTL64(h, 11) * PRIME64_1;
+    }
+
+    h ^= h >> 33;
+    h *= PRIME64_2;
+    h ^= h >> 29;
+    h *= PRIME64_3;
+    h ^= h >> 32;
+    return h;
+}
@@ -0,0 +1,40 @@
+/* -*- Mode: C; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+   Copyright (C) 2009,2010 Red Hat, Inc.
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2.1 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef _H_RED_HASH
+#define _H_RED_HASH
+
+#include "red_common.h"
+
+/* Incremental 64 bit content hash (the xxHash64 construction). The input is
+   consumed in 32 byte stripes by four independent lanes, which keeps several
+   multiplies in flight. Not cryptographic, used for identifying images. */
+
+typedef struct RedHash64 {
+    uint64_t lanes[4];
+    uint64_t total_len;
+    uint64_t seed;
+    uint8_t buf[32];
+    uint32_t buf_len;
+} RedHash64;
+
+void red_hash64_init(RedHash64 *hash, uint64_t seed);
+void red_hash64_update(RedHash64 *hash, const void *data, size_t len);
+uint64_t red_hash64_final(RedHash64 *hash);
+
+#endif
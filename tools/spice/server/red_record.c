@@ -0,0 +1,665 @@
+/* -*- Mode: C; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+   Copyright (C) 2009,2010 Red Hat, Inc.
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2.1 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdio.h>
+#include <stddef.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include "red_common.h"
+#include "red_record.h"
+
+struct RedRecord {
+    pthread_mutex_t lock;
+    FILE *file; // NULL once closed
+    RedRecord *next;
+};
+
+static pthread_mutex_t records_lock = PTHREAD_MUTEX_INITIALIZER;
+static RedRecord *records = NULL;
+
+static void red_record_close_all(void)
+{
+    RedRecord *record;
+
+    pthread_mutex_lock(&records_lock);
+    for (record = records; record; record = record->next) {
+        red_record_close(record);
+    }
+    pthread_mutex_unlock(&records_lock);
+}
+
+uint64_t red_record_now(void)
+{
+    struct timespec time;
+
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return (uint64_t)time.tv_sec * 1000 * 1000 * 1000 + time.tv_nsec;
+}
+
+RedRecord *red_record_open(const char *path)
+{
+    RedRecordFileHeader header;
+    RedRecord *record;
+    FILE *file;
+
+    if (!(file = fopen(path, "wb"))) {
+        red_printf("open %s failed, %s", path, strerror(errno));
+        return NULL;
+    }
+    header.magic = RED_RECORD_MAGIC;
+    header.version = RED_RECORD_VERSION;
+    if (fwrite(&header, sizeof(header), 1, file) != 1) {
+        red_printf("write %s failed", path);
+        fclose(file);
+        return NULL;
+    }
+    record = spice_new(RedRecord, 1);
+    pthread_mutex_init(&record->lock, NULL);
+    record->file = file;
+
+    pthread_mutex_lock(&records_lock);
+    if (!records) {
+        atexit(red_record_close_all);
+    }
+    record->next = records;
+    records = record;
+    pthread_mutex_unlock(&records_lock);
+    return record;
+}
+
+/* The record itself stays allocated since the worker that writes to it may
+   still be running, later writes are dropped. */
+void red_record_close(RedRecord *record)
+{
+    pthread_mutex_lock(&record->lock);
+    if (record->file) {
+        fclose(record->file);
+        record->file = NULL;
+    }
+    pthread_mutex_unlock(&record->lock);
+}
+
+void red_record_flush(RedRecord *record)
+{
+    pthread_mutex_lock(&record->lock);
+    if (record->file) {
+        fflush(record->file);
+    }
+    pthread_mutex_unlock(&record->lock);
+}
+
+static void red_record_write_header(RedRecord *record, uint32_t type, uint32_t size)
+{
+    RedRecordHeader header;
+
+    header.type = type;
+    header.size = size;
+    header.time = red_record_now();
+    fwrite(&header, sizeof(header), 1, record->file);
+}
+
+#define RECORD_VEC_SIZE 32
+
+void red_record_message(RedRecord *record, uint32_t channel_type, uint32_t channel_id,
+                        SpiceMarshaller *m)
+{
+    RedRecordMessage message;
+    struct iovec vec[RECORD_VEC_SIZE];
+    size_t size, written;
+    int vec_size, i;
+
+    pthread_mutex_lock(&record->lock);
+    if (!record->file) {
+        pthread_mutex_unlock(&record->lock);
+        return;
+    }
+    size = spice_marshaller_get_total_size(m);
+    red_record_write_header(record, RED_RECORD_MESSAGE, sizeof(message) + size);
+    message.channel_type = channel_type;
+    message.channel_id = channel_id;
+    fwrite(&message, sizeof(message), 1, record->file);
+    for (written = 0; written < size;) {
+        vec_size = spice_marshaller_fill_iovec(m, vec, RECORD_VEC_SIZE, written);
+        if (!vec_size) {
+            break;
+        }
+        for (i = 0; i < vec_size; i++) {
+            fwrite(vec[i].iov_base, 1, vec[i].iov_len, record->file);
+            written += vec[i].iov_len;
+        }
+    }
+    pthread_mutex_unlock(&record->lock);
+}
+
+void red_record_image(RedRecord *record, const RedRecordImage *image)
+{
+    pthread_mutex_lock(&record->lock);
+    if (record->file) {
+        red_record_write_header(record, RED_RECORD_IMAGE, sizeof(*image));
+        fwrite(image, sizeof(*image), 1, record->file);
+    }
+    pthread_mutex_unlock(&record->lock);
+}
+
+/* A QXL command rebuilt from its parsed form, see RED_RECORD_QXL_COMMAND.
+   Everything is addressed by offset since data moves as it grows. */
+typedef struct RecordQXL {
+    uint8_t *data;
+    size_t size;
+    size_t alloc;
+    uint32_t *relocs;
+    uint32_t num_relocs;
+    uint32_t relocs_alloc;
+} RecordQXL;
+
+#define RECORD_QXL_AT(qxl, type, offset) ((type *)((qxl)->data + (offset)))
+
+static size_t record_qxl_alloc(RecordQXL *qxl, size_t size)
+{
+    size_t offset = SPICE_ALIGN(qxl->size, 8);
+
+    if (offset + size > qxl->alloc) {
+        qxl->alloc = MAX(qxl->alloc * 2, offset + size);
+        qxl->data = spice_realloc(qxl->data, qxl->alloc);
+    }
+    memset(qxl->data + qxl->size, 0, offset + size - qxl->size);
+    qxl->size = offset + size;
+    return offset;
+}
+
+/* point the QXLPHYSICAL at field to target, both offsets into qxl */
+static void record_qxl_link(RecordQXL *qxl, size_t field, size_t target)
+{
+    QXLPHYSICAL addr = target;
+
+    memcpy(qxl->data + field, &addr, sizeof(addr));
+    if (qxl->num_relocs == qxl->relocs_alloc) {
+        qxl->relocs_alloc = qxl->relocs_alloc ? qxl->relocs_alloc * 2 : 16;
+        qxl->relocs = spice_realloc_n(qxl->relocs, qxl->relocs_alloc, sizeof(uint32_t));
+    }
+    qxl->relocs[qxl->num_relocs++] = field;
+}
+
+static void record_qxl_rect(QXLRect *qxl, SpiceRect *red)
+{
+    qxl->top    = red->top;
+    qxl->left   = red->left;
+    qxl->bottom = red->bottom;
+    qxl->right  = red->right;
+}
+
+static void record_qxl_point(QXLPoint *qxl, SpicePoint *red)
+{
+    qxl->x = red->x;
+    qxl->y = red->y;
+}
+
+static void record_qxl_image(RecordQXL *qxl, size_t field, SpiceImage *red)
+{
+    QXLImage *image;
+    QXLDataChunk *chunk;
+    QXLPalette *palette;
+    SpiceChunks *chunks;
+    size_t offset, palette_offset, data_offset;
+    uint32_t i;
+
+    if (!red) {
+        return;
+    }
+    if (red->descriptor.type == SPICE_IMAGE_TYPE_QUIC) {
+        offset = record_qxl_alloc(qxl, offsetof(QXLImage, quic.data) + sizeof(QXLDataChunk) +
+                                       red->u.quic.data_size);
+    } else {
+        offset = record_qxl_alloc(qxl, sizeof(QXLImage));
+    }
+    image = RECORD_QXL_AT(qxl, QXLImage, offset);
+    image->descriptor.id     = red->descriptor.id;
+    image->descriptor.type   = red->descriptor.type;
+    image->descriptor.width  = red->descriptor.width;
+    image->descriptor.height = red->descriptor.height;
+    if (red->descriptor.flags & SPICE_IMAGE_FLAGS_CACHE_ME) {
+        image->descriptor.flags |= QXL_IMAGE_CACHE;
+    }
+    if (red->descriptor.flags & SPICE_IMAGE_FLAGS_HIGH_BITS_SET) {
+        image->descriptor.flags |= QXL_IMAGE_HIGH_BITS_SET;
+    }
+
+    switch (red->descriptor.type) {
+    case SPICE_IMAGE_TYPE_BITMAP:
+        chunks = red->u.bitmap.data;
+        image->bitmap.format = red->u.bitmap.format;
+        image->bitmap.flags  = QXL_BITMAP_DIRECT;
+        if (red->u.bitmap.flags & SPICE_BITMAP_FLAGS_TOP_DOWN) {
+            image->bitmap.flags |= QXL_BITMAP_TOP_DOWN;
+        }
+        if (chunks->flags & SPICE_CHUNKS_FLAGS_UNSTABLE) {
+            image->bitmap.flags |= QXL_BITMAP_UNSTABLE;
+        }
+        image->bitmap.x      = red->u.bitmap.x;
+        image->bitmap.y      = red->u.bitmap.y;
+        image->bitmap.stride = red->u.bitmap.stride;
+        if (red->u.bitmap.palette) {
+            SpicePalette *red_palette = red->u.bitmap.palette;
+
+            palette_offset = record_qxl_alloc(qxl, sizeof(QXLPalette) +
+                                                   red_palette->num_ents * sizeof(uint32_t));
+            palette = RECORD_QXL_AT(qxl, QXLPalette, palette_offset);
+            palette->unique   = red_palette->unique;
+            palette->num_ents = red_palette->num_ents;
+            memcpy(palette->ents, red_palette->ents, red_palette->num_ents * sizeof(uint32_t));
+            record_qxl_link(qxl, offset + offsetof(QXLImage, bitmap.palette), palette_offset);
+        }
+        data_offset = record_qxl_alloc(qxl, chunks->data_size);
+        for (i = 0; i < chunks->num_chunks; i++) {
+            memcpy(qxl->data + data_offset, chunks->chunk[i].data, chunks->chunk[i].len);
+            data_offset += chunks->chunk[i].len;
+        }
+        record_qxl_link(qxl, offset + offsetof(QXLImage, bitmap.data),
+                        data_offset - chunks->data_size);
+        break;
+    case SPICE_IMAGE_TYPE_SURFACE:
+        image->surface_image.surface_id = red->u.surface.surface_id;
+        break;
+    case SPICE_IMAGE_TYPE_QUIC:
+        chunks = red->u.quic.data;
+        image->quic.data_size = red->u.quic.data_size;
+        chunk = (QXLDataChunk *)image->quic.data;
+        chunk->data_size = red->u.quic.data_size;
+        data_offset = 0;
+        for (i = 0; i < chunks->num_chunks; i++) {
+            memcpy(chunk->data + data_offset, chunks->chunk[i].data, chunks->chunk[i].len);
+            data_offset += chunks->chunk[i].len;
+        }
+        break;
+    }
+    record_qxl_link(qxl, field, offset);
+}
+
+static void record_qxl_brush(RecordQXL *qxl, size_t offset, SpiceBrush *red)
+{
+    QXLBrush *brush = RECORD_QXL_AT(qxl, QXLBrush, offset);
+
+    brush->type = red->type;
+    switch (red->type) {
+    case SPICE_BRUSH_TYPE_SOLID:
+        brush->u.color = red->u.color;
+        break;
+    case SPICE_BRUSH_TYPE_PATTERN:
+        record_qxl_point(&brush->u.pattern.pos, &red->u.pattern.pos);
+        record_qxl_image(qxl, offset + offsetof(QXLBrush, u.pattern.pat), red->u.pattern.pat);
+        break;
+    }
+}
+
+static void record_qxl_qmask(RecordQXL *qxl, size_t offset, SpiceQMask *red)
+{
+    QXLQMask *mask = RECORD_QXL_AT(qxl, QXLQMask, offset);
+
+    mask->flags = red->flags;
+    record_qxl_point(&mask->pos, &red->pos);
+    record_qxl_image(qxl, offset + offsetof(QXLQMask, bitmap), red->bitmap);
+}
+
+static void record_qxl_clip_rects(RecordQXL *qxl, size_t field, SpiceClipRects *red)
+{
+    QXLClipRects *rects;
+    QXLRect *rect;
+    size_t offset, size;
+    uint32_t i;
+
+    size = red->num_rects * sizeof(QXLRect);
+    offset = record_qxl_alloc(qxl, sizeof(QXLClipRects) + size);
+    rects = RECORD_QXL_AT(qxl, QXLClipRects, offset);
+    rects->num_rects = red->num_rects;
+    rects->chunk.data_size = size;
+    rect = (QXLRect *)rects->chunk.data;
+    for (i = 0; i < red->num_rects; i++) {
+        record_qxl_rect(rect++, &red->rects[i]);
+    }
+    record_qxl_link(qxl, field, offset);
+}
+
+static void record_qxl_path(RecordQXL *qxl, size_t field, SpicePath *red)
+{
+    QXLPath *path;
+    QXLPathSeg *seg;
+    size_t offset, size;
+    uint32_t i, j;
+
+    size = 0;
+    for (i = 0; i < red->num_segments; i++) {
+        size += sizeof(QXLPathSeg) + red->segments[i]->count * sizeof(QXLPointFix);
+    }
+    offset = record_qxl_alloc(qxl, sizeof(QXLPath) + size);
+    path = RECORD_QXL_AT(qxl, QXLPath, offset);
+    path->data_size = size;
+    path->chunk.data_size = size;
+    seg = (QXLPathSeg *)path->chunk.data;
+    for (i = 0; i < red->num_segments; i++) {
+        seg->flags = red->segments[i]->flags;
+        seg->count = red->segments[i]->count;
+        for (j = 0; j < seg->count; j++) {
+            seg->points[j].x = red->segments[i]->points[j].x;
+            seg->points[j].y = red->segments[i]->points[j].y;
+        }
+        seg = (QXLPathSeg *)&seg->points[j];
+    }
+    record_qxl_link(qxl, field, offset);
+}
+
+static void record_qxl_string(RecordQXL *qxl, size_t field, SpiceString *red)
+{
+    QXLString *str;
+    QXLRasterGlyph *glyph;
+    size_t offset, size, glyph_size;
+    int bpp = 0, i;
+
+    if (red->flags & SPICE_STRING_FLAGS_RASTER_A1) {
+        bpp = 1;
+    } else if (red->flags & SPICE_STRING_FLAGS_RASTER_A4) {
+        bpp = 4;
+    } else if (red->flags & SPICE_STRING_FLAGS_RASTER_A8) {
+        bpp = 8;
+    }
+
+    size = 0;
+    for (i = 0; i < red->length; i++) {
+        size += sizeof(QXLRasterGlyph) +
+                red->glyphs[i]->height * ((red->glyphs[i]->width * bpp + 7) / 8);
+    }
+    offset = record_qxl_alloc(qxl, sizeof(QXLString) + size);
+    str = RECORD_QXL_AT(qxl, QXLString, offset);
+    str->data_size = size;
+    str->length = red->length;
+    str->flags = red->flags;
+    str->chunk.data_size = size;
+    glyph = (QXLRasterGlyph *)str->chunk.data;
+    for (i = 0; i < red->length; i++) {
+        record_qxl_point(&glyph->render_pos, &red->glyphs[i]->render_pos);
+        record_qxl_point(&glyph->glyph_origin, &red->glyphs[i]->glyph_origin);
+        glyph->width = red->glyphs[i]->width;
+        glyph->height = red->glyphs[i]->height;
+        glyph_size = glyph->height * ((glyph->width * bpp + 7) / 8);
+        memcpy(glyph->data, red->glyphs[i]->data, glyph_size);
+        glyph = (QXLRasterGlyph *)&glyph->data[glyph_size];
+    }
+    record_qxl_link(qxl, field, offset);
+}
+
+static void red_record_qxl(RedRecord *record, uint32_t type, RecordQXL *qxl)
+{
+    RedRecordQXLCommand command;
+
+    pthread_mutex_lock(&record->lock);
+    if (record->file) {
+        command.type = type;
+        command.num_relocs = qxl->num_relocs;
+        command.data_size = qxl->size;
+        command.pad = 0;
+        red_record_write_header(record, RED_RECORD_QXL_COMMAND,
+                                sizeof(command) + qxl->num_relocs * sizeof(uint32_t) + qxl->size);
+        fwrite(&command, sizeof(command), 1, record->file);
+        if (qxl->num_relocs) {
+            fwrite(qxl->relocs, sizeof(uint32_t), qxl->num_relocs, record->file);
+        }
+        fwrite(qxl->data, 1, qxl->size, record->file);
+    }
+    pthread_mutex_unlock(&record->lock);
+    free(qxl->relocs);
+    free(qxl->data);
+}
+
+#define DRAWABLE_FIELD(field) offsetof(QXLDrawable, field)
+
+void red_record_drawable(RedRecord *record, RedDrawable *red)
+{
+    RecordQXL qxl;
+    QXLDrawable *drawable;
+    int i;
+
+    memset(&qxl, 0, sizeof(qxl));
+    record_qxl_alloc(&qxl, sizeof(QXLDrawable));
+    drawable = RECORD_QXL_AT(&qxl, QXLDrawable, 0);
+    drawable->surface_id  = red->surface_id;
+    drawable->effect      = red->effect;
+    drawable->type        = red->type;
+    drawable->self_bitmap = red->self_bitmap;
+    record_qxl_rect(&drawable->self_bitmap_area, &red->self_bitmap_area);
+    record_qxl_rect(&drawable->bbox, &red->bbox);
+    drawable->clip.type   = red->clip.type;
+    drawable->mm_time     = red->mm_time;
+    for (i = 0; i < 3; i++) {
+        drawable->surfaces_dest[i] = red->surfaces_dest[i];
+        record_qxl_rect(&drawable->surfaces_rects[i], &red->surfaces_rects[i]);
+    }
+    if (red->clip.type == SPICE_CLIP_TYPE_RECTS) {
+        /* drawable is stale from here on, every allocation may move the data */
+        record_qxl_clip_rects(&qxl, DRAWABLE_FIELD(clip.data), red->clip.rects);
+    }
+
+    switch (red->type) {
+    case QXL_DRAW_ALPHA_BLEND: {
+        QXLAlphaBlend *alpha_blend = RECORD_QXL_AT(&qxl, QXLAlphaBlend,
+                                                   DRAWABLE_FIELD(u.alpha_blend));
+
+        alpha_blend->alpha_flags = red->u.alpha_blend.alpha_flags;
+        alpha_blend->alpha       = red->u.alpha_blend.alpha;
+        record_qxl_rect(&alpha_blend->src_area, &red->u.alpha_blend.src_area);
+        record_qxl_image(&qxl, DRAWABLE_FIELD(u.alpha_blend.src_bitmap),
+                         red->u.alpha_blend.src_bitmap);
+        break;
+    }
+    case QXL_DRAW_BLACKNESS:
+        record_qxl_qmask(&qxl, DRAWABLE_FIELD(u.blackness.mask), &red->u.blackness.mask);
+        break;
+    case QXL_DRAW_WHITENESS:
+        record_qxl_qmask(&qxl, DRAWABLE_FIELD(u.whiteness.mask), &red->u.whiteness.mask);
+        break;
+    case QXL_DRAW_INVERS:
+        record_qxl_qmask(&qxl, DRAWABLE_FIELD(u.invers.mask), &red->u.invers.mask);
+        break;
+    case QXL_DRAW_BLEND:
+    case QXL_DRAW_COPY: {
+        /* QXLBlend and SpiceBlend are the copy structs */
+        QXLCopy *copy = RECORD_QXL_AT(&qxl, QXLCopy, DRAWABLE_FIELD(u.copy));
+
+        record_qxl_rect(&copy->src_area, &red->u.copy.src_area);
+        copy->rop_descriptor = red->u.copy.rop_descriptor;
+        copy->scale_mode     = red->u.copy.scale_mode;
+        record_qxl_image(&qxl, DRAWABLE_FIELD(u.copy.src_bitmap), red->u.copy.src_bitmap);
+        record_qxl_qmask(&qxl, DRAWABLE_FIELD(u.copy.mask), &red->u.copy.mask);
+        break;
+    }
+    case QXL_COPY_BITS:
+        record_qxl_point(RECORD_QXL_AT(&qxl, QXLPoint, DRAWABLE_FIELD(u.copy_bits.src_pos)),
+                         &red->u.copy_bits.src_pos);
+        break;
+    case QXL_DRAW_FILL:
+        RECORD_QXL_AT(&qxl, QXLFill, DRAWABLE_FIELD(u.fill))->rop_descriptor =
+            red->u.fill.rop_descriptor;
+        record_qxl_brush(&qxl, DRAWABLE_FIELD(u.fill.brush), &red->u.fill.brush);
+        record_qxl_qmask(&qxl, DRAWABLE_FIELD(u.fill.mask), &red->u.fill.mask);
+        break;
+    case QXL_DRAW_OPAQUE: {
+        QXLOpaque *opaque = RECORD_QXL_AT(&qxl, QXLOpaque, DRAWABLE_FIELD(u.opaque));
+
+        record_qxl_rect(&opaque->src_area, &red->u.opaque.src_area);
+        opaque->rop_descriptor = red->u.opaque.rop_descriptor;
+        opaque->scale_mode     = red->u.opaque.scale_mode;
+        record_qxl_image(&qxl, DRAWABLE_FIELD(u.opaque.src_bitmap), red->u.opaque.src_bitmap);
+        record_qxl_brush(&qxl, DRAWABLE_FIELD(u.opaque.brush), &red->u.opaque.brush);
+        record_qxl_qmask(&qxl, DRAWABLE_FIELD(u.opaque.mask), &red->u.opaque.mask);
+        break;
+    }
+    case QXL_DRAW_NOP:
+        break;
+    case QXL_DRAW_ROP3: {
+        QXLRop3 *rop3 = RECORD_QXL_AT(&qxl, QXLRop3, DRAWABLE_FIELD(u.rop3));
+
+        record_qxl_rect(&rop3->src_area, &red->u.rop3.src_area);
+        rop3->rop3       = red->u.rop3.rop3;
+        rop3->scale_mode = red->u.rop3.scale_mode;
+        record_qxl_image(&qxl, DRAWABLE_FIELD(u.rop3.src_bitmap), red->u.rop3.src_bitmap);
+        record_qxl_brush(&qxl, DRAWABLE_FIELD(u.rop3.brush), &red->u.rop3.brush);
+        record_qxl_qmask(&qxl, DRAWABLE_FIELD(u.rop3.mask), &red->u.rop3.mask);
+        break;
+    }
+    case QXL_DRAW_STROKE: {
+        QXLStroke *stroke = RECORD_QXL_AT(&qxl, QXLStroke, DRAWABLE_FIELD(u.stroke));
+        size_t style;
+
+        stroke->attr.flags      = red->u.stroke.attr.flags;
+        stroke->attr.style_nseg = red->u.stroke.attr.style_nseg;
+        stroke->fore_mode       = red->u.stroke.fore_mode;
+        stroke->back_mode       = red->u.stroke.back_mode;
+        record_qxl_path(&qxl, DRAWABLE_FIELD(u.stroke.path), red->u.stroke.path);
+        if (red->u.stroke.attr.flags & SPICE_LINE_FLAGS_STYLED) {
+            style = record_qxl_alloc(&qxl, red->u.stroke.attr.style_nseg * sizeof(QXLFIXED));
+            memcpy(qxl.data + style, red->u.stroke.attr.style,
+                   red->u.stroke.attr.style_nseg * sizeof(QXLFIXED));
+            record_qxl_link(&qxl, DRAWABLE_FIELD(u.stroke.attr.style), style);
+        }
+        record_qxl_brush(&qxl, DRAWABLE_FIELD(u.stroke.brush), &red->u.stroke.brush);
+        break;
+    }
+    case QXL_DRAW_TEXT: {
+        QXLText *text = RECORD_QXL_AT(&qxl, QXLText, DRAWABLE_FIELD(u.text));
+
+        record_qxl_rect(&text->back_area, &red->u.text.back_area);
+        text->fore_mode = red->u.text.fore_mode;
+        text->back_mode = red->u.text.back_mode;
+        record_qxl_string(&qxl, DRAWABLE_FIELD(u.text.str), red->u.text.str);
+        record_qxl_brush(&qxl, DRAWABLE_FIELD(u.text.fore_brush), &red->u.text.fore_brush);
+        record_qxl_brush(&qxl, DRAWABLE_FIELD(u.text.back_brush), &red->u.text.back_brush);
+        break;
+    }
+    case QXL_DRAW_TRANSPARENT: {
+        QXLTransparent *transparent = RECORD_QXL_AT(&qxl, QXLTransparent,
+                                                    DRAWABLE_FIELD(u.transparent));
+
+        record_qxl_rect(&transparent->src_area, &red->u.transparent.src_area);
+        transparent->src_color  = red->u.transparent.src_color;
+        transparent->true_color = red->u.transparent.true_color;
+        record_qxl_image(&qxl, DRAWABLE_FIELD(u.transparent.src_bitmap),
+                         red->u.transparent.src_bitmap);
+        break;
+    }
+    }
+    red_record_qxl(record, QXL_CMD_DRAW, &qxl);
+}
+
+void red_record_update_cmd(RedRecord *record, RedUpdateCmd *red)
+{
+    RecordQXL qxl;
+    QXLUpdateCmd *update;
+
+    memset(&qxl, 0, sizeof(qxl));
+    record_qxl_alloc(&qxl, sizeof(QXLUpdateCmd));
+    update = RECORD_QXL_AT(&qxl, QXLUpdateCmd, 0);
+    record_qxl_rect(&update->area, &red->area);
+    update->update_id  = red->update_id;
+    update->surface_id = red->surface_id;
+    red_record_qxl(record, QXL_CMD_UPDATE, &qxl);
+}
+
+void red_record_surface_cmd(RedRecord *record, RedSurfaceCmd *red)
+{
+    RecordQXL qxl;
+    QXLSurfaceCmd *surface;
+
+    memset(&qxl, 0, sizeof(qxl));
+    record_qxl_alloc(&qxl, sizeof(QXLSurfaceCmd));
+    surface = RECORD_QXL_AT(&qxl, QXLSurfaceCmd, 0);
+    surface->surface_id = red->surface_id;
+    surface->type       = red->type;
+    surface->flags      = red->flags;
+    if (red->type == QXL_SURFACE_CMD_CREATE) {
+        surface->u.surface_create.format = red->u.surface_create.format;
+        surface->u.surface_create.width  = red->u.surface_create.width;
+        surface->u.surface_create.height = red->u.surface_create.height;
+        surface->u.surface_create.stride = red->u.surface_create.stride;
+    }
+    red_record_qxl(record, QXL_CMD_SURFACE, &qxl);
+}
+
+void red_record_cursor_cmd(RedRecord *record, RedCursorCmd *red)
+{
+    RecordQXL qxl;
+    QXLCursorCmd *cursor_cmd;
+    QXLCursor *cursor;
+    size_t offset;
+
+    memset(&qxl, 0, sizeof(qxl));
+    record_qxl_alloc(&qxl, sizeof(QXLCursorCmd));
+    cursor_cmd = RECORD_QXL_AT(&qxl, QXLCursorCmd, 0);
+    cursor_cmd->type = red->type;
+    switch (red->type) {
+    case QXL_CURSOR_SET:
+        cursor_cmd->u.set.position.x = red->u.set.position.x;
+        cursor_cmd->u.set.position.y = red->u.set.position.y;
+        cursor_cmd->u.set.visible    = red->u.set.visible;
+        offset = record_qxl_alloc(&qxl, sizeof(QXLCursor) + red->u.set.shape.data_size);
+        cursor = RECORD_QXL_AT(&qxl, QXLCursor, offset);
+        cursor->header.unique     = red->u.set.shape.header.unique;
+        cursor->header.type       = red->u.set.shape.header.type;
+        cursor->header.width      = red->u.set.shape.header.width;
+        cursor->header.height     = red->u.set.shape.header.height;
+        cursor->header.hot_spot_x = red->u.set.shape.header.hot_spot_x;
+        cursor->header.hot_spot_y = red->u.set.shape.header.hot_spot_y;
+        cursor->data_size         = red->u.set.shape.data_size;
+        cursor->chunk.data_size   = red->u.set.shape.data_size;
+        memcpy(cursor->chunk.data, red->u.set.shape.data, red->u.set.shape.data_size);
+        record_qxl_link(&qxl, offsetof(QXLCursorCmd, u.set.shape), offset);
+        break;
+    case QXL_CURSOR_MOVE:
+        cursor_cmd->u.position.x = red->u.position.x;
+        cursor_cmd->u.position.y = red->u.position.y;
+        break;
+    case QXL_CURSOR_TRAIL:
+        cursor_cmd->u.trail.length    = red->u.trail.length;
+        cursor_cmd->u.trail.frequency = red->u.trail.frequency;
+        break;
+    }
+    red_record_qxl(record, QXL_CMD_CURSOR, &qxl);
+}
+
+void red_record_device(RedRecord *record, uint32_t op, QXLDevSurfaceCreate *surface)
+{
+    RedRecordQXLDevice device;
+
+    memset(&device, 0, sizeof(device));
+    device.op = op;
+    if (op == RED_RECORD_DEVICE_CREATE_PRIMARY) {
+        device.width      = surface->width;
+        device.height     = surface->height;
+        device.stride     = surface->stride;
+        device.format     = surface->format;
+        device.position   = surface->position;
+        device.mouse_mode = surface->mouse_mode;
+        device.flags      = surface->flags;
+        device.type       = surface->type;
+    }
+    pthread_mutex_lock(&record->lock);
+    if (record->file) {
+        red_record_write_header(record, RED_RECORD_QXL_DEVICE, sizeof(device));
+        fwrite(&device, sizeof(device), 1, record->file);
+    }
+    pthread_mutex_unlock(&record->lock);
+}
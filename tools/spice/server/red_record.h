@@ -0,0 +1,132 @@
+/* -*- Mode: C; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+   Copyright (C) 2009,2010 Red Hat, Inc.
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2.1 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef _H_RED_RECORD
+#define _H_RED_RECORD
+
+#include <stdint.h>
+
+/* Capture of the display traffic of a worker, for offline measurement (see
+   tests/display_record_stats.c) and replay (see tests/display_replay.c).
+   The file starts with a RedRecordFileHeader, followed by records, each a
+   RedRecordHeader and size bytes of payload:
+
+   RED_RECORD_MESSAGE     - a RedRecordMessage followed by the complete
+                            message as sent on the wire, SpiceDataHeader
+                            included.
+   RED_RECORD_IMAGE       - a RedRecordImage, one for every bitmap the worker
+                            encoded for sending.
+   RED_RECORD_QXL_COMMAND - a RedRecordQXLCommand, num_relocs uint32_t offsets
+                            and data_size bytes holding the command as the
+                            guest would have written it: the QXL command
+                            struct at offset 0 followed by everything it
+                            points to, with each chunk list linearized to a
+                            single chunk and bitmaps stored as
+                            QXL_BITMAP_DIRECT. Every non-NULL QXLPHYSICAL in
+                            the data holds the offset of its target and is
+                            listed in the relocs. The data of a created
+                            surface is not kept, its QXLPHYSICAL is 0.
+   RED_RECORD_QXL_DEVICE  - a RedRecordQXLDevice, for the device calls that
+                            change the surfaces outside the command ring.
+
+   All fields are in host byte order. The file is flushed when the worker
+   stops or the display client disconnects, and closed at exit. */
+
+#define RED_RECORD_MAGIC ('S' | ('P' << 8) | ('C' << 16) | ('R' << 24))
+#define RED_RECORD_VERSION 2
+
+enum {
+    RED_RECORD_MESSAGE = 1,
+    RED_RECORD_IMAGE,
+    RED_RECORD_QXL_COMMAND,
+    RED_RECORD_QXL_DEVICE,
+};
+
+typedef struct RedRecordFileHeader {
+    uint32_t magic;
+    uint32_t version;
+} RedRecordFileHeader;
+
+typedef struct RedRecordHeader {
+    uint32_t type;
+    uint32_t size;
+    uint64_t time; // ns, monotonic
+} RedRecordHeader;
+
+typedef struct RedRecordMessage {
+    uint32_t channel_type;
+    uint32_t channel_id;
+} RedRecordMessage;
+
+typedef struct RedRecordImage {
+    uint32_t image_type; // SPICE_IMAGE_TYPE_*, BITMAP if sent uncompressed
+    uint32_t lossy;
+    uint64_t raw_size;
+    uint64_t comp_size;
+    uint64_t encode_time; // ns spent by the worker, including waiting for the pool
+} RedRecordImage;
+
+typedef struct RedRecordQXLCommand {
+    uint32_t type; // QXL_CMD_*
+    uint32_t num_relocs;
+    uint32_t data_size;
+    uint32_t pad;
+} RedRecordQXLCommand;
+
+enum {
+    RED_RECORD_DEVICE_CREATE_PRIMARY = 1,
+    RED_RECORD_DEVICE_DESTROY_PRIMARY,
+    RED_RECORD_DEVICE_DESTROY_SURFACES,
+};
+
+typedef struct RedRecordQXLDevice {
+    uint32_t op; // RED_RECORD_DEVICE_*, the rest is only set for CREATE_PRIMARY
+    uint32_t width;
+    uint32_t height;
+    int32_t stride;
+    uint32_t format;
+    uint32_t position;
+    uint32_t mouse_mode;
+    uint32_t flags;
+    uint32_t type;
+} RedRecordQXLDevice;
+
+#ifndef RED_RECORD_FORMAT_ONLY
+
+#include "marshaller.h"
+#include "red_parse_qxl.h"
+
+typedef struct RedRecord RedRecord;
+
+RedRecord *red_record_open(const char *path);
+void red_record_close(RedRecord *record);
+void red_record_flush(RedRecord *record);
+uint64_t red_record_now(void);
+void red_record_message(RedRecord *record, uint32_t channel_type, uint32_t channel_id,
+                        SpiceMarshaller *m);
+void red_record_image(RedRecord *record, const RedRecordImage *image);
+void red_record_drawable(RedRecord *record, RedDrawable *drawable);
+void red_record_update_cmd(RedRecord *record, RedUpdateCmd *update);
+void red_record_surface_cmd(RedRecord *record, RedSurfaceCmd *surface);
+void red_record_cursor_cmd(RedRecord *record, RedCursorCmd *cursor);
+/* surface is only used by RED_RECORD_DEVICE_CREATE_PRIMARY */
+void red_record_device(RedRecord *record, uint32_t op, QXLDevSurfaceCreate *surface);
+
+#endif
+
+#endif
@@ -0,0 +1,92 @@
+/* -*- Mode: C; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+   Copyright (C) 2009,2010 Red Hat, Inc.
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2.1 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "red_slab.h"
+
+#define SLAB_ALIGN 16
+
+struct RedSlabChunk {
+    RedSlabChunk *next;
+    uint8_t pad[SLAB_ALIGN - sizeof(RedSlabChunk *)];
+    uint8_t data[0];
+};
+
+void red_slab_init(RedSlab *slab, size_t obj_size, uint32_t chunk_objs)
+{
+    ASSERT(chunk_objs);
+    slab->obj_size = (MAX(obj_size, sizeof(void *)) + SLAB_ALIGN - 1) & ~(SLAB_ALIGN - 1);
+    slab->chunk_objs = chunk_objs;
+    slab->free_list = NULL;
+    slab->chunks = NULL;
+    slab->num_chunks = 0;
+    slab->in_use = 0;
+}
+
+void red_slab_destroy(RedSlab *slab)
+{
+    RedSlabChunk *chunk;
+
+    while ((chunk = slab->chunks)) {
+        slab->chunks = chunk->next;
+        free(chunk);
+    }
+    slab->free_list = NULL;
+    slab->num_chunks = 0;
+    slab->in_use = 0;
+}
+
+static void red_slab_grow(RedSlab *slab)
+{
+    RedSlabChunk *chunk;
+    uint8_t *obj;
+    uint32_t i;
+
+    chunk = spice_malloc(sizeof(RedSlabChunk) + slab->obj_size * slab->chunk_objs);
+    chunk->next = slab->chunks;
+    slab->chunks = chunk;
+    slab->num_chunks++;
+
+    // push in reverse so objects are handed out in address order
+    obj = chunk->data + slab->obj_size * slab->chunk_objs;
+    for (i = 0; i < slab->chunk_objs; i++) {
+        obj -= slab->obj_size;
+        *(void **)obj = slab->free_list;
+        slab->free_list = obj;
+    }
+}
+
+void *red_slab_alloc(RedSlab *slab)
+{
+    void *obj;
+
+    if (!slab->free_list) {
+        red_slab_grow(slab);
+    }
+    obj = slab->free_list;
+    slab->free_list = *(void **)obj;
+    slab->in_use++;
+    return obj;
+}
+
+void red_slab_free(RedSlab *slab, void *obj)
+{
+    ASSERT(slab->in_use);
+    *(void **)obj = slab->free_list;
+    slab->free_list = obj;
+    slab->in_use--;
+}
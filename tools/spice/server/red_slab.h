@@ -0,0 +1,45 @@
+/* -*- Mode: C; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+   Copyright (C) 2009,2010 Red Hat, Inc.
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2.1 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef _H_RED_SLAB
+#define _H_RED_SLAB
+
+#include "red_common.h"
+
+/* Fixed size object cache. Objects are carved out of chunks of chunk_objs
+   entries and recycled through a free list, so the per command allocations
+   of the worker don't go through malloc. Chunks are only returned to the
+   system when the slab is destroyed. Not thread safe. */
+
+typedef struct RedSlabChunk RedSlabChunk;
+
+typedef struct RedSlab {
+    size_t obj_size;
+    uint32_t chunk_objs;
+    void *free_list;
+    RedSlabChunk *chunks;
+    uint32_t num_chunks;
+    uint32_t in_use;
+} RedSlab;
+
+void red_slab_init(RedSlab *slab, size_t obj_size, uint32_t chunk_objs);
+void red_slab_destroy(RedSlab *slab);
+void *red_slab_alloc(RedSlab *slab);
+void red_slab_free(RedSlab *slab, void *obj);
+
+#endif
@@ -57,6 +57,9 @@
 #include "demarshallers.h"
 #include "generated_marshallers.h"
 #include "zlib_encoder.h"
+#include "red_hash.h"
+#include "red_slab.h"
+#include "red_record.h"
 
 //#define COMPRESS_STAT
 //#define DUMP_BITMAP
@@ -93,12 +96,29 @@
 #define FPS_TEST_INTERVAL 1
 #define MAX_FPS 30
 
+// stream quality control, see stream_agent_update_rate
+#define STREAM_MAX_QUALITY 70
+#define STREAM_MIN_QUALITY 20
+#define STREAM_QUALITY_STEP 5
+#define STREAM_MIN_FPS 1
+// ack latency above STREAM_LATENCY_FACTOR * lowest latency seen plus
+// STREAM_LATENCY_SLACK (nano) means data is queuing up in the network
+#define STREAM_LATENCY_FACTOR 2
+#define STREAM_LATENCY_SLACK (50 * 1000 * 1000)
+
 //best bit rate per pixel base on 13000000 bps for frame size 720x576 pixels and 25 fps
 #define BEST_BIT_RATE_PER_PIXEL 38
 #define WARST_BIT_RATE_PER_PIXEL 4
 
 #define RED_COMPRESS_BUF_SIZE (1024 * 64)
 
+// smaller bitmaps aren't worth hashing
+#define IMAGE_DEDUP_MIN_PIXELS (32 * 32)
+#define IMAGE_DEDUP_SEEN_SIZE 4096
+// content ids are tagged in the top byte, which qxl image ids don't use
+#define IMAGE_CONTENT_ID_TAG_MASK (0xffULL << 56)
+#define IMAGE_CONTENT_ID_TAG (0xfeULL << 56)
+
 #define ZLIB_DEFAULT_COMPRESSION_LEVEL 3
 #define MIN_GLZ_SIZE_FOR_ZLIB 100
 
@@ -321,9 +341,22 @@ typedef struct LocalCursor {
 } LocalCursor;
 
 #define MAX_PIPE_SIZE 50
+
+/* Messages up to SEND_BATCH_MAX_MESSAGE bytes are copied to the channel's batch buffer
+   during a push and written together with the next message, so that a burst of small
+   draw messages costs one writev instead of one per message. */
+#define SEND_BATCH_SIZE (1024 * 16)
+#define SEND_BATCH_MAX_MESSAGE 2048
+
+/* Bytes a channel may queue before red_push moves to the next channel, so a big display
+   update doesn't delay the cursor. */
+#define CURSOR_PUSH_BUDGET (1024 * 16)
+#define DISPLAY_PUSH_BUDGET (1024 * 64)
+
 #define RECIVE_BUF_SIZE 1024
 
 #define WIDE_CLIENT_ACK_WINDOW 40
+#define ACK_TIMES_SIZE 4
 #define NARROW_CLIENT_ACK_WINDOW 20
 
 #define BITS_CACHE_HASH_SHIFT 10
@@ -367,14 +400,28 @@ struct RedChannel {
     uint32_t client_ack_generation;
     uint32_t messages_window;
 
+    struct {
+        uint64_t window_time[ACK_TIMES_SIZE];    // send time of unacked full windows
+        uint32_t head;
+        uint32_t count;
+        uint64_t latency;                        // smoothed, nano
+        uint64_t min_latency;
+    } ack_data;
+
     struct {
         int blocked;
+        uint32_t blocked_count;
         uint64_t serial;
         SpiceDataHeader *header;
         SpiceMarshaller *marshaller;
         uint32_t size;
         uint32_t pos;
         void *item;
+        int batching;        // inside a push, small messages go to batch
+        uint8_t *batch;
+        uint32_t batch_size;
+        uint32_t batch_pos;
+        uint64_t queued_bytes;
     } send_data;
 
     struct {
@@ -390,6 +437,13 @@ struct RedChannel {
     handle_message_proc handle_message;
 #ifdef RED_STATISTICS
     uint64_t *out_bytes_counter;
+    uint64_t *out_messages_counter;
+    uint64_t *out_writes_counter;
+    uint64_t *pipe_depth_counter;   // pipe size summed over pushes, divide by push_counter
+    uint64_t *push_counter;
+    uint64_t *pipe_size_counter;    // pipe size at the last push
+    uint64_t *ack_latency_counter;  // smoothed ack latency, nano
+    StatHistogram ack_latency_hist;
 #endif
 };
 
@@ -410,6 +464,9 @@ typedef struct ImageItem {
 
 typedef struct Drawable Drawable;
 
+typedef struct CompressJob CompressJob;
+typedef struct CompressPool CompressPool;
+
 typedef struct Stream Stream;
 struct Stream {
     uint8_t refs;
@@ -435,6 +492,10 @@ typedef struct StreamAgent {
     int frames;
     int drops;
     int fps;
+    int quality;
+    uint64_t interval_start;
+    uint64_t interval_bytes;        // stream data sent since interval_start
+    uint32_t interval_blocked;      // channel blocked_count at interval_start
 } StreamAgent;
 
 typedef struct StreamClipItem {
@@ -518,7 +579,7 @@ typedef struct FreeList {
 typedef struct DisplayChannel DisplayChannel;
 
 typedef struct  {
-    DisplayChannel *display_channel;
+    DisplayChannel *display_channel; // NULL when the buffers are private (see ImageEncoders)
     RedCompressBuf *bufs_head;
     RedCompressBuf *bufs_tail;
     jmp_buf jmp_env;
@@ -562,6 +623,22 @@ typedef struct {
     EncoderData data;
 } ZlibData;
 
+/* The worker owns one set of the non global encoders, and each compression thread owns
+   another one. The compression threads can't use the compress bufs free list of the display
+   channel (it is accessed only by the worker), so their encoders allocate private bufs. */
+typedef struct ImageEncoders {
+    int private_bufs;
+
+    QuicData quic_data;
+    QuicContext *quic;
+
+    LzData lz_data;
+    LzContext  *lz;
+
+    JpegData jpeg_data;
+    JpegEncoderContext *jpeg;
+} ImageEncoders;
+
 /**********************************/
 /* LZ dictionary related entities */
 /**********************************/
@@ -603,6 +680,40 @@ typedef struct GlzSharedDictionary {
 
 #define NUM_SURFACES 10000
 
+#ifdef RED_STATISTICS
+typedef enum {
+    CODEC_STAT_BITMAP,  // sent uncompressed
+    CODEC_STAT_QUIC,
+    CODEC_STAT_LZ,
+    CODEC_STAT_GLZ,
+    CODEC_STAT_ZLIB_GLZ,
+    CODEC_STAT_JPEG,
+    CODEC_STAT_JPEG_ALPHA,
+    CODEC_STAT_MJPEG,   // stream frames
+
+    CODEC_STAT_COUNT,
+} CodecStatType;
+
+static const char *codec_stat_names[CODEC_STAT_COUNT] = {
+    "bitmap",
+    "quic",
+    "lz",
+    "glz",
+    "zlib_glz",
+    "jpeg",
+    "jpeg_alpha",
+    "mjpeg",
+};
+
+typedef struct CodecStat {
+    uint64_t *images_counter;
+    uint64_t *raw_bytes_counter;
+    uint64_t *comp_bytes_counter;
+    uint64_t *time_counter;         // nano
+    StatHistogram time_hist;
+} CodecStat;
+#endif
+
 struct DisplayChannel {
     RedChannel base;
 
@@ -639,6 +750,7 @@ struct DisplayChannel {
 
         RedCompressBuf *free_compress_bufs;
         RedCompressBuf *used_compress_bufs;
+        RedCompressBuf *pool_compress_bufs; // allocated by the compress pool, freed after send
 
         FreeList free_list;
     } send_data;
@@ -652,6 +764,9 @@ struct DisplayChannel {
     uint64_t *cache_hits_counter;
     uint64_t *add_to_cache_counter;
     uint64_t *non_cache_counter;
+    uint64_t *stream_skips_counter;    // frames not sent to keep the stream fps
+    uint64_t *stream_drops_counter;    // frames replaced before they were sent
+    CodecStat codec_stat[CODEC_STAT_COUNT];
 #endif
 #ifdef COMPRESS_STAT
     stat_info_t lz_stat;
@@ -705,11 +820,26 @@ enum {
     TREE_ITEM_TYPE_SHADOW,
 };
 
+/* every surface keeps a coarse TREE_GRID_SIZE x TREE_GRID_SIZE grid counting the tree
+   items (drawables, containers and shadows) whose region touched each cell when they were
+   inserted. tree regions only shrink after insertion, so an area whose cells are all zero
+   cannot intersect any item in the tree and the linear ring walks can be skipped. */
+#define TREE_GRID_SIZE 16
+
+typedef struct TreeGridSpan {
+    uint32_t surface_id;
+    uint8_t left;
+    uint8_t top;
+    uint8_t right;
+    uint8_t bottom;
+} TreeGridSpan;
+
 typedef struct TreeItem {
     RingItem siblings_link;
     uint32_t type;
     struct Container *container;
     QRegion rgn;
+    TreeGridSpan grid_span;
 #ifdef PIPE_DEBUG
     uint32_t id;
 #endif
@@ -772,6 +902,9 @@ struct Drawable {
     SpiceImage *self_bitmap;
     DependItem depend_items[3];
 
+    int compress_prefetched;
+    CompressJob *compress_job;
+
     uint8_t *backed_surface_data;
     DependItem pipe_depend_items[3];
 
@@ -825,6 +958,10 @@ typedef struct RedSurface {
     Ring depend_on_me;
     QRegion draw_dirty_region;
 
+    uint16_t *tree_grid;
+    uint32_t tree_grid_cell_width;
+    uint32_t tree_grid_cell_height;
+
     //fix me - better handling here
     QXLReleaseInfoExt create, destroy;
 } RedSurface;
@@ -844,6 +981,7 @@ typedef struct ItemTrace {
 #define ITEMS_TRACE_MASK (NUM_TRACE_ITEMS - 1)
 
 #define NUM_DRAWABLES 1000
+#define WORKER_SLAB_CHUNK_OBJS 64
 #define NUM_CURSORS 100
 
 typedef struct RedWorker {
@@ -852,6 +990,7 @@ typedef struct RedWorker {
     CursorChannel *cursor_channel;
     QXLInstance *qxl;
     int id;
+    RedRecord *record;
     int channel;
     int running;
     uint32_t *pending;
@@ -886,6 +1025,11 @@ typedef struct RedWorker {
     _Drawable drawables[NUM_DRAWABLES];
     _Drawable *free_drawables;
 
+    RedSlab red_drawable_slab;
+    RedSlab container_slab;
+    RedSlab shadow_slab;
+    RedSlab stream_clip_slab;
+
     _CursorItem cursor_items[NUM_CURSORS];
     _CursorItem *free_cursor_items;
 
@@ -908,14 +1052,8 @@ typedef struct RedWorker {
     ItemTrace items_trace[NUM_TRACE_ITEMS];
     uint32_t next_item_trace;
 
-    QuicData quic_data;
-    QuicContext *quic;
-
-    LzData lz_data;
-    LzContext  *lz;
-
-    JpegData jpeg_data;
-    JpegEncoderContext *jpeg;
+    ImageEncoders encoders;
+    CompressPool *compress_pool;
 
     ZlibData zlib_data;
     ZlibEncoder *zlib;
@@ -930,10 +1068,13 @@ typedef struct RedWorker {
     uint32_t add_count;
     uint32_t add_with_shadow_count;
 #endif
+    uint64_t image_dedup_seen[IMAGE_DEDUP_SEEN_SIZE];   // recently seen content ids
 #ifdef RED_STATISTICS
     StatNodeRef stat;
     uint64_t *wakeup_counter;
     uint64_t *command_counter;
+    uint64_t *image_hash_counter;
+    uint64_t *image_dup_counter;
 #endif
 } RedWorker;
 
@@ -978,11 +1119,12 @@ static void display_channel_push_release(DisplayChannel *channel, uint8_t type,
 static void red_display_release_stream_clip(DisplayChannel* channel, StreamClipItem *item);
 static int red_display_free_some_independent_glz_drawables(DisplayChannel *channel);
 static void red_display_free_glz_drawable(DisplayChannel *channel, RedGlzDrawable *drawable);
-static void reset_rate(StreamAgent *stream_agent);
+static void reset_rate(DisplayChannel *display, StreamAgent *stream_agent);
 static BitmapGradualType _get_bitmap_graduality_level(RedWorker *worker, SpiceBitmap *bitmap, uint32_t group_id);
 static inline int _stride_is_extra(SpiceBitmap *bitmap);
 static void red_disconnect_cursor(RedChannel *channel);
 static void red_wait_pipe_item_sent(RedChannel *channel, PipeItem *item);
+static void red_drawable_drop_compress_job(RedWorker *worker, Drawable *drawable);
 
 #ifdef DUMP_BITMAP
 static void dump_bitmap(RedWorker *worker, SpiceBitmap *bitmap, uint32_t group_id);
@@ -1066,6 +1208,15 @@ static void print_compress_stats(DisplayChannel *display_channel)
 
 #endif
 
+static inline uint64_t red_now()
+{
+    struct timespec time;
+
+    clock_gettime(CLOCK_MONOTONIC, &time);
+
+    return time.tv_sec * 1000000000 + time.tv_nsec;
+}
+
 static inline int is_primary_surface(RedWorker *worker, uint32_t surface_id)
 {
     if (surface_id == 0) {
@@ -1301,6 +1452,7 @@ static inline void red_pipe_remove_drawable(RedWorker *worker, Drawable *drawabl
     if (ring_item_is_linked(&drawable->pipe_item.link)) {
         worker->display_channel->base.pipe_size--;
         ring_remove(&drawable->pipe_item.link);
+        red_drawable_drop_compress_job(worker, drawable);
         release_drawable(worker, drawable);
     }
 }
@@ -1353,9 +1505,12 @@ static void red_pipe_clear(RedChannel *channel)
     while ((item = (PipeItem *)ring_get_head(&channel->pipe))) {
         ring_remove(&item->link);
         switch (item->type) {
-        case PIPE_ITEM_TYPE_DRAW:
-            release_drawable(channel->worker, SPICE_CONTAINEROF(item, Drawable, pipe_item));
+        case PIPE_ITEM_TYPE_DRAW: {
+            Drawable *drawable = SPICE_CONTAINEROF(item, Drawable, pipe_item);
+            red_drawable_drop_compress_job(channel->worker, drawable);
+            release_drawable(channel->worker, drawable);
             break;
+        }
         case PIPE_ITEM_TYPE_CURSOR:
             red_release_cursor(channel->worker, (CursorItem *)item);
             break;
@@ -1452,6 +1607,11 @@ static void drawables_init(RedWorker *worker)
     for (i = 0; i < NUM_DRAWABLES; i++) {
         free_drawable(worker, &worker->drawables[i].u.drawable);
     }
+
+    red_slab_init(&worker->red_drawable_slab, sizeof(RedDrawable), WORKER_SLAB_CHUNK_OBJS);
+    red_slab_init(&worker->container_slab, sizeof(Container), WORKER_SLAB_CHUNK_OBJS);
+    red_slab_init(&worker->shadow_slab, sizeof(Shadow), WORKER_SLAB_CHUNK_OBJS);
+    red_slab_init(&worker->stream_clip_slab, sizeof(StreamClipItem), WORKER_SLAB_CHUNK_OBJS);
 }
 
 
@@ -1506,6 +1666,8 @@ static inline void red_destroy_surface(RedWorker *worker, uint32_t surface_id)
         }
 
         region_destroy(&surface->draw_dirty_region);
+        free(surface->tree_grid);
+        surface->tree_grid = NULL;
         surface->context.canvas = NULL;
         red_destroy_surface_item(worker, surface_id);
 
@@ -1541,7 +1703,7 @@ static inline void free_red_drawable(RedWorker *worker, RedDrawable *drawable, u
     release_info_ext.info = drawable->release_info;
     worker->qxl->st->qif->release_resource(worker->qxl, release_info_ext);
     red_put_drawable(drawable);
-    free(drawable);
+    red_slab_free(&worker->red_drawable_slab, drawable);
 }
 
 static void remove_depended_item(DependItem *item)
@@ -1584,6 +1746,7 @@ static inline void release_drawable(RedWorker *worker, Drawable *item)
     if (!--item->refs) {
         ASSERT(!item->stream);
         ASSERT(!item->tree_item.shadow);
+        ASSERT(!item->compress_job);
         region_destroy(&item->tree_item.base.rgn);
 
         remove_drawable_dependencies(worker, item);
@@ -1599,6 +1762,77 @@ static inline void release_drawable(RedWorker *worker, Drawable *item)
     }
 }
 
+static inline int tree_grid_cell(int32_t pos, uint32_t cell_size)
+{
+    if (pos <= 0) {
+        return 0;
+    }
+    pos /= cell_size;
+    return MIN(pos, TREE_GRID_SIZE - 1);
+}
+
+static inline void tree_grid_get_span(RedSurface *surface, int32_t left, int32_t top,
+                                      int32_t right, int32_t bottom, TreeGridSpan *span)
+{
+    span->left = tree_grid_cell(left, surface->tree_grid_cell_width);
+    span->top = tree_grid_cell(top, surface->tree_grid_cell_height);
+    span->right = tree_grid_cell(right - 1, surface->tree_grid_cell_width);
+    span->bottom = tree_grid_cell(bottom - 1, surface->tree_grid_cell_height);
+}
+
+static inline void tree_grid_add(RedWorker *worker, TreeItem *item, uint32_t surface_id)
+{
+    RedSurface *surface = &worker->surfaces[surface_id];
+    TreeGridSpan *span = &item->grid_span;
+    pixman_box32_t *extents = pixman_region32_extents(&item->rgn);
+    int x, y;
+
+    span->surface_id = surface_id;
+    tree_grid_get_span(surface, extents->x1, extents->y1, extents->x2, extents->y2, span);
+    for (y = span->top; y <= span->bottom; y++) {
+        uint16_t *cell = surface->tree_grid + y * TREE_GRID_SIZE;
+        for (x = span->left; x <= span->right; x++) {
+            cell[x]++;
+        }
+    }
+}
+
+static inline void tree_grid_remove(RedWorker *worker, TreeItem *item)
+{
+    TreeGridSpan *span = &item->grid_span;
+    RedSurface *surface = &worker->surfaces[span->surface_id];
+    int x, y;
+
+    for (y = span->top; y <= span->bottom; y++) {
+        uint16_t *cell = surface->tree_grid + y * TREE_GRID_SIZE;
+        for (x = span->left; x <= span->right; x++) {
+            ASSERT(cell[x]);
+            cell[x]--;
+        }
+    }
+}
+
+static inline int tree_grid_is_empty(RedSurface *surface, int32_t left, int32_t top,
+                                     int32_t right, int32_t bottom)
+{
+    TreeGridSpan span;
+    int x, y;
+
+    if (left >= right || top >= bottom) {
+        return TRUE;
+    }
+    tree_grid_get_span(surface, left, top, right, bottom, &span);
+    for (y = span.top; y <= span.bottom; y++) {
+        uint16_t *cell = surface->tree_grid + y * TREE_GRID_SIZE;
+        for (x = span.left; x <= span.right; x++) {
+            if (cell[x]) {
+                return FALSE;
+            }
+        }
+    }
+    return TRUE;
+}
+
 static inline void remove_shadow(RedWorker *worker, DrawItem *item)
 {
     Shadow *shadow;
@@ -1608,10 +1842,11 @@ static inline void remove_shadow(RedWorker *worker, DrawItem *item)
     }
     shadow = item->shadow;
     item->shadow = NULL;
+    tree_grid_remove(worker, &shadow->base);
     ring_remove(&shadow->base.siblings_link);
     region_destroy(&shadow->base.rgn);
     region_destroy(&shadow->on_hold);
-    free(shadow);
+    red_slab_free(&worker->shadow_slab, shadow);
     worker->shadows_count--;
 }
 
@@ -1619,9 +1854,10 @@ static inline void current_remove_container(RedWorker *worker, Container *contai
 {
     ASSERT(ring_is_empty(&container->items));
     worker->containers_count--;
+    tree_grid_remove(worker, &container->base);
     ring_remove(&container->base.siblings_link);
     region_destroy(&container->base.rgn);
-    free(container);
+    red_slab_free(&worker->container_slab, container);
 }
 
 static inline void container_cleanup(RedWorker *worker, Container *container)
@@ -1690,6 +1926,7 @@ static inline void current_remove_drawable(RedWorker *worker, Drawable *item)
         red_add_item_trace(worker, item);
     }
     remove_shadow(worker, &item->tree_item);
+    tree_grid_remove(worker, &item->tree_item.base);
     ring_remove(&item->tree_item.base.siblings_link);
     ring_remove(&item->list_link);
     ring_remove(&item->surface_list_link);
@@ -2103,7 +2340,7 @@ static void exclude_region(RedWorker *worker, Ring *ring, RingItem *ring_item, Q
 
 static inline Container *__new_container(RedWorker *worker, DrawItem *item)
 {
-    Container *container = spice_new(Container, 1);
+    Container *container = red_slab_alloc(&worker->container_slab);
     worker->containers_count++;
 #ifdef PIPE_DEBUG
     container->base.id = ++worker->last_id;
@@ -2113,6 +2350,7 @@ static inline Container *__new_container(RedWorker *worker, DrawItem *item)
     item->base.container = container;
     item->container_root = TRUE;
     region_clone(&container->base.rgn, &item->base.rgn);
+    tree_grid_add(worker, &container->base, item->base.grid_span.surface_id);
     ring_item_init(&container->base.siblings_link);
     ring_add_after(&container->base.siblings_link, &item->base.siblings_link);
     ring_remove(&item->base.siblings_link);
@@ -2135,6 +2373,7 @@ static inline void __current_add_drawable(RedWorker *worker, Drawable *drawable,
 
     surface = &worker->surfaces[surface_id];
     ring_add_after(&drawable->tree_item.base.siblings_link, pos);
+    tree_grid_add(worker, &drawable->tree_item.base, surface_id);
     ring_add(&worker->current_list, &drawable->list_link);
     worker->drawable_count++;
     ring_add(&surface->current_list, &drawable->surface_list_link);
@@ -2245,7 +2484,7 @@ static inline void red_detach_stream(RedWorker *worker, Stream *stream)
 
 static StreamClipItem *__new_stream_clip(DisplayChannel* channel, StreamAgent *agent)
 {
-    StreamClipItem *item = spice_new(StreamClipItem, 1);
+    StreamClipItem *item = red_slab_alloc(&channel->base.worker->stream_clip_slab);
     red_pipe_item_init((PipeItem *)item, PIPE_ITEM_TYPE_STREAM_CLIP);
 
     item->stream_agent = agent;
@@ -2304,7 +2543,7 @@ static void red_display_release_stream_clip(DisplayChannel* channel, StreamClipI
         if (item->rects) {
             free(item->rects);
         }
-        free(item);
+        red_slab_free(&channel->base.worker->stream_clip_slab, item);
     }
 }
 
@@ -2516,7 +2755,7 @@ static void red_display_create_stream(DisplayChannel *display, Stream *stream)
     }
     agent->drops = 0;
     agent->fps = MAX_FPS;
-    reset_rate(agent);
+    reset_rate(display, agent);
     red_pipe_add(&display->base, &agent->create_item);
 }
 
@@ -2654,24 +2893,65 @@ static inline int red_is_next_stream_frame(RedWorker *worker, const Drawable *ca
                                       prev->stream);
 }
 
-static void reset_rate(StreamAgent *stream_agent)
+static void stream_agent_set_quality(StreamAgent *agent, int quality)
 {
-    Stream *stream = stream_agent->stream;
-    int rate;
+    agent->quality = quality;
+    mjpeg_encoder_set_quality(agent->stream->mjpeg_encoder, quality);
+}
 
-    rate = get_bit_rate(stream->width, stream->height);
-    if (rate == stream->bit_rate) {
-        return;
-    }
+static void reset_rate(DisplayChannel *display, StreamAgent *stream_agent)
+{
+    stream_agent->interval_start = red_now();
+    stream_agent->interval_bytes = 0;
+    stream_agent->interval_blocked = display->base.send_data.blocked_count;
+    stream_agent_set_quality(stream_agent, STREAM_MAX_QUALITY);
+}
+
+/* Closed loop rate control, runs once per FPS_TEST_INTERVAL of frames. The
+   stream is congested when frames are dropped because the previous one is
+   still in the pipe, when the socket or the ack window blocked the channel,
+   when window ack latency grows well above the lowest one seen (data queuing
+   in the network) or when the stream exceeds its bit rate budget. Under
+   congestion quality is lowered first and fps only once quality is at its
+   minimum, since a lower fps is more visible than blockier frames. With
+   headroom fps is restored first and then quality. */
+static void stream_agent_update_rate(DisplayChannel *display, StreamAgent *agent,
+                                     double drop_factor)
+{
+    RedChannel *channel = &display->base;
+    uint64_t now = red_now();
+    uint64_t elapsed = MAX(now - agent->interval_start, 1);
+    uint64_t bit_rate = agent->interval_bytes * 8 * 1000 * 1000 * 1000 / elapsed;
+    int blocked = channel->send_data.blocked_count != agent->interval_blocked;
+    int queuing = channel->ack_data.count && channel->ack_data.latency >
+                  channel->ack_data.min_latency * STREAM_LATENCY_FACTOR + STREAM_LATENCY_SLACK;
 
-    /* MJpeg has no rate limiting anyway, so do nothing */
+    if (drop_factor < 0.9 || blocked || queuing || bit_rate > agent->stream->bit_rate) {
+        if (agent->quality > STREAM_MIN_QUALITY) {
+            stream_agent_set_quality(agent, MAX(agent->quality - 2 * STREAM_QUALITY_STEP,
+                                                STREAM_MIN_QUALITY));
+        } else if (agent->fps > STREAM_MIN_FPS) {
+            agent->fps = MAX(agent->fps * 3 / 4, STREAM_MIN_FPS);
+        }
+    } else if (drop_factor == 1) {
+        if (agent->fps < MAX_FPS) {
+            agent->fps++;
+        } else if (agent->quality < STREAM_MAX_QUALITY &&
+                   bit_rate * (agent->quality + STREAM_QUALITY_STEP) / agent->quality <
+                   agent->stream->bit_rate) {
+            stream_agent_set_quality(agent, agent->quality + STREAM_QUALITY_STEP);
+        }
+    }
+    agent->interval_start = now;
+    agent->interval_bytes = 0;
+    agent->interval_blocked = channel->send_data.blocked_count;
 }
 
 static inline void pre_stream_item_swap(RedWorker *worker, Stream *stream)
 {
     ASSERT(stream->current);
 
-    if (!worker->display_channel || !IS_LOW_BANDWIDTH()) {
+    if (!worker->display_channel) {
         return;
     }
 
@@ -2680,6 +2960,7 @@ static inline void pre_stream_item_swap(RedWorker *worker, Stream *stream)
 
     if (pipe_item_is_linked(&stream->current->pipe_item)) {
         ++agent->drops;
+        stat_inc_counter(worker->display_channel->stream_drops_counter, 1);
     }
 
     if (agent->frames / agent->fps < FPS_TEST_INTERVAL) {
@@ -2689,15 +2970,7 @@ static inline void pre_stream_item_swap(RedWorker *worker, Stream *stream)
 
     double drop_factor = ((double)agent->frames - (double)agent->drops) / (double)agent->frames;
 
-    if (drop_factor == 1) {
-        if (agent->fps < MAX_FPS) {
-            agent->fps++;
-        }
-    } else if (drop_factor < 0.9) {
-        if (agent->fps > 1) {
-            agent->fps--;
-        }
-    }
+    stream_agent_update_rate(worker->display_channel, agent, drop_factor);
     agent->frames = 1;
     agent->drops = 0;
 }
@@ -2932,12 +3205,22 @@ static inline int red_current_add(RedWorker *worker, Ring *ring, Drawable *drawa
     RingItem *now;
     QRegion exclude_rgn;
     RingItem *exclude_base = NULL;
+    RedSurface *surface;
+    pixman_box32_t *extents;
 
     print_base_item("ADD", &item->base);
     ASSERT(!region_is_empty(&item->base.rgn));
     worker->current_size++;
     region_init(&exclude_rgn);
-    now = ring_next(ring, ring);
+    surface = &worker->surfaces[drawable->surface_id];
+    extents = pixman_region32_extents(&item->base.rgn);
+    if (ring == &surface->current &&
+        tree_grid_is_empty(surface, extents->x1, extents->y1, extents->x2, extents->y2)) {
+        // nothing in the tree covers the item, no need to walk the siblings
+        now = NULL;
+    } else {
+        now = ring_next(ring, ring);
+    }
 
     while (now) {
         TreeItem *sibling = SPICE_CONTAINEROF(now, TreeItem, siblings_link);
@@ -3052,7 +3335,7 @@ static inline Shadow *__new_shadow(RedWorker *worker, Drawable *item, SpicePoint
         return NULL;
     }
 
-    Shadow *shadow = spice_new(Shadow, 1);
+    Shadow *shadow = red_slab_alloc(&worker->shadow_slab);
     worker->shadows_count++;
 #ifdef PIPE_DEBUG
     shadow->base.id = ++worker->last_id;
@@ -3089,6 +3372,7 @@ static inline int red_current_add_with_shadow(RedWorker *worker, Ring *ring, Dra
         red_detach_streams_behind(worker, &shadow->base.rgn);
     }
     ring_add(ring, &shadow->base.siblings_link);
+    tree_grid_add(worker, &shadow->base, item->surface_id);
     __current_add_drawable(worker, item, ring);
     if (item->tree_item.effect == QXL_EFFECT_OPAQUE) {
         QRegion exclude_rgn;
@@ -3444,10 +3728,104 @@ static inline void red_inc_surfaces_drawable_dependencies(RedWorker *worker, Dra
     }
 }
 
+static uint64_t red_bitmap_content_id(SpiceBitmap *bitmap)
+{
+    uint32_t line_size = bitmap->x * BITMAP_FMP_BYTES_PER_PIXEL[bitmap->format];
+    uint32_t header[4] = {bitmap->format, bitmap->x, bitmap->y,
+                          bitmap->flags & SPICE_BITMAP_FLAGS_TOP_DOWN};
+    RedHash64 hash;
+    uint32_t i;
+
+    red_hash64_init(&hash, 0);
+    red_hash64_update(&hash, header, sizeof(header));
+    for (i = 0; i < bitmap->data->num_chunks; i++) {
+        SpiceChunk *chunk = &bitmap->data->chunk[i];
+
+        if (bitmap->stride == line_size) {
+            red_hash64_update(&hash, chunk->data, chunk->len);
+        } else {
+            // the padding at the end of the lines is garbage
+            uint8_t *line = chunk->data;
+            uint8_t *end = chunk->data + chunk->len;
+
+            for (; line < end; line += bitmap->stride) {
+                red_hash64_update(&hash, line, line_size);
+            }
+        }
+    }
+    return (red_hash64_final(&hash) & ~IMAGE_CONTENT_ID_TAG_MASK) | IMAGE_CONTENT_ID_TAG;
+}
+
+/* Gives bitmaps an id derived from their content, so a bitmap that is drawn
+   again under another id, from the vga path or by another qxl device, hits
+   the pixmap cache. Bitmaps the guest didn't ask to cache are marked for
+   caching once their content is seen a second time or is already cached. */
+static void red_dedup_image(RedWorker *worker, SpiceImage *image)
+{
+    SpiceBitmap *bitmap;
+    uint64_t id;
+    uint64_t *seen;
+    int dup;
+
+    if (!image || image->descriptor.type != SPICE_IMAGE_TYPE_BITMAP) {
+        return;
+    }
+    bitmap = &image->u.bitmap;
+    if (!BITMAP_FMT_IS_RGB[bitmap->format] || bitmap->x * bitmap->y < IMAGE_DEDUP_MIN_PIXELS ||
+        (bitmap->data->flags & SPICE_CHUNKS_FLAGS_UNSTABLE)) {
+        return;
+    }
+
+    id = red_bitmap_content_id(bitmap);
+    stat_inc_counter(worker->image_hash_counter, 1);
+    seen = &worker->image_dedup_seen[id % IMAGE_DEDUP_SEEN_SIZE];
+    dup = *seen == id || (worker->display_channel &&
+                          pixmap_cache_contains(worker->display_channel->pixmap_cache, id));
+    *seen = id;
+    if (dup) {
+        stat_inc_counter(worker->image_dup_counter, 1);
+    }
+    if (image->descriptor.flags & SPICE_IMAGE_FLAGS_CACHE_ME) {
+        image->descriptor.id = id;
+    } else if (dup) {
+        image->descriptor.id = id;
+        image->descriptor.flags |= SPICE_IMAGE_FLAGS_CACHE_ME;
+    }
+}
+
+static void red_dedup_drawable_images(RedWorker *worker, RedDrawable *drawable)
+{
+    switch (drawable->type) {
+    case QXL_DRAW_OPAQUE:
+        red_dedup_image(worker, drawable->u.opaque.src_bitmap);
+        break;
+    case QXL_DRAW_COPY:
+        red_dedup_image(worker, drawable->u.copy.src_bitmap);
+        break;
+    case QXL_DRAW_TRANSPARENT:
+        red_dedup_image(worker, drawable->u.transparent.src_bitmap);
+        break;
+    case QXL_DRAW_ALPHA_BLEND:
+        red_dedup_image(worker, drawable->u.alpha_blend.src_bitmap);
+        break;
+    case QXL_DRAW_BLEND:
+        red_dedup_image(worker, drawable->u.blend.src_bitmap);
+        break;
+    case QXL_DRAW_ROP3:
+        red_dedup_image(worker, drawable->u.rop3.src_bitmap);
+        break;
+    default:
+        break;
+    }
+}
+
 static inline void red_process_drawable(RedWorker *worker, RedDrawable *drawable, uint32_t group_id)
 {
     int surface_id;
-    Drawable *item = get_drawable(worker, drawable->effect, drawable, group_id);
+    Drawable *item;
+
+    red_dedup_drawable_images(worker, drawable);
+    item = get_drawable(worker, drawable->effect, drawable, group_id);
 
     ASSERT(item);
 
@@ -4131,6 +4509,11 @@ static void red_update_area(RedWorker *worker, const SpiceRect *area, int surfac
 #ifdef ACYCLIC_SURFACE_DEBUG
     gn = ++surface->current_gn;
 #endif
+    if (tree_grid_is_empty(surface, area->left, area->top, area->right, area->bottom)) {
+        validate_area(worker, area, surface_id);
+        return;
+    }
+
     ring = &surface->current_list;
     ring_item = ring;
 
@@ -4283,15 +4666,6 @@ void qxl_process_cursor(RedWorker *worker, RedCursorCmd *cursor_cmd, uint32_t gr
     }
 }
 
-static inline uint64_t red_now()
-{
-    struct timespec time;
-
-    clock_gettime(CLOCK_MONOTONIC, &time);
-
-    return time.tv_sec * 1000000000 + time.tv_nsec;
-}
-
 static int red_process_cursor(RedWorker *worker, uint32_t max_pipe_size, int *ring_is_empty)
 {
     QXLCommandExt ext_cmd;
@@ -4320,6 +4694,9 @@ static int red_process_cursor(RedWorker *worker, uint32_t max_pipe_size, int *ri
 
             red_get_cursor_cmd(&worker->mem_slots, ext_cmd.group_id,
                                cursor, ext_cmd.cmd.data);
+            if (worker->record) {
+                red_record_cursor_cmd(worker->record, cursor);
+            }
             qxl_process_cursor(worker, cursor, ext_cmd.group_id);
             break;
         }
@@ -4357,10 +4734,15 @@ static int red_process_commands(RedWorker *worker, uint32_t max_pipe_size, int *
         worker->repoll_cmd_ring = 0;
         switch (ext_cmd.cmd.type) {
         case QXL_CMD_DRAW: {
-            RedDrawable *drawable = spice_new0(RedDrawable, 1);
+            RedDrawable *drawable = red_slab_alloc(&worker->red_drawable_slab);
+
+            memset(drawable, 0, sizeof(*drawable));
 
             red_get_drawable(&worker->mem_slots, ext_cmd.group_id,
                              drawable, ext_cmd.cmd.data, ext_cmd.flags);
+            if (worker->record) {
+                red_record_drawable(worker->record, drawable);
+            }
             red_process_drawable(worker, drawable, ext_cmd.group_id);
             break;
         }
@@ -4370,6 +4752,9 @@ static int red_process_commands(RedWorker *worker, uint32_t max_pipe_size, int *
 
             red_get_update_cmd(&worker->mem_slots, ext_cmd.group_id,
                                &update, ext_cmd.cmd.data);
+            if (worker->record) {
+                red_record_update_cmd(worker->record, &update);
+            }
             validate_surface(worker, update.surface_id);
             red_update_area(worker, &update.area, update.surface_id);
             worker->qxl->st->qif->notify_update(worker->qxl, update.update_id);
@@ -4400,6 +4785,9 @@ static int red_process_commands(RedWorker *worker, uint32_t max_pipe_size, int *
 
             red_get_surface_cmd(&worker->mem_slots, ext_cmd.group_id,
                                 surface, ext_cmd.cmd.data);
+            if (worker->record) {
+                red_record_surface_cmd(worker->record, surface);
+            }
             red_process_surface(worker, surface, ext_cmd.group_id, 0);
             break;
         }
@@ -4649,6 +5037,32 @@ static void red_display_reset_compress_buf(DisplayChannel *display_channel)
         display_channel->send_data.used_compress_bufs = buf->next;
         __red_display_free_compress_buf(display_channel, buf);
     }
+    while (display_channel->send_data.pool_compress_bufs) {
+        RedCompressBuf *buf = display_channel->send_data.pool_compress_bufs;
+        display_channel->send_data.pool_compress_bufs = buf->next;
+        free(buf);
+    }
+}
+
+static inline RedCompressBuf *encoder_data_alloc_compress_buf(EncoderData *enc_data)
+{
+    if (!enc_data->display_channel) {
+        return spice_new(RedCompressBuf, 1);
+    }
+    return red_display_alloc_compress_buf(enc_data->display_channel);
+}
+
+static void encoder_data_free_compress_bufs(EncoderData *enc_data)
+{
+    while (enc_data->bufs_head) {
+        RedCompressBuf *buf = enc_data->bufs_head;
+        enc_data->bufs_head = buf->send_next;
+        if (enc_data->display_channel) {
+            red_display_free_compress_buf(enc_data->display_channel, buf);
+        } else {
+            free(buf);
+        }
+    }
 }
 
 /******************************************************
@@ -4952,7 +5366,7 @@ static inline int encoder_usr_more_space(EncoderData *enc_data, uint32_t **io_pt
 {
     RedCompressBuf *buf;
 
-    if (!(buf = red_display_alloc_compress_buf(enc_data->display_channel))) {
+    if (!(buf = encoder_data_alloc_compress_buf(enc_data))) {
         return 0;
     }
     enc_data->bufs_tail->send_next = buf;
@@ -5083,36 +5497,36 @@ static void glz_usr_free_image(GlzEncoderUsrContext *usr, GlzUsrImageContext *im
     }
 }
 
-static inline void red_init_quic(RedWorker *worker)
+static inline void red_init_quic(ImageEncoders *enc)
 {
-    worker->quic_data.usr.error = quic_usr_error;
-    worker->quic_data.usr.warn = quic_usr_warn;
-    worker->quic_data.usr.info = quic_usr_warn;
-    worker->quic_data.usr.malloc = quic_usr_malloc;
-    worker->quic_data.usr.free = quic_usr_free;
-    worker->quic_data.usr.more_space = quic_usr_more_space;
-    worker->quic_data.usr.more_lines = quic_usr_more_lines;
+    enc->quic_data.usr.error = quic_usr_error;
+    enc->quic_data.usr.warn = quic_usr_warn;
+    enc->quic_data.usr.info = quic_usr_warn;
+    enc->quic_data.usr.malloc = quic_usr_malloc;
+    enc->quic_data.usr.free = quic_usr_free;
+    enc->quic_data.usr.more_space = quic_usr_more_space;
+    enc->quic_data.usr.more_lines = quic_usr_more_lines;
 
-    worker->quic = quic_create(&worker->quic_data.usr);
+    enc->quic = quic_create(&enc->quic_data.usr);
 
-    if (!worker->quic) {
+    if (!enc->quic) {
         PANIC("create quic failed");
     }
 }
 
-static inline void red_init_lz(RedWorker *worker)
+static inline void red_init_lz(ImageEncoders *enc)
 {
-    worker->lz_data.usr.error = lz_usr_error;
-    worker->lz_data.usr.warn = lz_usr_warn;
-    worker->lz_data.usr.info = lz_usr_warn;
-    worker->lz_data.usr.malloc = lz_usr_malloc;
-    worker->lz_data.usr.free = lz_usr_free;
-    worker->lz_data.usr.more_space = lz_usr_more_space;
-    worker->lz_data.usr.more_lines = lz_usr_more_lines;
+    enc->lz_data.usr.error = lz_usr_error;
+    enc->lz_data.usr.warn = lz_usr_warn;
+    enc->lz_data.usr.info = lz_usr_warn;
+    enc->lz_data.usr.malloc = lz_usr_malloc;
+    enc->lz_data.usr.free = lz_usr_free;
+    enc->lz_data.usr.more_space = lz_usr_more_space;
+    enc->lz_data.usr.more_lines = lz_usr_more_lines;
 
-    worker->lz = lz_create(&worker->lz_data.usr);
+    enc->lz = lz_create(&enc->lz_data.usr);
 
-    if (!worker->lz) {
+    if (!enc->lz) {
         PANIC("create lz failed");
     }
 }
@@ -5129,18 +5543,26 @@ static inline void red_display_init_glz_data(DisplayChannel *display)
     display->glz_data.usr.free_image = glz_usr_free_image;
 }
 
-static inline void red_init_jpeg(RedWorker *worker)
+static inline void red_init_jpeg(ImageEncoders *enc)
 {
-    worker->jpeg_data.usr.more_space = jpeg_usr_more_space;
-    worker->jpeg_data.usr.more_lines = jpeg_usr_more_lines;
+    enc->jpeg_data.usr.more_space = jpeg_usr_more_space;
+    enc->jpeg_data.usr.more_lines = jpeg_usr_more_lines;
 
-    worker->jpeg = jpeg_encoder_create(&worker->jpeg_data.usr);
+    enc->jpeg = jpeg_encoder_create(&enc->jpeg_data.usr);
 
-    if (!worker->jpeg) {
+    if (!enc->jpeg) {
         PANIC("create jpeg encoder failed");
     }
 }
 
+static void red_init_image_encoders(ImageEncoders *enc, int private_bufs)
+{
+    enc->private_bufs = private_bufs;
+    red_init_quic(enc);
+    red_init_lz(enc);
+    red_init_jpeg(enc);
+}
+
 static inline void red_init_zlib(RedWorker *worker)
 {
     worker->zlib_data.usr.more_space = zlib_usr_more_space;
@@ -5183,6 +5605,17 @@ typedef uint16_t rgb16_pixel_t;
 
 #undef ATTR_PACKED
 
+#define GRADUAL_TILE_SIZE 64
+#define GRADUAL_MAX_TILE_COLUMNS 128
+#define TILE_SAMPLE_ROWS 3
+#define TILE_SAMPLE_COLS 5
+
+typedef struct GradualTile {
+    double score;
+    int num_samples;    // squares that are not flat
+    int num_flat;
+} GradualTile;
+
 #define RED_BITMAP_UTILS_RGB16
 #include "red_bitmap_utils.h"
 #define RED_BITMAP_UTILS_RGB24
@@ -5198,60 +5631,102 @@ typedef uint16_t rgb16_pixel_t;
 // in window media player 12). see red_stream_add_frame
 #define GRADUAL_MEDIUM_SCORE_TH 0.002
 
-// assumes that stride doesn't overflow
+typedef struct GradualArea {
+    uint32_t photo;
+    uint32_t gradient;
+    uint32_t text;
+} GradualArea;
+
+// classifies a row of tiles by their mean score and accounts their area
+static void gradual_tiles_flush(GradualTile *tiles, int num_tiles, double photo_th,
+                                GradualArea *area)
+{
+    int i;
+
+    for (i = 0; i < num_tiles; i++) {
+        GradualTile *tile = &tiles[i];
+        double score;
+
+        // mostly flat tiles compress well with any codec, ignore them
+        if (tile->num_samples && tile->num_samples * 4 >= tile->num_flat) {
+            score = tile->score / (tile->num_samples * 3);
+            if (score < photo_th) {
+                area->photo += tile->num_samples + tile->num_flat;
+            } else if (score < GRADUAL_MEDIUM_SCORE_TH) {
+                area->gradient += tile->num_samples + tile->num_flat;
+            } else {
+                area->text += tile->num_samples + tile->num_flat;
+            }
+        }
+        memset(tile, 0, sizeof(*tile));
+    }
+}
+
+/* The bitmap is split into tiles of GRADUAL_TILE_SIZE (wider for very wide
+   bitmaps) which are classified as photo, gradient or text like. The protocol
+   carries one codec per image, so the level is decided by the share of each
+   class in the non flat area: a photo inside a document isn't averaged away
+   by the text and flat background around it. */
 static BitmapGradualType _get_bitmap_graduality_level(RedWorker *worker, SpiceBitmap *bitmap, uint32_t group_id)
 {
-    double score = 0.0;
-    int num_samples = 0;
-    int num_lines;
-    double chunk_score = 0.0;
-    int chunk_num_samples = 0;
-    uint32_t x, i;
+    GradualTile tiles[GRADUAL_MAX_TILE_COLUMNS];
+    GradualArea area = {0, 0, 0};
+    int tile_width = MAX(GRADUAL_TILE_SIZE,
+                         (bitmap->x + GRADUAL_MAX_TILE_COLUMNS - 1) / GRADUAL_MAX_TILE_COLUMNS);
+    int num_tiles = (bitmap->x + tile_width - 1) / tile_width;
+    double photo_th = bitmap->format == SPICE_BITMAP_FMT_16BIT ? GRADUAL_HIGH_RGB16_TH :
+                                                                 GRADUAL_HIGH_RGB24_TH;
+    int line_index = 0;
+    uint32_t i, total;
     SpiceChunk *chunk;
 
+    memset(tiles, 0, sizeof(tiles));
     chunk = bitmap->data->chunk;
     for (i = 0; i < bitmap->data->num_chunks; i++) {
-        num_lines = chunk[i].len / bitmap->stride;
-        x = bitmap->x;
-        switch (bitmap->format) {
-        case SPICE_BITMAP_FMT_16BIT:
-            compute_lines_gradual_score_rgb16((rgb16_pixel_t *)chunk[i].data, x, num_lines,
-                                              &chunk_score, &chunk_num_samples);
-            break;
-        case SPICE_BITMAP_FMT_24BIT:
-            compute_lines_gradual_score_rgb24((rgb24_pixel_t *)chunk[i].data, x, num_lines,
-                                              &chunk_score, &chunk_num_samples);
-            break;
-        case SPICE_BITMAP_FMT_32BIT:
-        case SPICE_BITMAP_FMT_RGBA:
-            compute_lines_gradual_score_rgb32((rgb32_pixel_t *)chunk[i].data, x, num_lines,
-                                              &chunk_score, &chunk_num_samples);
-            break;
-        default:
-            red_error("invalid bitmap format (not RGB) %u", bitmap->format);
+        int num_lines = chunk[i].len / bitmap->stride;
+        uint8_t *lines = chunk[i].data;
+
+        while (num_lines > 0) {
+            // lines up to the end of the current row of tiles, plus the line below
+            // them when the chunk has it
+            int n = MIN(num_lines, GRADUAL_TILE_SIZE - line_index % GRADUAL_TILE_SIZE);
+            int sampled = MIN(n + 1, num_lines);
+
+            switch (bitmap->format) {
+            case SPICE_BITMAP_FMT_16BIT:
+                compute_lines_tiles_score_rgb16(lines, bitmap->stride, bitmap->x, sampled,
+                                                line_index, tile_width, tiles);
+                break;
+            case SPICE_BITMAP_FMT_24BIT:
+                compute_lines_tiles_score_rgb24(lines, bitmap->stride, bitmap->x, sampled,
+                                                line_index, tile_width, tiles);
+                break;
+            case SPICE_BITMAP_FMT_32BIT:
+            case SPICE_BITMAP_FMT_RGBA:
+                compute_lines_tiles_score_rgb32(lines, bitmap->stride, bitmap->x, sampled,
+                                                line_index, tile_width, tiles);
+                break;
+            default:
+                red_error("invalid bitmap format (not RGB) %u", bitmap->format);
+            }
+            line_index += n;
+            lines += n * bitmap->stride;
+            num_lines -= n;
+            if (line_index % GRADUAL_TILE_SIZE == 0) {
+                gradual_tiles_flush(tiles, num_tiles, photo_th, &area);
+            }
         }
-        score += chunk_score;
-        num_samples += chunk_num_samples;
     }
+    gradual_tiles_flush(tiles, num_tiles, photo_th, &area);
 
-    ASSERT(num_samples);
-    score /= num_samples;
-
-    if (bitmap->format == SPICE_BITMAP_FMT_16BIT) {
-        if (score < GRADUAL_HIGH_RGB16_TH) {
-            return BITMAP_GRADUAL_HIGH;
-        }
-    } else {
-        if (score < GRADUAL_HIGH_RGB24_TH) {
-            return BITMAP_GRADUAL_HIGH;
-        }
+    total = area.photo + area.gradient + area.text;
+    if (area.photo * 2 > total) {
+        return BITMAP_GRADUAL_HIGH;
     }
-
-    if (score < GRADUAL_MEDIUM_SCORE_TH) {
+    if ((area.photo + area.gradient) * 2 > total) {
         return BITMAP_GRADUAL_MEDIUM;
-    } else {
-        return BITMAP_GRADUAL_LOW;
     }
+    return BITMAP_GRADUAL_LOW;
 }
 
 static inline int _stride_is_extra(SpiceBitmap *bitmap)
@@ -5297,6 +5772,7 @@ typedef struct compress_send_data_t {
     uint32_t comp_buf_size;
     SpicePalette *lzplt_palette;
     int is_lossy;
+    uint64_t encode_time;       // nano
 } compress_send_data_t;
 
 
@@ -5400,13 +5876,12 @@ glz:
     return TRUE;
 }
 
-static inline int red_lz_compress_image(DisplayChannel *display_channel,
+static inline int red_lz_compress_image(DisplayChannel *display_channel, ImageEncoders *enc,
                                         SpiceImage *dest, SpiceBitmap *src,
                                         compress_send_data_t* o_comp_data, uint32_t group_id)
 {
-    RedWorker *worker = display_channel->base.worker;
-    LzData *lz_data = &worker->lz_data;
-    LzContext *lz = worker->lz;
+    LzData *lz_data = &enc->lz_data;
+    LzContext *lz = enc->lz;
     LzImageType type = MAP_BITMAP_FMT_TO_LZ_IMAGE_TYPE[src->format];
     int size;            // size of the compressed data
 
@@ -5414,7 +5889,8 @@ static inline int red_lz_compress_image(DisplayChannel *display_channel,
     stat_time_t start_time = stat_now();
 #endif
 
-    lz_data->data.bufs_tail = red_display_alloc_compress_buf(display_channel);
+    lz_data->data.display_channel = enc->private_bufs ? NULL : display_channel;
+    lz_data->data.bufs_tail = encoder_data_alloc_compress_buf(&lz_data->data);
     lz_data->data.bufs_head = lz_data->data.bufs_tail;
 
     if (!lz_data->data.bufs_head) {
@@ -5422,14 +5898,9 @@ static inline int red_lz_compress_image(DisplayChannel *display_channel,
     }
 
     lz_data->data.bufs_head->send_next = NULL;
-    lz_data->data.display_channel = display_channel;
 
     if (setjmp(lz_data->data.jmp_env)) {
-        while (lz_data->data.bufs_head) {
-            RedCompressBuf *buf = lz_data->data.bufs_head;
-            lz_data->data.bufs_head = buf->send_next;
-            red_display_free_compress_buf(display_channel, buf);
-        }
+        encoder_data_free_compress_bufs(&lz_data->data);
         return FALSE;
     }
 
@@ -5456,6 +5927,8 @@ static inline int red_lz_compress_image(DisplayChannel *display_channel,
         o_comp_data->comp_buf = lz_data->data.bufs_head;
         o_comp_data->comp_buf_size = size;
     } else {
+        // the palette cache belongs to the worker
+        ASSERT(!enc->private_bufs);
         dest->descriptor.type = SPICE_IMAGE_TYPE_LZ_PLT;
         dest->u.lz_plt.data_size = size;
         dest->u.lz_plt.flags = src->flags & SPICE_BITMAP_FLAGS_TOP_DOWN;
@@ -5469,20 +5942,21 @@ static inline int red_lz_compress_image(DisplayChannel *display_channel,
         o_comp_data->lzplt_palette = dest->u.lz_plt.palette;
     }
 
-    stat_compress_add(&display_channel->lz_stat, start_time, src->stride * src->y,
-                      o_comp_data->comp_buf_size);
+    if (!enc->private_bufs) {
+        stat_compress_add(&display_channel->lz_stat, start_time, src->stride * src->y,
+                          o_comp_data->comp_buf_size);
+    }
     return TRUE;
 }
 
-static int red_jpeg_compress_image(DisplayChannel *display_channel, SpiceImage *dest,
-                                   SpiceBitmap *src, compress_send_data_t* o_comp_data,
-                                   uint32_t group_id)
+static int red_jpeg_compress_image(DisplayChannel *display_channel, ImageEncoders *enc,
+                                   SpiceImage *dest, SpiceBitmap *src,
+                                   compress_send_data_t* o_comp_data, uint32_t group_id)
 {
-    RedWorker *worker = display_channel->base.worker;
-    JpegData *jpeg_data = &worker->jpeg_data;
-    LzData *lz_data = &worker->lz_data;
-    JpegEncoderContext *jpeg = worker->jpeg;
-    LzContext *lz = worker->lz;
+    JpegData *jpeg_data = &enc->jpeg_data;
+    LzData *lz_data = &enc->lz_data;
+    JpegEncoderContext *jpeg = enc->jpeg;
+    LzContext *lz = enc->lz;
     JpegEncoderImageType jpeg_in_type;
     int jpeg_size = 0;
     int has_alpha = FALSE;
@@ -5513,7 +5987,8 @@ static int red_jpeg_compress_image(DisplayChannel *display_channel, SpiceImage *
         return FALSE;
     }
 
-    jpeg_data->data.bufs_tail = red_display_alloc_compress_buf(display_channel);
+    jpeg_data->data.display_channel = enc->private_bufs ? NULL : display_channel;
+    jpeg_data->data.bufs_tail = encoder_data_alloc_compress_buf(&jpeg_data->data);
     jpeg_data->data.bufs_head = jpeg_data->data.bufs_tail;
 
     if (!jpeg_data->data.bufs_head) {
@@ -5522,14 +5997,9 @@ static int red_jpeg_compress_image(DisplayChannel *display_channel, SpiceImage *
     }
 
     jpeg_data->data.bufs_head->send_next = NULL;
-    jpeg_data->data.display_channel = display_channel;
 
     if (setjmp(jpeg_data->data.jmp_env)) {
-        while (jpeg_data->data.bufs_head) {
-            RedCompressBuf *buf = jpeg_data->data.bufs_head;
-            jpeg_data->data.bufs_head = buf->send_next;
-            red_display_free_compress_buf(display_channel, buf);
-        }
+        encoder_data_free_compress_bufs(&jpeg_data->data);
         return FALSE;
     }
 
@@ -5567,8 +6037,10 @@ static int red_jpeg_compress_image(DisplayChannel *display_channel, SpiceImage *
         o_comp_data->comp_buf_size = jpeg_size;
         o_comp_data->is_lossy = TRUE;
 
-        stat_compress_add(&display_channel->jpeg_stat, start_time, src->stride * src->y,
-                          o_comp_data->comp_buf_size);
+        if (!enc->private_bufs) {
+            stat_compress_add(&display_channel->jpeg_stat, start_time, src->stride * src->y,
+                              o_comp_data->comp_buf_size);
+        }
         return TRUE;
     }
 
@@ -5579,7 +6051,7 @@ static int red_jpeg_compress_image(DisplayChannel *display_channel, SpiceImage *
      comp_head_left = sizeof(lz_data->data.bufs_head->buf) - comp_head_filled;
      lz_out_start_byte = ((uint8_t *)lz_data->data.bufs_head->buf) + comp_head_filled;
 
-     lz_data->data.display_channel = display_channel;
+     lz_data->data.display_channel = jpeg_data->data.display_channel;
 
      lz_data->data.u.lines_data.chunks = src->data;
      lz_data->data.u.lines_data.stride = src->stride;
@@ -5610,18 +6082,19 @@ static int red_jpeg_compress_image(DisplayChannel *display_channel, SpiceImage *
     o_comp_data->comp_buf = jpeg_data->data.bufs_head;
     o_comp_data->comp_buf_size = jpeg_size + alpha_lz_size;
     o_comp_data->is_lossy = TRUE;
-    stat_compress_add(&display_channel->jpeg_alpha_stat, start_time, src->stride * src->y,
-                      o_comp_data->comp_buf_size);
+    if (!enc->private_bufs) {
+        stat_compress_add(&display_channel->jpeg_alpha_stat, start_time, src->stride * src->y,
+                          o_comp_data->comp_buf_size);
+    }
     return TRUE;
 }
 
-static inline int red_quic_compress_image(DisplayChannel *display_channel, SpiceImage *dest,
-                                          SpiceBitmap *src, compress_send_data_t* o_comp_data,
-                                          uint32_t group_id)
+static inline int red_quic_compress_image(DisplayChannel *display_channel, ImageEncoders *enc,
+                                          SpiceImage *dest, SpiceBitmap *src,
+                                          compress_send_data_t* o_comp_data, uint32_t group_id)
 {
-    RedWorker *worker = display_channel->base.worker;
-    QuicData *quic_data = &worker->quic_data;
-    QuicContext *quic = worker->quic;
+    QuicData *quic_data = &enc->quic_data;
+    QuicContext *quic = enc->quic;
     QuicImageType type;
     int size, stride;
 
@@ -5646,7 +6119,8 @@ static inline int red_quic_compress_image(DisplayChannel *display_channel, Spice
         return FALSE;
     }
 
-    quic_data->data.bufs_tail = red_display_alloc_compress_buf(display_channel);
+    quic_data->data.display_channel = enc->private_bufs ? NULL : display_channel;
+    quic_data->data.bufs_tail = encoder_data_alloc_compress_buf(&quic_data->data);
     quic_data->data.bufs_head = quic_data->data.bufs_tail;
 
     if (!quic_data->data.bufs_head) {
@@ -5654,14 +6128,9 @@ static inline int red_quic_compress_image(DisplayChannel *display_channel, Spice
     }
 
     quic_data->data.bufs_head->send_next = NULL;
-    quic_data->data.display_channel = display_channel;
 
     if (setjmp(quic_data->data.jmp_env)) {
-        while (quic_data->data.bufs_head) {
-            RedCompressBuf *buf = quic_data->data.bufs_head;
-            quic_data->data.bufs_head = buf->send_next;
-            red_display_free_compress_buf(display_channel, buf);
-        }
+        encoder_data_free_compress_bufs(&quic_data->data);
         return FALSE;
     }
 
@@ -5696,17 +6165,26 @@ static inline int red_quic_compress_image(DisplayChannel *display_channel, Spice
     o_comp_data->comp_buf = quic_data->data.bufs_head;
     o_comp_data->comp_buf_size = size << 2;
 
-    stat_compress_add(&display_channel->quic_stat, start_time, src->stride * src->y,
-                      o_comp_data->comp_buf_size);
+    if (!enc->private_bufs) {
+        stat_compress_add(&display_channel->quic_stat, start_time, src->stride * src->y,
+                          o_comp_data->comp_buf_size);
+    }
     return TRUE;
 }
 
+typedef enum {
+    IMAGE_COMPRESS_METHOD_NONE,
+    IMAGE_COMPRESS_METHOD_QUIC,
+    IMAGE_COMPRESS_METHOD_JPEG,
+    IMAGE_COMPRESS_METHOD_LZ,
+    IMAGE_COMPRESS_METHOD_GLZ,
+} ImageCompressMethod;
+
 #define MIN_SIZE_TO_COMPRESS 54
 #define MIN_DIMENSION_TO_QUIC 3
-static inline int red_compress_image(DisplayChannel *display_channel,
-                                     SpiceImage *dest, SpiceBitmap *src, Drawable *drawable,
-                                     int can_lossy,
-                                     compress_send_data_t* o_comp_data)
+static ImageCompressMethod red_get_image_compress_method(DisplayChannel *display_channel,
+                                                         SpiceBitmap *src, Drawable *drawable,
+                                                         int can_lossy)
 {
     spice_image_compression_t image_compression =
         display_channel->base.worker->image_compression;
@@ -5714,10 +6192,10 @@ static inline int red_compress_image(DisplayChannel *display_channel,
 
     if ((image_compression == SPICE_IMAGE_COMPRESS_OFF) ||
         ((src->y * src->stride) < MIN_SIZE_TO_COMPRESS)) { // TODO: change the size cond
-        return FALSE;
+        return IMAGE_COMPRESS_METHOD_NONE;
     } else if (image_compression == SPICE_IMAGE_COMPRESS_QUIC) {
         if (BITMAP_FMT_IS_PLT[src->format]) {
-            return FALSE;
+            return IMAGE_COMPRESS_METHOD_NONE;
         } else {
             quic_compress = TRUE;
         }
@@ -5730,7 +6208,7 @@ static inline int red_compress_image(DisplayChannel *display_channel,
             if ((image_compression == SPICE_IMAGE_COMPRESS_LZ) ||
                 (image_compression == SPICE_IMAGE_COMPRESS_GLZ) ||
                 BITMAP_FMT_IS_PLT[src->format]) {
-                return FALSE;
+                return IMAGE_COMPRESS_METHOD_NONE;
             } else {
                 quic_compress = TRUE;
             }
@@ -5755,63 +6233,387 @@ static inline int red_compress_image(DisplayChannel *display_channel,
     }
 
     if (quic_compress) {
-#ifdef COMPRESS_DEBUG
-        red_printf("QUIC compress");
-#endif
         // if bitmaps is picture-like, compress it using jpeg
         if (can_lossy && display_channel->enable_jpeg &&
             ((image_compression == SPICE_IMAGE_COMPRESS_AUTO_LZ) ||
             (image_compression == SPICE_IMAGE_COMPRESS_AUTO_GLZ))) {
             // if we use lz for alpha, the stride can't be extra 
             if (src->format != SPICE_BITMAP_FMT_RGBA || !_stride_is_extra(src)) {
-                return red_jpeg_compress_image(display_channel, dest,
-                                               src, o_comp_data, drawable->group_id);
+                return IMAGE_COMPRESS_METHOD_JPEG;
             }
         }
-        return red_quic_compress_image(display_channel, dest,
-                                       src, o_comp_data, drawable->group_id);
-    } else {
-        int glz;
-        int ret;
-        if ((image_compression == SPICE_IMAGE_COMPRESS_AUTO_GLZ) ||
-            (image_compression == SPICE_IMAGE_COMPRESS_GLZ)) {
-            glz = BITMAP_FMT_IS_RGB[src->format] && (
-                    (src->x * src->y) < glz_enc_dictionary_get_size(
-                        display_channel->glz_dict->dict));
-        } else if ((image_compression == SPICE_IMAGE_COMPRESS_AUTO_LZ) ||
-                   (image_compression == SPICE_IMAGE_COMPRESS_LZ)) {
-            glz = FALSE;
-        } else {
-            red_error("invalid image compression type %u", image_compression);
-        }
+        return IMAGE_COMPRESS_METHOD_QUIC;
+    }
 
-        if (glz) {
-            /* using the global dictionary only if it is not freezed */
-            pthread_rwlock_rdlock(&display_channel->glz_dict->encode_lock);
-            if (!display_channel->glz_dict->migrate_freeze) {
-                ret = red_glz_compress_image(display_channel,
-                                             dest, src,
-                                             drawable, o_comp_data);
-            } else {
-                glz = FALSE;
-            }
-            pthread_rwlock_unlock(&display_channel->glz_dict->encode_lock);
+    if ((image_compression == SPICE_IMAGE_COMPRESS_AUTO_GLZ) ||
+        (image_compression == SPICE_IMAGE_COMPRESS_GLZ)) {
+        if (BITMAP_FMT_IS_RGB[src->format] &&
+            ((src->x * src->y) < glz_enc_dictionary_get_size(display_channel->glz_dict->dict))) {
+            return IMAGE_COMPRESS_METHOD_GLZ;
         }
+    } else if ((image_compression != SPICE_IMAGE_COMPRESS_AUTO_LZ) &&
+               (image_compression != SPICE_IMAGE_COMPRESS_LZ)) {
+        red_error("invalid image compression type %u", image_compression);
+    }
+    return IMAGE_COMPRESS_METHOD_LZ;
+}
+
+static inline int red_compress_image(DisplayChannel *display_channel,
+                                     SpiceImage *dest, SpiceBitmap *src, Drawable *drawable,
+                                     int can_lossy,
+                                     compress_send_data_t* o_comp_data)
+{
+    ImageEncoders *enc = &display_channel->base.worker->encoders;
+    int ret;
 
-        if (!glz) {
-            ret = red_lz_compress_image(display_channel, dest, src, o_comp_data,
-                                        drawable->group_id);
+    switch (red_get_image_compress_method(display_channel, src, drawable, can_lossy)) {
+    case IMAGE_COMPRESS_METHOD_JPEG:
 #ifdef COMPRESS_DEBUG
-            red_printf("LZ LOCAL compress");
+        red_printf("QUIC compress");
 #endif
-        }
+        return red_jpeg_compress_image(display_channel, enc, dest,
+                                       src, o_comp_data, drawable->group_id);
+    case IMAGE_COMPRESS_METHOD_QUIC:
+#ifdef COMPRESS_DEBUG
+        red_printf("QUIC compress");
+#endif
+        return red_quic_compress_image(display_channel, enc, dest,
+                                       src, o_comp_data, drawable->group_id);
+    case IMAGE_COMPRESS_METHOD_GLZ: {
+        int glz = FALSE;
+
+        /* using the global dictionary only if it is not freezed */
+        pthread_rwlock_rdlock(&display_channel->glz_dict->encode_lock);
+        if (!display_channel->glz_dict->migrate_freeze) {
+            ret = red_glz_compress_image(display_channel,
+                                         dest, src,
+                                         drawable, o_comp_data);
+            glz = TRUE;
+        }
+        pthread_rwlock_unlock(&display_channel->glz_dict->encode_lock);
+        if (glz) {
 #ifdef COMPRESS_DEBUG
-        else {
             red_printf("LZ global compress fmt=%d", src->format);
+#endif
+            return ret;
         }
+        // fall through
+    }
+    case IMAGE_COMPRESS_METHOD_LZ:
+        ret = red_lz_compress_image(display_channel, enc, dest, src, o_comp_data,
+                                    drawable->group_id);
+#ifdef COMPRESS_DEBUG
+        red_printf("LZ LOCAL compress");
 #endif
         return ret;
+    default:
+        return FALSE;
+    }
+}
+
+/******************************************************
+ *              Image compression threads
+ ******************************************************/
+
+/* Bitmaps of drawables that are about to be sent are compressed ahead of time by a pool of
+   threads, while the worker keeps sending the pipe. The messages are still marshalled by the
+   worker in pipe order, it just picks up the already compressed data in fill_bits.
+   Only the per image encoders (quic, jpeg and lz of rgb bitmaps) are used by the pool. Glz
+   must encode the images in the order they are sent, and lz of palette bitmaps updates the
+   palette cache, so both are still done by the worker.
+   NOTE - images compressed by the pool are not accounted by COMPRESS_STAT */
+
+#define COMPRESS_LOOKAHEAD_PER_THREAD 2
+
+enum {
+    COMPRESS_JOB_QUEUED,
+    COMPRESS_JOB_RUNNING,
+    COMPRESS_JOB_DONE,
+};
+
+struct CompressJob {
+    RingItem link;
+    int state;
+
+    DisplayChannel *display_channel;
+    SpiceImage *simage;
+    uint32_t group_id;
+    ImageCompressMethod method;
+
+    /* the method was chosen according to these */
+    spice_image_compression_t image_compression;
+    int enable_jpeg;
+    int can_lossy;
+
+    int succeeded;
+    SpiceImage dest;
+    compress_send_data_t comp_send_data;
+};
+
+typedef struct CompressThread {
+    pthread_t thread;
+    CompressPool *pool;
+    ImageEncoders encoders;
+} CompressThread;
+
+struct CompressPool {
+    pthread_mutex_t lock;
+    pthread_cond_t job_cond;
+    pthread_cond_t done_cond;
+    Ring jobs;
+    uint32_t lookahead;
+    uint32_t num_threads;
+    CompressThread threads[RED_MAX_COMPRESS_THREADS];
+};
+
+static void compress_job_run(CompressJob *job, ImageEncoders *enc)
+{
+    SpiceBitmap *src = &job->simage->u.bitmap;
+    uint64_t start_time = red_now();
+
+    switch (job->method) {
+    case IMAGE_COMPRESS_METHOD_JPEG:
+        job->succeeded = red_jpeg_compress_image(job->display_channel, enc, &job->dest, src,
+                                                 &job->comp_send_data, job->group_id);
+        break;
+    case IMAGE_COMPRESS_METHOD_QUIC:
+        job->succeeded = red_quic_compress_image(job->display_channel, enc, &job->dest, src,
+                                                 &job->comp_send_data, job->group_id);
+        break;
+    case IMAGE_COMPRESS_METHOD_LZ:
+        job->succeeded = red_lz_compress_image(job->display_channel, enc, &job->dest, src,
+                                               &job->comp_send_data, job->group_id);
+        break;
+    default:
+        red_error("invalid compress method %u", job->method);
+    }
+    job->comp_send_data.encode_time = red_now() - start_time;
+}
+
+static void *compress_thread_main(void *arg)
+{
+    CompressThread *thread = (CompressThread *)arg;
+    CompressPool *pool = thread->pool;
+
+    for (;;) {
+        CompressJob *job;
+
+        pthread_mutex_lock(&pool->lock);
+        while (!(job = (CompressJob *)ring_get_tail(&pool->jobs))) {
+            pthread_cond_wait(&pool->job_cond, &pool->lock);
+        }
+        ring_remove(&job->link);
+        job->state = COMPRESS_JOB_RUNNING;
+        pthread_mutex_unlock(&pool->lock);
+
+        compress_job_run(job, &thread->encoders);
+
+        pthread_mutex_lock(&pool->lock);
+        job->state = COMPRESS_JOB_DONE;
+        pthread_cond_broadcast(&pool->done_cond);
+        pthread_mutex_unlock(&pool->lock);
+    }
+    return NULL;
+}
+
+static void red_init_compress_pool(RedWorker *worker, uint32_t num_threads)
+{
+    CompressPool *pool;
+    int i;
+
+    worker->compress_pool = NULL;
+    if (!num_threads) {
+        return;
+    }
+    ASSERT(num_threads <= RED_MAX_COMPRESS_THREADS);
+
+    pool = spice_new0(CompressPool, 1);
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->job_cond, NULL);
+    pthread_cond_init(&pool->done_cond, NULL);
+    ring_init(&pool->jobs);
+    pool->num_threads = num_threads;
+    pool->lookahead = num_threads * COMPRESS_LOOKAHEAD_PER_THREAD;
+
+    for (i = 0; i < num_threads; i++) {
+        CompressThread *thread = &pool->threads[i];
+        int r;
+
+        thread->pool = pool;
+        red_init_image_encoders(&thread->encoders, TRUE);
+        if ((r = pthread_create(&thread->thread, NULL, compress_thread_main, thread))) {
+            red_error("create compress thread failed %d", r);
+        }
+    }
+    worker->compress_pool = pool;
+}
+
+static void compress_job_wait(CompressPool *pool, CompressJob *job)
+{
+    pthread_mutex_lock(&pool->lock);
+    while (job->state != COMPRESS_JOB_DONE) {
+        pthread_cond_wait(&pool->done_cond, &pool->lock);
+    }
+    pthread_mutex_unlock(&pool->lock);
+}
+
+static void red_drawable_drop_compress_job(RedWorker *worker, Drawable *drawable)
+{
+    CompressPool *pool = worker->compress_pool;
+    CompressJob *job = drawable->compress_job;
+
+    if (!job) {
+        return;
+    }
+    drawable->compress_job = NULL;
+
+    pthread_mutex_lock(&pool->lock);
+    if (job->state == COMPRESS_JOB_QUEUED) {
+        ring_remove(&job->link);
+        job->state = COMPRESS_JOB_DONE;
+        job->succeeded = FALSE;
+    }
+    pthread_mutex_unlock(&pool->lock);
+    compress_job_wait(pool, job);
+
+    if (job->succeeded) {
+        RedCompressBuf *buf = job->comp_send_data.comp_buf;
+        while (buf) {
+            RedCompressBuf *next = buf->send_next;
+            free(buf);
+            buf = next;
+        }
+    }
+    free(job);
+}
+
+static void red_compress_pool_add_job(RedWorker *worker, Drawable *drawable)
+{
+    DisplayChannel *display_channel = worker->display_channel;
+    CompressPool *pool = worker->compress_pool;
+    RedDrawable *red_drawable = drawable->red_drawable;
+    SpiceImage *simage;
+    SpiceBitmap *src;
+    ImageCompressMethod method;
+    CompressJob *job;
+
+    if (drawable->stream || red_drawable->type != QXL_DRAW_COPY) {
+        return;
+    }
+
+    simage = red_drawable->u.copy.src_bitmap;
+    if (!simage || simage->descriptor.type != SPICE_IMAGE_TYPE_BITMAP) {
+        return;
+    }
+
+    src = &simage->u.bitmap;
+    if (!BITMAP_FMT_IS_RGB[src->format]) {
+        return;
+    }
+
+    if ((simage->descriptor.flags & SPICE_IMAGE_FLAGS_CACHE_ME) &&
+        pixmap_cache_contains(display_channel->pixmap_cache, simage->descriptor.id)) {
+        return;
+    }
+
+    // red_send_qxl_draw_copy allows lossy compression of the source only in jpeg mode
+    method = red_get_image_compress_method(display_channel, src, drawable,
+                                           display_channel->enable_jpeg);
+    if (method != IMAGE_COMPRESS_METHOD_QUIC && method != IMAGE_COMPRESS_METHOD_JPEG &&
+        method != IMAGE_COMPRESS_METHOD_LZ) {
+        return;
+    }
+
+    // an unstable bitmap may still point into guest memory, which the guest may modify
+    // while a pool thread reads it, so it is compressed by the worker when it is sent
+    if (src->data->flags & SPICE_CHUNKS_FLAGS_UNSTABLE) {
+        return;
+    }
+
+    job = spice_new0(CompressJob, 1);
+    ring_item_init(&job->link);
+    job->state = COMPRESS_JOB_QUEUED;
+    job->display_channel = display_channel;
+    job->simage = simage;
+    job->group_id = drawable->group_id;
+    job->method = method;
+    job->image_compression = worker->image_compression;
+    job->enable_jpeg = display_channel->enable_jpeg;
+    job->can_lossy = display_channel->enable_jpeg;
+    job->dest.descriptor = simage->descriptor;
+    drawable->compress_job = job;
+
+    pthread_mutex_lock(&pool->lock);
+    ring_add(&pool->jobs, &job->link);
+    pthread_cond_signal(&pool->job_cond);
+    pthread_mutex_unlock(&pool->lock);
+}
+
+/* submits the bitmaps of the drawables that will be sent next */
+static void red_compress_pool_prefetch(RedWorker *worker)
+{
+    Ring *pipe;
+    RingItem *link;
+    uint32_t n;
+
+    if (!worker->compress_pool || !worker->display_channel) {
+        return;
+    }
+
+    pipe = &worker->display_channel->base.pipe;
+    for (link = ring_get_tail(pipe), n = 0; link && n < worker->compress_pool->lookahead;
+         link = ring_prev(pipe, link), n++) {
+        PipeItem *pipe_item = (PipeItem *)link;
+        Drawable *drawable;
+
+        if (pipe_item->type != PIPE_ITEM_TYPE_DRAW) {
+            continue;
+        }
+        drawable = SPICE_CONTAINEROF(pipe_item, Drawable, pipe_item);
+        if (drawable->compress_prefetched) {
+            continue;
+        }
+        drawable->compress_prefetched = TRUE;
+        red_compress_pool_add_job(worker, drawable);
+    }
+}
+
+/* returns -1 if the image wasn't compressed by the pool with the same parameters */
+static int red_compress_image_by_pool(DisplayChannel *display_channel, SpiceImage *dest,
+                                      SpiceImage *simage, Drawable *drawable, int can_lossy,
+                                      compress_send_data_t* o_comp_data)
+{
+    RedWorker *worker = display_channel->base.worker;
+    CompressJob *job = drawable->compress_job;
+    RedCompressBuf *buf;
+    int ret;
+
+    if (!job || job->simage != simage || job->can_lossy != can_lossy ||
+        job->image_compression != worker->image_compression ||
+        job->enable_jpeg != display_channel->enable_jpeg) {
+        return -1;
     }
+
+    compress_job_wait(worker->compress_pool, job);
+    drawable->compress_job = NULL;
+
+    ret = job->succeeded;
+    if (ret) {
+        dest->descriptor.type = job->dest.descriptor.type;
+        dest->u = job->dest.u;
+        *o_comp_data = job->comp_send_data;
+
+        // from now on the bufs are released with the other bufs of the message. They were
+        // allocated by a pool thread, so they go back to the heap rather than to the free list
+        for (buf = o_comp_data->comp_buf; buf; buf = buf->send_next) {
+            buf->next = display_channel->send_data.pool_compress_bufs;
+            display_channel->send_data.pool_compress_bufs = buf;
+        }
+    } else {
+        o_comp_data->encode_time = job->comp_send_data.encode_time;
+    }
+    free(job);
+    return ret;
 }
 
 static inline void red_display_add_image_to_pixmap_cache(DisplayChannel *display_channel,
@@ -5835,6 +6637,39 @@ static inline void red_display_add_image_to_pixmap_cache(DisplayChannel *display
     }
 }
 
+#ifdef RED_STATISTICS
+static inline void red_codec_stat_add(CodecStat *codec_stat, uint64_t raw_size,
+                                      uint64_t comp_size, uint64_t time)
+{
+    stat_inc_counter(codec_stat->images_counter, 1);
+    stat_inc_counter(codec_stat->raw_bytes_counter, raw_size);
+    stat_inc_counter(codec_stat->comp_bytes_counter, comp_size);
+    stat_inc_counter(codec_stat->time_counter, time);
+    stat_histogram_add(&codec_stat->time_hist, time);
+}
+
+static inline CodecStatType red_codec_stat_type(uint8_t image_type)
+{
+    switch (image_type) {
+    case SPICE_IMAGE_TYPE_QUIC:
+        return CODEC_STAT_QUIC;
+    case SPICE_IMAGE_TYPE_LZ_RGB:
+    case SPICE_IMAGE_TYPE_LZ_PLT:
+        return CODEC_STAT_LZ;
+    case SPICE_IMAGE_TYPE_GLZ_RGB:
+        return CODEC_STAT_GLZ;
+    case SPICE_IMAGE_TYPE_ZLIB_GLZ_RGB:
+        return CODEC_STAT_ZLIB_GLZ;
+    case SPICE_IMAGE_TYPE_JPEG:
+        return CODEC_STAT_JPEG;
+    case SPICE_IMAGE_TYPE_JPEG_ALPHA:
+        return CODEC_STAT_JPEG_ALPHA;
+    default:
+        return CODEC_STAT_BITMAP;
+    }
+}
+#endif
+
 typedef enum {
     FILL_BITS_TYPE_INVALID,
     FILL_BITS_TYPE_CACHE,
@@ -5912,14 +6747,42 @@ static FillBitsType fill_bits(DisplayChannel *display_channel, SpiceMarshaller *
     }
     case SPICE_IMAGE_TYPE_BITMAP: {
         SpiceBitmap *bitmap = &image.u.bitmap;
+        int comp_succeeded;
+        uint64_t raw_size = (uint64_t)simage->u.bitmap.stride * simage->u.bitmap.y;
+        uint64_t comp_size;
 #ifdef DUMP_BITMAP
         dump_bitmap(display_channel->base.worker, &simage->u.bitmap, drawable->group_id);
 #endif
         /* Images must be added to the cache only after they are compressed
            in order to prevent starvation in the client between pixmap_cache and
            global dictionary (in cases of multiple monitors) */
-        if (!red_compress_image(display_channel, &image, &simage->u.bitmap,
-                                drawable, can_lossy, &comp_send_data)) {
+        comp_succeeded = red_compress_image_by_pool(display_channel, &image, simage, drawable,
+                                                    can_lossy, &comp_send_data);
+        if (comp_succeeded == -1) {
+            uint64_t start_time = red_now();
+
+            comp_succeeded = red_compress_image(display_channel, &image, &simage->u.bitmap,
+                                                drawable, can_lossy, &comp_send_data);
+            comp_send_data.encode_time = red_now() - start_time;
+        }
+        comp_size = comp_succeeded ? comp_send_data.comp_buf_size : raw_size;
+#ifdef RED_STATISTICS
+        red_codec_stat_add(&display_channel->codec_stat[comp_succeeded ?
+                               red_codec_stat_type(image.descriptor.type) : CODEC_STAT_BITMAP],
+                           raw_size, comp_size, comp_send_data.encode_time);
+#endif
+        if (worker->record) {
+            RedRecordImage record_image;
+
+            record_image.image_type = comp_succeeded ? image.descriptor.type :
+                                                       SPICE_IMAGE_TYPE_BITMAP;
+            record_image.lossy = comp_succeeded && comp_send_data.is_lossy;
+            record_image.raw_size = raw_size;
+            record_image.comp_size = comp_size;
+            record_image.encode_time = comp_send_data.encode_time;
+            red_record_image(worker->record, &record_image);
+        }
+        if (!comp_succeeded) {
             uint32_t y;
             uint32_t stride;
             SpicePalette *palette;
@@ -6053,6 +6916,7 @@ static inline void red_channel_reset_send_data(RedChannel *channel)
         spice_marshaller_reserve_space(channel->send_data.marshaller, sizeof(SpiceDataHeader));
     spice_marshaller_set_base(channel->send_data.marshaller, sizeof(SpiceDataHeader));
     channel->send_data.pos = 0;
+    channel->send_data.size = 0;
     channel->send_data.header->type = 0;
     channel->send_data.header->size = 0;
     channel->send_data.header->sub_list = 0;
@@ -7320,28 +8184,44 @@ static void inline channel_release_res(RedChannel *channel)
     channel->send_data.item = NULL;
 }
 
+/* blocked_count counts the times the channel became blocked, not the failed retries */
+static inline void red_channel_set_blocked(RedChannel *channel)
+{
+    if (!channel->send_data.blocked) {
+        channel->send_data.blocked = TRUE;
+        channel->send_data.blocked_count++;
+    }
+}
+
 static void red_send_data(RedChannel *channel, void *item)
 {
     for (;;) {
-        uint32_t n = channel->send_data.size - channel->send_data.pos;
+        uint32_t batched = channel->send_data.batch_size - channel->send_data.batch_pos;
+        uint32_t n = batched + channel->send_data.size - channel->send_data.pos;
         struct iovec vec[MAX_SEND_VEC];
-        int vec_size;
+        int vec_size = 0;
 
         if (!n) {
             channel->send_data.blocked = FALSE;
+            channel->send_data.batch_size = channel->send_data.batch_pos = 0;
             if (channel->send_data.item) {
                 channel->release_item(channel, channel->send_data.item);
                 channel->send_data.item = NULL;
             }
             break;
         }
-        vec_size = spice_marshaller_fill_iovec(channel->send_data.marshaller,
-                                               vec, MAX_SEND_VEC, channel->send_data.pos);
+        if (batched) {
+            vec[0].iov_base = channel->send_data.batch + channel->send_data.batch_pos;
+            vec[0].iov_len = batched;
+            vec_size = 1;
+        }
+        vec_size += spice_marshaller_fill_iovec(channel->send_data.marshaller, vec + vec_size,
+                                                MAX_SEND_VEC - vec_size, channel->send_data.pos);
         ASSERT(channel->peer);
         if ((n = channel->peer->cb_writev(channel->peer->ctx, vec, vec_size)) == -1) {
             switch (errno) {
             case EAGAIN:
-                channel->send_data.blocked = TRUE;
+                red_channel_set_blocked(channel);
                 if (item) {
                     channel->hold_item(item);
                     channel->send_data.item = item;
@@ -7358,12 +8238,66 @@ static void red_send_data(RedChannel *channel, void *item)
                 return;
             }
         } else {
-            channel->send_data.pos += n;
             stat_inc_counter(channel->out_bytes_counter, n);
+            stat_inc_counter(channel->out_writes_counter, 1);
+            batched = MIN(batched, n);
+            channel->send_data.batch_pos += batched;
+            channel->send_data.pos += n - batched;
         }
     }
 }
 
+/* copies the current message to the batch buffer. The message is then considered sent, and
+   the item it belongs to needn't be held. */
+static inline int red_batch_message(RedChannel *channel)
+{
+    struct iovec vec[MAX_SEND_VEC];
+    uint8_t *now = channel->send_data.batch + channel->send_data.batch_size;
+    int vec_size;
+    int i;
+
+    if (!channel->send_data.batching || channel->send_data.blocked ||
+        channel->send_data.size > SEND_BATCH_MAX_MESSAGE ||
+        channel->send_data.batch_size + channel->send_data.size > SEND_BATCH_SIZE) {
+        return FALSE;
+    }
+    vec_size = spice_marshaller_fill_iovec(channel->send_data.marshaller, vec, MAX_SEND_VEC, 0);
+    for (i = 0; i < vec_size; i++) {
+        memcpy(now, vec[i].iov_base, vec[i].iov_len);
+        now += vec[i].iov_len;
+    }
+    if (now - channel->send_data.batch - channel->send_data.batch_size !=
+                                                                channel->send_data.size) {
+        return FALSE; // more chunks than MAX_SEND_VEC, nothing was committed
+    }
+    channel->send_data.batch_size += channel->send_data.size;
+    channel->send_data.pos = channel->send_data.size;
+    return TRUE;
+}
+
+static inline void red_channel_begin_batch(RedChannel *channel)
+{
+    if (!channel) {
+        return;
+    }
+    channel->send_data.batching = TRUE;
+    stat_inc_counter(channel->push_counter, 1);
+    stat_inc_counter(channel->pipe_depth_counter, channel->pipe_size);
+    stat_set_counter(channel->pipe_size_counter, channel->pipe_size);
+}
+
+/* writes the messages that were batched during the push */
+static inline void red_channel_end_batch(RedChannel *channel)
+{
+    if (!channel) {
+        return;
+    }
+    channel->send_data.batching = FALSE;
+    if (channel->send_data.batch_size != channel->send_data.batch_pos) {
+        red_send_data(channel, NULL);
+    }
+}
+
 static void display_channel_push_release(DisplayChannel *channel, uint8_t type, uint64_t id,
                                          uint64_t* sync_data)
 {
@@ -7388,14 +8322,65 @@ static void display_channel_push_release(DisplayChannel *channel, uint8_t type,
     free_list->res->resources[free_list->res->count++].id = id;
 }
 
+/* the client acks every client_ack_window messages, remember when each window
+   was completed in order to measure the ack latency */
+static inline void red_ack_window_sent(RedChannel *channel)
+{
+    uint32_t tail;
+
+    if (channel->ack_data.count == ACK_TIMES_SIZE) {
+        channel->ack_data.head = (channel->ack_data.head + 1) % ACK_TIMES_SIZE;
+        channel->ack_data.count--;
+    }
+    tail = (channel->ack_data.head + channel->ack_data.count++) % ACK_TIMES_SIZE;
+    channel->ack_data.window_time[tail] = red_now();
+}
+
+static inline void red_ack_received(RedChannel *channel)
+{
+    uint64_t latency;
+
+    if (!channel->ack_data.count) {
+        return;
+    }
+    latency = red_now() - channel->ack_data.window_time[channel->ack_data.head];
+    channel->ack_data.head = (channel->ack_data.head + 1) % ACK_TIMES_SIZE;
+    channel->ack_data.count--;
+    if (!channel->ack_data.min_latency || latency < channel->ack_data.min_latency) {
+        channel->ack_data.min_latency = latency;
+    }
+    channel->ack_data.latency = channel->ack_data.latency ?
+                                (channel->ack_data.latency * 7 + latency) / 8 : latency;
+    stat_set_counter(channel->ack_latency_counter, channel->ack_data.latency);
+    stat_histogram_add(&channel->ack_latency_hist, latency);
+}
+
+static inline void red_ack_reset(RedChannel *channel)
+{
+    channel->ack_data.head = channel->ack_data.count = 0;
+    channel->ack_data.latency = 0;
+}
+
 static inline void red_begin_send_message(RedChannel *channel, void *item)
 {
     spice_marshaller_flush(channel->send_data.marshaller);
     channel->send_data.size = spice_marshaller_get_total_size(channel->send_data.marshaller);
     channel->send_data.header->size =  channel->send_data.size - sizeof(SpiceDataHeader);
-    channel->messages_window++;
+    if (channel->worker->record) {
+        red_record_message(channel->worker->record,
+                           (channel == (RedChannel *)channel->worker->cursor_channel) ?
+                           SPICE_CHANNEL_CURSOR : SPICE_CHANNEL_DISPLAY,
+                           channel->id, channel->send_data.marshaller);
+    }
+    if (++channel->messages_window % channel->client_ack_window == 0) {
+        red_ack_window_sent(channel);
+    }
     channel->send_data.header = NULL; /* avoid writing to this until we have a new message */
-    red_send_data(channel, item);
+    channel->send_data.queued_bytes += channel->send_data.size;
+    stat_inc_counter(channel->out_messages_counter, 1);
+    if (!red_batch_message(channel)) {
+        red_send_data(channel, item);
+    }
 }
 
 static inline void display_begin_send_message(DisplayChannel *channel, void *item)
@@ -7462,6 +8447,7 @@ static inline void red_unref_channel(RedChannel *channel)
     ASSERT(channel);
     if (!--channel->listener.refs) {
         spice_marshaller_destroy(channel->send_data.marshaller);
+        free(channel->send_data.batch);
         free(channel);
     }
 }
@@ -7666,6 +8652,7 @@ static inline int red_send_stream_data(DisplayChannel *display_channel, Drawable
     uint64_t time_now = red_now();
     if (time_now - agent->lats_send_time < (1000 * 1000 * 1000) / agent->fps) {
         agent->frames--;
+        stat_inc_counter(display_channel->stream_skips_counter, 1);
         return TRUE;
     }
 
@@ -7726,8 +8713,16 @@ static inline int red_send_stream_data(DisplayChannel *display_channel, Drawable
     spice_marshaller_add_ref(channel->send_data.marshaller,
                              display_channel->send_data.stream_outbuf, n);
 
+#ifdef RED_STATISTICS
+    red_codec_stat_add(&display_channel->codec_stat[CODEC_STAT_MJPEG],
+                       (uint64_t)frame_stride * (drawable->red_drawable->u.copy.src_area.bottom -
+                                                 drawable->red_drawable->u.copy.src_area.top),
+                       n, red_now() - time_now);
+#endif
+
     display_begin_send_message(display_channel, NULL);
     agent->lats_send_time = time_now;
+    agent->interval_bytes += n;
     return TRUE;
 }
 
@@ -7756,6 +8751,7 @@ static void red_send_set_ack(RedChannel *channel)
     ack.generation = ++channel->ack_generation;
     ack.window = channel->client_ack_window;
     channel->messages_window = 0;
+    red_ack_reset(channel);
 
     spice_marshall_msg_set_ack(channel->send_data.marshaller, &ack);
 
@@ -7969,17 +8965,17 @@ static void red_send_image(DisplayChannel *display_channel, ImageItem *item)
     }
 
     if (lossy_comp) {
-        comp_succeeded = red_jpeg_compress_image(display_channel, &red_image,
-                                                 &bitmap, &comp_send_data,
+        comp_succeeded = red_jpeg_compress_image(display_channel, &worker->encoders,
+                                                 &red_image, &bitmap, &comp_send_data,
                                                  worker->mem_slots.internal_groupslot_id);
     } else {
         if (!lz_comp) {
-            comp_succeeded = red_quic_compress_image(display_channel, &red_image, &bitmap,
-                                                     &comp_send_data,
+            comp_succeeded = red_quic_compress_image(display_channel, &worker->encoders,
+                                                     &red_image, &bitmap, &comp_send_data,
                                                      worker->mem_slots.internal_groupslot_id);
         } else {
-            comp_succeeded = red_lz_compress_image(display_channel, &red_image, &bitmap,
-                                                   &comp_send_data,
+            comp_succeeded = red_lz_compress_image(display_channel, &worker->encoders,
+                                                   &red_image, &bitmap, &comp_send_data,
                                                    worker->mem_slots.internal_groupslot_id);
         }
     }
@@ -8286,7 +9282,7 @@ static inline PipeItem *red_pipe_get(RedChannel *channel)
     }
 
     if (channel->messages_window > channel->client_ack_window * 2) {
-        channel->send_data.blocked = TRUE;
+        red_channel_set_blocked(channel);
         return NULL;
     }
 
@@ -8295,18 +9291,25 @@ static inline PipeItem *red_pipe_get(RedChannel *channel)
     return item;
 }
 
-static void display_channel_push(RedWorker *worker)
+/* returns TRUE if it stopped because the budget was used up */
+static int display_channel_push_budget(RedWorker *worker, uint64_t budget)
 {
     PipeItem *pipe_item;
+    uint64_t pushed = 0;
 
-    while ((pipe_item = red_pipe_get((RedChannel *)worker->display_channel))) {
+    red_channel_begin_batch((RedChannel *)worker->display_channel);
+    while (pushed < budget && (pipe_item = red_pipe_get((RedChannel *)worker->display_channel))) {
         DisplayChannel *display_channel;
+        uint64_t queued_bytes;
+        red_compress_pool_prefetch(worker);
         display_channel = (DisplayChannel *)red_ref_channel((RedChannel *)worker->display_channel);
+        queued_bytes = display_channel->base.send_data.queued_bytes;
         red_display_reset_send_data(display_channel);
         switch (pipe_item->type) {
         case PIPE_ITEM_TYPE_DRAW: {
             Drawable *drawable = SPICE_CONTAINEROF(pipe_item, Drawable, pipe_item);
             send_qxl_drawable(display_channel, drawable);
+            red_drawable_drop_compress_job(worker, drawable);
             release_drawable(worker, drawable);
             break;
         }
@@ -8387,18 +9390,31 @@ static void display_channel_push(RedWorker *worker)
         default:
             red_error("invalid pipe item type");
         }
+        pushed += display_channel->base.send_data.queued_bytes - queued_bytes;
         red_unref_channel((RedChannel *)display_channel);
     }
+    red_channel_end_batch((RedChannel *)worker->display_channel);
+    return pushed >= budget;
 }
 
-static void cursor_channel_push(RedWorker *worker)
+static void display_channel_push(RedWorker *worker)
+{
+    display_channel_push_budget(worker, ~(uint64_t)0);
+}
+
+/* returns TRUE if it stopped because the budget was used up */
+static int cursor_channel_push_budget(RedWorker *worker, uint64_t budget)
 {
     PipeItem *pipe_item;
+    uint64_t pushed = 0;
 
-    while ((pipe_item = red_pipe_get((RedChannel *)worker->cursor_channel))) {
+    red_channel_begin_batch((RedChannel *)worker->cursor_channel);
+    while (pushed < budget && (pipe_item = red_pipe_get((RedChannel *)worker->cursor_channel))) {
         CursorChannel *cursor_channel;
+        uint64_t queued_bytes;
 
         cursor_channel = (CursorChannel *)red_ref_channel((RedChannel *)worker->cursor_channel);
+        queued_bytes = cursor_channel->base.send_data.queued_bytes;
         red_channel_reset_send_data((RedChannel*)cursor_channel);
         switch (pipe_item->type) {
         case PIPE_ITEM_TYPE_CURSOR:
@@ -8437,14 +9453,27 @@ static void cursor_channel_push(RedWorker *worker)
         default:
             red_error("invalid pipe item type");
         }
+        pushed += cursor_channel->base.send_data.queued_bytes - queued_bytes;
         red_unref_channel((RedChannel *)cursor_channel);
     }
+    red_channel_end_batch((RedChannel *)worker->cursor_channel);
+    return pushed >= budget;
+}
+
+static void cursor_channel_push(RedWorker *worker)
+{
+    cursor_channel_push_budget(worker, ~(uint64_t)0);
 }
 
+/* alternates between the channels, each round a channel sends up to its budget */
 static inline void red_push(RedWorker *worker)
 {
-    cursor_channel_push(worker);
-    display_channel_push(worker);
+    int more;
+
+    do {
+        more = cursor_channel_push_budget(worker, CURSOR_PUSH_BUDGET);
+        more |= display_channel_push_budget(worker, DISPLAY_PUSH_BUDGET);
+    } while (more);
 }
 
 typedef struct ShowTreeData {
@@ -8529,6 +9558,7 @@ static void red_disconnect_channel(RedChannel *channel)
     channel->peer = NULL;
     channel->send_data.blocked = FALSE;
     channel->send_data.size = channel->send_data.pos = 0;
+    channel->send_data.batch_size = channel->send_data.batch_pos = 0;
     spice_marshaller_reset(channel->send_data.marshaller);
     red_unref_channel(channel);
 }
@@ -8731,6 +9761,9 @@ static inline void red_create_surface(RedWorker *worker, uint32_t surface_id, ui
     ring_init(&surface->current_list);
     ring_init(&surface->depend_on_me);
     region_init(&surface->draw_dirty_region);
+    surface->tree_grid = spice_new0(uint16_t, TREE_GRID_SIZE * TREE_GRID_SIZE);
+    surface->tree_grid_cell_width = MAX((width + TREE_GRID_SIZE - 1) / TREE_GRID_SIZE, 1);
+    surface->tree_grid_cell_height = MAX((height + TREE_GRID_SIZE - 1) / TREE_GRID_SIZE, 1);
     surface->refs = 1;
     if (worker->renderer != RED_RENDERER_INVALID) {
         surface->context.canvas = create_canvas_for_surface(worker, surface, worker->renderer,
@@ -8928,6 +9961,7 @@ static int channel_handle_message(RedChannel *channel, size_t size, uint32_t typ
     case SPICE_MSGC_ACK:
         if (channel->client_ack_generation == channel->ack_generation) {
             channel->messages_window -= channel->client_ack_window;
+            red_ack_received(channel);
         }
         break;
     case SPICE_MSGC_DISCONNECTING:
@@ -9012,6 +10046,10 @@ static GlzSharedDictionary *red_get_glz_dictionary(DisplayChannel *display,
         shared_dict = red_create_glz_dictionary(display, id, window_size);
         ring_add(&glz_dictionary_list, &shared_dict->base);
     } else {
+        // the client may advertise a bigger window when it has more memory for it
+        if (!glz_enc_dictionary_grow(shared_dict->dict, window_size, &display->glz_data.usr)) {
+            red_printf("lz window %d size %d is too big", id, window_size);
+        }
         shared_dict->refs++;
     }
     pthread_mutex_unlock(&glz_dictionary_list_lock);
@@ -9367,6 +10405,7 @@ static RedChannel *__new_channel(RedWorker *worker, int size, uint32_t channel_i
     channel->recive_data.end = channel->recive_data.buf + sizeof(channel->recive_data.buf);
     ring_init(&channel->pipe);
     channel->send_data.marshaller = spice_marshaller_new();
+    channel->send_data.batch = spice_malloc(SEND_BATCH_SIZE);
 
     event.events = EPOLLIN | EPOLLOUT | EPOLLET;
     event.data.ptr = channel;
@@ -9380,6 +10419,8 @@ static RedChannel *__new_channel(RedWorker *worker, int size, uint32_t channel_i
     return channel;
 
 error2:
+    spice_marshaller_destroy(channel->send_data.marshaller);
+    free(channel->send_data.batch);
     free(channel);
 error1:
     peer->cb_free(peer);
@@ -9387,6 +10428,37 @@ error1:
     return NULL;
 }
 
+#ifdef RED_STATISTICS
+static void red_channel_init_stat(RedChannel *channel, StatNodeRef stat)
+{
+    channel->out_bytes_counter = stat_add_counter(stat, "out_bytes", TRUE);
+    channel->out_messages_counter = stat_add_counter(stat, "out_messages", TRUE);
+    channel->out_writes_counter = stat_add_counter(stat, "out_writes", TRUE);
+    channel->pipe_depth_counter = stat_add_counter(stat, "pipe_depth", TRUE);
+    channel->push_counter = stat_add_counter(stat, "pushes", TRUE);
+    channel->pipe_size_counter = stat_add_counter(stat, "pipe_size", TRUE);
+    channel->ack_latency_counter = stat_add_counter(stat, "ack_latency", TRUE);
+    stat_add_histogram(&channel->ack_latency_hist, stat, "ack_latency_hist", TRUE);
+}
+
+static void red_display_init_codec_stat(DisplayChannel *display_channel)
+{
+    StatNodeRef codecs = stat_add_node(display_channel->stat, "codecs", TRUE);
+    int i;
+
+    for (i = 0; i < CODEC_STAT_COUNT; i++) {
+        CodecStat *codec_stat = &display_channel->codec_stat[i];
+        StatNodeRef stat = stat_add_node(codecs, codec_stat_names[i], TRUE);
+
+        codec_stat->images_counter = stat_add_counter(stat, "images", TRUE);
+        codec_stat->raw_bytes_counter = stat_add_counter(stat, "raw_bytes", TRUE);
+        codec_stat->comp_bytes_counter = stat_add_counter(stat, "comp_bytes", TRUE);
+        codec_stat->time_counter = stat_add_counter(stat, "time", TRUE);
+        stat_add_histogram(&codec_stat->time_hist, stat, "time_hist", TRUE);
+    }
+}
+#endif
+
 static void handle_channel_events(EventListener *in_listener, uint32_t events)
 {
     RedChannel *channel = (RedChannel *)in_listener;
@@ -9427,6 +10499,10 @@ static void display_channel_release_item(RedChannel *channel, void *item)
     ASSERT(item);
     switch (((PipeItem *)item)->type) {
     case PIPE_ITEM_TYPE_DRAW:
+        red_drawable_drop_compress_job(channel->worker,
+                                       SPICE_CONTAINEROF(item, Drawable, pipe_item));
+        release_drawable(channel->worker, SPICE_CONTAINEROF(item, Drawable, pipe_item));
+        break;
     case PIPE_ITEM_TYPE_STREAM_CREATE:
         release_drawable(channel->worker, SPICE_CONTAINEROF(item, Drawable, pipe_item));
         break;
@@ -9462,14 +10538,18 @@ static void handle_new_display_channel(RedWorker *worker, RedsStreamContext *pee
     }
 #ifdef RED_STATISTICS
     display_channel->stat = stat_add_node(worker->stat, "display_channel", TRUE);
-    display_channel->base.out_bytes_counter = stat_add_counter(display_channel->stat,
-                                                               "out_bytes", TRUE);
+    red_channel_init_stat((RedChannel *)display_channel, display_channel->stat);
     display_channel->cache_hits_counter = stat_add_counter(display_channel->stat,
                                                            "cache_hits", TRUE);
     display_channel->add_to_cache_counter = stat_add_counter(display_channel->stat,
                                                              "add_to_cache", TRUE);
     display_channel->non_cache_counter = stat_add_counter(display_channel->stat,
                                                           "non_cache", TRUE);
+    display_channel->stream_skips_counter = stat_add_counter(display_channel->stat,
+                                                             "stream_skips", TRUE);
+    display_channel->stream_drops_counter = stat_add_counter(display_channel->stat,
+                                                             "stream_drops", TRUE);
+    red_display_init_codec_stat(display_channel);
 #endif
     ring_init(&display_channel->palette_cache_lru);
     display_channel->palette_cache_available = CLIENT_PALETTE_CACHE_SIZE;
@@ -9584,7 +10664,7 @@ static void red_connect_cursor(RedWorker *worker, RedsStreamContext *peer, int m
     }
 #ifdef RED_STATISTICS
     channel->stat = stat_add_node(worker->stat, "cursor_channel", TRUE);
-    channel->base.out_bytes_counter = stat_add_counter(channel->stat, "out_bytes", TRUE);
+    red_channel_init_stat((RedChannel *)channel, channel->stat);
 #endif
     ring_init(&channel->cursor_cache_lru);
     channel->cursor_cache_available = CLIENT_CURSOR_CACHE_SIZE;
@@ -9822,6 +10902,9 @@ static inline void handle_dev_destroy_surfaces(RedWorker *worker)
     RedWorkerMessage message;
     red_printf("");
     flush_all_qxl_commands(worker);
+    if (worker->record) {
+        red_record_device(worker->record, RED_RECORD_DEVICE_DESTROY_SURFACES, NULL);
+    }
     //to handle better
     for (i = 0; i < NUM_SURFACES; ++i) {
         if (worker->surfaces[i].context.canvas) {
@@ -9875,6 +10958,9 @@ static inline void handle_dev_create_primary_surface(RedWorker *worker)
 
     line_0 = (uint8_t*)get_virt(&worker->mem_slots, surface.mem, surface.height * abs(surface.stride),
                                 surface.group_id);
+    if (worker->record) {
+        red_record_device(worker->record, RED_RECORD_DEVICE_CREATE_PRIMARY, &surface);
+    }
     if (surface.stride < 0) {
         line_0 -= (int32_t)(surface.stride * (surface.height -1));
     }
@@ -9920,6 +11006,9 @@ static inline void handle_dev_destroy_primary_surface(RedWorker *worker)
     }
 
     flush_all_qxl_commands(worker);
+    if (worker->record) {
+        red_record_device(worker->record, RED_RECORD_DEVICE_DESTROY_PRIMARY, NULL);
+    }
     destroy_surface_wait(worker, 0);
     red_destroy_surface(worker, 0);
     ASSERT(ring_is_empty(&worker->streams));
@@ -10015,6 +11104,9 @@ static void handle_dev_input(EventListener *listener, uint32_t events)
     case RED_WORKER_MESSAGE_DISPLAY_DISCONNECT:
         red_printf("disconnect");
         red_disconnect_display((RedChannel *)worker->display_channel);
+        if (worker->record) {
+            red_record_flush(worker->record);
+        }
         break;
     case RED_WORKER_MESSAGE_STOP: {
         int x;
@@ -10031,6 +11123,9 @@ static void handle_dev_input(EventListener *listener, uint32_t events)
         red_cursor_flush(worker);
         red_wait_outgoing_item((RedChannel *)worker->display_channel);
         red_wait_outgoing_item((RedChannel *)worker->cursor_channel);
+        if (worker->record) {
+            red_record_flush(worker->record);
+        }
         message = RED_WORKER_MESSAGE_READY;
         write_message(worker->channel, &message);
         break;
@@ -10204,6 +11299,14 @@ static void red_init(RedWorker *worker, WorkerInitData *init_data)
     drawables_init(worker);
     cursor_items_init(worker);
     red_init_streams(worker);
+    red_init_compress_pool(worker, init_data->compression_threads);
+    if (init_data->record_path) {
+        char *record_path = spice_malloc(strlen(init_data->record_path) + 16);
+
+        sprintf(record_path, "%s.%d", init_data->record_path, worker->id);
+        worker->record = red_record_open(record_path);
+        free(record_path);
+    }
     stat_init(&worker->add_stat, add_stat_name);
     stat_init(&worker->exclude_stat, exclude_stat_name);
     stat_init(&worker->__exclude_stat, __exclude_stat_name);
@@ -10213,6 +11316,8 @@ static void red_init(RedWorker *worker, WorkerInitData *init_data)
     worker->stat = stat_add_node(INVALID_STAT_REF, worker_str, TRUE);
     worker->wakeup_counter = stat_add_counter(worker->stat, "wakeups", TRUE);
     worker->command_counter = stat_add_counter(worker->stat, "commands", TRUE);
+    worker->image_hash_counter = stat_add_counter(worker->stat, "hashed_images", TRUE);
+    worker->image_dup_counter = stat_add_counter(worker->stat, "duplicate_images", TRUE);
 #endif
     if ((epoll = epoll_create(MAX_EPOLL_SOURCES)) == -1) {
         red_error("epoll_create failed, %s", strerror(errno));
@@ -10255,9 +11360,7 @@ void *red_worker_main(void *arg)
 #endif
 
     red_init(&worker, (WorkerInitData *)arg);
-    red_init_quic(&worker);
-    red_init_lz(&worker);
-    red_init_jpeg(&worker);
+    red_init_image_encoders(&worker.encoders, FALSE);
     red_init_zlib(&worker);
     worker.epoll_timeout = INF_EPOLL_WAIT;
     for (;;) {
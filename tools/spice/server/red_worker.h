@@ -98,6 +98,8 @@ typedef struct WorkerInitData {
     uint8_t memslot_id_bits;
     uint8_t internal_groupslot_id;
     uint32_t n_surfaces;
+    uint32_t compression_threads;
+    const char *record_path;
 } WorkerInitData;
 
 void *red_worker_main(void *arg);
@@ -98,6 +98,8 @@ uint32_t streaming_video = STREAM_VIDEO_FILTER;
 spice_image_compression_t image_compression = SPICE_IMAGE_COMPRESS_AUTO_GLZ;
 spice_wan_compression_t jpeg_state = SPICE_WAN_COMPRESSION_AUTO;
 spice_wan_compression_t zlib_glz_state = SPICE_WAN_COMPRESSION_AUTO;
+uint32_t compression_threads = 0;
+char *display_record_path = NULL;
 #ifdef USE_TUNNEL
 void *red_tunnel = NULL;
 #endif
@@ -233,7 +235,7 @@ enum NetTestStage {
 
 #ifdef RED_STATISTICS
 
-#define REDS_MAX_STAT_NODES 100
+#define REDS_MAX_STAT_NODES 1024
 #define REDS_STAT_SHM_SIZE (sizeof(SpiceStat) + REDS_MAX_STAT_NODES * sizeof(SpiceStatNode))
 
 typedef struct RedsStatValue {
@@ -521,6 +523,22 @@ static struct iovec *reds_iovec_skip(struct iovec vec[], int skip, int *vec_size
 
 #ifdef RED_STATISTICS
 
+/* readers map the segment read only and never take stat_lock: the generation is
+   odd while the tree is being changed, so a snapshot taken between two equal
+   even reads of it is consistent. Counter values are updated in place without
+   touching the generation. */
+static inline void stat_begin_update(void)
+{
+    reds->stat->generation++;
+    __sync_synchronize();
+}
+
+static inline void stat_end_update(void)
+{
+    __sync_synchronize();
+    reds->stat->generation++;
+}
+
 void insert_stat_node(StatNodeRef parent, StatNodeRef ref)
 {
     SpiceStatNode *node = &reds->stat->nodes[ref];
@@ -573,7 +591,7 @@ StatNodeRef stat_add_node(StatNodeRef parent, const char *name, int visible)
         pthread_mutex_unlock(&reds->stat_lock);
         return INVALID_STAT_REF;
     }
-    reds->stat->generation++;
+    stat_begin_update();
     reds->stat->num_of_nodes++;
     for (ref = 0; ref <= REDS_MAX_STAT_NODES; ref++) {
         node = &reds->stat->nodes[ref];
@@ -586,6 +604,7 @@ StatNodeRef stat_add_node(StatNodeRef parent, const char *name, int visible)
     node->flags = SPICE_STAT_NODE_FLAG_ENABLED | (visible ? SPICE_STAT_NODE_FLAG_VISIBLE : 0);
     strncpy(node->name, name, sizeof(node->name));
     insert_stat_node(parent, ref);
+    stat_end_update();
     pthread_mutex_unlock(&reds->stat_lock);
     return ref;
 }
@@ -593,9 +612,10 @@ StatNodeRef stat_add_node(StatNodeRef parent, const char *name, int visible)
 void stat_remove(SpiceStatNode *node)
 {
     pthread_mutex_lock(&reds->stat_lock);
+    stat_begin_update();
     node->flags &= ~SPICE_STAT_NODE_FLAG_ENABLED;
-    reds->stat->generation++;
     reds->stat->num_of_nodes--;
+    stat_end_update();
     pthread_mutex_unlock(&reds->stat_lock);
 }
 
@@ -622,6 +642,33 @@ void stat_remove_counter(uint64_t *counter)
     stat_remove((SpiceStatNode *)(counter - offsetof(SpiceStatNode, value)));
 }
 
+/* the bucket names are prefixed with their index to keep them ordered, since
+   siblings are sorted by name */
+static const char *stat_histogram_names[STAT_HISTOGRAM_BUCKETS] = {
+    "0_lt_16us",
+    "1_lt_65us",
+    "2_lt_262us",
+    "3_lt_1ms",
+    "4_lt_4ms",
+    "5_lt_16ms",
+    "6_lt_67ms",
+    "7_lt_268ms",
+    "8_ge_268ms",
+};
+
+StatNodeRef stat_add_histogram(StatHistogram *hist, StatNodeRef parent, const char *name,
+                               int visible)
+{
+    StatNodeRef ref = stat_add_node(parent, name, visible);
+    int i;
+
+    for (i = 0; i < STAT_HISTOGRAM_BUCKETS; i++) {
+        hist->buckets[i] = ref == INVALID_STAT_REF ? NULL :
+                           stat_add_counter(ref, stat_histogram_names[i], visible);
+    }
+    return ref;
+}
+
 static void reds_update_stat_value(RedsStatValue* stat_value, uint32_t value)
 {
     stat_value->value = value;
@@ -4100,6 +4147,26 @@ __visible__ int spice_server_set_streaming_video(SpiceServer *s, int value)
     return 0;
 }
 
+/* the threads are per qxl device, and are created when the device is added */
+__visible__ int spice_server_set_compression_threads(SpiceServer *s, int num_threads)
+{
+    ASSERT(reds == s);
+    if (num_threads < 0 || num_threads > RED_MAX_COMPRESS_THREADS) {
+        return -1;
+    }
+    compression_threads = num_threads;
+    return 0;
+}
+
+/* applies to qxl devices added afterwards, each worker writes path.<qxl id> */
+__visible__ int spice_server_set_display_record(SpiceServer *s, const char *path)
+{
+    ASSERT(reds == s);
+    free(display_record_path);
+    display_record_path = path ? spice_strdup(path) : NULL;
+    return 0;
+}
+
 __visible__ int spice_server_set_playback_compression(SpiceServer *s, int enable)
 {
     ASSERT(reds == s);
@@ -424,6 +424,8 @@ enum {
 };
 
 int spice_server_set_streaming_video(SpiceServer *s, int value);
+int spice_server_set_compression_threads(SpiceServer *s, int num_threads);
+int spice_server_set_display_record(SpiceServer *s, const char *path);
 int spice_server_set_playback_compression(SpiceServer *s, int enable);
 int spice_server_set_agent_mouse(SpiceServer *s, int enable);
 
@@ -23,12 +23,23 @@
 typedef uint32_t StatNodeRef;
 #define INVALID_STAT_REF (~(StatNodeRef)0)
 
+/* nano second samples counted in power of 4 buckets, bucket i holds samples
+   below 2^(STAT_HISTOGRAM_SHIFT + 2 * i) and the last one everything above */
+#define STAT_HISTOGRAM_SHIFT 14
+#define STAT_HISTOGRAM_BUCKETS 9
+
+typedef struct StatHistogram {
+    uint64_t *buckets[STAT_HISTOGRAM_BUCKETS];
+} StatHistogram;
+
 #ifdef RED_STATISTICS
 
 StatNodeRef stat_add_node(StatNodeRef parent, const char *name, int visible);
 void stat_remove_node(StatNodeRef node);
 uint64_t *stat_add_counter(StatNodeRef parent, const char *name, int visible);
 void stat_remove_counter(uint64_t *counter);
+StatNodeRef stat_add_histogram(StatHistogram *hist, StatNodeRef parent, const char *name,
+                               int visible);
 
 #define stat_inc_counter(counter, value) {  \
     if (counter) {                          \
@@ -36,12 +47,33 @@ void stat_remove_counter(uint64_t *counter);
     }                                       \
 }
 
+#define stat_set_counter(counter, value) {  \
+    if (counter) {                          \
+        *(counter) = (value);               \
+    }                                       \
+}
+
+static inline void stat_histogram_add(StatHistogram *hist, uint64_t value)
+{
+    int i = 0;
+
+    value >>= STAT_HISTOGRAM_SHIFT;
+    while (value && i < STAT_HISTOGRAM_BUCKETS - 1) {
+        value >>= 2;
+        i++;
+    }
+    stat_inc_counter(hist->buckets[i], 1);
+}
+
 #else
 #define stat_add_node(p, n, v) INVALID_STAT_REF
 #define stat_remove_node(n)
 #define stat_add_counter(p, n, v) NULL
 #define stat_remove_counter(c)
+#define stat_add_histogram(h, p, n, v) INVALID_STAT_REF
 #define stat_inc_counter(c, v)
+#define stat_set_counter(c, v)
+#define stat_histogram_add(h, v)
 #endif
 
 #endif
@@ -0,0 +1,338 @@
+/* Summarizes a display capture written by a worker when
+ * spice_server_set_display_record() is set: traffic per channel and message
+ * type, bytes and encode time per image codec, the send rate over time and
+ * the QXL commands captured for replay.
+ *
+ * usage: display_record_stats <capture file>
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <spice/protocol.h>
+#include <spice/qxl_dev.h>
+#define RED_RECORD_FORMAT_ONLY
+#include "red_record.h"
+
+#define MAX_MSG_TYPE 512
+#define MAX_IMAGE_TYPE 128
+#define MAX_QXL_TYPE (QXL_CMD_SURFACE + 1)
+#define NSEC_PER_SEC (1000ULL * 1000 * 1000)
+
+enum {
+    STAT_CHANNEL_DISPLAY,
+    STAT_CHANNEL_CURSOR,
+    STAT_CHANNEL_COUNT,
+};
+
+typedef struct MessageStat {
+    uint64_t count;
+    uint64_t bytes;
+} MessageStat;
+
+typedef struct ImageStat {
+    uint64_t count;
+    uint64_t lossy;
+    uint64_t raw_size;
+    uint64_t comp_size;
+    uint64_t encode_time;
+    uint64_t max_encode_time;
+} ImageStat;
+
+static MessageStat messages[STAT_CHANNEL_COUNT][MAX_MSG_TYPE];
+static ImageStat images[MAX_IMAGE_TYPE];
+static MessageStat qxl_commands[MAX_QXL_TYPE];
+static uint64_t device_calls;
+
+static uint64_t *encode_times;
+static size_t num_encode_times;
+static size_t encode_times_size;
+
+static const char *channel_names[STAT_CHANNEL_COUNT] = {"display", "cursor"};
+
+static const char *message_name(int channel, int type)
+{
+    switch (type) {
+    case SPICE_MSG_MIGRATE: return "migrate";
+    case SPICE_MSG_MIGRATE_DATA: return "migrate_data";
+    case SPICE_MSG_SET_ACK: return "set_ack";
+    case SPICE_MSG_PING: return "ping";
+    case SPICE_MSG_WAIT_FOR_CHANNELS: return "wait_for_channels";
+    case SPICE_MSG_DISCONNECTING: return "disconnecting";
+    case SPICE_MSG_NOTIFY: return "notify";
+    }
+    if (channel == STAT_CHANNEL_CURSOR) {
+        switch (type) {
+        case SPICE_MSG_CURSOR_INIT: return "init";
+        case SPICE_MSG_CURSOR_RESET: return "reset";
+        case SPICE_MSG_CURSOR_SET: return "set";
+        case SPICE_MSG_CURSOR_MOVE: return "move";
+        case SPICE_MSG_CURSOR_HIDE: return "hide";
+        case SPICE_MSG_CURSOR_TRAIL: return "trail";
+        case SPICE_MSG_CURSOR_INVAL_ONE: return "inval_one";
+        case SPICE_MSG_CURSOR_INVAL_ALL: return "inval_all";
+        }
+        return NULL;
+    }
+    switch (type) {
+    case SPICE_MSG_DISPLAY_MODE: return "mode";
+    case SPICE_MSG_DISPLAY_MARK: return "mark";
+    case SPICE_MSG_DISPLAY_RESET: return "reset";
+    case SPICE_MSG_DISPLAY_COPY_BITS: return "copy_bits";
+    case SPICE_MSG_DISPLAY_INVAL_LIST: return "inval_list";
+    case SPICE_MSG_DISPLAY_INVAL_ALL_PIXMAPS: return "inval_all_pixmaps";
+    case SPICE_MSG_DISPLAY_INVAL_PALETTE: return "inval_palette";
+    case SPICE_MSG_DISPLAY_INVAL_ALL_PALETTES: return "inval_all_palettes";
+    case SPICE_MSG_DISPLAY_STREAM_CREATE: return "stream_create";
+    case SPICE_MSG_DISPLAY_STREAM_DATA: return "stream_data";
+    case SPICE_MSG_DISPLAY_STREAM_CLIP: return "stream_clip";
+    case SPICE_MSG_DISPLAY_STREAM_DESTROY: return "stream_destroy";
+    case SPICE_MSG_DISPLAY_STREAM_DESTROY_ALL: return "stream_destroy_all";
+    case SPICE_MSG_DISPLAY_DRAW_FILL: return "draw_fill";
+    case SPICE_MSG_DISPLAY_DRAW_OPAQUE: return "draw_opaque";
+    case SPICE_MSG_DISPLAY_DRAW_COPY: return "draw_copy";
+    case SPICE_MSG_DISPLAY_DRAW_BLEND: return "draw_blend";
+    case SPICE_MSG_DISPLAY_DRAW_BLACKNESS: return "draw_blackness";
+    case SPICE_MSG_DISPLAY_DRAW_WHITENESS: return "draw_whiteness";
+    case SPICE_MSG_DISPLAY_DRAW_INVERS: return "draw_invers";
+    case SPICE_MSG_DISPLAY_DRAW_ROP3: return "draw_rop3";
+    case SPICE_MSG_DISPLAY_DRAW_STROKE: return "draw_stroke";
+    case SPICE_MSG_DISPLAY_DRAW_TEXT: return "draw_text";
+    case SPICE_MSG_DISPLAY_DRAW_TRANSPARENT: return "draw_transparent";
+    case SPICE_MSG_DISPLAY_DRAW_ALPHA_BLEND: return "draw_alpha_blend";
+    case SPICE_MSG_DISPLAY_SURFACE_CREATE: return "surface_create";
+    case SPICE_MSG_DISPLAY_SURFACE_DESTROY: return "surface_destroy";
+    }
+    return NULL;
+}
+
+static const char *image_name(int type)
+{
+    switch (type) {
+    case SPICE_IMAGE_TYPE_BITMAP: return "bitmap";
+    case SPICE_IMAGE_TYPE_QUIC: return "quic";
+    case SPICE_IMAGE_TYPE_LZ_PLT: return "lz_plt";
+    case SPICE_IMAGE_TYPE_LZ_RGB: return "lz_rgb";
+    case SPICE_IMAGE_TYPE_GLZ_RGB: return "glz_rgb";
+    case SPICE_IMAGE_TYPE_JPEG: return "jpeg";
+    case SPICE_IMAGE_TYPE_ZLIB_GLZ_RGB: return "zlib_glz_rgb";
+    case SPICE_IMAGE_TYPE_JPEG_ALPHA: return "jpeg_alpha";
+    }
+    return "unknown";
+}
+
+static const char *qxl_name(int type)
+{
+    switch (type) {
+    case QXL_CMD_DRAW: return "draw";
+    case QXL_CMD_UPDATE: return "update";
+    case QXL_CMD_CURSOR: return "cursor";
+    case QXL_CMD_SURFACE: return "surface";
+    }
+    return "unknown";
+}
+
+static void add_encode_time(uint64_t time)
+{
+    if (num_encode_times == encode_times_size) {
+        encode_times_size = encode_times_size ? encode_times_size * 2 : 1024;
+        encode_times = realloc(encode_times, encode_times_size * sizeof(uint64_t));
+        if (!encode_times) {
+            fprintf(stderr, "out of memory\n");
+            exit(1);
+        }
+    }
+    encode_times[num_encode_times++] = time;
+}
+
+static int compare_u64(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a;
+    uint64_t y = *(const uint64_t *)b;
+
+    return (x > y) - (x < y);
+}
+
+static double percentile_ms(double p)
+{
+    size_t i = (size_t)(p * (num_encode_times - 1));
+
+    return encode_times[i] / 1e6;
+}
+
+static void print_stats(uint64_t duration, uint64_t peak_second_bytes)
+{
+    double seconds = duration / (double)NSEC_PER_SEC;
+    uint64_t total_bytes = 0;
+    int channel, type;
+
+    printf("duration %.3f sec\n\n", seconds);
+    printf("%-8s %-20s %10s %14s %10s\n", "channel", "message", "count", "bytes", "avg");
+    for (channel = 0; channel < STAT_CHANNEL_COUNT; channel++) {
+        for (type = 0; type < MAX_MSG_TYPE; type++) {
+            MessageStat *stat = &messages[channel][type];
+            const char *name;
+            char type_str[16];
+
+            if (!stat->count) {
+                continue;
+            }
+            if (!(name = message_name(channel, type))) {
+                sprintf(type_str, "%d", type);
+                name = type_str;
+            }
+            printf("%-8s %-20s %10llu %14llu %10llu\n", channel_names[channel], name,
+                   (unsigned long long)stat->count, (unsigned long long)stat->bytes,
+                   (unsigned long long)(stat->bytes / stat->count));
+            total_bytes += stat->bytes;
+        }
+    }
+    printf("\ntotal %llu bytes, %.1f KB/s average, %.1f KB/s peak second\n\n",
+           (unsigned long long)total_bytes,
+           seconds > 0 ? total_bytes / seconds / 1024 : 0.0,
+           peak_second_bytes / 1024.0);
+
+    printf("%-14s %8s %8s %14s %14s %7s %10s %10s\n", "codec", "count", "lossy", "raw bytes",
+           "sent bytes", "ratio", "enc ms", "max ms");
+    for (type = 0; type < MAX_IMAGE_TYPE; type++) {
+        ImageStat *stat = &images[type];
+
+        if (!stat->count) {
+            continue;
+        }
+        printf("%-14s %8llu %8llu %14llu %14llu %7.2f %10.2f %10.2f\n", image_name(type),
+               (unsigned long long)stat->count, (unsigned long long)stat->lossy,
+               (unsigned long long)stat->raw_size, (unsigned long long)stat->comp_size,
+               stat->comp_size ? stat->raw_size / (double)stat->comp_size : 0.0,
+               stat->encode_time / 1e6, stat->max_encode_time / 1e6);
+    }
+    if (num_encode_times) {
+        qsort(encode_times, num_encode_times, sizeof(uint64_t), compare_u64);
+        printf("\nimage encode latency: p50 %.3f ms, p95 %.3f ms, p99 %.3f ms\n",
+               percentile_ms(0.5), percentile_ms(0.95), percentile_ms(0.99));
+    }
+
+    printf("\n%-14s %10s %14s\n", "qxl command", "count", "bytes");
+    for (type = 0; type < MAX_QXL_TYPE; type++) {
+        MessageStat *stat = &qxl_commands[type];
+
+        if (!stat->count) {
+            continue;
+        }
+        printf("%-14s %10llu %14llu\n", qxl_name(type), (unsigned long long)stat->count,
+               (unsigned long long)stat->bytes);
+    }
+    printf("%-14s %10llu\n", "device call", (unsigned long long)device_calls);
+}
+
+int main(int argc, char **argv)
+{
+    RedRecordFileHeader file_header;
+    RedRecordHeader header;
+    uint64_t first_time = 0, last_time = 0;
+    uint64_t second_start = 0, second_bytes = 0, peak_second_bytes = 0;
+    uint8_t *payload = NULL;
+    uint32_t payload_size = 0;
+    FILE *file;
+
+    if (argc != 2) {
+        fprintf(stderr, "usage: %s <capture file>\n", argv[0]);
+        return 1;
+    }
+    if (!(file = fopen(argv[1], "rb"))) {
+        perror(argv[1]);
+        return 1;
+    }
+    if (fread(&file_header, sizeof(file_header), 1, file) != 1 ||
+        file_header.magic != RED_RECORD_MAGIC || file_header.version != RED_RECORD_VERSION) {
+        fprintf(stderr, "%s: not a display capture\n", argv[1]);
+        return 1;
+    }
+
+    while (fread(&header, sizeof(header), 1, file) == 1) {
+        if (header.size > payload_size) {
+            payload_size = header.size;
+            if (!(payload = realloc(payload, payload_size))) {
+                fprintf(stderr, "out of memory\n");
+                return 1;
+            }
+        }
+        if (fread(payload, 1, header.size, file) != header.size) {
+            fprintf(stderr, "truncated record, stopping\n");
+            break;
+        }
+        if (!first_time) {
+            first_time = second_start = header.time;
+        }
+        last_time = header.time;
+
+        switch (header.type) {
+        case RED_RECORD_MESSAGE: {
+            RedRecordMessage *message = (RedRecordMessage *)payload;
+            SpiceDataHeader *data_header = (SpiceDataHeader *)(message + 1);
+            int channel;
+            uint32_t size;
+
+            if (header.size < sizeof(*message) + sizeof(*data_header)) {
+                break;
+            }
+            channel = (message->channel_type == SPICE_CHANNEL_CURSOR) ? STAT_CHANNEL_CURSOR :
+                                                                        STAT_CHANNEL_DISPLAY;
+            size = header.size - sizeof(*message);
+            if (data_header->type < MAX_MSG_TYPE) {
+                messages[channel][data_header->type].count++;
+                messages[channel][data_header->type].bytes += size;
+            }
+            if (header.time - second_start >= NSEC_PER_SEC) {
+                second_start = header.time;
+                second_bytes = 0;
+            }
+            second_bytes += size;
+            if (second_bytes > peak_second_bytes) {
+                peak_second_bytes = second_bytes;
+            }
+            break;
+        }
+        case RED_RECORD_IMAGE: {
+            RedRecordImage *image = (RedRecordImage *)payload;
+            ImageStat *stat;
+
+            if (header.size < sizeof(*image) || image->image_type >= MAX_IMAGE_TYPE) {
+                break;
+            }
+            stat = &images[image->image_type];
+            stat->count++;
+            stat->lossy += !!image->lossy;
+            stat->raw_size += image->raw_size;
+            stat->comp_size += image->comp_size;
+            stat->encode_time += image->encode_time;
+            if (image->encode_time > stat->max_encode_time) {
+                stat->max_encode_time = image->encode_time;
+            }
+            add_encode_time(image->encode_time);
+            break;
+        }
+        case RED_RECORD_QXL_COMMAND: {
+            RedRecordQXLCommand *command = (RedRecordQXLCommand *)payload;
+
+            if (header.size < sizeof(*command) || command->type >= MAX_QXL_TYPE) {
+                break;
+            }
+            qxl_commands[command->type].count++;
+            qxl_commands[command->type].bytes += command->data_size;
+            break;
+        }
+        case RED_RECORD_QXL_DEVICE:
+            device_calls++;
+            break;
+        default:
+            break;
+        }
+    }
+    fclose(file);
+    free(payload);
+
+    print_stats(last_time - first_time, peak_second_bytes);
+    free(encode_times);
+    return 0;
+}
@@ -0,0 +1,521 @@
+/* Replays the QXL commands of a display capture, written by a worker when
+ * spice_server_set_display_record() is set, into a headless worker as fast
+ * as it takes them, and reports how long the worker took.
+ *
+ * usage: display_replay <capture file>
+ *
+ * Display and cursor commands are handed out through get_command and
+ * get_cursor_command, a cursor command not before the display commands that
+ * preceded it in the capture. The device calls on the surfaces are made in
+ * their place in the display command stream. The replay ends with an update
+ * of the whole primary surface, so the worker renders everything that is
+ * still pending. No client is connected, image compression and sending are
+ * not part of the measurement.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <spice.h>
+#include <spice/qxl_dev.h>
+#include "test_util.h"
+#include "basic_event_loop.h"
+#define RED_RECORD_FORMAT_ONLY
+#include "red_record.h"
+
+#define MEM_SLOT_GROUP_ID 0
+#define NSEC_PER_SEC (1000ULL * 1000 * 1000)
+
+typedef struct ReplayItem {
+    uint32_t record_type; // RED_RECORD_QXL_COMMAND or RED_RECORD_QXL_DEVICE
+    uint32_t cmd_type;
+    uint8_t *data;        // the command, relocated
+    uint8_t *surface;     // memory of a created surface, until it is released
+    RedRecordQXLDevice device;
+    uint32_t display_pos; // cursor commands: display items before this one
+} ReplayItem;
+
+typedef struct ReplayQueue {
+    ReplayItem *items;
+    uint32_t num_items;
+    uint32_t size;
+    uint32_t pos;         // next item to hand out
+} ReplayQueue;
+
+static ReplayQueue display_queue;
+static ReplayQueue cursor_queue;
+static uint32_t num_surfaces = 1;
+static int has_primary;
+static RedRecordQXLDevice primary;
+static uint8_t *primary_mem;
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t cond = PTHREAD_COND_INITIALIZER;
+static int worker_clock_valid;
+static clockid_t worker_clock;
+
+static QXLWorker *qxl_worker = NULL;
+
+static void *replay_malloc(size_t size)
+{
+    void *ptr = calloc(1, size ? size : 1);
+
+    if (!ptr) {
+        fprintf(stderr, "out of memory\n");
+        exit(1);
+    }
+    return ptr;
+}
+
+static ReplayItem *queue_add(ReplayQueue *queue)
+{
+    if (queue->num_items == queue->size) {
+        queue->size = queue->size ? queue->size * 2 : 1024;
+        queue->items = realloc(queue->items, queue->size * sizeof(ReplayItem));
+        if (!queue->items) {
+            fprintf(stderr, "out of memory\n");
+            exit(1);
+        }
+    }
+    memset(&queue->items[queue->num_items], 0, sizeof(ReplayItem));
+    return &queue->items[queue->num_items++];
+}
+
+static int load_command(uint8_t *payload, uint32_t size)
+{
+    RedRecordQXLCommand *command = (RedRecordQXLCommand *)payload;
+    uint32_t *relocs = (uint32_t *)(command + 1);
+    ReplayItem *item;
+    QXLPHYSICAL addr;
+    uint8_t *data;
+    uint32_t i;
+
+    if (size < sizeof(*command) ||
+        size != sizeof(*command) + command->num_relocs * sizeof(uint32_t) + command->data_size) {
+        return FALSE;
+    }
+    data = replay_malloc(command->data_size);
+    memcpy(data, relocs + command->num_relocs, command->data_size);
+    for (i = 0; i < command->num_relocs; i++) {
+        if (command->data_size < sizeof(addr) || relocs[i] > command->data_size - sizeof(addr)) {
+            free(data);
+            return FALSE;
+        }
+        memcpy(&addr, data + relocs[i], sizeof(addr));
+        addr += (uintptr_t)data;
+        memcpy(data + relocs[i], &addr, sizeof(addr));
+    }
+
+    if (command->type == QXL_CMD_CURSOR) {
+        item = queue_add(&cursor_queue);
+        item->display_pos = display_queue.num_items;
+    } else {
+        item = queue_add(&display_queue);
+    }
+    item->record_type = RED_RECORD_QXL_COMMAND;
+    item->cmd_type = command->type;
+    item->data = data;
+    if (command->type == QXL_CMD_SURFACE &&
+        ((QXLSurfaceCmd *)data)->surface_id >= num_surfaces) {
+        num_surfaces = ((QXLSurfaceCmd *)data)->surface_id + 1;
+    }
+    return TRUE;
+}
+
+static int load_capture(const char *path)
+{
+    RedRecordFileHeader file_header;
+    RedRecordHeader header;
+    uint8_t *payload = NULL;
+    uint32_t payload_size = 0;
+    ReplayItem *item;
+    FILE *file;
+
+    if (!(file = fopen(path, "rb"))) {
+        perror(path);
+        return FALSE;
+    }
+    if (fread(&file_header, sizeof(file_header), 1, file) != 1 ||
+        file_header.magic != RED_RECORD_MAGIC || file_header.version != RED_RECORD_VERSION) {
+        fprintf(stderr, "%s: not a display capture\n", path);
+        fclose(file);
+        return FALSE;
+    }
+    while (fread(&header, sizeof(header), 1, file) == 1) {
+        if (header.size > payload_size) {
+            payload_size = header.size;
+            payload = realloc(payload, payload_size);
+            if (!payload) {
+                fprintf(stderr, "out of memory\n");
+                exit(1);
+            }
+        }
+        if (fread(payload, 1, header.size, file) != header.size) {
+            fprintf(stderr, "truncated record, stopping\n");
+            break;
+        }
+        switch (header.type) {
+        case RED_RECORD_QXL_COMMAND:
+            if (!load_command(payload, header.size)) {
+                fprintf(stderr, "bad command record, stopping\n");
+                goto out;
+            }
+            break;
+        case RED_RECORD_QXL_DEVICE:
+            if (header.size != sizeof(RedRecordQXLDevice)) {
+                fprintf(stderr, "bad device record, stopping\n");
+                goto out;
+            }
+            item = queue_add(&display_queue);
+            item->record_type = RED_RECORD_QXL_DEVICE;
+            memcpy(&item->device, payload, sizeof(item->device));
+            break;
+        default:
+            break;
+        }
+    }
+out:
+    fclose(file);
+    free(payload);
+    return TRUE;
+}
+
+#define RELEASE_ID_CURSOR (1ULL << 32)
+
+/* The release id is the index of the item, the items move while the capture
+   is loaded. Every command struct starts with its QXLReleaseInfo. */
+static void set_release_ids(void)
+{
+    uint32_t i;
+
+    for (i = 0; i < display_queue.num_items; i++) {
+        if (display_queue.items[i].record_type == RED_RECORD_QXL_COMMAND) {
+            ((QXLReleaseInfo *)display_queue.items[i].data)->id = i;
+        }
+    }
+    for (i = 0; i < cursor_queue.num_items; i++) {
+        ((QXLReleaseInfo *)cursor_queue.items[i].data)->id = RELEASE_ID_CURSOR | i;
+    }
+}
+
+static ReplayItem *release_id_to_item(uint64_t id)
+{
+    if (id & RELEASE_ID_CURSOR) {
+        return &cursor_queue.items[(uint32_t)id];
+    }
+    return &display_queue.items[id];
+}
+
+static void note_worker_thread(void)
+{
+    if (!worker_clock_valid) {
+        pthread_getcpuclockid(pthread_self(), &worker_clock);
+        worker_clock_valid = TRUE;
+    }
+}
+
+static uint64_t clock_ns(clockid_t clock)
+{
+    struct timespec time;
+
+    clock_gettime(clock, &time);
+    return (uint64_t)time.tv_sec * NSEC_PER_SEC + time.tv_nsec;
+}
+
+static uint64_t timeval_ns(struct timeval *time)
+{
+    return (uint64_t)time->tv_sec * NSEC_PER_SEC + time->tv_usec * 1000ULL;
+}
+
+void attache_worker(QXLInstance *qin, QXLWorker *_qxl_worker)
+{
+    QXLDevMemSlot slot = {
+        .slot_group_id = MEM_SLOT_GROUP_ID,
+        .slot_id = 0,
+        .generation = 0,
+        .virt_start = 0,
+        .virt_end = ~0,
+        .addr_delta = 0,
+        .qxl_ram_size = ~0,
+    };
+
+    qxl_worker = _qxl_worker;
+    qxl_worker->add_memslot(qxl_worker, &slot);
+}
+
+void set_compression_level(QXLInstance *qin, int level)
+{
+}
+
+void set_mm_time(QXLInstance *qin, uint32_t mm_time)
+{
+}
+
+void get_init_info(QXLInstance *qin, QXLDevInitInfo *info)
+{
+    bzero(info, sizeof(*info));
+    info->num_memslots = 1;
+    info->num_memslots_groups = 1;
+    info->memslot_id_bits = 1;
+    info->memslot_gen_bits = 1;
+    info->n_surfaces = num_surfaces;
+}
+
+static void hand_out(ReplayItem *item, struct QXLCommandExt *ext)
+{
+    if (item->cmd_type == QXL_CMD_SURFACE) {
+        QXLSurfaceCmd *surface = (QXLSurfaceCmd *)item->data;
+
+        if (surface->type == QXL_SURFACE_CMD_CREATE) {
+            item->surface = replay_malloc((size_t)surface->u.surface_create.height *
+                                          abs(surface->u.surface_create.stride));
+            surface->u.surface_create.data = (uintptr_t)item->surface;
+        }
+    }
+    ext->cmd.data = (uintptr_t)item->data;
+    ext->cmd.type = item->cmd_type;
+    ext->cmd.padding = 0;
+    ext->group_id = MEM_SLOT_GROUP_ID;
+    ext->flags = 0;
+}
+
+static int display_command_ready(void)
+{
+    return display_queue.pos < display_queue.num_items &&
+           display_queue.items[display_queue.pos].record_type == RED_RECORD_QXL_COMMAND;
+}
+
+static int cursor_command_ready(void)
+{
+    return cursor_queue.pos < cursor_queue.num_items &&
+           cursor_queue.items[cursor_queue.pos].display_pos <= display_queue.pos;
+}
+
+int get_command(QXLInstance *qin, struct QXLCommandExt *ext)
+{
+    int ret = FALSE;
+
+    note_worker_thread();
+    pthread_mutex_lock(&lock);
+    if (display_command_ready()) {
+        hand_out(&display_queue.items[display_queue.pos++], ext);
+        ret = TRUE;
+    }
+    if (!ret || display_queue.pos == display_queue.num_items) {
+        pthread_cond_broadcast(&cond);
+    }
+    pthread_mutex_unlock(&lock);
+    return ret;
+}
+
+int req_cmd_notification(QXLInstance *qin)
+{
+    int ready;
+
+    pthread_mutex_lock(&lock);
+    ready = display_command_ready();
+    pthread_mutex_unlock(&lock);
+    return !ready;
+}
+
+void release_resource(QXLInstance *qin, struct QXLReleaseInfoExt release_info)
+{
+    ReplayItem *item;
+
+    ASSERT(release_info.group_id == MEM_SLOT_GROUP_ID);
+    item = release_id_to_item(release_info.info->id);
+    /* a surface create is released when the surface is destroyed */
+    free(item->surface);
+    item->surface = NULL;
+}
+
+int get_cursor_command(QXLInstance *qin, struct QXLCommandExt *ext)
+{
+    int ret = FALSE;
+
+    pthread_mutex_lock(&lock);
+    if (cursor_command_ready()) {
+        hand_out(&cursor_queue.items[cursor_queue.pos++], ext);
+        ret = TRUE;
+    }
+    if (!ret || cursor_queue.pos == cursor_queue.num_items) {
+        pthread_cond_broadcast(&cond);
+    }
+    pthread_mutex_unlock(&lock);
+    return ret;
+}
+
+int req_cursor_notification(QXLInstance *qin)
+{
+    int ready;
+
+    pthread_mutex_lock(&lock);
+    ready = cursor_command_ready();
+    pthread_mutex_unlock(&lock);
+    return !ready;
+}
+
+void notify_update(QXLInstance *qin, uint32_t update_id)
+{
+}
+
+int flush_resources(QXLInstance *qin)
+{
+    return 0;
+}
+
+QXLInterface display_sif = {
+    .base = {
+        .type = SPICE_INTERFACE_QXL,
+        .description = "replay",
+        .major_version = SPICE_INTERFACE_QXL_MAJOR,
+        .minor_version = SPICE_INTERFACE_QXL_MINOR
+    },
+    .attache_worker = attache_worker,
+    .set_compression_level = set_compression_level,
+    .set_mm_time = set_mm_time,
+    .get_init_info = get_init_info,
+    .get_command = get_command,
+    .req_cmd_notification = req_cmd_notification,
+    .release_resource = release_resource,
+    .get_cursor_command = get_cursor_command,
+    .req_cursor_notification = req_cursor_notification,
+    .notify_update = notify_update,
+    .flush_resources = flush_resources,
+};
+
+QXLInstance display_sin = {
+    .base = {
+        .sif = &display_sif.base,
+    },
+    .id = 0,
+};
+
+static void device_call(RedRecordQXLDevice *device)
+{
+    QXLDevSurfaceCreate surface;
+
+    switch (device->op) {
+    case RED_RECORD_DEVICE_CREATE_PRIMARY:
+        free(primary_mem);
+        has_primary = TRUE;
+        primary = *device;
+        primary_mem = replay_malloc((size_t)device->height * abs(device->stride));
+        surface.width      = device->width;
+        surface.height     = device->height;
+        surface.stride     = device->stride;
+        surface.format     = device->format;
+        surface.position   = device->position;
+        surface.mouse_mode = device->mouse_mode;
+        surface.flags      = device->flags;
+        surface.type       = device->type;
+        surface.mem        = (uintptr_t)primary_mem;
+        surface.group_id   = MEM_SLOT_GROUP_ID;
+        qxl_worker->create_primary_surface(qxl_worker, 0, &surface);
+        break;
+    case RED_RECORD_DEVICE_DESTROY_PRIMARY:
+        qxl_worker->destroy_primary_surface(qxl_worker, 0);
+        has_primary = FALSE;
+        break;
+    case RED_RECORD_DEVICE_DESTROY_SURFACES:
+        qxl_worker->destroy_surfaces(qxl_worker);
+        has_primary = FALSE;
+        break;
+    }
+}
+
+/* runs the capture through the worker, device calls are made from here */
+static void replay(void)
+{
+    uint32_t i;
+
+    qxl_worker->start(qxl_worker);
+    for (i = 0; i < display_queue.num_items; i++) {
+        if (display_queue.items[i].record_type != RED_RECORD_QXL_DEVICE) {
+            continue;
+        }
+        pthread_mutex_lock(&lock);
+        while (display_queue.pos != i) {
+            pthread_cond_wait(&cond, &lock);
+        }
+        pthread_mutex_unlock(&lock);
+
+        device_call(&display_queue.items[i].device);
+
+        pthread_mutex_lock(&lock);
+        display_queue.pos++;
+        pthread_mutex_unlock(&lock);
+        qxl_worker->wakeup(qxl_worker);
+    }
+
+    pthread_mutex_lock(&lock);
+    while (display_queue.pos != display_queue.num_items ||
+           cursor_queue.pos != cursor_queue.num_items) {
+        pthread_cond_wait(&cond, &lock);
+    }
+    pthread_mutex_unlock(&lock);
+
+    if (has_primary) {
+        QXLRect area;
+
+        area.top = area.left = 0;
+        area.bottom = primary.height;
+        area.right = primary.width;
+        qxl_worker->update_area(qxl_worker, 0, &area, NULL, 0, 0);
+    }
+}
+
+int main(int argc, char **argv)
+{
+    SpiceCoreInterface *core;
+    SpiceServer *server;
+    struct rusage usage_start, usage_end;
+    uint64_t start, wall, cpu, worker_cpu = 0;
+    uint32_t num_commands, i;
+
+    if (argc != 2) {
+        fprintf(stderr, "usage: %s <capture file>\n", argv[0]);
+        return 1;
+    }
+    if (!load_capture(argv[1])) {
+        return 1;
+    }
+    set_release_ids();
+    num_commands = cursor_queue.num_items;
+    for (i = 0; i < display_queue.num_items; i++) {
+        num_commands += display_queue.items[i].record_type == RED_RECORD_QXL_COMMAND;
+    }
+    if (!num_commands) {
+        fprintf(stderr, "%s: no QXL commands, captured by an older server?\n", argv[1]);
+        return 1;
+    }
+
+    core = basic_event_loop_init();
+    server = spice_server_new();
+    spice_server_init(server, core);
+    spice_server_add_interface(server, &display_sin.base);
+
+    getrusage(RUSAGE_SELF, &usage_start);
+    start = clock_ns(CLOCK_MONOTONIC);
+    replay();
+    wall = clock_ns(CLOCK_MONOTONIC) - start;
+    getrusage(RUSAGE_SELF, &usage_end);
+    if (worker_clock_valid) {
+        worker_cpu = clock_ns(worker_clock);
+    }
+    cpu = timeval_ns(&usage_end.ru_utime) + timeval_ns(&usage_end.ru_stime) -
+          timeval_ns(&usage_start.ru_utime) - timeval_ns(&usage_start.ru_stime);
+
+    printf("%u commands (%u cursor), %u surfaces\n", num_commands, cursor_queue.num_items,
+           num_surfaces);
+    printf("wall %.3f ms, %.0f commands/s\n", wall / 1e6,
+           wall ? num_commands / (wall / (double)NSEC_PER_SEC) : 0.0);
+    printf("process cpu %.3f ms, worker thread cpu %.3f ms\n", cpu / 1e6, worker_cpu / 1e6);
+    return 0;
+}
@@ -0,0 +1,222 @@
+/* Glz encoding throughput with several encoders sharing one dictionary, the way
+ * display channels of one client share it.
+ *
+ * usage: glz_bench [threads] [images per thread]
+ *
+ * Every thread has its own encoder and encodes rgb32 images built from a pool of
+ * tiles that is common to all threads, so matches are found in images added by
+ * the other encoders too.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdarg.h>
+#include <string.h>
+#include <pthread.h>
+#include <sys/time.h>
+
+#include "glz_encoder.h"
+
+#define IMAGE_WIDTH 256
+#define IMAGE_HEIGHT 128
+#define IMAGES_PER_THREAD 16
+#define TILE_SIZE 16
+#define NUM_TILES 256
+#define WINDOW_SIZE (16 * 1024 * 1024)
+#define MAX_THREADS 16
+
+typedef struct BenchUsrContext {
+    GlzEncoderUsrContext usr;
+} BenchUsrContext;
+
+typedef struct BenchThread {
+    pthread_t thread;
+    int id;
+    BenchUsrContext usr;
+    GlzEncoderContext *encoder;
+    uint32_t *images[IMAGES_PER_THREAD];
+    uint8_t *out;
+    uint64_t out_bytes;
+} BenchThread;
+
+static GlzEncDictContext *dict;
+static uint32_t tiles[NUM_TILES][TILE_SIZE * TILE_SIZE];
+static int images_per_thread = 2000;
+
+static void bench_error(GlzEncoderUsrContext *usr, const char *fmt, ...)
+{
+    va_list ap;
+
+    va_start(ap, fmt);
+    vfprintf(stderr, fmt, ap);
+    va_end(ap);
+    abort();
+}
+
+static void bench_warn(GlzEncoderUsrContext *usr, const char *fmt, ...)
+{
+}
+
+static void *bench_malloc(GlzEncoderUsrContext *usr, int size)
+{
+    return malloc(size);
+}
+
+static void bench_free(GlzEncoderUsrContext *usr, void *ptr)
+{
+    free(ptr);
+}
+
+static int bench_more_space(GlzEncoderUsrContext *usr, uint8_t **io_ptr)
+{
+    return 0;
+}
+
+static int bench_more_lines(GlzEncoderUsrContext *usr, uint8_t **lines)
+{
+    return 0;
+}
+
+/* the images stay allocated for the whole run, nothing to release */
+static void bench_free_image(GlzEncoderUsrContext *usr, GlzUsrImageContext *image)
+{
+}
+
+static void bench_init_usr(BenchUsrContext *usr)
+{
+    memset(usr, 0, sizeof(*usr));
+    usr->usr.error = bench_error;
+    usr->usr.warn = bench_warn;
+    usr->usr.info = bench_warn;
+    usr->usr.malloc = bench_malloc;
+    usr->usr.free = bench_free;
+    usr->usr.more_space = bench_more_space;
+    usr->usr.more_lines = bench_more_lines;
+    usr->usr.free_image = bench_free_image;
+}
+
+static uint32_t bench_rand(uint32_t *seed)
+{
+    *seed = *seed * 1103515245 + 12345;
+    return *seed >> 8;
+}
+
+/* flat areas and text like noise, the kind of content glz is used for */
+static void init_tiles(void)
+{
+    uint32_t seed = 1;
+    int i, j;
+
+    for (i = 0; i < NUM_TILES; i++) {
+        uint32_t color = bench_rand(&seed) & 0xffffff;
+
+        for (j = 0; j < TILE_SIZE * TILE_SIZE; j++) {
+            tiles[i][j] = (i % 4 == 0 && bench_rand(&seed) % 3 == 0) ? 0 : color;
+        }
+    }
+}
+
+static uint32_t *create_image(uint32_t *seed)
+{
+    uint32_t *image = malloc(IMAGE_WIDTH * IMAGE_HEIGHT * 4);
+    int x, y, row;
+
+    for (y = 0; y < IMAGE_HEIGHT; y += TILE_SIZE) {
+        for (x = 0; x < IMAGE_WIDTH; x += TILE_SIZE) {
+            uint32_t *tile = tiles[bench_rand(seed) % NUM_TILES];
+
+            for (row = 0; row < TILE_SIZE; row++) {
+                memcpy(image + (y + row) * IMAGE_WIDTH + x, tile + row * TILE_SIZE,
+                       TILE_SIZE * 4);
+            }
+        }
+    }
+    return image;
+}
+
+static uint64_t now_usec(void)
+{
+    struct timeval tv;
+
+    gettimeofday(&tv, NULL);
+    return (uint64_t)tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+static void *bench_thread_main(void *opaque)
+{
+    BenchThread *bench = opaque;
+    GlzEncDictImageContext *dict_image;
+    int i;
+
+    for (i = 0; i < images_per_thread; i++) {
+        bench->out_bytes += glz_encode(bench->encoder, LZ_IMAGE_TYPE_RGB32, IMAGE_WIDTH,
+                                       IMAGE_HEIGHT, TRUE,
+                                       (uint8_t *)bench->images[i % IMAGES_PER_THREAD],
+                                       IMAGE_HEIGHT, IMAGE_WIDTH * 4, bench->out,
+                                       IMAGE_WIDTH * IMAGE_HEIGHT * 8, NULL, &dict_image);
+    }
+    return NULL;
+}
+
+int main(int argc, char **argv)
+{
+    BenchUsrContext usr;
+    BenchThread *threads;
+    int num_threads = argc > 1 ? atoi(argv[1]) : 4;
+    uint64_t start, elapsed, in_bytes, out_bytes = 0;
+    uint32_t seed = 7;
+    int i, j;
+
+    if (argc > 2) {
+        images_per_thread = atoi(argv[2]);
+    }
+    if (num_threads < 1 || num_threads > MAX_THREADS || images_per_thread < 1) {
+        fprintf(stderr, "usage: %s [threads (max %d)] [images per thread]\n", argv[0],
+                MAX_THREADS);
+        return 1;
+    }
+
+    init_tiles();
+    bench_init_usr(&usr);
+    if (!(dict = glz_enc_dictionary_create(WINDOW_SIZE, MAX_THREADS, &usr.usr))) {
+        fprintf(stderr, "failed creating dictionary\n");
+        return 1;
+    }
+
+    threads = calloc(num_threads, sizeof(BenchThread));
+    for (i = 0; i < num_threads; i++) {
+        threads[i].id = i;
+        bench_init_usr(&threads[i].usr);
+        threads[i].encoder = glz_encoder_create(i, dict, &threads[i].usr.usr);
+        threads[i].out = malloc(IMAGE_WIDTH * IMAGE_HEIGHT * 8);
+        for (j = 0; j < IMAGES_PER_THREAD; j++) {
+            threads[i].images[j] = create_image(&seed);
+        }
+    }
+
+    start = now_usec();
+    for (i = 0; i < num_threads; i++) {
+        pthread_create(&threads[i].thread, NULL, bench_thread_main, &threads[i]);
+    }
+    for (i = 0; i < num_threads; i++) {
+        pthread_join(threads[i].thread, NULL);
+        out_bytes += threads[i].out_bytes;
+    }
+    elapsed = now_usec() - start;
+
+    in_bytes = (uint64_t)num_threads * images_per_thread * IMAGE_WIDTH * IMAGE_HEIGHT * 4;
+    printf("%d threads, %d images each: %.3f sec, %.1f MB/s, ratio %.2f\n", num_threads,
+           images_per_thread, elapsed / 1000000.0, in_bytes / (double)elapsed,
+           in_bytes / (double)out_bytes);
+
+    for (i = 0; i < num_threads; i++) {
+        glz_encoder_destroy(threads[i].encoder);
+        for (j = 0; j < IMAGES_PER_THREAD; j++) {
+            free(threads[i].images[j]);
+        }
+        free(threads[i].out);
+    }
+    free(threads);
+    glz_enc_dictionary_destroy(dict, &usr.usr);
+    return 0;
+}
@@ -0,0 +1,254 @@
+/* Quic encode/decode throughput over a set of screenshots.
+ *
+ * usage: quic_bench [-n iterations] image.ppm...
+ *
+ * Every image (binary PPM, P6) is converted to rgb32 and encoded with the
+ * scalar path and with each row kernel this cpu supports. The encoder must
+ * call the kernel for every row after the first, every output must be
+ * identical to the scalar one, and it must decode back to the source.
+ * Throughput is computed from the fastest of the iterations of each image.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdarg.h>
+#include <string.h>
+#include <sys/time.h>
+
+#include "quic.c"
+
+#define MAX_KERNELS 3
+
+typedef struct BenchUsrContext {
+    QuicUsrContext usr;
+} BenchUsrContext;
+
+typedef struct BenchKernel {
+    const char *name;
+    decorelate_row_rgb32_t row;
+    uint64_t time;
+} BenchKernel;
+
+static decorelate_row_rgb32_t bench_row;
+static int bench_rows;
+
+/* counts the rows the encoder hands to the kernel under test */
+static void bench_count_row(const rgb32_pixel_t *prev_row, const rgb32_pixel_t *cur_row,
+                            int width, BYTE *r, BYTE *g, BYTE *b)
+{
+    bench_rows++;
+    bench_row(prev_row, cur_row, width, r, g, b);
+}
+
+static void bench_error(QuicUsrContext *usr, const char *fmt, ...)
+{
+    va_list ap;
+
+    va_start(ap, fmt);
+    vfprintf(stderr, fmt, ap);
+    va_end(ap);
+    abort();
+}
+
+static void bench_warn(QuicUsrContext *usr, const char *fmt, ...)
+{
+}
+
+static void *bench_malloc(QuicUsrContext *usr, int size)
+{
+    return malloc(size);
+}
+
+static void bench_free(QuicUsrContext *usr, void *ptr)
+{
+    free(ptr);
+}
+
+static int bench_more_space(QuicUsrContext *usr, uint32_t **io_ptr, int rows_completed)
+{
+    return 0;
+}
+
+static int bench_more_lines(QuicUsrContext *usr, uint8_t **lines)
+{
+    return 0;
+}
+
+static uint64_t now_usec(void)
+{
+    struct timeval tv;
+
+    gettimeofday(&tv, NULL);
+    return (uint64_t)tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+static int read_ppm(const char *name, uint32_t **pixels, int *width, int *height)
+{
+    FILE *f;
+    int maxval, i;
+    uint8_t rgb[3];
+
+    if (!(f = fopen(name, "rb"))) {
+        return FALSE;
+    }
+    if (fscanf(f, "P6 %d %d %d", width, height, &maxval) != 3 || maxval != 255 ||
+        fgetc(f) == EOF || *width <= 0 || *height <= 0) {
+        fclose(f);
+        return FALSE;
+    }
+    *pixels = malloc(*width * *height * 4);
+    for (i = 0; i < *width * *height; i++) {
+        if (fread(rgb, 3, 1, f) != 1) {
+            free(*pixels);
+            fclose(f);
+            return FALSE;
+        }
+        (*pixels)[i] = (rgb[0] << 16) | (rgb[1] << 8) | rgb[2];
+    }
+    fclose(f);
+    return TRUE;
+}
+
+static int bench_encode(QuicContext *quic, uint32_t *pixels, int width, int height,
+                        uint32_t *out, int out_words)
+{
+    return quic_encode(quic, QUIC_IMAGE_TYPE_RGB32, width, height, (uint8_t *)pixels,
+                       height, width * 4, out, out_words);
+}
+
+static int bench_kernels(BenchKernel *kernels)
+{
+    int n = 0;
+
+    kernels[n].name = "scalar";
+    kernels[n++].row = NULL;
+#ifdef QUIC_SIMD_SSE2
+    kernels[n].name = "sse2";
+    kernels[n++].row = decorelate_row_rgb32_sse2;
+#endif
+#ifdef QUIC_SIMD_AVX2
+    if (__builtin_cpu_supports("avx2")) {
+        kernels[n].name = "avx2";
+        kernels[n++].row = decorelate_row_rgb32_avx2;
+    }
+#endif
+    return n;
+}
+
+int main(int argc, char **argv)
+{
+    BenchUsrContext usr;
+    QuicContext *quic;
+    decorelate_row_rgb32_t selected_row;
+    BenchKernel kernels[MAX_KERNELS];
+    uint64_t bytes = 0, decode_time = 0;
+    uint64_t start, best, best_decode;
+    int iterations = 10;
+    int num_kernels, i, k, n, arg = 1;
+
+    if (argc > 2 && !strcmp(argv[1], "-n")) {
+        iterations = atoi(argv[2]);
+        arg = 3;
+    }
+    if (arg == argc || iterations < 1) {
+        fprintf(stderr, "usage: %s [-n iterations] image.ppm...\n", argv[0]);
+        return 1;
+    }
+
+    memset(&usr, 0, sizeof(usr));
+    usr.usr.error = bench_error;
+    usr.usr.warn = bench_warn;
+    usr.usr.info = bench_warn;
+    usr.usr.malloc = bench_malloc;
+    usr.usr.free = bench_free;
+    usr.usr.more_space = bench_more_space;
+    usr.usr.more_lines = bench_more_lines;
+
+    quic_init();
+    quic = quic_create(&usr.usr);
+    selected_row = decorelate_row_rgb32;
+    memset(kernels, 0, sizeof(kernels));
+    num_kernels = bench_kernels(kernels);
+    for (k = 1; k < num_kernels && kernels[k].row != selected_row; k++);
+    printf("row kernel: %s\n", k < num_kernels ? kernels[k].name : "scalar only");
+
+    for (; arg < argc; arg++) {
+        uint32_t *pixels, *decoded, *scalar_out, *out;
+        int width, height, out_words, scalar_len, len;
+        QuicImageType type;
+
+        if (!read_ppm(argv[arg], &pixels, &width, &height)) {
+            fprintf(stderr, "%s: can't read binary ppm\n", argv[arg]);
+            return 1;
+        }
+        out_words = width * height * 2 + 1024;
+        scalar_out = malloc(out_words * 4);
+        out = malloc(out_words * 4);
+        decoded = malloc(width * height * 4);
+
+        for (k = 0; k < num_kernels; k++) {
+            bench_row = kernels[k].row;
+            decorelate_row_rgb32 = bench_row ? bench_count_row : NULL;
+            best = ~(uint64_t)0;
+            for (i = 0; i < iterations; i++) {
+                bench_rows = 0;
+                start = now_usec();
+                len = bench_encode(quic, pixels, width, height, k ? out : scalar_out,
+                                   out_words);
+                best = MIN(best, now_usec() - start);
+            }
+            kernels[k].time += best;
+
+            if (!k) {
+                scalar_len = len;
+                if (scalar_len <= 0) {
+                    fprintf(stderr, "%s: encoding failed\n", argv[arg]);
+                    return 1;
+                }
+                continue;
+            }
+            if (bench_rows != height - 1) {
+                fprintf(stderr, "%s: %s kernel ran for %d of %d rows\n", argv[arg],
+                        kernels[k].name, bench_rows, height - 1);
+                return 1;
+            }
+            if (len != scalar_len || memcmp(out, scalar_out, len * 4)) {
+                fprintf(stderr, "%s: %s output differs from scalar output\n", argv[arg],
+                        kernels[k].name);
+                return 1;
+            }
+        }
+        decorelate_row_rgb32 = selected_row;
+
+        best_decode = ~(uint64_t)0;
+        for (i = 0; i < iterations; i++) {
+            start = now_usec();
+            quic_decode_begin(quic, scalar_out, scalar_len, &type, &width, &height);
+            quic_decode(quic, QUIC_IMAGE_TYPE_RGB32, (uint8_t *)decoded, width * 4);
+            best_decode = MIN(best_decode, now_usec() - start);
+        }
+        decode_time += best_decode;
+
+        for (n = 0; n < width * height; n++) {
+            if ((decoded[n] & 0xffffff) != pixels[n]) {
+                fprintf(stderr, "%s: decoded image differs at pixel %d\n", argv[arg], n);
+                return 1;
+            }
+        }
+
+        printf("%s: %dx%d, ratio %.2f\n", argv[arg], width, height,
+               (double)width * height * 4 / (scalar_len * 4));
+        bytes += (uint64_t)width * height * 4;
+        free(pixels);
+        free(decoded);
+        free(scalar_out);
+        free(out);
+    }
+    quic_destroy(quic);
+
+    for (k = 0; k < num_kernels; k++) {
+        printf("encode %-7s %.1f MB/s\n", kernels[k].name, bytes / (double)kernels[k].time);
+    }
+    printf("decode         %.1f MB/s\n", bytes / (double)decode_time);
+    return 0;
+}
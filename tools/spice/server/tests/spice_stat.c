@@ -0,0 +1,238 @@
+/* Samples the statistics a running server publishes in shared memory.
+ *
+ * usage: spice_stat [-a] [-i interval ms] [-n samples] <server pid>
+ *
+ * The segment is mapped read only and copied without taking any lock; a copy
+ * is retried when the server changed the node tree meanwhile. From the second
+ * sample on each counter is followed by its rate per second over the interval,
+ * which is meaningless for the level values (pipe_size, ack_latency). Cache
+ * hit rate and the average pipe depth are derived from their counters.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <spice/stats.h>
+
+#define INVALID_INDEX (~(uint32_t)0)
+#define NSEC_PER_SEC (1000ULL * 1000 * 1000)
+#define MAX_DEPTH 32
+
+typedef struct Snapshot {
+    SpiceStat *stat;
+    uint32_t max_nodes;
+    uint64_t time;
+} Snapshot;
+
+static int show_all;
+
+static uint64_t now(void)
+{
+    struct timespec time;
+
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return (uint64_t)time.tv_sec * NSEC_PER_SEC + time.tv_nsec;
+}
+
+static int take_snapshot(const SpiceStat *shm, size_t size, Snapshot *snapshot)
+{
+    int tries;
+
+    for (tries = 0; tries < 1000; tries++) {
+        uint32_t generation = *(volatile uint32_t *)&shm->generation;
+
+        if (generation & 1) {
+            usleep(1000);
+            continue;
+        }
+        __sync_synchronize();
+        memcpy(snapshot->stat, shm, size);
+        __sync_synchronize();
+        if (*(volatile uint32_t *)&shm->generation == generation) {
+            snapshot->time = now();
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static const SpiceStatNode *get_node(const Snapshot *snapshot, uint32_t index)
+{
+    if (index == INVALID_INDEX || index >= snapshot->max_nodes) {
+        return NULL;
+    }
+    return &snapshot->stat->nodes[index];
+}
+
+static int child_value(const Snapshot *snapshot, const SpiceStatNode *node, const char *name,
+                       uint64_t *value)
+{
+    const SpiceStatNode *child = get_node(snapshot, node->first_child_index);
+
+    for (; child; child = get_node(snapshot, child->next_sibling_index)) {
+        if ((child->flags & SPICE_STAT_NODE_FLAG_ENABLED) &&
+            (child->flags & SPICE_STAT_NODE_FLAG_VALUE) &&
+            !strncmp(child->name, name, sizeof(child->name))) {
+            *value = child->value;
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/* value of the named child, over the interval when there is a previous sample */
+static int child_delta(const Snapshot *snapshot, const Snapshot *prev, uint32_t index,
+                       const char *name, uint64_t *value)
+{
+    uint64_t prev_value;
+
+    if (!child_value(snapshot, get_node(snapshot, index), name, value)) {
+        return 0;
+    }
+    if (prev && child_value(prev, get_node(prev, index), name, &prev_value)) {
+        *value -= prev_value;
+    }
+    return 1;
+}
+
+static void print_derived(const Snapshot *snapshot, const Snapshot *prev, uint32_t index,
+                          int depth)
+{
+    uint64_t hits, adds, non_cache, pushes, pipe_depth;
+
+    if (child_delta(snapshot, prev, index, "cache_hits", &hits) &&
+        child_delta(snapshot, prev, index, "add_to_cache", &adds) &&
+        child_delta(snapshot, prev, index, "non_cache", &non_cache) &&
+        hits + adds + non_cache) {
+        printf("%*s%-24s %19.1f%%\n", depth * 2, "", "cache_hit_rate",
+               100.0 * hits / (hits + adds + non_cache));
+    }
+    if (child_delta(snapshot, prev, index, "pushes", &pushes) &&
+        child_delta(snapshot, prev, index, "pipe_depth", &pipe_depth) && pushes) {
+        printf("%*s%-24s %20.1f\n", depth * 2, "", "avg_pipe_depth",
+               (double)pipe_depth / pushes);
+    }
+}
+
+static void print_nodes(const Snapshot *snapshot, const Snapshot *prev, uint32_t index,
+                        int depth)
+{
+    const SpiceStatNode *node;
+
+    if (depth >= MAX_DEPTH) {
+        return;
+    }
+    for (; (node = get_node(snapshot, index)); index = node->next_sibling_index) {
+        char name[SPICE_STAT_NODE_NAME_MAX + 1];
+
+        if (!(node->flags & SPICE_STAT_NODE_FLAG_ENABLED) ||
+            (!show_all && !(node->flags & SPICE_STAT_NODE_FLAG_VISIBLE))) {
+            continue;
+        }
+        snprintf(name, sizeof(name), "%.*s", (int)sizeof(node->name), node->name);
+        if (!(node->flags & SPICE_STAT_NODE_FLAG_VALUE)) {
+            printf("%*s%s\n", depth * 2, "", name);
+            print_derived(snapshot, prev, index, depth + 1);
+            print_nodes(snapshot, prev, node->first_child_index, depth + 1);
+            continue;
+        }
+        printf("%*s%-24s %20llu", depth * 2, "", name, (unsigned long long)node->value);
+        if (prev) {
+            const SpiceStatNode *prev_node = get_node(prev, index);
+            double interval = (double)(snapshot->time - prev->time) / NSEC_PER_SEC;
+
+            printf(" %14.1f/s", (double)(node->value - prev_node->value) / interval);
+        }
+        printf("\n");
+    }
+}
+
+int main(int argc, char **argv)
+{
+    unsigned int interval = 1000;
+    int samples = 1;
+    char shm_name[64];
+    struct stat st;
+    SpiceStat *shm;
+    Snapshot snapshots[2];
+    Snapshot *snapshot, *prev = NULL;
+    int opt, fd, i;
+
+    while ((opt = getopt(argc, argv, "ai:n:")) != -1) {
+        switch (opt) {
+        case 'a':
+            show_all = 1;
+            break;
+        case 'i':
+            interval = atoi(optarg);
+            break;
+        case 'n':
+            samples = atoi(optarg);
+            break;
+        default:
+            fprintf(stderr, "usage: %s [-a] [-i interval ms] [-n samples] <server pid>\n",
+                    argv[0]);
+            return 1;
+        }
+    }
+    if (optind != argc - 1) {
+        fprintf(stderr, "usage: %s [-a] [-i interval ms] [-n samples] <server pid>\n", argv[0]);
+        return 1;
+    }
+
+    snprintf(shm_name, sizeof(shm_name), SPICE_STAT_SHM_NAME, atoi(argv[optind]));
+    if ((fd = shm_open(shm_name, O_RDONLY, 0)) == -1) {
+        perror(shm_name);
+        return 1;
+    }
+    if (fstat(fd, &st) == -1 || st.st_size < (off_t)sizeof(SpiceStat)) {
+        fprintf(stderr, "%s: bad segment\n", shm_name);
+        return 1;
+    }
+    shm = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    if (shm == MAP_FAILED) {
+        perror("mmap");
+        return 1;
+    }
+    close(fd);
+    if (shm->magic != SPICE_STAT_MAGIC || shm->version != SPICE_STAT_VERSION) {
+        fprintf(stderr, "%s: unknown format\n", shm_name);
+        return 1;
+    }
+
+    for (i = 0; i < 2; i++) {
+        snapshots[i].stat = malloc(st.st_size);
+        snapshots[i].max_nodes = (st.st_size - sizeof(SpiceStat)) / sizeof(SpiceStatNode);
+        if (!snapshots[i].stat) {
+            fprintf(stderr, "out of memory\n");
+            return 1;
+        }
+    }
+
+    for (i = 0; samples <= 0 || i < samples; i++) {
+        snapshot = &snapshots[i % 2];
+        if (i) {
+            usleep(interval * 1000);
+        }
+        if (!take_snapshot(shm, st.st_size, snapshot)) {
+            fprintf(stderr, "%s: the node tree keeps changing\n", shm_name);
+            return 1;
+        }
+        // rates are only shown while the tree is the same one
+        if (prev && prev->stat->generation != snapshot->stat->generation) {
+            prev = NULL;
+        }
+        if (i) {
+            printf("\n");
+        }
+        print_nodes(snapshot, prev, snapshot->stat->root_index, 0);
+        fflush(stdout);
+        prev = snapshot;
+    }
+    return 0;
+}
@@ -8,15 +8,17 @@
 int main(int argc, char **argv)
 {
   struct xs_handle * xsh;
+  char * reply;
 
   if (argc < 2 ||
-      strcmp(argv[1], "check"))
+      (strcmp(argv[1], "check") && strcmp(argv[1], "stats")))
   {
     fprintf(stderr,
             "Usage:\n"
             "\n"
             "       %s check\n"
-            "\n", argv[0]);
+            "       %s stats\n"
+            "\n", argv[0], argv[0]);
     return 2;
   }
 
@@ -27,7 +29,10 @@ int main(int argc, char **argv)
     return 1;
   }
 
-  xs_debug_command(xsh, argv[1], NULL, 0);
+  reply = xs_debug_command(xsh, argv[1], NULL, 0);
+  if (reply != NULL && strcmp(argv[1], "stats") == 0)
+    fputs(reply, stdout);
+  free(reply);
 
   xs_daemon_close(xsh);
 
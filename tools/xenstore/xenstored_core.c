@@ -30,6 +30,7 @@
 #include <stdio.h>
 #include <stdarg.h>
 #include <stdlib.h>
+#include <limits.h>
 #include <syslog.h>
 #include <string.h>
 #include <errno.h>
@@ -38,6 +39,11 @@
 #include <signal.h>
 #include <assert.h>
 #include <setjmp.h>
+#include <poll.h>
+#ifdef __linux__
+#include <sys/epoll.h>
+#define USE_EPOLL
+#endif
 
 #include "utils.h"
 #include "list.h"
@@ -47,6 +53,7 @@
 #include "xenstored_watch.h"
 #include "xenstored_transaction.h"
 #include "xenstored_domain.h"
+#include "xenstored_store.h"
 #include "xenctrl.h"
 #include "tdb.h"
 
@@ -61,11 +68,34 @@ static bool recovery = true;
 static bool remove_local = true;
 static int reopen_log_pipe[2];
 static char *tracefile = NULL;
-static TDB_CONTEXT *tdb_ctx;
+
+/* Seconds between snapshots of the store to its tdb file, 0 for none. */
+static unsigned int snapshot_interval;
+#define MAX_SNAPSHOT_INTERVAL (INT_MAX / 1000)
+static time_t next_snapshot;
 
 static void corrupt(struct connection *conn, const char *fmt, ...);
 static void check_store(void);
 
+/* Connections with input or output to handle. */
+static LIST_HEAD(ready_connections);
+
+/* Requests taken off a ring per round, so one busy domain can't starve
+ * the others. */
+#define RING_BATCH 32
+
+/* Request latency, from its connection going on the ready list to its
+ * reply being queued, and the time spent handling it, in microseconds. */
+static struct {
+	unsigned long wakeups;
+	unsigned long requests;
+	unsigned long ring_batches;
+	unsigned long ring_requests;
+	unsigned long max_batch;
+	uint64_t latency_total, latency_max;
+	uint64_t service_total, service_max;
+} stats;
+
 #define log(...)							\
 	do {								\
 		char *s = talloc_asprintf(NULL, __VA_ARGS__);		\
@@ -80,20 +110,29 @@ int quota_nb_watch_per_domain = 128;
 int quota_max_entry_size = 2048; /* 2K */
 int quota_max_transaction = 10;
 
-TDB_CONTEXT *tdb_context(struct connection *conn)
+/* conn = NULL used in manual_node at setup. */
+static struct transaction *conn_transaction(struct connection *conn)
 {
-	/* conn = NULL used in manual_node at setup. */
-	if (!conn || !conn->transaction)
-		return tdb_ctx;
-	return tdb_transaction_context(conn->transaction);
+	return conn ? conn->transaction : NULL;
 }
 
-bool replace_tdb(const char *newname, TDB_CONTEXT *newtdb)
+static bool store_record(struct transaction *trans, const struct node *node)
 {
-	if (rename(newname, xs_daemon_tdb()) != 0)
+	if (trans)
+		return transaction_store(trans, node);
+	if (!store_write(node))
 		return false;
-	tdb_close(tdb_ctx);
-	tdb_ctx = talloc_steal(talloc_autofree_context(), newtdb);
+	transaction_node_changed(node->name);
+	return true;
+}
+
+static bool delete_record(struct transaction *trans, const char *name)
+{
+	if (trans)
+		return transaction_delete(trans, name);
+	if (!store_delete(name))
+		return false;
+	transaction_node_changed(name);
 	return true;
 }
 
@@ -292,11 +331,102 @@ static int destroy_conn(void *_conn)
         if (conn->target)
                 talloc_unlink(conn, conn->target);
 	list_del(&conn->list);
+	list_del(&conn->ready_list);
 	trace_destroy(conn, "connection");
 	return 0;
 }
 
 
+void conn_ready(struct connection *conn)
+{
+	if (list_empty(&conn->ready_list)) {
+		gettimeofday(&conn->ready_time, NULL);
+		list_add_tail(&conn->ready_list, &ready_connections);
+	}
+}
+
+/*
+ * Sockets are polled with epoll where there is one, so a wakeup only costs
+ * the connections that have something to do.  Domain rings have no fd:
+ * they are put on the ready list by their event channel (handle_event) or
+ * when output is queued for them.  Socket connections found readable or
+ * writable are put on the ready list too, and poll_wait() returns the
+ * other fds that are ready, by the pointer they were added with.  It waits
+ * for up to timeout milliseconds, or for ever if timeout is negative.
+ */
+#define MAX_POLL_EVENTS 64
+#define MAX_POLL_FDS 4
+
+static struct {
+	int fd;
+	void *ptr;
+} poll_fds[MAX_POLL_FDS];
+static unsigned int nr_poll_fds;
+
+static void conn_set_ready(struct connection *conn, unsigned int events)
+{
+	conn->ready_events |= events;
+	conn_ready(conn);
+}
+
+#ifdef USE_EPOLL
+static int epoll_fd = -1;
+
+static void poll_ctl(int op, int fd, unsigned int events, void *ptr)
+{
+	struct epoll_event ev;
+
+	memset(&ev, 0, sizeof(ev));
+	ev.events = ((events & POLLIN) ? EPOLLIN : 0) |
+		((events & POLLOUT) ? EPOLLOUT : 0);
+	ev.data.ptr = ptr;
+	if (epoll_ctl(epoll_fd, op, fd, &ev) != 0)
+		barf_perror("epoll_ctl failed");
+}
+
+static void poll_init(void)
+{
+	epoll_fd = epoll_create(MAX_POLL_EVENTS);
+	if (epoll_fd < 0)
+		barf_perror("Could not create epoll fd");
+}
+
+static void poll_add_conn(struct connection *conn)
+{
+	poll_ctl(EPOLL_CTL_ADD, conn->fd, POLLIN, conn);
+}
+
+static void conn_set_output(struct connection *conn, bool want)
+{
+	if (conn->domain || conn->want_output == want)
+		return;
+	conn->want_output = want;
+	poll_ctl(EPOLL_CTL_MOD, conn->fd, POLLIN | (want ? POLLOUT : 0), conn);
+}
+
+static int poll_wait(void **ready, int timeout)
+{
+	struct epoll_event ev[MAX_POLL_EVENTS];
+	unsigned int j;
+	int i, nr, nr_ready = 0;
+
+	nr = epoll_wait(epoll_fd, ev, MAX_POLL_EVENTS, timeout);
+	for (i = 0; i < nr; i++) {
+		for (j = 0; j < nr_poll_fds; j++)
+			if (ev[i].data.ptr == poll_fds[j].ptr)
+				break;
+		if (j < nr_poll_fds) {
+			ready[nr_ready++] = ev[i].data.ptr;
+			continue;
+		}
+		/* Errors and hangups show up when reading. */
+		conn_set_ready(ev[i].data.ptr,
+			       ((ev[i].events & EPOLLOUT) ? POLLOUT : 0) |
+			       ((ev[i].events & ~EPOLLOUT) ? POLLIN : 0));
+	}
+	return nr < 0 ? nr : nr_ready;
+}
+#else
 static void set_fd(int fd, fd_set *set, int *max)
 {
 	if (fd < 0)
@@ -306,40 +436,72 @@ static void set_fd(int fd, fd_set *set, int *max)
 		*max = fd;
 }
 
+static void poll_init(void)
+{
+}
+
+static void poll_add_conn(struct connection *conn)
+{
+}
 
-static int initialize_set(fd_set *inset, fd_set *outset, int sock, int ro_sock,
-			  struct timeval **ptimeout)
+static void conn_set_output(struct connection *conn, bool want)
 {
-	static struct timeval zero_timeout = { 0 };
+	conn->want_output = want;
+}
+
+static int poll_wait(void **ready, int timeout)
+{
+	struct timeval tv = { timeout / 1000, (timeout % 1000) * 1000 };
 	struct connection *conn;
-	int max = -1;
+	fd_set inset, outset;
+	unsigned int i, events;
+	int max = -1, nr_ready = 0;
 
-	*ptimeout = NULL;
+	FD_ZERO(&inset);
+	FD_ZERO(&outset);
 
-	FD_ZERO(inset);
-	FD_ZERO(outset);
+	for (i = 0; i < nr_poll_fds; i++)
+		set_fd(poll_fds[i].fd, &inset, &max);
 
-	set_fd(sock,               inset, &max);
-	set_fd(ro_sock,            inset, &max);
-	set_fd(reopen_log_pipe[0], inset, &max);
+	list_for_each_entry(conn, &connections, list) {
+		if (conn->domain)
+			continue;
+		set_fd(conn->fd, &inset, &max);
+		if (conn->want_output)
+			FD_SET(conn->fd, &outset);
+	}
 
-	if (xce_handle != -1)
-		set_fd(xc_evtchn_fd(xce_handle), inset, &max);
+	if (select(max+1, &inset, &outset, NULL,
+		   timeout < 0 ? NULL : &tv) < 0)
+		return -1;
+
+	for (i = 0; i < nr_poll_fds; i++)
+		if (FD_ISSET(poll_fds[i].fd, &inset))
+			ready[nr_ready++] = poll_fds[i].ptr;
 
 	list_for_each_entry(conn, &connections, list) {
-		if (conn->domain) {
-			if (domain_can_read(conn) ||
-			    (domain_can_write(conn) &&
-			     !list_empty(&conn->out_list)))
-				*ptimeout = &zero_timeout;
-		} else {
-			set_fd(conn->fd, inset, &max);
-			if (!list_empty(&conn->out_list))
-				FD_SET(conn->fd, outset);
-		}
+		if (conn->domain)
+			continue;
+		events = (FD_ISSET(conn->fd, &inset) ? POLLIN : 0) |
+			(FD_ISSET(conn->fd, &outset) ? POLLOUT : 0);
+		if (events)
+			conn_set_ready(conn, events);
 	}
+	return nr_ready;
+}
+#endif
 
-	return max;
+static void poll_add_fd(int fd, void *ptr)
+{
+	if (fd < 0)
+		return;
+	assert(nr_poll_fds < MAX_POLL_FDS);
+	poll_fds[nr_poll_fds].fd = fd;
+	poll_fds[nr_poll_fds].ptr = ptr;
+	nr_poll_fds++;
+#ifdef USE_EPOLL
+	poll_ctl(EPOLL_CTL_ADD, fd, POLLIN, ptr);
+#endif
 }
 
 static int destroy_fd(void *_fd)
@@ -365,85 +527,55 @@ bool is_child(const char *child, const char *parent)
 	return child[len] == '/' || child[len] == '\0';
 }
 
-/* If it fails, returns NULL and sets errno. */
-static struct node *read_node(struct connection *conn, const char *name)
+/* If it fails, returns NULL and sets errno.  The node is the store's (or
+ * the transaction's), valid until the request is done: use copy_node() to
+ * change it. */
+static const struct node *read_node(struct connection *conn, const char *name)
 {
-	TDB_DATA key, data;
-	uint32_t *p;
-	struct node *node;
-	TDB_CONTEXT * context = tdb_context(conn);
+	const struct node *node;
+	struct transaction *trans = conn_transaction(conn);
 
-	key.dptr = (void *)name;
-	key.dsize = strlen(name);
-	data = tdb_fetch(context, key);
+	if (!trans || !transaction_fetch(trans, name, &node))
+		node = store_lookup(name);
+	if (!node)
+		errno = ENOENT;
+	return node;
+}
 
-	if (data.dptr == NULL) {
-		if (tdb_error(context) == TDB_ERR_NOEXIST)
-			errno = ENOENT;
-		else {
-			log("TDB error on read: %s", tdb_errorstr(context));
-			errno = EIO;
-		}
+/* A node to change and write back.  Its name, permissions, data and
+ * children are still the store's: replace them rather than change them
+ * in place. */
+static struct node *copy_node(struct connection *conn, const void *ctx,
+			      const struct node *node)
+{
+	struct node *copy = talloc(ctx, struct node);
+
+	if (!copy) {
+		errno = ENOMEM;
 		return NULL;
 	}
-
-	node = talloc(name, struct node);
-	node->name = talloc_strdup(node, name);
-	node->parent = NULL;
-	node->tdb = tdb_context(conn);
-	talloc_steal(node, data.dptr);
-
-	/* Datalen, childlen, number of permissions */
-	p = (uint32_t *)data.dptr;
-	node->num_perms = p[0];
-	node->datalen = p[1];
-	node->childlen = p[2];
-
-	/* Permissions are struct xs_permissions. */
-	node->perms = (void *)&p[3];
-	/* Data is binary blob (usually ascii, no nul). */
-	node->data = node->perms + node->num_perms;
-	/* Children is strings, nul separated. */
-	node->children = node->data + node->datalen;
-
-	return node;
+	*copy = *node;
+	copy->trans = conn_transaction(conn);
+	return copy;
 }
 
 static bool write_node(struct connection *conn, const struct node *node)
 {
 	/*
 	 * conn will be null when this is called from manual_node.
-	 * tdb_context copes with this.
+	 * conn_transaction copes with this.
 	 */
 
-	TDB_DATA key, data;
-	void *p;
-
-	key.dptr = (void *)node->name;
-	key.dsize = strlen(node->name);
-
-	data.dsize = 3*sizeof(uint32_t)
+	/* Sized as the record in a tdb snapshot. */
+	unsigned int size = 3*sizeof(uint32_t)
 		+ node->num_perms*sizeof(node->perms[0])
 		+ node->datalen + node->childlen;
 
-	if (domain_is_unprivileged(conn) && data.dsize >= quota_max_entry_size)
+	if (domain_is_unprivileged(conn) && size >= quota_max_entry_size)
 		goto error;
 
-	data.dptr = talloc_size(node, data.dsize);
-	((uint32_t *)data.dptr)[0] = node->num_perms;
-	((uint32_t *)data.dptr)[1] = node->datalen;
-	((uint32_t *)data.dptr)[2] = node->childlen;
-	p = data.dptr + 3 * sizeof(uint32_t);
-
-	memcpy(p, node->perms, node->num_perms*sizeof(node->perms[0]));
-	p += node->num_perms*sizeof(node->perms[0]);
-	memcpy(p, node->data, node->datalen);
-	p += node->datalen;
-	memcpy(p, node->children, node->childlen);
-
-	/* TDB should set errno, but doesn't even set ecode AFAICT. */
-	if (tdb_store(tdb_context(conn), key, data, TDB_REPLACE) != 0) {
-		corrupt(conn, "Write of %s failed", key.dptr);
+	if (!store_record(conn_transaction(conn), node)) {
+		corrupt(conn, "Write of %s failed", node->name);
 		goto error;
 	}
 	return true;
@@ -486,7 +618,7 @@ static char *get_parent(const char *node)
 /* What do parents say? */
 static enum xs_perm_type ask_parents(struct connection *conn, const char *name)
 {
-	struct node *node;
+	const struct node *node;
 
 	do {
 		name = get_parent(name);
@@ -519,11 +651,11 @@ static int errno_from_parents(struct connection *conn, const char *node,
 }
 
 /* If it fails, returns NULL and sets errno. */
-struct node *get_node(struct connection *conn,
-		      const char *name,
-		      enum xs_perm_type perm)
+const struct node *get_node(struct connection *conn,
+			    const char *name,
+			    enum xs_perm_type perm)
 {
-	struct node *node;
+	const struct node *node;
 
 	if (!name || !is_valid_nodename(name)) {
 		errno = EINVAL;
@@ -619,6 +751,10 @@ void send_reply(struct connection *conn, enum xsd_sockmsg_type type,
 
 	/* Queue for later transmission. */
 	list_add_tail(&bdata->list, &conn->out_list);
+	if (conn->domain)
+		conn_ready(conn);
+	else
+		conn_set_output(conn, true);
 }
 
 /* Some routines (write, mkdir, etc) just need a non-error return */
@@ -724,7 +860,7 @@ bool check_event_node(const char *node)
 
 static void send_directory(struct connection *conn, const char *name)
 {
-	struct node *node;
+	const struct node *node;
 
 	name = canonicalize(conn, name);
 	node = get_node(conn, name, XS_PERM_READ);
@@ -738,7 +874,7 @@ static void send_directory(struct connection *conn, const char *name)
 
 static void do_read(struct connection *conn, const char *name)
 {
-	struct node *node;
+	const struct node *node;
 
 	name = canonicalize(conn, name);
 	node = get_node(conn, name, XS_PERM_READ);
@@ -750,14 +886,10 @@ static void do_read(struct connection *conn, const char *name)
 	send_reply(conn, XS_READ, node->data, node->datalen);
 }
 
-static void delete_node_single(struct connection *conn, struct node *node)
+static void delete_node_single(struct connection *conn,
+			       const struct node *node)
 {
-	TDB_DATA key;
-
-	key.dptr = (void *)node->name;
-	key.dsize = strlen(node->name);
-
-	if (tdb_delete(tdb_context(conn), key) != 0) {
+	if (!delete_record(conn_transaction(conn), node->name)) {
 		corrupt(conn, "Could not delete '%s'", node->name);
 		return;
 	}
@@ -774,12 +906,15 @@ static struct node *construct_node(struct connection *conn, const char *name)
 {
 	const char *base;
 	unsigned int baselen;
+	const struct node *stored;
 	struct node *parent, *node;
 	char *children, *parentname = get_parent(name);
 
 	/* If parent doesn't exist, create it. */
-	parent = read_node(conn, parentname);
-	if (!parent)
+	stored = read_node(conn, parentname);
+	if (stored)
+		parent = copy_node(conn, parentname, stored);
+	else
 		parent = construct_node(conn, parentname);
 	if (!parent)
 		return NULL;
@@ -798,7 +933,7 @@ static struct node *construct_node(struct connection *conn, const char *name)
 
 	/* Allocate node */
 	node = talloc(name, struct node);
-	node->tdb = tdb_context(conn);
+	node->trans = conn_transaction(conn);
 	node->name = talloc_strdup(node, name);
 
 	/* Inherit permissions, except domains own what they create */
@@ -819,15 +954,11 @@ static struct node *construct_node(struct connection *conn, const char *name)
 static int destroy_node(void *_node)
 {
 	struct node *node = _node;
-	TDB_DATA key;
 
 	if (streq(node->name, "/"))
 		corrupt(NULL, "Destroying root node!");
 
-	key.dptr = (void *)node->name;
-	key.dsize = strlen(node->name);
-
-	tdb_delete(node->tdb, key);
+	delete_record(node->trans, node->name);
 	return 0;
 }
 
@@ -864,6 +995,7 @@ static struct node *create_node(struct connection *conn,
 static void do_write(struct connection *conn, struct buffered_data *in)
 {
 	unsigned int offset, datalen;
+	const struct node *stored;
 	struct node *node;
 	char *vec[1] = { NULL }; /* gcc4 + -W + -Werror fucks code. */
 	char *name;
@@ -878,8 +1010,8 @@ static void do_write(struct connection *conn, struct buffered_data *in)
 	datalen = in->used - offset;
 
 	name = canonicalize(conn, vec[0]);
-	node = get_node(conn, name, XS_PERM_WRITE);
-	if (!node) {
+	stored = get_node(conn, name, XS_PERM_WRITE);
+	if (!stored) {
 		/* No permissions, invalid input? */
 		if (errno != ENOENT) {
 			send_error(conn, errno);
@@ -891,6 +1023,11 @@ static void do_write(struct connection *conn, struct buffered_data *in)
 			return;
 		}
 	} else {
+		node = copy_node(conn, name, stored);
+		if (!node) {
+			send_error(conn, errno);
+			return;
+		}
 		node->data = in->buffer + offset;
 		node->datalen = datalen;
 		if (!write_node(conn, node)){
@@ -906,7 +1043,7 @@ static void do_write(struct connection *conn, struct buffered_data *in)
 
 static void do_mkdir(struct connection *conn, const char *name)
 {
-	struct node *node;
+	const struct node *node;
 
 	name = canonicalize(conn, name);
 	node = get_node(conn, name, XS_PERM_WRITE);
@@ -929,7 +1066,7 @@ static void do_mkdir(struct connection *conn, const char *name)
 	send_ack(conn, XS_MKDIR);
 }
 
-static void delete_node(struct connection *conn, struct node *node)
+static void delete_node(struct connection *conn, const struct node *node)
 {
 	unsigned int i;
 
@@ -940,11 +1077,12 @@ static void delete_node(struct connection *conn, struct node *node)
 
 	/* Delete children, too. */
 	for (i = 0; i < node->childlen; i += strlen(node->children+i) + 1) {
-		struct node *child;
+		const struct node *child;
+		char *childname;
 
-		child = read_node(conn, 
-				  talloc_asprintf(node, "%s/%s", node->name,
-						  node->children + i));
+		childname = talloc_asprintf(NULL, "%s/%s", node->name,
+					    node->children + i);
+		child = read_node(conn, childname);
 		if (child) {
 			delete_node(conn, child);
 		}
@@ -953,6 +1091,7 @@ static void delete_node(struct connection *conn, struct node *node)
 			      node->name, node->children + i);
 			/* Skip it, we've already deleted the parent. */
 		}
+		talloc_free(childname);
 	}
 }
 
@@ -968,6 +1107,9 @@ static bool remove_child_entry(struct connection *conn, struct node *node,
 			       size_t offset)
 {
 	size_t childlen = strlen(node->children + offset);
+
+	/* The children may be the store's: cut them from a copy. */
+	node->children = talloc_memdup(node, node->children, node->childlen);
 	memdel(node->children, offset, childlen + 1, node->childlen);
 	node->childlen -= childlen + 1;
 	return write_node(conn, node);
@@ -989,16 +1131,25 @@ static bool delete_child(struct connection *conn,
 }
 
 
-static int _rm(struct connection *conn, struct node *node, const char *name)
+static int _rm(struct connection *conn, const struct node *node,
+	       const char *name)
 {
 	/* Delete from parent first, then if we crash, the worst that can
 	   happen is the child will continue to take up space, but will
 	   otherwise be unreachable. */
-	struct node *parent = read_node(conn, get_parent(name));
-	if (!parent) {
+	char *parentname = get_parent(name);
+	const struct node *stored = read_node(conn, parentname);
+	struct node *parent;
+
+	if (!stored) {
 		send_error(conn, EINVAL);
 		return 0;
 	}
+	parent = copy_node(conn, parentname, stored);
+	if (!parent) {
+		send_error(conn, errno);
+		return 0;
+	}
 
 	if (!delete_child(conn, parent, basename(name))) {
 		send_error(conn, EINVAL);
@@ -1013,17 +1164,16 @@ static int _rm(struct connection *conn, struct node *node, const char *name)
 static void internal_rm(const char *name)
 {
 	char *tname = talloc_strdup(NULL, name);
-	struct node *node = read_node(NULL, tname);
+	const struct node *node = read_node(NULL, tname);
 	if (node)
 		_rm(NULL, node, tname);
-	talloc_free(node);
 	talloc_free(tname);
 }
 
 
 static void do_rm(struct connection *conn, const char *name)
 {
-	struct node *node;
+	const struct node *node;
 
 	name = canonicalize(conn, name);
 	node = get_node(conn, name, XS_PERM_WRITE);
@@ -1057,7 +1207,7 @@ static void do_rm(struct connection *conn, const char *name)
 
 static void do_get_perms(struct connection *conn, const char *name)
 {
-	struct node *node;
+	const struct node *node;
 	char *strings;
 	unsigned int len;
 
@@ -1068,7 +1218,7 @@ static void do_get_perms(struct connection *conn, const char *name)
 		return;
 	}
 
-	strings = perms_to_strings(node, node->perms, node->num_perms, &len);
+	strings = perms_to_strings(name, node->perms, node->num_perms, &len);
 	if (!strings)
 		send_error(conn, errno);
 	else
@@ -1080,6 +1230,7 @@ static void do_set_perms(struct connection *conn, struct buffered_data *in)
 	unsigned int num;
 	struct xs_permissions *perms;
 	char *name, *permstr;
+	const struct node *stored;
 	struct node *node;
 
 	num = xs_count_strings(in->buffer, in->used);
@@ -1094,7 +1245,8 @@ static void do_set_perms(struct connection *conn, struct buffered_data *in)
 	num--;
 
 	/* We must own node to do this (tools can do this too). */
-	node = get_node(conn, name, XS_PERM_WRITE|XS_PERM_OWNER);
+	stored = get_node(conn, name, XS_PERM_WRITE|XS_PERM_OWNER);
+	node = stored ? copy_node(conn, name, stored) : NULL;
 	if (!node) {
 		send_error(conn, errno);
 		return;
@@ -1128,6 +1280,32 @@ static void do_set_perms(struct connection *conn, struct buffered_data *in)
 	send_ack(conn, XS_SET_PERMS);
 }
 
+/* Counters since the last time somebody asked. */
+static void send_stats(struct connection *conn)
+{
+	char *str;
+
+	str = talloc_asprintf(conn,
+		"wakeups: %lu\n"
+		"requests: %lu\n"
+		"latency: avg %llu max %llu us\n"
+		"service: avg %llu max %llu us\n"
+		"ring batches: %lu, avg %lu max %lu requests\n",
+		stats.wakeups, stats.requests,
+		stats.requests ? (unsigned long long)
+			(stats.latency_total / stats.requests) : 0ULL,
+		(unsigned long long)stats.latency_max,
+		stats.requests ? (unsigned long long)
+			(stats.service_total / stats.requests) : 0ULL,
+		(unsigned long long)stats.service_max,
+		stats.ring_batches,
+		stats.ring_batches ? stats.ring_requests / stats.ring_batches : 0,
+		stats.max_batch);
+	send_reply(conn, XS_DEBUG, str, strlen(str) + 1);
+	talloc_free(str);
+	memset(&stats, 0, sizeof(stats));
+}
+
 static void do_debug(struct connection *conn, struct buffered_data *in)
 {
 	int num;
@@ -1150,6 +1328,11 @@ static void do_debug(struct connection *conn, struct buffered_data *in)
 	if (streq(in->buffer, "check"))
 		check_store();
 
+	if (streq(in->buffer, "stats")) {
+		send_stats(conn);
+		return;
+	}
+
 	send_ack(conn, XS_DEBUG);
 }
 
@@ -1251,14 +1434,36 @@ static void process_message(struct connection *conn, struct buffered_data *in)
 	conn->transaction = NULL;
 }
 
+static uint64_t usecs_since(const struct timeval *from,
+			    const struct timeval *to)
+{
+	return (uint64_t)(to->tv_sec - from->tv_sec) * 1000000 +
+		to->tv_usec - from->tv_usec;
+}
+
 static void consider_message(struct connection *conn)
 {
+	struct timeval start, end;
+	uint64_t latency, service;
+
 	if (verbose)
 		xprintf("Got message %s len %i from %p\n",
 			sockmsg_string(conn->in->hdr.msg.type),
 			conn->in->hdr.msg.len, conn);
 
+	gettimeofday(&start, NULL);
 	process_message(conn, conn->in);
+	gettimeofday(&end, NULL);
+
+	latency = usecs_since(&conn->ready_time, &end);
+	service = usecs_since(&start, &end);
+	stats.requests++;
+	stats.latency_total += latency;
+	stats.service_total += service;
+	if (latency > stats.latency_max)
+		stats.latency_max = latency;
+	if (service > stats.service_max)
+		stats.service_max = service;
 
 	talloc_free(conn->in);
 	conn->in = new_buffer(conn);
@@ -1317,6 +1522,83 @@ static void handle_output(struct connection *conn)
 {
 	if (!write_messages(conn))
 		talloc_free(conn);
+	else if (list_empty(&conn->out_list))
+		conn_set_output(conn, false);
+}
+
+static void handle_socket(struct connection *conn)
+{
+	unsigned int events = conn->ready_events;
+
+	conn->ready_events = 0;
+
+	talloc_increase_ref_count(conn);
+	if (events & POLLIN)
+		handle_input(conn);
+	if (talloc_free(conn) == 0)
+		return;
+
+	talloc_increase_ref_count(conn);
+	if ((events & POLLOUT) && !list_empty(&conn->out_list))
+		handle_output(conn);
+	talloc_free(conn);
+}
+
+/* Take a batch of requests off the ring, write out what fits of the
+ * replies, and let the domain know once. */
+static void handle_ring(struct connection *conn)
+{
+	unsigned long requests = stats.requests;
+	struct timeval ready_time = conn->ready_time;
+	unsigned int n;
+
+	for (n = 0; n < RING_BATCH * 2 && domain_can_read(conn); n++) {
+		talloc_increase_ref_count(conn);
+		handle_input(conn);
+		if (talloc_free(conn) == 0)
+			return;
+	}
+
+	while (!list_empty(&conn->out_list) && domain_can_write(conn)) {
+		talloc_increase_ref_count(conn);
+		handle_output(conn);
+		if (talloc_free(conn) == 0)
+			return;
+	}
+
+	/* Out of batch: come back after the others had their turn.  Output
+	 * that didn't fit waits for the domain to signal it made room. */
+	if (domain_can_read(conn)) {
+		conn_ready(conn);
+		/* The requests left have been waiting since then. */
+		conn->ready_time = ready_time;
+	}
+	domain_notify(conn);
+
+	requests = stats.requests - requests;
+	if (requests) {
+		stats.ring_batches++;
+		stats.ring_requests += requests;
+		if (requests > stats.max_batch)
+			stats.max_batch = requests;
+	}
+}
+
+static void handle_ready_connections(void)
+{
+	struct connection *conn;
+	LIST_HEAD(work);
+
+	/* Connections handled here can free others, or make them ready
+	 * again for the next round. */
+	list_splice_init(&ready_connections, &work);
+	while ((conn = list_top(&work, struct connection, ready_list))) {
+		list_del_init(&conn->ready_list);
+		if (conn->domain)
+			handle_ring(conn);
+		else
+			handle_socket(conn);
+	}
 }
 
 struct connection *new_connection(connwritefn_t *write, connreadfn_t *read)
@@ -1332,6 +1614,7 @@ struct connection *new_connection(connwritefn_t *write, connreadfn_t *read)
 	new->read = read;
 	new->can_write = true;
 	new->transaction_started = 0;
+	INIT_LIST_HEAD(&new->ready_list);
 	INIT_LIST_HEAD(&new->out_list);
 	INIT_LIST_HEAD(&new->watches);
 	INIT_LIST_HEAD(&new->transaction_list);
@@ -1399,12 +1682,11 @@ static void accept_connection(int sock, bool canwrite)
 	if (conn) {
 		conn->fd = fd;
 		conn->can_write = canwrite;
+		poll_add_conn(conn);
 	} else
 		close(fd);
 }
 
-#define TDB_FLAGS 0
-
 /* We create initial nodes manually. */
 static void manual_node(const char *name, const char *child)
 {
@@ -1426,11 +1708,7 @@ static void manual_node(const char *name, const char *child)
 
 static void setup_structure(void)
 {
-	char *tdbname;
-	tdbname = talloc_strdup(talloc_autofree_context(), xs_daemon_tdb());
-	tdb_ctx = tdb_open(tdbname, 0, TDB_FLAGS, O_RDWR, 0);
-
-	if (tdb_ctx) {
+	if (store_import(xs_daemon_tdb())) {
 		/* XXX When we make xenstored able to restart, this will have
 		   to become cleverer, checking for existing domains and not
 		   removing the corresponding entries, but for now xenstored
@@ -1459,10 +1737,9 @@ static void setup_structure(void)
 		talloc_free(tlocal);
 	}
 	else {
-		tdb_ctx = tdb_open(tdbname, 7919, TDB_FLAGS, O_RDWR|O_CREAT,
-				   0640);
-		if (!tdb_ctx)
-			barf_perror("Could not create tdb file %s", tdbname);
+		if (errno != ENOENT)
+			barf_perror("Could not read tdb file %s",
+				    xs_daemon_tdb());
 
 		manual_node("/", "tool");
 		manual_node("/tool", "xenstored");
@@ -1472,8 +1749,34 @@ static void setup_structure(void)
 	}
 }
 
+/* Milliseconds until a snapshot of the store is due, -1 if none is. */
+static int snapshot_timeout(void)
+{
+	time_t now, wait;
+
+	if (!snapshot_interval || !store_changed())
+		return -1;
+	now = time(NULL);
+	if (now >= next_snapshot)
+		return 0;
+	/* The clock may have been set back. */
+	wait = next_snapshot - now;
+	if (wait > snapshot_interval)
+		wait = snapshot_interval;
+	return wait * 1000;
+}
+
+static void snapshot_store(void)
+{
+	if (snapshot_timeout() != 0)
+		return;
+	if (!store_export(xs_daemon_tdb()))
+		log("Snapshot of the store failed: %s", strerror(errno));
+	next_snapshot = time(NULL) + snapshot_interval;
+}
+
 
-static unsigned int hash_from_key_fn(void *k)
+unsigned int hash_from_key_fn(void *k)
 {
 	char *str = k;
 	unsigned int hash = 5381;
@@ -1486,7 +1789,7 @@ static unsigned int hash_from_key_fn(void *k)
 }
 
 
-static int keys_equal_fn(void *key1, void *key2)
+int keys_equal_fn(void *key1, void *key2)
 {
 	return 0 == strcmp((char *)key1, (char *)key2);
 }
@@ -1526,9 +1829,11 @@ static void remember_string(struct hashtable *hash, const char *str)
  */
 static void check_store_(const char *name, struct hashtable *reachable)
 {
-	struct node *node = read_node(NULL, name);
+	const struct node *stored = read_node(NULL, name);
+	struct node *node;
 
-	if (node) {
+	/* A copy, to take out bad children in recovery mode. */
+	if (stored && (node = copy_node(NULL, NULL, stored))) {
 		size_t i = 0;
 
 		struct hashtable * children =
@@ -1540,7 +1845,7 @@ static void check_store_(const char *name, struct hashtable *reachable)
 			size_t childlen = strlen(node->children + i);
 			char * childname = child_name(node->name,
 						      node->children + i);
-			struct node *childnode = read_node(NULL, childname);
+			const struct node *childnode = read_node(NULL, childname);
 			
 			if (childnode) {
 				if (hashtable_search(children, childname)) {
@@ -1568,7 +1873,6 @@ static void check_store_(const char *name, struct hashtable *reachable)
 				}
 			}
 
-			talloc_free(childnode);
 			talloc_free(childname);
 			i += childlen + 1;
 		}
@@ -1590,22 +1894,16 @@ static void check_store_(const char *name, struct hashtable *reachable)
 /**
  * Helper to clean_store below.
  */
-static int clean_store_(TDB_CONTEXT *tdb, TDB_DATA key, TDB_DATA val,
-			void *private)
+static void clean_store_(const struct node *node, void *private)
 {
 	struct hashtable *reachable = private;
-	char * name = talloc_strndup(NULL, key.dptr, key.dsize);
 
-	if (!hashtable_search(reachable, name)) {
-		log("clean_store: '%s' is orphaned!", name);
+	if (!hashtable_search(reachable, (void *)node->name)) {
+		log("clean_store: '%s' is orphaned!", node->name);
 		if (recovery) {
-			tdb_delete(tdb, key);
+			store_delete(node->name);
 		}
 	}
-
-	talloc_free(name);
-
-	return 0;
 }
 
 
@@ -1615,7 +1913,7 @@ static int clean_store_(TDB_CONTEXT *tdb, TDB_DATA key, TDB_DATA val,
  */
 static void clean_store(struct hashtable *reachable)
 {
-	tdb_traverse(tdb_ctx, &clean_store_, reachable);
+	store_traverse(&clean_store_, reachable);
 }
 
 
@@ -1724,6 +2022,9 @@ static void usage(void)
 "  --no-recovery       to request that no recovery should be attempted when\n"
 "                      the store is corrupted (debug only),\n"
 "  --preserve-local    to request that /local is preserved on start-up,\n"
+"  --snapshot-interval <secs>\n"
+"                      to write the store, which is kept in memory, out to\n"
+"                      its tdb file at most this often while it changes,\n"
 "  --verbose           to request verbose execution.\n");
 }
 
@@ -1740,6 +2041,7 @@ static struct option options[] = {
 	{ "transaction", 1, NULL, 't' },
 	{ "no-recovery", 0, NULL, 'R' },
 	{ "preserve-local", 0, NULL, 'L' },
+	{ "snapshot-interval", 1, NULL, 'I' },
 	{ "verbose", 0, NULL, 'V' },
 	{ "watch-nb", 1, NULL, 'W' },
 	{ NULL, 0, NULL, 0 } };
@@ -1748,17 +2050,17 @@ extern void dump_conn(struct connection *conn);
 
 int main(int argc, char *argv[])
 {
-	int opt, *sock, *ro_sock, max;
+	int opt, *sock, *ro_sock;
 	struct sockaddr_un addr;
-	fd_set inset, outset;
 	bool dofork = true;
 	bool outputpid = false;
 	bool no_domain_init = false;
 	const char *pidfile = NULL;
 	int evtchn_fd = -1;
-	struct timeval *timeout;
+	void *ready[MAX_POLL_FDS];
+	int i, nr_ready, timeout;
 
-	while ((opt = getopt_long(argc, argv, "DE:F:HNPS:t:T:RLVW:", options,
+	while ((opt = getopt_long(argc, argv, "DE:F:HI:NPS:t:T:RLVW:", options,
 				  NULL)) != -1) {
 		switch (opt) {
 		case 'D':
@@ -1773,6 +2075,20 @@ int main(int argc, char *argv[])
 		case 'H':
 			usage();
 			return 0;
+		case 'I': {
+			char *end;
+			long secs;
+
+			errno = 0;
+			secs = strtol(optarg, &end, 10);
+			/* In milliseconds, it must fit a poll timeout. */
+			if (errno || end == optarg || *end || secs < 0 ||
+			    secs > MAX_SNAPSHOT_INTERVAL)
+				barf("%s: invalid snapshot interval '%s'",
+				     argv[0], optarg);
+			snapshot_interval = secs;
+			break;
+		}
 		case 'N':
 			dofork = false;
 			break;
@@ -1905,76 +2221,47 @@ int main(int argc, char *argv[])
 		evtchn_fd = xc_evtchn_fd(xce_handle);
 
 	/* Get ready to listen to the tools. */
-	max = initialize_set(&inset, &outset, *sock, *ro_sock, &timeout);
+	poll_init();
+	poll_add_fd(*sock, sock);
+	poll_add_fd(*ro_sock, ro_sock);
+	poll_add_fd(reopen_log_pipe[0], reopen_log_pipe);
+	poll_add_fd(evtchn_fd, &evtchn_fd);
 
 	/* Tell the kernel we're up and running. */
 	xenbus_notify_running();
 
 	/* Main loop. */
 	for (;;) {
-		struct connection *conn, *next;
-
-		if (select(max+1, &inset, &outset, NULL, timeout) < 0) {
+		/* Don't sleep while a ring has requests left over. */
+		timeout = list_empty(&ready_connections) ?
+			snapshot_timeout() : 0;
+		nr_ready = poll_wait(ready, timeout);
+		if (nr_ready < 0) {
 			if (errno == EINTR)
 				continue;
-			barf_perror("Select failed");
+			barf_perror("Poll failed");
 		}
-
-		if (FD_ISSET(reopen_log_pipe[0], &inset)) {
-			char c;
-			if (read(reopen_log_pipe[0], &c, 1) != 1)
-				barf_perror("read failed");
-			reopen_log();
+		stats.wakeups++;
+
+		for (i = 0; i < nr_ready; i++) {
+			if (ready[i] == reopen_log_pipe) {
+				char c;
+				if (read(reopen_log_pipe[0], &c, 1) != 1)
+					barf_perror("read failed");
+				reopen_log();
+			} else if (ready[i] == sock)
+				accept_connection(*sock, true);
+			else if (ready[i] == ro_sock)
+				accept_connection(*ro_sock, false);
+			else if (ready[i] == &evtchn_fd)
+				handle_event();
 		}
 
-		if (FD_ISSET(*sock, &inset))
-			accept_connection(*sock, true);
-
-		if (FD_ISSET(*ro_sock, &inset))
-			accept_connection(*ro_sock, false);
-
-		if (evtchn_fd != -1 && FD_ISSET(evtchn_fd, &inset))
-			handle_event();
-
-		next = list_entry(connections.next, typeof(*conn), list);
-		if (&next->list != &connections)
-			talloc_increase_ref_count(next);
-		while (&next->list != &connections) {
-			conn = next;
-
-			next = list_entry(conn->list.next,
-					  typeof(*conn), list);
-			if (&next->list != &connections)
-				talloc_increase_ref_count(next);
-
-			if (conn->domain) {
-				if (domain_can_read(conn))
-					handle_input(conn);
-				if (talloc_free(conn) == 0)
-					continue;
-
-				talloc_increase_ref_count(conn);
-				if (domain_can_write(conn) &&
-				    !list_empty(&conn->out_list))
-					handle_output(conn);
-				if (talloc_free(conn) == 0)
-					continue;
-			} else {
-				if (FD_ISSET(conn->fd, &inset))
-					handle_input(conn);
-				if (talloc_free(conn) == 0)
-					continue;
-
-				talloc_increase_ref_count(conn);
-				if (FD_ISSET(conn->fd, &outset))
-					handle_output(conn);
-				if (talloc_free(conn) == 0)
-					continue;
-			}
-		}
+		handle_ready_connections();
 
-		max = initialize_set(&inset, &outset, *sock, *ro_sock,
-				     &timeout);
+		/* Nobody holds on to nodes they looked up any more. */
+		store_release();
+		snapshot_store();
 	}
 }
 
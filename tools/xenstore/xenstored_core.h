@@ -23,6 +23,7 @@
 #include <xenctrl.h>
 
 #include <sys/types.h>
+#include <sys/time.h>
 #include <dirent.h>
 #include <stdbool.h>
 #include <stdint.h>
@@ -93,14 +94,26 @@ struct connection
 	/* Methods for communicating over this connection: write can be NULL */
 	connwritefn_t *write;
 	connreadfn_t *read;
+
+	/* On the list of connections to service in the next loop. */
+	struct list_head ready_list;
+
+	/* When it went on that list. */
+	struct timeval ready_time;
+
+	/* Socket readiness (POLLIN/POLLOUT) reported for it. */
+	unsigned int ready_events;
+
+	/* Is the socket polled for output? */
+	bool want_output;
 };
 extern struct list_head connections;
 
 struct node {
 	const char *name;
 
-	/* Database I came from */
-	TDB_CONTEXT *tdb;
+	/* Transaction I came from, NULL for the global database */
+	struct transaction *trans;
 
 	/* Parent (optional) */
 	struct node *parent;
@@ -141,21 +154,22 @@ char *canonicalize(struct connection *conn, const char *node);
 bool check_event_node(const char *node);
 
 /* Get this node, checking we have permissions. */
-struct node *get_node(struct connection *conn,
-		      const char *name,
-		      enum xs_perm_type perm);
-
-/* Get TDB context for this connection */
-TDB_CONTEXT *tdb_context(struct connection *conn);
+const struct node *get_node(struct connection *conn,
+			    const char *name,
+			    enum xs_perm_type perm);
 
 /* Destructor for tdbs: required for transaction code */
 int destroy_tdb(void *_tdb);
 
-/* Replace the tdb: required for transaction code */
-bool replace_tdb(const char *newname, TDB_CONTEXT *newtdb);
+/* Hashtable callbacks for malloced string keys */
+unsigned int hash_from_key_fn(void *k);
+int keys_equal_fn(void *key1, void *key2);
 
 struct connection *new_connection(connwritefn_t *write, connreadfn_t *read);
 
+/* Service this connection in the next round of the main loop. */
+void conn_ready(struct connection *conn);
+
 
 /* Is this a valid node name? */
 bool is_valid_nodename(const char *node);
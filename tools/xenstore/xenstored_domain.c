@@ -22,6 +22,7 @@
 #include <unistd.h>
 #include <stdlib.h>
 #include <stdarg.h>
+#include <poll.h>
 
 #include "utils.h"
 #include "talloc.h"
@@ -72,10 +73,39 @@ struct domain
 
 	/* number of watch for this domain */
 	int nbwatch;
+
+	/* Have we moved the ring indexes since we last notified it? */
+	bool notify;
 };
 
 static LIST_HEAD(domains);
 
+/* Domains by local event channel port. */
+static struct domain **port_domains;
+static unsigned int nr_port_domains;
+
+/* Pending ports taken per wakeup. */
+#define EVENT_BATCH 64
+
+static void set_port_domain(evtchn_port_t port, struct domain *domain)
+{
+	if (port >= nr_port_domains) {
+		unsigned int nr = port + 64;
+		struct domain **p;
+
+		if (!domain)
+			return;
+		p = realloc(port_domains, nr * sizeof(*p));
+		if (!p)
+			barf_perror("Failed to allocate port table");
+		memset(p + nr_port_domains, 0,
+		       (nr - nr_port_domains) * sizeof(*p));
+		port_domains = p;
+		nr_port_domains = nr;
+	}
+	port_domains[port] = domain;
+}
+
 static bool check_indexes(XENSTORE_RING_IDX cons, XENSTORE_RING_IDX prod)
 {
 	return ((prod - cons) <= XENSTORE_RING_SIZE);
@@ -127,7 +157,8 @@ static int writechn(struct connection *conn,
 	xen_mb();
 	intf->rsp_prod += len;
 
-	xc_evtchn_notify(xce_handle, conn->domain->port);
+	/* Notified once per batch, by domain_notify(). */
+	conn->domain->notify = true;
 
 	return len;
 }
@@ -157,7 +188,7 @@ static int readchn(struct connection *conn, void *data, unsigned int len)
 	xen_mb();
 	intf->req_cons += len;
 
-	xc_evtchn_notify(xce_handle, conn->domain->port);
+	conn->domain->notify = true;
 
 	return len;
 }
@@ -169,6 +200,7 @@ static int destroy_domain(void *_domain)
 	list_del(&domain->list);
 
 	if (domain->port) {
+		set_port_domain(domain->port, NULL);
 		if (xc_evtchn_unbind(xce_handle, domain->port) == -1)
 			eprintf("> Unbinding port %i failed!\n", domain->port);
 	}
@@ -207,19 +239,33 @@ static void domain_cleanup(void)
 		fire_watches(NULL, "@releaseDomain", false);
 }
 
-/* We scan all domains rather than use the information given here. */
+/* Queue the domains whose ports fired, taking what's pending at once. */
 void handle_event(void)
 {
+	struct pollfd pfd = { .fd = xc_evtchn_fd(xce_handle), .events = POLLIN };
 	evtchn_port_t port;
+	unsigned int n = 0;
+
+	do {
+		if ((port = xc_evtchn_pending(xce_handle)) == -1)
+			barf_perror("Failed to read from event fd");
 
-	if ((port = xc_evtchn_pending(xce_handle)) == -1)
-		barf_perror("Failed to read from event fd");
+		if (port == virq_port)
+			domain_cleanup();
+		else if (port < nr_port_domains && port_domains[port])
+			conn_ready(port_domains[port]->conn);
 
-	if (port == virq_port)
-		domain_cleanup();
+		if (xc_evtchn_unmask(xce_handle, port) == -1)
+			barf_perror("Failed to write to event fd");
+	} while (++n < EVENT_BATCH && poll(&pfd, 1, 0) == 1);
+}
 
-	if (xc_evtchn_unmask(xce_handle, port) == -1)
-		barf_perror("Failed to write to event fd");
+void domain_notify(struct connection *conn)
+{
+	if (conn->domain->notify) {
+		conn->domain->notify = false;
+		xc_evtchn_notify(xce_handle, conn->domain->port);
+	}
 }
 
 bool domain_can_read(struct connection *conn)
@@ -253,6 +299,7 @@ static struct domain *new_domain(void *context, unsigned int domid,
 	domain = talloc(context, struct domain);
 	domain->port = 0;
 	domain->shutdown = 0;
+	domain->notify = false;
 	domain->domid = domid;
 	domain->path = talloc_domain_path(domain, domid);
 
@@ -264,6 +311,7 @@ static struct domain *new_domain(void *context, unsigned int domid,
 	if (rc == -1)
 	    return NULL;
 	domain->port = rc;
+	set_port_domain(domain->port, domain);
 
 	domain->conn = new_connection(writechn, readchn);
 	domain->conn->domain = domain;
@@ -366,10 +414,14 @@ void do_introduce(struct connection *conn, struct buffered_data *in)
 		fire_watches(NULL, "@introduceDomain", false);
 	} else if ((domain->mfn == mfn) && (domain->conn != conn)) {
 		/* Use XS_INTRODUCE for recreating the xenbus event-channel. */
-		if (domain->port)
+		if (domain->port) {
+			set_port_domain(domain->port, NULL);
 			xc_evtchn_unbind(xce_handle, domain->port);
+		}
 		rc = xc_evtchn_bind_interdomain(xce_handle, domid, port);
 		domain->port = (rc == -1) ? 0 : rc;
+		if (domain->port)
+			set_port_domain(domain->port, domain);
 		domain->remote_port = port;
 	} else {
 		send_error(conn, EINVAL);
@@ -377,6 +429,8 @@ void do_introduce(struct connection *conn, struct buffered_data *in)
 	}
 
 	domain_conn_reset(domain);
+	/* It may have queued requests before we were listening. */
+	conn_ready(domain->conn);
 
 	send_ack(conn, XS_INTRODUCE);
 }
@@ -575,6 +629,7 @@ static int dom0_init(void)
 	talloc_steal(dom0->conn, dom0); 
 
 	xc_evtchn_notify(xce_handle, dom0->port); 
+	conn_ready(dom0->conn);
 
 	return 0; 
 }
@@ -609,7 +664,7 @@ int domain_init(void)
 	return xce_handle;
 }
 
-void domain_entry_inc(struct connection *conn, struct node *node)
+void domain_entry_inc(struct connection *conn, const struct node *node)
 {
 	struct domain *d;
 
@@ -635,7 +690,7 @@ void domain_entry_inc(struct connection *conn, struct node *node)
 	}
 }
 
-void domain_entry_dec(struct connection *conn, struct node *node)
+void domain_entry_dec(struct connection *conn, const struct node *node)
 {
 	struct domain *d;
 
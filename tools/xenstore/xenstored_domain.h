@@ -53,11 +53,14 @@ void restore_existing_connections(void);
 bool domain_can_read(struct connection *conn);
 bool domain_can_write(struct connection *conn);
 
+/* Send the event the ring accesses since the last call owe the domain. */
+void domain_notify(struct connection *conn);
+
 bool domain_is_unprivileged(struct connection *conn);
 
 /* Quota manipulation */
-void domain_entry_inc(struct connection *conn, struct node *);
-void domain_entry_dec(struct connection *conn, struct node *);
+void domain_entry_inc(struct connection *conn, const struct node *);
+void domain_entry_dec(struct connection *conn, const struct node *);
 void domain_entry_fix(unsigned int domid, int num);
 int domain_entry(struct connection *conn);
 void domain_watch_inc(struct connection *conn);
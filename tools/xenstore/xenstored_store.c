@@ -0,0 +1,324 @@
+/*
+    Node store for Xen Store Daemon.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+#include <stdio.h>
+#include <sys/types.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <string.h>
+#include "talloc.h"
+#include "list.h"
+#include "hashtable.h"
+#include "xenstored_store.h"
+#include "xs_lib.h"
+#include "utils.h"
+
+/*
+ * The nodes live in memory, indexed by name.  Each is kept as a struct node
+ * with its permissions, data and children in the same allocation, so a
+ * lookup hands out the node itself rather than a copy.  A changed node is
+ * replaced by a new copy; the old one, like a deleted one, is only freed
+ * by store_release(), so nodes looked up while handling a request stay
+ * valid to its end.  A tdb file is only read at start up, and written
+ * when the daemon takes a snapshot.
+ */
+struct store_entry
+{
+	/* List of all nodes, for traversing the store. */
+	struct list_head list;
+
+	struct node *node;
+};
+
+#define TDB_FLAGS 0
+
+static struct hashtable *nodes;
+static LIST_HEAD(entries);
+static void *retired;
+static bool changed;
+
+const struct node *store_lookup(const char *name)
+{
+	struct store_entry *e;
+
+	if (!nodes)
+		return NULL;
+	e = hashtable_search(nodes, (void *)name);
+	return e ? e->node : NULL;
+}
+
+struct node *store_copy_node(const void *ctx, const struct node *node)
+{
+	size_t permlen = node->num_perms * sizeof(node->perms[0]);
+	struct node *copy;
+	char *p;
+
+	copy = talloc_size(ctx, sizeof(*copy) + permlen + node->datalen +
+			   node->childlen + strlen(node->name) + 1);
+	if (!copy)
+		return NULL;
+
+	p = (char *)(copy + 1);
+	copy->trans = NULL;
+	copy->parent = NULL;
+	copy->num_perms = node->num_perms;
+	copy->perms = (void *)p;
+	memcpy(p, node->perms, permlen);
+	p += permlen;
+	copy->datalen = node->datalen;
+	copy->data = p;
+	memcpy(p, node->data, node->datalen);
+	p += node->datalen;
+	copy->childlen = node->childlen;
+	copy->children = p;
+	memcpy(p, node->children, node->childlen);
+	p += node->childlen;
+	strcpy(p, node->name);
+	copy->name = p;
+	return copy;
+}
+
+bool store_write(const struct node *node)
+{
+	struct store_entry *e;
+	struct node *copy;
+	char *key;
+
+	if (!nodes) {
+		nodes = create_hashtable(1024, hash_from_key_fn,
+					 keys_equal_fn);
+		if (!nodes)
+			goto nomem;
+	}
+
+	e = hashtable_search(nodes, (void *)node->name);
+	if (e) {
+		/* node may well be the one we're replacing. */
+		copy = store_copy_node(e, node);
+		if (!copy)
+			goto nomem;
+		store_retire(e->node);
+		e->node = copy;
+		changed = true;
+		return true;
+	}
+
+	e = talloc(talloc_autofree_context(), struct store_entry);
+	if (!e)
+		goto nomem;
+	e->node = store_copy_node(e, node);
+	key = strdup(node->name);
+	if (!e->node || !key || !hashtable_insert(nodes, key, e)) {
+		free(key);
+		talloc_free(e);
+		goto nomem;
+	}
+	list_add_tail(&e->list, &entries);
+	changed = true;
+	return true;
+ nomem:
+	errno = ENOMEM;
+	return false;
+}
+
+bool store_delete(const char *name)
+{
+	struct store_entry *e;
+
+	e = nodes ? hashtable_remove(nodes, (void *)name) : NULL;
+	if (!e) {
+		errno = ENOENT;
+		return false;
+	}
+	list_del(&e->list);
+	store_retire(e);
+	changed = true;
+	return true;
+}
+
+void store_traverse(void (*fn)(const struct node *node, void *private),
+		    void *private)
+{
+	struct store_entry *e, *next;
+
+	list_for_each_entry_safe(e, next, &entries, list)
+		fn(e->node, private);
+}
+
+void store_retire(void *ptr)
+{
+	if (!retired)
+		retired = talloc_new(talloc_autofree_context());
+	talloc_steal(retired, ptr);
+}
+
+void store_release(void)
+{
+	talloc_free(retired);
+	retired = NULL;
+}
+
+bool store_changed(void)
+{
+	return changed;
+}
+
+/* Records are the permissions, data and children after their sizes. */
+static int import_record(TDB_CONTEXT *tdb, TDB_DATA key, TDB_DATA val,
+			 void *private)
+{
+	struct node node;
+	uint32_t *p = (uint32_t *)val.dptr;
+	bool ok;
+
+	/* A bad record is left out: check_store() drops references to it. */
+	if (val.dsize < 3 * sizeof(uint32_t) ||
+	    val.dsize != 3 * sizeof(uint32_t) + p[0] * sizeof(node.perms[0])
+	    + p[1] + p[2])
+		return 0;
+
+	node.name = talloc_strndup(NULL, (char *)key.dptr, key.dsize);
+	node.num_perms = p[0];
+	node.datalen = p[1];
+	node.childlen = p[2];
+	node.perms = (void *)&p[3];
+	node.data = node.perms + node.num_perms;
+	node.children = node.data + node.datalen;
+
+	ok = store_write(&node);
+	talloc_free((char *)node.name);
+	*(bool *)private = ok;
+	return ok ? 0 : -1;
+}
+
+bool store_import(const char *file)
+{
+	/* tdb allocates off its name. */
+	char *tdbname = talloc_strdup(NULL, file);
+	TDB_CONTEXT *tdb;
+	bool ok = true;
+	int saved_errno;
+
+	tdb = tdb_open(tdbname, 0, TDB_FLAGS, O_RDONLY, 0);
+	if (!tdb) {
+		saved_errno = errno;
+		talloc_free(tdbname);
+		errno = saved_errno;
+		return false;
+	}
+
+	if (tdb_traverse(tdb, import_record, &ok) < 0 && ok) {
+		errno = EIO;
+		ok = false;
+	}
+	saved_errno = errno;
+	tdb_close(tdb);
+	talloc_free(tdbname);
+	changed = false;
+	errno = saved_errno;
+	return ok;
+}
+
+static bool export_node(TDB_CONTEXT *tdb, const struct node *node)
+{
+	TDB_DATA key, data;
+	uint32_t *p;
+	int ret;
+
+	key.dptr = (void *)node->name;
+	key.dsize = strlen(node->name);
+	data.dsize = 3 * sizeof(uint32_t)
+		+ node->num_perms * sizeof(node->perms[0])
+		+ node->datalen + node->childlen;
+	data.dptr = talloc_size(NULL, data.dsize);
+	if (!data.dptr) {
+		errno = ENOMEM;
+		return false;
+	}
+
+	p = (uint32_t *)data.dptr;
+	p[0] = node->num_perms;
+	p[1] = node->datalen;
+	p[2] = node->childlen;
+	memcpy(&p[3], node->perms, node->num_perms * sizeof(node->perms[0]));
+	memcpy((char *)&p[3] + node->num_perms * sizeof(node->perms[0]),
+	       node->data, node->datalen);
+	memcpy(data.dptr + data.dsize - node->childlen, node->children,
+	       node->childlen);
+
+	/* TDB should set errno, but doesn't even set ecode AFAICT. */
+	ret = tdb_store(tdb, key, data, TDB_INSERT);
+	talloc_free(data.dptr);
+	if (ret != 0) {
+		errno = EIO;
+		return false;
+	}
+	return true;
+}
+
+/* Written aside and renamed over the old one, which stays complete if we
+ * fail or crash halfway. */
+bool store_export(const char *file)
+{
+	char *tmpname = talloc_asprintf(NULL, "%s.new", file);
+	struct store_entry *e;
+	TDB_CONTEXT *tdb;
+	bool ok = true;
+	int saved_errno;
+
+	unlink(tmpname);
+	tdb = tdb_open(tmpname, 7919, TDB_FLAGS, O_RDWR|O_CREAT|O_EXCL, 0640);
+	if (!tdb) {
+		talloc_free(tmpname);
+		return false;
+	}
+
+	list_for_each_entry(e, &entries, list) {
+		ok = export_node(tdb, e->node);
+		if (!ok)
+			break;
+	}
+
+	saved_errno = errno;
+	if (tdb_close(tdb) != 0 && ok) {
+		saved_errno = EIO;
+		ok = false;
+	}
+	if (ok && rename(tmpname, file) != 0) {
+		saved_errno = errno;
+		ok = false;
+	}
+	if (ok)
+		changed = false;
+	else
+		unlink(tmpname);
+	talloc_free(tmpname);
+	errno = saved_errno;
+	return ok;
+}
+
+/*
+ * Local variables:
+ *  c-file-style: "linux"
+ *  indent-tabs-mode: t
+ *  c-indent-level: 8
+ *  c-basic-offset: 8
+ *  tab-width: 8
+ * End:
+ */
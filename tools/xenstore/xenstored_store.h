@@ -0,0 +1,52 @@
+/*
+    Node store for Xen Store Daemon.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+#ifndef _XENSTORED_STORE_H
+#define _XENSTORED_STORE_H
+#include "xenstored_core.h"
+
+/* The node as the store has it, or NULL.  It stays valid until the next
+ * store_release(), even if the node is changed or deleted meanwhile, but
+ * must not be changed in place. */
+const struct node *store_lookup(const char *name);
+
+/* Copy of node in a single allocation, without trans or parent. */
+struct node *store_copy_node(const void *ctx, const struct node *node);
+
+/* Add or replace a node, or remove one.  If they fail, errno is set. */
+bool store_write(const struct node *node);
+bool store_delete(const char *name);
+
+/* Call fn for every node; fn may delete the node it is given. */
+void store_traverse(void (*fn)(const struct node *node, void *private),
+		    void *private);
+
+/* Keep a node that was looked up around until store_release(). */
+void store_retire(void *ptr);
+
+/* Free the nodes replaced or deleted since the last call. */
+void store_release(void);
+
+/* Has the store changed since it was last exported? */
+bool store_changed(void);
+
+/* Read the nodes from a tdb file, or write all of them to one.  They fail
+ * with errno set; a missing file to import is ENOENT. */
+bool store_import(const char *file);
+bool store_export(const char *file);
+
+#endif /* _XENSTORED_STORE_H */
@@ -28,11 +28,14 @@
 #include <stdlib.h>
 #include <fcntl.h>
 #include <unistd.h>
+#include <string.h>
 #include "talloc.h"
 #include "list.h"
+#include "hashtable.h"
 #include "xenstored_transaction.h"
 #include "xenstored_watch.h"
 #include "xenstored_domain.h"
+#include "xenstored_store.h"
 #include "xs_lib.h"
 #include "utils.h"
 
@@ -48,6 +51,29 @@ struct changed_node
 	bool recurse;
 };
 
+/*
+ * Transactions don't copy the store.  Every node a transaction reads or
+ * writes gets an entry here; writes and deletes are kept in the entry and
+ * only reach the store on commit.  While any transaction is open, changes
+ * to the store are stamped with a generation per node, and a commit fails
+ * if one of the nodes it accessed was changed after it started.  Stamps
+ * are dropped once every open transaction started after them.
+ */
+struct accessed_node
+{
+	/* List of all nodes accessed by this transaction. */
+	struct list_head list;
+
+	/* The name of the node. */
+	char *node;
+
+	/* Written or deleted by this transaction? */
+	bool modified;
+
+	/* The new node if modified, NULL if deleted. */
+	struct node *data;
+};
+
 struct changed_domain
 {
 	/* List of all changed domains in the context of this transaction. */
@@ -65,15 +91,18 @@ struct transaction
 	/* List of all transactions active on this connection. */
 	struct list_head list;
 
+	/* List of all open transactions, oldest first. */
+	struct list_head open_list;
+
 	/* Connection-local identifier for this transaction. */
 	uint32_t id;
 
 	/* Generation when transaction started. */
-	unsigned int generation;
+	uint64_t generation;
 
-	/* TDB to work on, and filename */
-	TDB_CONTEXT *tdb;
-	char *tdb_name;
+	/* Nodes read or written, by name, and in order of access. */
+	struct hashtable *accessed;
+	struct list_head accessed_list;
 
 	/* List of changed nodes. */
 	struct list_head changes;
@@ -82,13 +111,206 @@ struct transaction
 	struct list_head changed_domains;
 };
 
+struct node_stamp
+{
+	/* List of all stamps, oldest first. */
+	struct list_head list;
+
+	/* The name of the node, also its key in node_stamps. */
+	char *node;
+
+	/* Generation of the last change of the node. */
+	uint64_t generation;
+};
+
 extern int quota_max_transaction;
-static unsigned int generation;
+static uint64_t generation;
+
+/* Open transactions, over all connections. */
+static LIST_HEAD(open_transactions);
 
-/* Return tdb context to use for this connection. */
-TDB_CONTEXT *tdb_transaction_context(struct transaction *trans)
+/* Last change of each node changed since the oldest open transaction
+ * started, by name and in order of change. */
+static struct hashtable *node_stamps;
+static LIST_HEAD(node_stamp_list);
+
+/* A change that couldn't be stamped: transactions started before it
+ * must not commit. */
+static uint64_t unstamped_generation;
+
+static struct accessed_node *find_accessed(struct transaction *trans,
+					   const char *name)
+{
+	struct accessed_node *i;
+	char *key;
+
+	i = hashtable_search(trans->accessed, (void *)name);
+	if (i)
+		return i;
+
+	i = talloc_zero(trans, struct accessed_node);
+	i->node = talloc_strdup(i, name);
+	key = strdup(name);
+	if (!key || !hashtable_insert(trans->accessed, key, i)) {
+		free(key);
+		talloc_free(i);
+		return NULL;
+	}
+	list_add_tail(&i->list, &trans->accessed_list);
+	return i;
+}
+
+/* Returns false if trans didn't change the node, so the store has it. */
+bool transaction_fetch(struct transaction *trans, const char *name,
+		       const struct node **node)
 {
-	return trans->tdb;
+	struct accessed_node *i = find_accessed(trans, name);
+
+	if (!i || !i->modified)
+		return false;
+
+	*node = i->data;
+	return true;
+}
+
+/* Nodes fetched before stay valid, like the store's own. */
+bool transaction_store(struct transaction *trans, const struct node *node)
+{
+	struct accessed_node *i = find_accessed(trans, node->name);
+	struct node *copy;
+
+	copy = i ? store_copy_node(i, node) : NULL;
+	if (!copy) {
+		errno = ENOMEM;
+		return false;
+	}
+	if (i->data)
+		store_retire(i->data);
+	i->modified = true;
+	i->data = copy;
+	return true;
+}
+
+bool transaction_delete(struct transaction *trans, const char *name)
+{
+	struct accessed_node *i = find_accessed(trans, name);
+
+	if (!i) {
+		errno = ENOMEM;
+		return false;
+	}
+	if (i->data)
+		store_retire(i->data);
+	i->modified = true;
+	i->data = NULL;
+	return true;
+}
+
+void transaction_node_changed(const char *name)
+{
+	struct node_stamp *stamp;
+	char *key;
+
+	generation++;
+	if (list_empty(&open_transactions))
+		return;
+
+	if (!node_stamps) {
+		node_stamps = create_hashtable(16, hash_from_key_fn,
+					       keys_equal_fn);
+		if (!node_stamps) {
+			unstamped_generation = generation;
+			return;
+		}
+	}
+
+	stamp = hashtable_search(node_stamps, (void *)name);
+	if (stamp) {
+		list_del(&stamp->list);
+	} else {
+		key = strdup(name);
+		stamp = malloc(sizeof(*stamp));
+		if (!key || !stamp ||
+		    !hashtable_insert(node_stamps, key, stamp)) {
+			free(key);
+			free(stamp);
+			unstamped_generation = generation;
+			return;
+		}
+		stamp->node = key;
+	}
+	stamp->generation = generation;
+	list_add_tail(&stamp->list, &node_stamp_list);
+}
+
+/* Stamps no newer than the oldest open transaction can't conflict. */
+static void prune_node_stamps(void)
+{
+	struct node_stamp *stamp, *tmp;
+	uint64_t oldest;
+
+	if (!node_stamps)
+		return;
+
+	if (list_empty(&open_transactions)) {
+		hashtable_destroy(node_stamps, 1);
+		node_stamps = NULL;
+		INIT_LIST_HEAD(&node_stamp_list);
+		return;
+	}
+
+	oldest = list_entry(open_transactions.next, struct transaction,
+			    open_list)->generation;
+	list_for_each_entry_safe(stamp, tmp, &node_stamp_list, list) {
+		if (stamp->generation > oldest)
+			break;
+		list_del(&stamp->list);
+		/* Frees the key, stamp->node. */
+		free(hashtable_remove(node_stamps, stamp->node));
+	}
+}
+
+static bool transaction_conflicts(struct transaction *trans)
+{
+	struct accessed_node *i;
+	struct node_stamp *stamp;
+
+	if (trans->generation < unstamped_generation)
+		return true;
+
+	if (!node_stamps)
+		return false;
+
+	list_for_each_entry(i, &trans->accessed_list, list) {
+		stamp = hashtable_search(node_stamps, i->node);
+		if (stamp && stamp->generation > trans->generation)
+			return true;
+	}
+	return false;
+}
+
+/* Write out the changes: new and updated nodes first, so a crash halfway
+ * leaves orphans for check_store rather than dangling children. */
+static bool transaction_commit(struct transaction *trans)
+{
+	struct accessed_node *i;
+
+	list_for_each_entry(i, &trans->accessed_list, list) {
+		if (!i->modified || !i->data)
+			continue;
+		if (!store_write(i->data))
+			return false;
+		transaction_node_changed(i->node);
+	}
+
+	list_for_each_entry(i, &trans->accessed_list, list) {
+		if (!i->modified || i->data)
+			continue;
+		/* Nodes created and deleted again never made it there. */
+		store_delete(i->node);
+		transaction_node_changed(i->node);
+	}
+	return true;
 }
 
 /* Callers get a change node (which can fail) and only commit after they've
@@ -97,11 +319,9 @@ void add_change_node(struct transaction *trans, const char *node, bool recurse)
 {
 	struct changed_node *i;
 
-	if (!trans) {
-		/* They're changing the global database. */
-		generation++;
+	/* Changes to the global database are stamped as they are written. */
+	if (!trans)
 		return;
-	}
 
 	list_for_each_entry(i, &trans->changes, list)
 		if (streq(i->node, node))
@@ -118,9 +338,10 @@ static int destroy_transaction(void *_transaction)
 	struct transaction *trans = _transaction;
 
 	trace_destroy(trans, "transaction");
-	if (trans->tdb)
-		tdb_close(trans->tdb);
-	unlink(trans->tdb_name);
+	hashtable_destroy(trans->accessed, 0);
+
+	list_del(&trans->open_list);
+	prune_node_stamps();
 	return 0;
 }
 
@@ -158,16 +379,14 @@ void do_transaction_start(struct connection *conn, struct buffered_data *in)
 	trans = talloc(in, struct transaction);
 	INIT_LIST_HEAD(&trans->changes);
 	INIT_LIST_HEAD(&trans->changed_domains);
+	INIT_LIST_HEAD(&trans->accessed_list);
 	trans->generation = generation;
-	trans->tdb_name = talloc_asprintf(trans, "%s.%p",
-					  xs_daemon_tdb(), trans);
-	trans->tdb = tdb_copy(tdb_context(conn), trans->tdb_name);
-	if (!trans->tdb) {
-		send_error(conn, errno);
+	trans->accessed = create_hashtable(16, hash_from_key_fn,
+					   keys_equal_fn);
+	if (!trans->accessed) {
+		send_error(conn, ENOMEM);
 		return;
 	}
-	/* Make it close if we go away. */
-	talloc_steal(trans, trans->tdb);
 
 	/* Pick an unused transaction identifier. */
 	do {
@@ -178,6 +397,7 @@ void do_transaction_start(struct connection *conn, struct buffered_data *in)
 	/* Now we own it. */
 	list_add_tail(&trans->list, &conn->transaction_list);
 	talloc_steal(conn, trans);
+	list_add_tail(&trans->open_list, &open_transactions);
 	talloc_set_destructor(trans, destroy_transaction);
 	conn->transaction_started++;
 
@@ -209,17 +429,14 @@ void do_transaction_end(struct connection *conn, const char *arg)
 	talloc_steal(arg, trans);
 
 	if (streq(arg, "T")) {
-		/* FIXME: Merge, rather failing on any change. */
-		if (trans->generation != generation) {
+		if (transaction_conflicts(trans)) {
 			send_error(conn, EAGAIN);
 			return;
 		}
-		if (!replace_tdb(trans->tdb_name, trans->tdb)) {
+		if (!transaction_commit(trans)) {
 			send_error(conn, errno);
 			return;
 		}
-		/* Don't close this: we won! */
-		trans->tdb = NULL;
 
 		/* fix domain entry for each changed domain */
 		list_for_each_entry(d, &trans->changed_domains, list)
@@ -228,7 +445,6 @@ void do_transaction_end(struct connection *conn, const char *arg)
 		/* Fire off the watches for everything that changed. */
 		list_for_each_entry(i, &trans->changes, list)
 			fire_watches(conn, i->node, i->recurse);
-		generation++;
 	}
 	send_ack(conn, XS_TRANSACTION_END);
 }
@@ -35,8 +35,17 @@ void transaction_entry_dec(struct transaction *trans, unsigned int domid);
 void add_change_node(struct transaction *trans, const char *node,
                      bool recurse);
 
-/* Return tdb context to use for this connection. */
-TDB_CONTEXT *tdb_transaction_context(struct transaction *trans);
+/* Nodes as this transaction sees them.  Fetch returns false if the
+ * transaction didn't change the node; otherwise node is its version, valid
+ * as long as the store's, or NULL if the transaction deleted it.  Store and
+ * delete fail with errno set. */
+bool transaction_fetch(struct transaction *trans, const char *name,
+		       const struct node **node);
+bool transaction_store(struct transaction *trans, const struct node *node);
+bool transaction_delete(struct transaction *trans, const char *name);
+
+/* This node was changed in the global database. */
+void transaction_node_changed(const char *name);
 
 void conn_delete_all_transactions(struct connection *conn);
 
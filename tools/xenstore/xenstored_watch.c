@@ -24,8 +24,10 @@
 #include <sys/time.h>
 #include <time.h>
 #include <assert.h>
+#include <string.h>
 #include "talloc.h"
 #include "list.h"
+#include "hashtable.h"
 #include "xenstored_watch.h"
 #include "xs_lib.h"
 #include "utils.h"
@@ -33,11 +35,36 @@
 
 extern int quota_nb_watch_per_domain;
 
+/*
+ * Watches are indexed by path in a trie, so firing only looks at the
+ * watches on the changed node, its ancestors and, for rm, its children.
+ * Each trie node is also in a hashtable by path, so walking down from "/"
+ * is a lookup per path component.  Event names ("@introduceDomain") hang
+ * off "/", which is_child() considers their parent too.
+ */
+struct watch_node
+{
+	/* Siblings under the parent's children */
+	struct list_head list;
+	struct list_head children;
+	struct watch_node *parent;
+
+	/* Watches on exactly this path */
+	struct list_head watches;
+
+	char *path;
+};
+
 struct watch
 {
 	/* Watches on this connection */
 	struct list_head list;
 
+	/* Watches on the same path */
+	struct list_head node_list;
+	struct watch_node *wnode;
+	struct connection *conn;
+
 	/* Current outstanding events applying to this watch. */
 	struct list_head events;
 
@@ -58,7 +85,7 @@ static void add_event(struct connection *conn,
 
 	if (!check_event_node(name)) {
 		/* Can this conn load node, or see that it doesn't exist? */
-		struct node *node = get_node(conn, name, XS_PERM_READ);
+		const struct node *node = get_node(conn, name, XS_PERM_READ);
 		/*
 		 * XXX We allow EACCES here because otherwise a non-dom0
 		 * backend driver cannot watch for disappearance of a frontend
@@ -86,29 +113,138 @@ static void add_event(struct connection *conn,
 	talloc_free(data);
 }
 
-void fire_watches(struct connection *conn, const char *name, bool recurse)
+/* Path index of the watch trie. */
+static struct hashtable *watch_index;
+
+static struct watch_node *find_watch_node(const char *path)
+{
+	if (!watch_index)
+		return NULL;
+	return hashtable_search(watch_index, (void *)path);
+}
+
+static struct watch_node *get_watch_node(const char *path)
+{
+	struct watch_node *wnode, *parent = NULL;
+	const char *slash;
+	char *key;
+
+	wnode = find_watch_node(path);
+	if (wnode)
+		return wnode;
+
+	if (!watch_index) {
+		watch_index = create_hashtable(16, hash_from_key_fn,
+					       keys_equal_fn);
+		if (!watch_index)
+			return NULL;
+	}
+
+	if (!streq(path, "/")) {
+		char *parent_path;
+
+		slash = strrchr(path + 1, '/');
+		parent_path = slash ?
+			talloc_strndup(NULL, path, slash - path) :
+			talloc_strdup(NULL, "/");
+		parent = get_watch_node(parent_path);
+		talloc_free(parent_path);
+		if (!parent)
+			return NULL;
+	}
+
+	wnode = talloc(NULL, struct watch_node);
+	wnode->path = talloc_strdup(wnode, path);
+	wnode->parent = parent;
+	INIT_LIST_HEAD(&wnode->children);
+	INIT_LIST_HEAD(&wnode->watches);
+	key = strdup(path);
+	if (!key || !hashtable_insert(watch_index, key, wnode)) {
+		free(key);
+		talloc_free(wnode);
+		return NULL;
+	}
+	if (parent)
+		list_add_tail(&wnode->list, &parent->children);
+	return wnode;
+}
+
+/* Drop trie nodes that no longer lead to any watch. */
+static void put_watch_node(struct watch_node *wnode)
+{
+	struct watch_node *parent;
+
+	while (wnode && list_empty(&wnode->watches) &&
+	       list_empty(&wnode->children)) {
+		parent = wnode->parent;
+		if (parent)
+			list_del(&wnode->list);
+		hashtable_remove(watch_index, wnode->path);
+		talloc_free(wnode);
+		wnode = parent;
+	}
+}
+
+static void fire_node_watches(struct watch_node *wnode, const char *name)
 {
-	struct connection *i;
 	struct watch *watch;
 
+	list_for_each_entry(watch, &wnode->watches, node_list)
+		add_event(watch->conn, watch, name ? name : watch->node);
+}
+
+/* Watches below wnode get their own path as event. */
+static void fire_child_watches(struct watch_node *wnode)
+{
+	struct watch_node *child;
+
+	list_for_each_entry(child, &wnode->children, list) {
+		fire_node_watches(child, NULL);
+		fire_child_watches(child);
+	}
+}
+
+void fire_watches(struct connection *conn, const char *name, bool recurse)
+{
+	struct watch_node *wnode;
+	char *path;
+	unsigned int i;
+
 	/* During transactions, don't fire watches. */
 	if (conn && conn->transaction)
 		return;
 
-	/* Create an event for each watch. */
-	list_for_each_entry(i, &connections, list) {
-		list_for_each_entry(watch, &i->watches, list) {
-			if (is_child(name, watch->node))
-				add_event(i, watch, name);
-			else if (recurse && is_child(watch->node, name))
-				add_event(i, watch, watch->node);
-		}
+	/* Create an event for each watch on name or one of its parents,
+	 * walking down from "/" while there are any. */
+	wnode = find_watch_node("/");
+	if (!wnode)
+		return;
+	fire_node_watches(wnode, name);
+
+	path = talloc_strdup(NULL, name);
+	for (i = 1; wnode && !streq(name, "/") && path[i - 1]; i++) {
+		if (path[i] != '/' && path[i] != '\0')
+			continue;
+		path[i] = '\0';
+		wnode = find_watch_node(path);
+		if (wnode)
+			fire_node_watches(wnode, name);
+		path[i] = name[i];
 	}
+	talloc_free(path);
+
+	/* wnode is name's own trie node if there is one. */
+	if (recurse && wnode)
+		fire_child_watches(wnode);
 }
 
 static int destroy_watch(void *_watch)
 {
-	trace_destroy(_watch, "watch");
+	struct watch *watch = _watch;
+
+	trace_destroy(watch, "watch");
+	list_del(&watch->node_list);
+	put_watch_node(watch->wnode);
 	return 0;
 }
 
@@ -156,15 +292,24 @@ void do_watch(struct connection *conn, struct buffered_data *in)
 	watch = talloc(conn, struct watch);
 	watch->node = talloc_strdup(watch, vec[0]);
 	watch->token = talloc_strdup(watch, vec[1]);
+	watch->conn = conn;
 	if (relative)
 		watch->relative_path = get_implicit_path(conn);
 	else
 		watch->relative_path = NULL;
 
+	watch->wnode = get_watch_node(watch->node);
+	if (!watch->wnode) {
+		talloc_free(watch);
+		send_error(conn, ENOMEM);
+		return;
+	}
+
 	INIT_LIST_HEAD(&watch->events);
 
 	domain_watch_inc(conn);
 	list_add_tail(&watch->list, &conn->watches);
+	list_add_tail(&watch->node_list, &watch->wnode->watches);
 	trace_create(watch, "watch");
 	talloc_set_destructor(watch, destroy_watch);
 	send_ack(conn, XS_WATCH);
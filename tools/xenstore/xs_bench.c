@@ -0,0 +1,293 @@
+/* Drive concurrent transactional clients against a running xenstored.
+ *
+ * Each client is a process with its own connection, looping over
+ * transactions that read and write nodes under its own /bench/<n> and,
+ * for a share of them, one of a few nodes under /bench/shared that all
+ * clients fight over.  Transactions ending in EAGAIN are retried.
+ * Idle watches, which every change has to be matched against, can be
+ * registered on a separate connection for the duration of the run.
+ * Point XENSTORED_PATH/XENSTORED_RUNDIR at a local daemon to run it
+ * without a hypervisor.
+ */
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdarg.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <signal.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+#include "xs.h"
+#include "xs_lib.h"
+#include "utils.h"
+
+struct client_result {
+	unsigned long commits;
+	unsigned long retries;
+	unsigned long failures;
+	double latency;		/* summed over commits, in seconds */
+	double max_latency;
+};
+
+static unsigned int nr_clients = 16;
+static unsigned int duration = 10;
+static unsigned int nr_reads = 4;
+static unsigned int nr_writes = 2;
+static unsigned int nr_nodes = 16;
+static unsigned int shared_percent = 0;
+static unsigned int nr_shared = 4;
+static unsigned int fill_nodes = 0;
+static unsigned int fill_size = 256;
+static unsigned int nr_watches = 0;
+
+static double now(void)
+{
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+static void write_node(struct xs_handle *h, xs_transaction_t t,
+		       const char *path, const char *value, unsigned int len)
+{
+	if (!xs_write(h, t, path, value, len) && errno != EAGAIN)
+		barf_perror("Could not write %s", path);
+}
+
+/* Bulk up the store, which is what made copying it per transaction hurt. */
+static void fill_store(void)
+{
+	struct xs_handle *h = xs_daemon_open();
+	char path[64], *value;
+	unsigned int i;
+
+	if (!h)
+		barf_perror("Could not contact xenstored");
+
+	value = malloc(fill_size);
+	if (!value)
+		barf("Out of memory");
+	memset(value, 'x', fill_size);
+
+	for (i = 0; i < fill_nodes; i++) {
+		snprintf(path, sizeof(path), "/bench/fill/%u/%u", i / 100, i);
+		write_node(h, XBT_NULL, path, value, fill_size);
+	}
+	free(value);
+	xs_daemon_close(h);
+}
+
+/* Watches on paths the clients never touch, held by the returned handle. */
+static struct xs_handle *add_watches(void)
+{
+	struct xs_handle *h;
+	char path[64];
+	unsigned int i;
+
+	if (!nr_watches)
+		return NULL;
+
+	h = xs_daemon_open();
+	if (!h)
+		barf_perror("Could not contact xenstored");
+
+	for (i = 0; i < nr_watches; i++) {
+		snprintf(path, sizeof(path), "/bench/watch/%u/%u", i / 100, i);
+		if (!xs_watch(h, path, "bench"))
+			barf_perror("Could not watch %s", path);
+	}
+	return h;
+}
+
+static bool one_transaction(struct xs_handle *h, unsigned int id,
+			    unsigned int iter)
+{
+	xs_transaction_t t;
+	char path[64], value[32];
+	unsigned int i, len;
+	void *data;
+
+	t = xs_transaction_start(h);
+	if (t == XBT_NULL)
+		barf_perror("Could not start transaction");
+
+	for (i = 0; i < nr_reads; i++) {
+		snprintf(path, sizeof(path), "/bench/%u/%u", id,
+			 (iter + i) % nr_nodes);
+		data = xs_read(h, t, path, &len);
+		free(data);
+	}
+
+	len = snprintf(value, sizeof(value), "%u", iter);
+	for (i = 0; i < nr_writes; i++) {
+		snprintf(path, sizeof(path), "/bench/%u/%u", id,
+			 (iter + i) % nr_nodes);
+		write_node(h, t, path, value, len);
+	}
+
+	if (shared_percent && (unsigned int)rand() % 100 < shared_percent) {
+		snprintf(path, sizeof(path), "/bench/shared/%u",
+			 (unsigned int)rand() % nr_shared);
+		data = xs_read(h, t, path, &len);
+		free(data);
+		write_node(h, t, path, value, strlen(value));
+	}
+
+	if (xs_transaction_end(h, t, false))
+		return true;
+	if (errno != EAGAIN)
+		barf_perror("Could not end transaction");
+	return false;
+}
+
+static void run_client(unsigned int id, int fd)
+{
+	struct client_result res;
+	struct xs_handle *h;
+	unsigned int iter;
+	double end, start;
+
+	memset(&res, 0, sizeof(res));
+	srand(id + 1);
+
+	h = xs_daemon_open();
+	if (!h)
+		barf_perror("Could not contact xenstored");
+
+	end = now() + duration;
+	for (iter = 0; now() < end; iter++) {
+		unsigned int tries;
+
+		start = now();
+		for (tries = 0; !one_transaction(h, id, iter); tries++) {
+			if (tries == 100) {
+				res.failures++;
+				break;
+			}
+			res.retries++;
+		}
+		if (tries < 100) {
+			double latency = now() - start;
+
+			res.commits++;
+			res.latency += latency;
+			if (latency > res.max_latency)
+				res.max_latency = latency;
+		}
+	}
+
+	xs_daemon_close(h);
+	/* Smaller than PIPE_BUF, so results don't interleave. */
+	if (!xs_write_all(fd, &res, sizeof(res)))
+		barf_perror("Could not report results");
+	exit(0);
+}
+
+static void usage(void)
+{
+	barf("Usage: xs_bench [-c clients] [-t seconds] [-r reads] "
+	     "[-w writes] [-n nodes] [-s shared%%] [-S shared nodes] "
+	     "[-f fill nodes] [-z fill size] [-W idle watches]");
+}
+
+int main(int argc, char *argv[])
+{
+	struct client_result res, total;
+	struct xs_handle *watcher;
+	unsigned int i;
+	int opt, fds[2];
+	double elapsed;
+
+	while ((opt = getopt(argc, argv, "c:t:r:w:n:s:S:f:z:W:")) != -1) {
+		switch (opt) {
+		case 'c':
+			nr_clients = atoi(optarg);
+			break;
+		case 't':
+			duration = atoi(optarg);
+			break;
+		case 'r':
+			nr_reads = atoi(optarg);
+			break;
+		case 'w':
+			nr_writes = atoi(optarg);
+			break;
+		case 'n':
+			nr_nodes = atoi(optarg);
+			break;
+		case 's':
+			shared_percent = atoi(optarg);
+			break;
+		case 'S':
+			nr_shared = atoi(optarg);
+			break;
+		case 'f':
+			fill_nodes = atoi(optarg);
+			break;
+		case 'z':
+			fill_size = atoi(optarg);
+			break;
+		case 'W':
+			nr_watches = atoi(optarg);
+			break;
+		default:
+			usage();
+		}
+	}
+	if (optind != argc || !nr_clients || !nr_nodes || !nr_shared)
+		usage();
+
+	fill_store();
+	watcher = add_watches();
+
+	if (pipe(fds) != 0)
+		barf_perror("Could not create pipe");
+
+	elapsed = now();
+	for (i = 0; i < nr_clients; i++) {
+		switch (fork()) {
+		case -1:
+			barf_perror("Could not fork");
+		case 0:
+			close(fds[0]);
+			run_client(i, fds[1]);
+		}
+	}
+	close(fds[1]);
+
+	memset(&total, 0, sizeof(total));
+	for (i = 0; i < nr_clients; i++) {
+		if (read(fds[0], &res, sizeof(res)) != sizeof(res))
+			barf("Client died");
+		total.commits += res.commits;
+		total.retries += res.retries;
+		total.failures += res.failures;
+		total.latency += res.latency;
+		if (res.max_latency > total.max_latency)
+			total.max_latency = res.max_latency;
+	}
+	while (wait(NULL) > 0)
+		;
+	elapsed = now() - elapsed;
+	if (watcher)
+		xs_daemon_close(watcher);
+
+	printf("%u clients, %u reads + %u writes per transaction, "
+	       "%u%% shared, %u fill nodes, %u watches\n",
+	       nr_clients, nr_reads, nr_writes, shared_percent, fill_nodes,
+	       nr_watches);
+	printf("commits:  %lu (%.0f/s)\n", total.commits,
+	       total.commits / elapsed);
+	printf("retries:  %lu (%.2f per commit)\n", total.retries,
+	       total.commits ? (double)total.retries / total.commits : 0.0);
+	printf("gave up:  %lu\n", total.failures);
+	printf("latency:  avg %.3f ms, max %.3f ms\n",
+	       total.commits ? total.latency * 1000 / total.commits : 0.0,
+	       total.max_latency * 1000);
+	return 0;
+}